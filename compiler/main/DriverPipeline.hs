@@ -2053,6 +2053,9 @@ linkBinary' staticLink dflags o_files dep_packages = do
                 | WayParMSlot `elem` ways dflags =
                     -- nothing so far; POSIX version might add some
                     []
+                | WayParTcp `elem` ways dflags =
+                    -- sockets are in the C library
+                    []
                 | otherwise = []-- not parallel at all
 
     rc_objs <- maybeCreateManifest dflags output_fn
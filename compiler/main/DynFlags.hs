@@ -1549,6 +1549,7 @@ data Way
   | WayParMPI
   | WayParCp
   | WayParMSlot
+  | WayParTcp
   | WayDyn
   deriving (Eq, Ord, Show)
 
@@ -1571,11 +1572,13 @@ allowed_combination way = and [ x `allowedWith` y
         (WayCustom {}) `allowedWith` _          = True
         WayThreaded `allowedWith` WayProf       = True
         WayThreaded `allowedWith` WayEventLog   = True
+        WayThreaded `allowedWith` WayParCp      = True
         WayProf     `allowedWith` WayEventLog   = True
         WayEventLog `allowedWith` WayParPvm     = True
         WayEventLog `allowedWith` WayParMPI     = True
         WayEventLog `allowedWith` WayParCp      = True
         WayEventLog `allowedWith` WayParMSlot   = True
+        WayEventLog `allowedWith` WayParTcp     = True
         _ `allowedWith` _                       = False
 
 mkBuildTag :: [Way] -> String
@@ -1592,6 +1595,7 @@ wayTag WayParPvm   = "pp"
 wayTag WayParMPI   = "pm"
 wayTag WayParCp    = "pc"
 wayTag WayParMSlot = "ms"
+wayTag WayParTcp   = "pt"
 
 wayRTSOnly :: Way -> Bool
 wayRTSOnly (WayCustom {}) = False
@@ -1604,6 +1608,7 @@ wayRTSOnly WayParPvm   = True
 wayRTSOnly WayParMPI   = True
 wayRTSOnly WayParCp    = True
 wayRTSOnly WayParMSlot = True
+wayRTSOnly WayParTcp   = True
 
 wayDesc :: Way -> String
 wayDesc (WayCustom xs) = xs
@@ -1616,6 +1621,7 @@ wayDesc WayParPvm   = "Parallel RTS (PVM)"
 wayDesc WayParMPI   = "Parallel RTS (MPI)"
 wayDesc WayParCp    = "Parallel RTS (SharedMem)"
 wayDesc WayParMSlot = "Parallel RTS (Mailslots)"
+wayDesc WayParTcp   = "Parallel RTS (TCP)"
 
 -- Turn these flags on when enabling this way
 wayGeneralFlags :: Platform -> Way -> [GeneralFlag]
@@ -1636,6 +1642,7 @@ wayGeneralFlags _ WayParPvm   = []
 wayGeneralFlags _ WayParMPI   = []
 wayGeneralFlags _ WayParCp    = []
 wayGeneralFlags _ WayParMSlot = []
+wayGeneralFlags _ WayParTcp   = []
 
 -- Turn these flags off when enabling this way
 wayUnsetGeneralFlags :: Platform -> Way -> [GeneralFlag]
@@ -1656,6 +1663,7 @@ wayUnsetGeneralFlags _ WayParPvm   = []
 wayUnsetGeneralFlags _ WayParMPI   = []
 wayUnsetGeneralFlags _ WayParCp    = []
 wayUnsetGeneralFlags _ WayParMSlot = []
+wayUnsetGeneralFlags _ WayParTcp   = []
 
 wayOptc :: Platform -> Way -> [String]
 wayOptc _ (WayCustom {}) = []
@@ -1671,6 +1679,7 @@ wayOptc _ WayParPvm     = ["-DPARALLEL_RTS", "-DUSE_PVM"]
 wayOptc _ WayParMPI     = ["-DPARALLEL_RTS", "-DUSE_MPI"]
 wayOptc _ WayParCp      = ["-DPARALLEL_RTS", "-DUSE_COPY"]
 wayOptc _ WayParMSlot   = ["-DPARALLEL_RTS", "-DUSE_SLOTS"]
+wayOptc _ WayParTcp     = ["-DPARALLEL_RTS", "-DUSE_TCP"]
 
 wayOptl :: Platform -> Way -> [String]
 wayOptl _ (WayCustom {}) = []
@@ -1695,6 +1704,7 @@ wayOptl _ WayParPvm     = []
 wayOptl _ WayParMPI     = []
 wayOptl _ WayParCp      = []
 wayOptl _ WayParMSlot   = []
+wayOptl _ WayParTcp     = []
 
 wayOptP :: Platform -> Way -> [String]
 wayOptP _ (WayCustom {}) = []
@@ -1707,6 +1717,7 @@ wayOptP _ WayParPvm   = ["-D__PARALLEL_HASKELL__"]
 wayOptP _ WayParMPI   = ["-D__PARALLEL_HASKELL__"]
 wayOptP _ WayParCp    = ["-D__PARALLEL_HASKELL__"]
 wayOptP _ WayParMSlot = ["-D__PARALLEL_HASKELL__"]
+wayOptP _ WayParTcp   = ["-D__PARALLEL_HASKELL__"]
 
 whenGeneratingDynamicToo :: MonadIO m => DynFlags -> m () -> m ()
 whenGeneratingDynamicToo dflags f = ifGeneratingDynamicToo dflags f (return ())
@@ -2864,6 +2875,7 @@ dynamic_flags_deps = [
   , make_ord_flag defGhcFlag "parmpi"         (NoArg (addWay WayParMPI) )
   , make_ord_flag defGhcFlag "parcp"          (NoArg (addWay WayParCp) )
   , make_ord_flag defGhcFlag "parms"          (NoArg (addWay WayParMSlot) )
+  , make_ord_flag defGhcFlag "partcp"         (NoArg (addWay WayParTcp) )
 
         ----- Linker --------------------------------------------------------
   , make_ord_flag defGhcFlag "static"         (NoArg removeWayDyn)
@@ -2986,7 +2986,13 @@ primop SendDataOp "sendData#" GenPrimOp
 
       * 3: single data, closing the inport
 
-      * 4: rFork (PE indicated by higher bits above 4) }
+      * 4: rFork (PE indicated by higher bits above 4)
+
+      * 5: add the current receiver to a broadcast
+
+      * 6: broadcast single data to all receivers added before,
+           packing it only once (fan-out of a relaying tree of PEs
+           indicated by higher bits, 0 for none) }
    with
    out_of_line      = True
    has_side_effects = True
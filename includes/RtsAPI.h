@@ -241,6 +241,30 @@ typedef struct _RTSStats {
     // The number of times a GC thread has iterated it's outer loop across all
     // parallel GCs
   uint64_t scav_find_work;
+
+  // -----------------------------------
+  // Communication of this PE (parallel ways, zero otherwise)
+
+    // Messages sent to other PEs (each batched message counted)
+  uint64_t msgs_sent;
+    // Messages received from other PEs
+  uint64_t msgs_received;
+    // Bytes sent, after encoding and compression
+  uint64_t msg_bytes_sent;
+    // Bytes received
+  uint64_t msg_bytes_received;
+    // Graphs packed for messages
+  uint64_t packs;
+    // Packing attempts which found a blackhole (the sender blocks)
+  uint64_t packs_blocked;
+    // Graphs unpacked from messages
+  uint64_t unpacks;
+    // Elapsed time spent packing graphs for messages
+  Time pack_ns;
+    // Elapsed time spent unpacking graphs from messages
+  Time unpack_ns;
+    // Elapsed time spent waiting for messages in MP_recv
+  Time recv_blocked_ns;
 } RTSStats;
 
 void getRTSStats (RTSStats *s);
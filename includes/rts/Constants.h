@@ -306,7 +306,8 @@
  * sendWrapper (rts/parallel/DataComms.c) returns special codes to
  * indicate temporary failures, used in DataComms.c and PrimOps.cmm:
  */
-#define MSG_BLOCKED    0x00 /* packing hit a black hole, block thread */
+#define MSG_BLOCKED    0x00 /* packing hit a black hole, or receiver
+                               congested: block thread */
 #define MSG_FAILED     0x01 /* sending failed, deschedule and retry */
 #define MSG_OK         0x02 /* packing and msg. passing succeeded */
 
@@ -182,6 +182,8 @@
 #define EVENT_SEND_MESSAGE               67 /* (tag, sender_process, sender_thread, receiver_machine, receiver_process, receiver_inport) */
 #define EVENT_RECEIVE_MESSAGE            68 /* (tag, receiver_process, receiver_inport, sender_machine, sender_process, sender_outport, message_size) */
 #define EVENT_SEND_RECEIVE_LOCAL_MESSAGE 69 /* (tag, sender_process, sender_thread, receiver_process, receiver_inport) */
+#define EVENT_INBOX_DEPTH                70 /* (messages, bytes, pending_bytes) */
+#define EVENT_MESSAGE_COMPRESSION        71 /* (tag, raw_bytes, sent_bytes) */
 
 
 /* Range 100 - 139 is reserved for Mercury. */
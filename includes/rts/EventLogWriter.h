@@ -35,3 +35,11 @@ typedef struct {
  * a file `program.eventlog`.
  */
 extern const EventLogWriter FileEventLogWriter;
+
+#if defined(PARALLEL_RTS)
+/*
+ * An EventLogWriter which sends the eventlogs of all PEs to the main PE,
+ * which writes them into one file `<argv>.eventlog` (-qT).
+ */
+extern const EventLogWriter StreamEventLogWriter;
+#endif
@@ -217,6 +217,14 @@ typedef struct _PAR_DEBUG_FLAGS {
 #define PAR_DEBUG_MASK(n)     ((uint16_t) (1<<(n)))
 #define MAX_PAR_DEBUG_MASK    ((uint16_t) ((1<<(MAX_PAR_DEBUG_OPTION+1))-1))
 
+/* process placement (PAR_FLAGS.placement): one policy (round-robin if
+ * none is set), optionally combined with PLACE_REMOTE */
+#define PLACE_RANDOM     1  /* -qrnd:    random PE */
+#define PLACE_REMOTE     2  /* -qremote: avoid the local PE */
+#define PLACE_LEASTLOAD  4  /* -qrll:    least loaded PE */
+#define PLACE_TWOCHOICE  8  /* -qr2:     less loaded of two random PEs */
+#define PLACE_LOCALITY  16  /* -qrloc:   local PE unless others are idler */
+
 #endif /* PARALLEL_RTS */
 
 /* See Note [Synchronization of flags and base APIs] */
@@ -226,6 +234,29 @@ typedef struct _PAR_FLAGS {
   PAR_DEBUG_FLAGS Debug;         /* debugging options */
   uint32_t      sendBufferSize;
   uint32_t      placement;
+  bool          pinPEs;         /* pin PEs to cores and NUMA nodes,
+                                 * shared-memory version only (-qA) */
+  uint32_t      batchSize;      /* batch small messages per PE (bytes),
+                                 * 0: do not batch */
+  Time          batchTime;      /* flush batches after this time */
+  bool          stealing;       /* hold received processes until idle,
+                                 * idle PEs steal them (-qF) */
+  uint32_t      sharingSlots;   /* closures shared between two PEs
+                                 * across messages (-qC), 0: off */
+  bool          remoteRefs;     /* send placeholders for blackholes in
+                                 * data messages instead of blocking (-qL) */
+  uint32_t      unpackOldGen;   /* unpack graphs of this size (bytes) into
+                                 * the oldest generation (-qO), 0: never */
+  bool          encodePackets;  /* send packed graphs in the dense
+                                 * encoding (-qE) */
+  uint32_t      compressMin;    /* compress messages of this size (bytes)
+                                 * or larger (-qZ), 0: never */
+  bool          streamTrace;    /* stream eventlogs to the main PE, which
+                                 * writes one merged eventlog (-qT) */
+  uint32_t      recvBudgetMsgs; /* receive at most this many messages, */
+  uint32_t      recvBudgetBytes;/* bytes, */
+  Time          recvBudgetTime; /* or for this long, before running
+                                 * threads again (-qR), 0: unlimited */
   long          wait;
 #endif /* PARALLEL_RTS */
   uint32_t       nCapabilities;  /* number of threads to run simultaneously */
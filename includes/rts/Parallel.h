@@ -54,9 +54,43 @@ bool isBlackhole(StgClosure* closure);
 
 // interfaces for (un-)packing, defined in Pack.c.
 
-// packs to buffer, returns size-in-bytes + P_ERRCODEMAX, or an error code
+// packs to buffer, returns size-in-bytes + P_ERRCODEMAX, or an error code.
+// The heap words needed to unpack the graph are stored in *unpackedSize
+// (unless NULL), for the unpacked_size field of the message.
 int packToBuffer(StgClosure* closure,
-                 StgWord *buffer, uint32_t bufsize, StgTSO *caller);
+                 StgWord *buffer, uint32_t bufsize, StgTSO *caller,
+                 uint32_t *unpackedSize);
+
+// Payload of large byte arrays (which never move in the heap) can be left
+// out of the buffer: the packer skips its place in the buffer (a segment)
+// and records where the data is, the sender gathers buffer and segments
+// when sending. The segments refer to the buffer content (chunk) at hand,
+// positions are in words from the start of the buffer.
+#define MAX_PACK_SEGMENTS 64
+typedef struct PackSegment_ {
+  uint32_t at;       // position in the buffer, in StgWords
+  uint32_t size;     // in StgWords
+  StgWord *data;     // payload in the heap
+} PackSegment;
+
+typedef struct PackSegments_ {
+  uint32_t    count;
+  PackSegment seg[MAX_PACK_SEGMENTS];
+} PackSegments;
+
+// packs in chunks: a full buffer is handed to the flush function (with its
+// size in words) and then reused. Returns the size of the last chunk (as
+// packToBuffer), or P_NOBUFFER when the flush function returned false.
+// A dest PE other than 0 enables the sharing cache for dest (-qC), and
+// remote references instead of blocking on blackholes (-qL).
+// With segments (not NULL), the payload of large byte arrays is left out
+// of the buffer and described in *segments, separately for each chunk
+// (the flush function has to send them along).
+typedef bool (*PackFlushFn)(void *flushArg, uint32_t size);
+int packToBufferChunked(StgClosure* closure,
+                        StgWord *buffer, uint32_t bufsize, StgTSO *caller,
+                        PackFlushFn flush, void *flushArg, PEId dest,
+                        PackSegments *segments, uint32_t *unpackedSize);
 
 // packing can fail for different reasons, encoded in small ints which are
 // returned by packToBuffer:
@@ -78,8 +112,12 @@ int packToBuffer(StgClosure* closure,
 // serialisation into a Haskell Byte array, returning error codes on failure
 StgClosure* tryPackToMemory(StgClosure* graphroot, StgTSO* tso,
                             Capability* cap);
+// free the per-capability scratch space used by tryPackToMemory
+void freePackCache(Capability* cap);
 
-// unpack a graph from packBuffer (wiping the buffer), aborts if unsuccessful
+// unpack a graph from packBuffer (wiping the buffer), aborts if unsuccessful.
+// Allocates all closures in one heap region when the buffer carries the
+// unpacked size of the graph.
 StgClosure* unpackGraph(rtsPackBuffer *packBuffer, Capability* cap);
 
 // respective deserialisation (global pack buffer used for unpacking)
@@ -96,7 +134,7 @@ StgClosure* createListNode(Capability *cap,
 #if defined(PARALLEL_RTS)
 
 // parallel machine setup, startup / shutdown
-// in MPSystem file (PVMComm | MPIComm | CpComm currently)
+// in MPSystem file (PVMComm | MPIComm | CpComm | TCPComm currently)
 extern bool IAmMainThread;
 
 void          startupParallelSystem(int* argc, char** argv[]);
@@ -107,19 +145,73 @@ void          shutdownParallelSystem(StgInt errorcode);
 void          emitStartupEvents(void);
 // defined in ParInit.c, called in RtsStartup.c (after shutdown when tracing)
 void          zipTraceFiles(void);
+#if defined(TRACING)
+// <argv>.parevents, defined in ParInit.c
+extern char  *pareventsName;
+#endif
+// the main PE collects the communication statistics of all PEs before
+// shutdown (+RTS -s). Defined in Schedule.c, called in RtsStartup.c
+void          collectPEStats(void);
+// with -qT, the main PE waits for the rest of the eventlogs of all PEs
+// before shutdown. Defined in Schedule.c, called in RtsStartup.c
+void          collectPETraces(void);
+
+// Threaded PEs (way thr_pc): all capabilities of a PE share the runtime
+// tables, pack buffer and MP-System. These are protected by one lock,
+// which may be taken recursively. Capabilities are always acquired
+// before this lock, never while holding it. Defined in ParInit.c.
+#if defined(THREADED_RTS)
+void acquireParLock(void);
+void releaseParLock(void);
+#define ACQUIRE_PAR_LOCK() acquireParLock()
+#define RELEASE_PAR_LOCK() releaseParLock()
+
+// the communication task receives all messages of a threaded PE,
+// defined in Schedule.c, started and stopped in RtsStartup.c
+void startCommTask(void);
+void stopCommTask(void);
+#else
+#define ACQUIRE_PAR_LOCK() /* nothing */
+#define RELEASE_PAR_LOCK() /* nothing */
+#endif
 
 // packbuffer resides in DataComms.c
 void initPackBuffer(void);
 void freePackBuffer(void);
 
-// RecvBuffer resides in Schedule.c:
-// init on demand
-void freeRecvBuffer(void);
-
 // runtime table initialisation and release
 void initRTT(void);
 void freeRTT(void);
 
+// sharing cache between PEs (-qC), in Pack.c: closures defined in a
+// packet for pe become valid when it was sent (commitSharing after
+// packToBufferChunked with a dest PE). Updated after each GC.
+void commitSharing(PEId pe, bool sent);
+void updateSharingCaches(void);
+void freeSharingCaches(void);
+
+// remote references (-qL), in Pack.c: packing for a dest PE does not
+// block on blackholes, it packs references to placeholders on dest. They
+// are kept if the message was sent (commitRemoteRefs after
+// packToBufferChunked with a dest PE). The sender polls the blackholes
+// (remoteRefValue is NULL until updated) and sends their values, the
+// receiver takes the placeholder to update (takePlaceholder).
+void commitRemoteRefs(bool sent);
+uint32_t outstandingRemoteRefs(void);
+StgClosure* remoteRefValue(uint32_t i, PEId *dest, StgWord *id);
+void removeRemoteRef(uint32_t i);
+StgClosure* takePlaceholder(PEId pe, StgWord id);
+void freeRemoteRefs(void);
+
+// dense encoding of packets for sending (-qE), in Pack.c. encodePacket
+// returns the size of the encoding in bytes, 0 if it would not be smaller
+// than the packet (or maxBytes); decodePacket returns false if the data
+// is garbled.
+uint32_t encodePacket(StgWord *buffer, uint32_t size,
+                      StgWord8 *out, uint32_t maxBytes);
+bool decodePacket(StgWord8 *in, uint32_t length,
+                  StgWord *buffer, uint32_t size);
+
 // creation of a new process (+registering the first thread)
 // used in Rts API, defined in RTTables.c
 void newProcess(StgTSO* firstTSO);
@@ -133,10 +225,89 @@ bool sendMsg(OpCode tag, rtsPackBuffer* dataBuffer);
 // sendWrapper is called by primitive operations, does not need
 // declaration here.
 
+// Messages received in the dense encoding (-qE) or compressed (-qZ) are
+// decoded before they are processed, into a buffer which is reused for
+// the next message. Plain messages are returned as they are.
+rtsPackBuffer* decodeMsg(rtsPackBuffer *msg);
+
+// Keeping the load information which every message carries (used for
+// process placement), called by the scheduler for each message
+void recordPELoad(PEId pe, rtsPackBuffer *msg);
+
 // Unpacking and updating placeholders (if valid data)
 void processDataMsg(Capability* cap, OpCode opcode,
                     rtsPackBuffer *recvBuffer);
 
+// Small messages to the same PE are batched into one PP_PACKET message.
+// In the packet, each message is preceded by this header and padded to
+// a multiple of StgWord.
+typedef struct PacketEntry_ {
+  StgWord32 tag;     // OpCode of the message
+  StgWord32 length;  // message size in bytes (without padding)
+} PacketEntry;
+
+// Sending batched messages, all of them if force is set, otherwise the
+// ones which have waited long enough (-qBt). Returns false if a send failed.
+bool flushSendBatches(bool force);
+
+// Threads sending to a congested PE block on a gate per PE until the
+// MP-System can take data for it again. The scheduler (holding a
+// capability) opens the gates of PEs which are ready, sendGatesReady
+// tells whether there are any (without a capability), sendGatesClosed
+// whether threads wait at all. See DataComms.c
+bool sendGatesClosed(void);
+bool sendGatesReady(void);
+bool openSendGates(Capability *cap);
+
+// Work stealing (-qF): received processes are held until the PE is idle,
+// idle PEs fish for held processes of other PEs.
+// holdProcess returns false if the process should be started right away,
+// takeHeldProcess returns NULL if there is none (the caller frees it).
+bool holdProcess(rtsPackBuffer *msg);
+rtsPackBuffer* takeHeldProcess(void);
+uint32_t heldProcessCount(void);
+void fishForWork(void);
+void feedHungryPEs(void);
+void processFishMsg(PEId fisher);
+void processNoWorkMsg(PEId pe);
+
+// Collecting PP_PART messages, and joining them with the final message
+// (returns msg itself if no parts were received, otherwise a new buffer
+// which the caller has to free)
+void processPartMsg(rtsPackBuffer *part);
+rtsPackBuffer* joinParts(rtsPackBuffer *msg);
+
+// Receiving a PP_BCAST message (one graph for several inports), relaying
+// it to other PEs if required. See DataComms.c
+void processBcastMsg(Capability *cap, rtsPackBuffer *msg);
+
+// Remote references (-qL, PP_VALUE): the values of updated blackholes
+// which were sent as placeholders are sent from the scheduler (holding
+// a capability), the receiver updates the placeholders. See DataComms.c
+void sendRemoteValues(void);
+void processValueMsg(Capability *cap, rtsPackBuffer *msg);
+
+// Communication statistics (PP_STATS): the main PE asks the other PEs
+// (requestPEStats) and waits until missingPEStats is 0, their answers
+// are PP_STATS messages as well. See DataComms.c
+void requestPEStats(void);
+uint32_t missingPEStats(void);
+void processStatsMsg(PEId pe, rtsPackBuffer *msg);
+
+// Streamed eventlogs (-qT, PP_EVENTLOG): other PEs queue their eventlog
+// data (queueEventLogData, from StreamEventLogWriter), which is sent to
+// the main PE from flushSendBatches. At shutdown, the main PE asks them
+// to end their eventlog (requestPETraces) and waits until
+// missingPETraces is 0, or gives up on the missing ones (abandonPETraces).
+// takeEventLogEndRequest tells the scheduler of other PEs to end the
+// eventlog. See DataComms.c
+void queueEventLogData(void *data, size_t size);
+void requestPETraces(void);
+uint32_t missingPETraces(void);
+void abandonPETraces(void);
+bool takeEventLogEndRequest(void);
+void processEventLogMsg(PEId pe, rtsPackBuffer *msg);
+
 // special structure used as the "owning thread" of system-generated
 // blackholes.  Layout [ hdr | payload ], holds a TSO header.info and blocking
 // queues in the payload field.
@@ -56,6 +56,22 @@ typedef struct rtsPackBuffer_ {
     // for data messages only,
     StgInt               id;            // currently unused
     StgInt               size;          // payload size in units of StgWord
-    StgInt               unpacked_size; // currently unused
+    StgInt               unpacked_size; // heap words of the graph, 0: unknown
+    // load of the sending PE, piggybacked on every message
+    StgWord32            runQueueLength; // threads ready to run
+    StgWord32            heapLive;       // kbytes live after the last GC
+    // wire format of the payload (PACKET_* below); size always counts
+    // the words of the plain format, encodedSize the bytes of the dense
+    // encoding, compressedSize the bytes sent when compressed
+    StgWord32            format;
+    StgWord32            encodedSize;
+    StgWord32            compressedSize;
     StgWord              buffer[];      // payload
 } rtsPackBuffer;
+
+// rtsPackBuffer.format: 0 is the plain format (one StgWord per tag, offset
+// and field), PACKET_ENCODED the dense encoding of Pack.c (encodePacket).
+// PACKET_COMPRESSED: the payload (plain or encoded) is LZ-compressed
+#define PACKET_PLAIN      0
+#define PACKET_ENCODED    1
+#define PACKET_COMPRESSED 2
@@ -30,7 +30,7 @@
 #
 # The ways currently defined.
 #
-ALL_WAYS=v l debug dyn thr thr_l p_dyn p debug_dyn thr_dyn thr_p_dyn thr_debug_dyn thr_debug debug_p thr_debug_p l_dyn thr_l_dyn thr_p  pp debug_pp pm debug_pm pc debug_pc ms debug_ms l_pp l_pm l_pc l_ms
+ALL_WAYS=v l debug dyn thr thr_l p_dyn p debug_dyn thr_dyn thr_p_dyn thr_debug_dyn thr_debug debug_p thr_debug_p l_dyn thr_l_dyn thr_p  pp debug_pp pm debug_pm pc debug_pc thr_pc thr_debug_pc ms debug_ms pt debug_pt l_pp l_pm l_pc l_ms l_pt
 
 #
 # The following ways currently are treated specially,
@@ -138,6 +138,10 @@ WAY_pc_HC_OPTS= -static -parcp
 WAY_ms_NAME=mcore parallel(mailslots)
 WAY_ms_HC_OPTS= -static -parms
 
+# Way 'pt':
+WAY_pt_NAME=gen.parallel (tcp)
+WAY_pt_HC_OPTS= -static -partcp
+
 # Way 'debug_pp':
 WAY_debug_pp_NAME=debug for parallel (pvm)
 WAY_debug_pp_HC_OPTS= -static -optc-DDEBUG -parpvm
@@ -150,10 +154,22 @@ WAY_debug_pm_HC_OPTS= -static -optc-DDEBUG -parmpi
 WAY_debug_pc_NAME=debug for mcore parallel (copy)
 WAY_debug_pc_HC_OPTS= -static -optc-DDEBUG -parcp
 
+# Way 'thr_pc':
+WAY_thr_pc_NAME=threaded mcore parallel (copy)
+WAY_thr_pc_HC_OPTS= -static -optc-DTHREADED_RTS -parcp
+
+# Way 'thr_debug_pc':
+WAY_thr_debug_pc_NAME=threaded debug for mcore parallel (copy)
+WAY_thr_debug_pc_HC_OPTS= -static -optc-DTHREADED_RTS -optc-DDEBUG -parcp
+
 # Way 'debug_ms':
 WAY_debug_ms_NAME=debug for mcore parallel (mailslots)
 WAY_debug_ms_HC_OPTS= -static -optc-DDEBUG -parms
 
+# Way 'debug_pt':
+WAY_debug_pt_NAME=debug for parallel (tcp)
+WAY_debug_pt_HC_OPTS= -static -optc-DDEBUG -partcp
+
 # combined with logging (not for -debug, which always implies it)
 # Way 'l_pp':
 WAY_l_pp_NAME=parallel (pvm) with event logging
@@ -170,3 +186,7 @@ WAY_l_pc_HC_OPTS= -static -parcp -eventlog
 # Way 'l_ms':
 WAY_l_ms_NAME=parallel (mailslots) with event logging
 WAY_l_ms_HC_OPTS= -static -parms -eventlog
+
+# Way 'l_pt':
+WAY_l_pt_NAME=parallel (tcp) with event logging
+WAY_l_pt_HC_OPTS= -static -partcp -eventlog
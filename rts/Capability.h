@@ -157,6 +157,10 @@ struct Capability_ {
     StgTRecChunk *free_trec_chunks;
     StgTRecHeader *free_trec_headers;
     uint32_t transaction_tokens;
+
+    // Scratch space for serialisation (rts/parallel/Pack.c), kept between
+    // calls. Allocated on demand.
+    struct PackCache_ *pack_cache;
 } // typedef Capability is defined in RtsAPI.h
   // We never want a Capability to overlap a cache line with anything
   // else, so round it up to a cache line size:
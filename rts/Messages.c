@@ -161,7 +161,27 @@ loop:
 
    ------------------------------------------------------------------------- */
 
+#if defined(PARALLEL_RTS) && defined(THREADED_RTS)
+// In a threaded PE, blackholes owned by the system TSO are updated by
+// whichever capability processes the data for them (holding the parallel
+// lock, see processDataMsg), and their blocking queues are not owned by
+// any capability. Blocking on them therefore takes the parallel lock.
+static uint32_t messageBlackHole_(Capability *cap, MessageBlackHole *msg);
+
+uint32_t messageBlackHole(Capability *cap, MessageBlackHole *msg)
+{
+    uint32_t r;
+
+    ACQUIRE_PAR_LOCK();
+    r = messageBlackHole_(cap, msg);
+    RELEASE_PAR_LOCK();
+    return r;
+}
+
+static uint32_t messageBlackHole_(Capability *cap, MessageBlackHole *msg)
+#else
 uint32_t messageBlackHole(Capability *cap, MessageBlackHole *msg)
+#endif
 {
     const StgInfoTable *info;
     StgClosure *p;
@@ -218,7 +238,12 @@ loop:
         owner = (StgTSO*)p;
 
 #if defined(THREADED_RTS)
+#if defined(PARALLEL_RTS)
+        // the system TSO lives on no capability, handled right here
+        if (!is_system && owner->cap != cap) {
+#else
         if (owner->cap != cap) {
+#endif
             sendMessage(cap, owner->cap, (Message*)msg);
             debugTraceCap(DEBUG_sched, cap, "forwarding message to cap %d",
                           owner->cap->no);
@@ -308,7 +333,12 @@ loop:
         ASSERT(owner != END_TSO_QUEUE);
 
 #if defined(THREADED_RTS)
+#if defined(PARALLEL_RTS)
+        // the system TSO lives on no capability, handled right here
+        if (!is_system && owner->cap != cap) {
+#else
         if (owner->cap != cap) {
+#endif
             sendMessage(cap, owner->cap, (Message*)msg);
             debugTraceCap(DEBUG_sched, cap, "forwarding message to cap %d",
                           owner->cap->no);
@@ -279,7 +279,21 @@ void initRtsFlagsDefaults(void)
 #if defined(PARALLEL_RTS)
     RtsFlags.ParFlags.sendBufferSize    = 20; /* MD should be tested */
     RtsFlags.ParFlags.placement         = 0; /* default: RR placement,
-                                                including local PE*/
+                                                including local PE
+                                                (PLACE_* in Flags.h) */
+    RtsFlags.ParFlags.batchSize         = 8192;
+    RtsFlags.ParFlags.batchTime         = MSToTime(2);
+    RtsFlags.ParFlags.pinPEs            = false; /* kernel places PEs */
+    RtsFlags.ParFlags.stealing          = false;
+    RtsFlags.ParFlags.sharingSlots      = 0; /* 0: no sharing cache */
+    RtsFlags.ParFlags.remoteRefs        = false; /* block on blackholes */
+    RtsFlags.ParFlags.unpackOldGen      = 0; /* 0: unpack into the nursery */
+    RtsFlags.ParFlags.encodePackets     = false; /* send plain words */
+    RtsFlags.ParFlags.compressMin       = 0; /* 0: no compression */
+    RtsFlags.ParFlags.streamTrace       = false; /* one eventlog per PE */
+    RtsFlags.ParFlags.recvBudgetMsgs    = 0; /* 0: drain all messages */
+    RtsFlags.ParFlags.recvBudgetBytes   = 0;
+    RtsFlags.ParFlags.recvBudgetTime    = 0;
 #endif /* PARALLEL_RTS */
 
 #if defined(THREADED_RTS)
@@ -502,9 +516,38 @@ usage_text[] = {
 #endif
 #if defined(PARALLEL_RTS)
 "  -qQ<size> Set pack-buffer size (default: 1MB)",
-"  -qq<n>    Set MPI-send-buffer size to <n> * pack-buffer (default: 20)",
+"  -qq<n>    Limit MPI sends in flight to <n> * pack-buffer per PE (default: 20)",
+"            (shared-memory version: ring size per PE pair <n> * 32kB)",
+"  -qA       Pin PEs to cores, in blocks per NUMA node, and prefer PEs on",
+"            the same node for placement (shared-memory version, Linux)",
+"  -qB<size> Batch small messages to the same PE up to <size> bytes",
+"            (default: 8k, 0 disables batching)",
+"  -qBt<n>   Send batched messages after at most <n> ms (default: 2)",
+"  -qC<n>    Keep <n> closures per PE pair which later messages refer to",
+"            instead of sending them again (default: 0, off)",
+"  -qE       Send packed graphs in a denser encoding (fewer bytes, more",
+"            time to pack and unpack)",
+"  -qF       Start received processes only when idle, idle PEs steal",
+"            unstarted processes from others",
+"  -qL       Send data containing thunks under evaluation right away, with",
+"            placeholders which receive the values later (default: wait)",
+"  -qO<size> Unpack received graphs of at least <size> bytes directly into",
+"            the oldest generation (default: 0, off)",
+#if defined(THREADED_RTS)
+"  -qN[<n>]  Use <n> capabilities per PE (default: 1,",
+"            -qN alone uses all processors)",
+#endif
+"  -qR<n>    Receive at most <n> messages before running threads again",
+"  -qRb<size> ... at most <size> bytes of messages",
+"  -qRt<n>   ... for at most <n> microseconds (default: receive all)",
 "  -qremote  Avoid placing child processes on the same PE",
 "  -qrnd     Enable random process placement (i.e. not round-robin)",
+"  -qrll     Place child processes on the least loaded PE",
+"  -qr2      Place child processes on the less loaded of two random PEs",
+"  -qrloc    Place child processes locally unless other PEs are idler",
+"  -qT       Stream eventlogs to the main PE, which writes one merged",
+"            eventlog (with -l, instead of an archive of per-PE files)",
+"  -qZ<size> Compress messages of at least <size> bytes (default: 0, off)",
 /*
 "  -qP       Activate parallel profiling (Eden)",
 "  -qPh      include GC statistics in trace file (implies -qP)",
@@ -1795,12 +1838,97 @@ process_par_option(int arg, bool *error)
 
   // the -q prefix is shared with THREADED_RTS.
   // Currently taken by THREADED_RTS: a,b,g,m,w.
-  // Currently accepted here: q,Q,r(emote/nd),W,D
+  // Currently accepted here: A,B,C,E,F,L,N,O,q,Q,R,r(emote/nd/ll/loc/2),T,W,Z,D
 
   /* Communication and task creation cost parameters */
   switch(rts_argv[arg][2]) {
 
   // alphabetical order:
+  case 'A': // -qA ... pin PEs to cores and NUMA nodes
+    RtsFlags.ParFlags.pinPEs = true;
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qA: pinning PEs to cores\n"));
+    break;
+  case 'B': // -qB<size> ... batch messages, -qBt<n> ... flush after <n> ms
+    if (rts_argv[arg][3] == 't') {
+      if (rts_argv[arg][4] != '\0') {
+        RtsFlags.ParFlags.batchTime =
+          MSToTime(strtol(rts_argv[arg]+4, (char **) NULL, 10));
+      } else {
+        errorBelch("missing argument to -qBt\n");
+        *error = true;
+      }
+    } else if (rts_argv[arg][3] != '\0') {
+      RtsFlags.ParFlags.batchSize =
+        decodeSize(rts_argv[arg], 3, 0, RtsFlags.ParFlags.packBufferSize);
+    } else {
+      errorBelch("missing argument to -qB\n");
+      *error = true;
+    }
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("%s: batching messages up to %d bytes, "
+                            "for %" FMT_Int64 " ms\n", rts_argv[arg],
+                            RtsFlags.ParFlags.batchSize,
+                            TimeToMS(RtsFlags.ParFlags.batchTime)));
+    break;
+  case 'C': // -qC<n> ... sharing cache of <n> closures per PE pair
+    if (rts_argv[arg][3] != '\0') {
+      RtsFlags.ParFlags.sharingSlots =
+        strtol(rts_argv[arg]+3, (char **) NULL, 10);
+    } else {
+      errorBelch("missing argument to -qC\n");
+      *error = true;
+    }
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qC: sharing cache of %d closures per PE\n",
+                            RtsFlags.ParFlags.sharingSlots));
+    break;
+  case 'E': // -qE ... dense encoding of packed graphs
+    RtsFlags.ParFlags.encodePackets = true;
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qE: sending packed graphs encoded\n"));
+    break;
+  case 'F': // -qF ... work stealing of unstarted processes
+    RtsFlags.ParFlags.stealing = true;
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qF: stealing unstarted processes\n"));
+    break;
+  case 'L': // -qL ... placeholders for blackholes in data messages
+    RtsFlags.ParFlags.remoteRefs = true;
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qL: sending placeholders for blackholes\n"));
+    break;
+  case 'O': // -qO<size> ... unpack large graphs into the oldest generation
+    if (rts_argv[arg][3] != '\0') {
+      RtsFlags.ParFlags.unpackOldGen =
+        decodeSize(rts_argv[arg], 3, 0, HS_INT32_MAX);
+    } else {
+      errorBelch("missing argument to -qO\n");
+      *error = true;
+    }
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qO: unpacking graphs of %d bytes or more "
+                            "into the oldest generation\n",
+                            RtsFlags.ParFlags.unpackOldGen));
+    break;
+#if defined(THREADED_RTS)
+  case 'N': // -qN<n> ... capabilities per PE (-N<n> sets the PE count)
+    if (rts_argv[arg][3] == '\0') {
+      RtsFlags.ParFlags.nCapabilities = getNumberOfProcessors();
+    } else {
+      int nCapabilities = strtol(rts_argv[arg]+3, (char **) NULL, 10);
+      if (nCapabilities <= 0) {
+        errorBelch("bad value for -qN");
+        *error = true;
+      } else {
+        RtsFlags.ParFlags.nCapabilities = (uint32_t)nCapabilities;
+      }
+    }
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qN: %d capabilities per PE\n",
+                            RtsFlags.ParFlags.nCapabilities));
+    break;
+#endif
   case 'q': /* -qq<n> ... set send buffer size to <n> * packbuffer */
     if (rts_argv[arg][3] != '\0') {
       RtsFlags.ParFlags.sendBufferSize =
@@ -1829,28 +1957,98 @@ process_par_option(int arg, bool *error)
   //                debugBelch("-qQ<n>: pack buffer size set to %d bytes\n",
   //                      RtsFlags.ParFlags.packBufferSize));
   //   break;
+  case 'R': // -qR<n>, -qRb<size>, -qRt<n> ... receive budget
+    if (rts_argv[arg][3] == 'b') {
+      if (rts_argv[arg][4] != '\0') {
+        RtsFlags.ParFlags.recvBudgetBytes =
+          decodeSize(rts_argv[arg], 4, 0, HS_INT32_MAX);
+      } else {
+        errorBelch("missing argument to -qRb\n");
+        *error = true;
+      }
+    } else if (rts_argv[arg][3] == 't') {
+      if (rts_argv[arg][4] != '\0') {
+        RtsFlags.ParFlags.recvBudgetTime =
+          USToTime(strtol(rts_argv[arg]+4, (char **) NULL, 10));
+      } else {
+        errorBelch("missing argument to -qRt\n");
+        *error = true;
+      }
+    } else if (rts_argv[arg][3] != '\0') {
+      RtsFlags.ParFlags.recvBudgetMsgs =
+        strtol(rts_argv[arg]+3, (char **) NULL, 10);
+    } else {
+      errorBelch("missing argument to -qR\n");
+      *error = true;
+    }
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("%s: receive budget %d messages, %d bytes, "
+                            "%" FMT_Int64 " us\n", rts_argv[arg],
+                            RtsFlags.ParFlags.recvBudgetMsgs,
+                            RtsFlags.ParFlags.recvBudgetBytes,
+                            TimeToUS(RtsFlags.ParFlags.recvBudgetTime)));
+    break;
   case 'r':  // -Qr... : something about placement  
     switch(rts_argv[arg][3]) {
     case 'n': // will be "random placement"
       if (!strncmp(rts_argv[arg],"-qrnd",5)) {
-        RtsFlags.ParFlags.placement 
-          = (1 | RtsFlags.ParFlags.placement); // set first bit 
+        RtsFlags.ParFlags.placement // one policy, keep -qremote
+          = (PLACE_RANDOM | (RtsFlags.ParFlags.placement & PLACE_REMOTE));
         IF_PAR_DEBUG(verbose,
              debugBelch("-qrnd: random process placement\n"));
       }
       break;
     case 'e': // will be -Qremote: create children only on remote PEs
       if (!strncmp(rts_argv[arg],"-qremote",8)) {
-        RtsFlags.ParFlags.placement 
-          = (2 | RtsFlags.ParFlags.placement); // set 2nd bit
+        RtsFlags.ParFlags.placement
+          = (PLACE_REMOTE | RtsFlags.ParFlags.placement);
         IF_PAR_DEBUG(verbose,
              debugBelch("-qremote: only remote process creation.\n"));
       }
       break;
+    case 'l': // -qrll: least loaded PE, -qrloc: prefer local PE
+      if (!strcmp(rts_argv[arg],"-qrll")) {
+        RtsFlags.ParFlags.placement
+          = (PLACE_LEASTLOAD | (RtsFlags.ParFlags.placement & PLACE_REMOTE));
+        IF_PAR_DEBUG(verbose,
+             debugBelch("-qrll: least loaded PE placement\n"));
+      } else if (!strcmp(rts_argv[arg],"-qrloc")) {
+        RtsFlags.ParFlags.placement
+          = (PLACE_LOCALITY | (RtsFlags.ParFlags.placement & PLACE_REMOTE));
+        IF_PAR_DEBUG(verbose,
+             debugBelch("-qrloc: locality-preferring placement\n"));
+      } else {
+        errorBelch("Unknown option %s", rts_argv[arg]);
+        *error = true;
+      }
+      break;
+    case '2': // -qr2: power of two choices
+      RtsFlags.ParFlags.placement
+        = (PLACE_TWOCHOICE | (RtsFlags.ParFlags.placement & PLACE_REMOTE));
+      IF_PAR_DEBUG(verbose,
+           debugBelch("-qr2: two random choices placement\n"));
+      break;
     default: 
       doNothing();
     }
     break; // finish "case 'r'"
+  case 'T': // -qT ... stream eventlogs to the main PE
+    RtsFlags.ParFlags.streamTrace = true;
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qT: streaming eventlogs to the main PE\n"));
+    break;
+  case 'Z': // -qZ<size> ... compress messages of at least <size> bytes
+    if (rts_argv[arg][3] != '\0') {
+      RtsFlags.ParFlags.compressMin =
+        decodeSize(rts_argv[arg], 3, 0, HS_INT32_MAX);
+    } else {
+      errorBelch("missing argument to -qZ\n");
+      *error = true;
+    }
+    IF_PAR_DEBUG(verbose,
+                 debugBelch("-qZ: compressing messages of %d bytes or more\n",
+                            RtsFlags.ParFlags.compressMin));
+    break;
 
     /*
   case 'B': // timeout for buffered messaging
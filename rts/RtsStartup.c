@@ -350,6 +350,11 @@ hs_init_ghc(int *argc, char **argv[], RtsConfig rts_config)
     ioManagerStart();
 #endif
 
+#if defined(PARALLEL_RTS) && defined(THREADED_RTS)
+    /* threaded PE: messages are received by a dedicated task */
+    startCommTask();
+#endif
+
     /* Record initialization times */
     stat_endInit();
 }
@@ -406,6 +411,20 @@ hs_exit_(bool wait_foreign)
     checkFPUStack();
 #endif
 
+#if defined(PARALLEL_RTS)
+    /* the other PEs report their communication statistics (+RTS -s),
+     * and send the rest of their eventlog (-qT), unless we exit on error */
+    if (err == 0) {
+        collectPEStats();
+        collectPETraces();
+    }
+#endif
+
+#if defined(PARALLEL_RTS) && defined(THREADED_RTS)
+    /* no more messages, the MP-System is shut down below */
+    stopCommTask();
+#endif
+
 #if defined(THREADED_RTS)
     ioManagerDie();
 #endif
@@ -522,9 +541,12 @@ hs_exit_(bool wait_foreign)
     endTracing();
     freeTracing();
 
-#if defined(PARALLEL_RTS) && (defined(USE_SLOTS) || defined(USE_COPY))
+#if defined(PARALLEL_RTS) && (defined(USE_SLOTS) || defined(USE_COPY) \
+                              || defined(USE_TCP))
     // for parallel ways which do not use a start script, create an
-    // archive (i.e. WayParCp and WayParMSlot, see DriverPipeline.hs)
+    // archive (i.e. WayParCp, WayParMSlot and WayParTcp, see
+    // DriverPipeline.hs). Trace files of PEs on other hosts are only
+    // found when the directory is shared.
 
     zipTraceFiles();
 #endif
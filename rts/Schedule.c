@@ -138,6 +138,7 @@ static bool requestSync (Capability **pcap, Task *task,
                          PendingSync *sync_type, SyncType *prev_sync_type);
 static void acquireAllCapabilities(Capability *cap, Task *task);
 static void releaseAllCapabilities(uint32_t n, Capability *cap, Task *task);
+static void stopAllCapabilities(Capability **pCap, Task *task);
 static void startWorkerTasks (uint32_t from USED_IF_THREADS,
                               uint32_t to USED_IF_THREADS);
 #endif
@@ -151,7 +152,13 @@ static void scheduleActivateSpark(Capability *cap);
 #endif
 #if defined(PARALLEL_RTS)
 static void processMessages(Capability *cap);
-static void startNewProcess(Capability *cap, StgClosure *graph);
+static void endEventLogStream(Capability **pcap);
+static void startNewProcess(Capability *cap, StgClosure *graph, bool spread);
+static bool startHeldProcess(Capability *cap);
+#if defined(THREADED_RTS)
+static void requestTermination(Capability *cap, StgTSO *tso, Port port);
+static void scheduleTerminateThreads(Capability *cap);
+#endif
 #endif
 static void schedulePostRunThread(Capability *cap, StgTSO *t);
 static bool scheduleHandleHeapOverflow( Capability *cap, StgTSO *t );
@@ -616,6 +623,55 @@ schedulePreLoop(void)
 #endif
 }
 
+#if defined(PARALLEL_RTS) && !defined(THREADED_RTS)
+/* -----------------------------------------------------------------------------
+ * flushSendBatchesBlocking()
+ *
+ * Before the PE blocks in MP_recv, all batched messages have to be sent,
+ * receivers might wait for them. While the MP-System refuses to send
+ * (full ring, too many sends in flight), messages are taken in as soon
+ * as there are any, they may be what the receiver waits for. Otherwise
+ * we back off, yielding first and then sleeping shortly, instead of
+ * spinning on the CPU. Likewise, threads blocked on a congested PE
+ * (send gates, see DataComms.c) are not woken by a message: we wait
+ * until their PE is ready, and do not block in MP_recv then.
+ * Returns whether threads were woken.
+ * -------------------------------------------------------------------------- */
+
+// yields before sleeping, and sleep time (usec)
+#define FLUSH_SPINS  100
+#define FLUSH_SLEEP  100
+
+static bool
+flushSendBatchesBlocking (Capability *cap)
+{
+  uint32_t spins = 0;
+  bool flushed;
+
+  while (!MP_probe()) {
+    flushed = flushSendBatches(true);
+    if (openSendGates(cap)) {
+      return true;
+    }
+    if (flushed && !sendGatesClosed()) {
+      return false;
+    }
+    if (spins < FLUSH_SPINS) {
+      spins++;
+      yieldThread();
+    } else {
+#if defined(mingw32_HOST_OS)
+      Sleep(1);
+#else
+      struct timespec t = { 0, FLUSH_SLEEP * 1000 };
+      nanosleep(&t, NULL);
+#endif
+    }
+  }
+  return false;
+}
+#endif
+
 /* -----------------------------------------------------------------------------
  * scheduleFindWork()
  *
@@ -639,7 +695,36 @@ scheduleFindWork (Capability **pcap)
     //        try to activate a local spark (as above)
     //        otherwise send out a fish message here
 
-#if defined(PARALLEL_RTS)
+#if defined(PARALLEL_RTS) && defined(THREADED_RTS)
+    // threaded PE: the communication task receives and sends in the
+    // background (see commTaskLoop). Here, we only kill threads on
+    // request of other PEs, and start held processes when idle.
+    scheduleTerminateThreads(*pcap);
+
+    if (RtsFlags.ParFlags.stealing && emptyRunQueue(*pcap)) {
+      startHeldProcess(*pcap);
+    }
+#elif defined(PARALLEL_RTS)
+    // work stealing (-qF): when idle, start a process held back, or
+    // otherwise send out a fish message
+    if (RtsFlags.ParFlags.stealing) {
+      if (emptyRunQueue(*pcap) && !startHeldProcess(*pcap)) {
+        fishForWork();
+      }
+      feedHungryPEs();
+    }
+
+    // values for placeholders sent before (-qL), if they are there
+    sendRemoteValues();
+
+    if (emptyRunQueue(*pcap)) {
+      // about to block: send all batched messages before
+      flushSendBatchesBlocking(*pcap);
+    } else {
+      flushSendBatches(false);
+      openSendGates(*pcap);
+    }
+
     if (emptyRunQueue(*pcap) || MP_probe() ) {
       // nothing to do or messages available for us
 
@@ -647,6 +732,9 @@ scheduleFindWork (Capability **pcap)
       processMessages(*pcap);
       // this call will set sched_state for termination as well
 
+      if (takeEventLogEndRequest()) {
+        endEventLogStream(pcap);
+      }
     }
 #endif
 
@@ -665,9 +753,18 @@ scheduleFindWork (Capability **pcap)
  * For message codes, see PEOpCodes.h
  * At this level, there are basically 3 message types:
  *   System messages:  PP_FINISH, (PP_READY, PP_PETIDS not here)
- *   Control messages: PP_RFORK, PP_TERMINATE
- *   Data messages:    PP_DATA, PP_HEAD, PP_CONSTR, PP_CONNECT
- * processMessages receives them and executes the required action.
+ *   Control messages: PP_RFORK, PP_TERMINATE, PP_FISH, PP_NOWORK
+ *   Data messages:    PP_DATA, PP_HEAD, PP_CONSTR, PP_CONNECT, PP_BCAST,
+ *                     PP_VALUE
+ * Small messages may arrive batched in a PP_PACKET (see DataComms.c).
+ * processMessages receives them, processMessage executes the required
+ * action for each message.
+ *
+ * With a receive budget (-qR), processMessages stops receiving when the
+ * budget (messages, bytes or time) is used up and threads are waiting
+ * to run, so that a flood of messages does not starve them. The
+ * remaining messages are received in the next round of the scheduler.
+ * A PP_PACKET is always processed as a whole.
  *
  * This function used to live inside HLComms.c, but has now moved to
  * the scheduler to bring Capabilities and such into scope.
@@ -675,42 +772,231 @@ scheduleFindWork (Capability **pcap)
  * and sending methods for data messages.
  */
 
-// static data...
-static rtsPackBuffer *recvBuffer = NULL;
-static void initRecvBuffer(void);
-// done on demand in processMessages
-static void initRecvBuffer(void) {
-  if (recvBuffer == NULL) {
-    recvBuffer = (rtsPackBuffer*)
-      stgMallocBytes(sizeof(StgWord)*DATASPACEWORDS,
-                     "recvBuffer");
+// process one message (from a PP_PACKET, or received on its own)
+static void processMessage(Capability *cap, OpCode opcode, PEId pe,
+                           rtsPackBuffer *recvBuffer) {
+  Port sender, receiver;
+  StgTSO* tso; // for terminate messages
+
+  ASSERT(ISOPCODE(opcode) && opcode != PP_PACKET);
+
+  IF_PAR_DEBUG(verbose,
+               debugBelch("Received %s (Code %0d) from %d\n",
+                          getOpName(opcode),opcode,pe));
+
+  // all messages but the MP-System's FINISH carry the sender's load, and
+  // may be encoded or compressed (-qE, -qZ)
+  if (opcode != PP_FINISH) {
+    recordPELoad(pe, recvBuffer);
+    recvBuffer = decodeMsg(recvBuffer);
   }
+
+  switch (opcode) {
+    /* system messages (one valid) */
+  case PP_FINISH:
+      IF_PAR_DEBUG(verbose,
+                   debugBelch("== received FINISH from [%d]\n", pe));
+      if (IAmMainThread) {
+          /* One of the child PEs has stopped (internal error). We could
+           *  inform the other children and go on, but the system is
+           *  unstable in case of global memory. We abort execution.
+           */
+        errorBelch("Error on child node [%d], aborting execution.\n", pe);
+      } else { // not IAmMainThread
+        ASSERT(pe == 1); // only the main PE (with logical No.1) may
+                         // send a FINISH to children.
+      }
+      // this will stop the main scheduling loop, makes all threads
+      // join and shut down the entire instance.
+#if defined(THREADED_RTS)
+      // (all capabilities, and the communication task)
+      interruptStgRts();
+#else
+      sched_state = SCHED_INTERRUPTING;
+#endif
+      break;
+  case PP_NEWPE:
+  case PP_READY:
+  case PP_PETIDS:
+    barf("MP-System message %x found on scheduler level",
+         opcode);
+    /* When a new PE joins then potentially FISH & REVAL message may
+       reach PES before they are notified of the new PEs existence. The
+       only solution is to bounce/fail these messages back to the sender.
+
+       But we will worry about it once we start seeing these race
+       conditions! Currently, we assume a closed system. TODO: do
+       something about supporting an open system!
+    */
+    break;
+
+    /* control messages */
+  case PP_RFORK:
+    {
+      StgClosure *graph;
+      rtsPackBuffer *packet;
+
+      ASSERT(isRtsPort(recvBuffer->receiver) &&
+             recvBuffer->receiver.machine == thisPE);
+      // join with parts received before (if any)
+      packet = joinParts(recvBuffer);
+      // edentrace: emit an event receiveMessage(cap, packet)
+      traceReceiveMessageEvent(cap, opcode, packet);
+      // with -qF, the process may be held back until we are idle
+      if (!holdProcess(packet)) {
+        graph = unpackGraph(packet, cap);
+        startNewProcess(cap, graph, true);
+      }
+      if (packet != recvBuffer) {
+        stgFree(packet);
+      }
+
+      break;
+    }
+  case PP_FISH:
+    // an idle PE asks for a held process (work stealing)
+    processFishMsg(pe);
+    break;
+  case PP_NOWORK:
+    // answer to our PP_FISH, no process to steal there
+    processNoWorkMsg(pe);
+    break;
+  case PP_PART:
+    // part of a large graph, collected until the final message arrives
+    processPartMsg(recvBuffer);
+    break;
+  case PP_TERMINATE:
+    // remote request to terminate a local thread
+    // ports: sender = a remote inport, receiver = a local thread
+    // receiver should be (thisPE, a process, a ThreadID)
+
+    receiver = recvBuffer->receiver;
+    sender = recvBuffer->sender;
+
+    // checks if 1. this thread exists
+    //           2. belongs to the process
+    // TODO: this is currently unimplemented.  what we want is to
+    // kill the thread with thread->id == receiver.id
+    tso = findTSOByP(receiver);
+    if (tso == NULL) {
+      // nothing to do
+      break;
+    }
+    // checks if 3. (still) has receiver set to this sender
+    if (equalPorts(*(MyReceiver(tso)), sender)) {
+
+      // edentrace: emit event receiveMessage(cap, recvBuffer TERMINATE)
+      traceReceiveMessageEvent(cap, opcode, recvBuffer);
+#if defined(THREADED_RTS)
+      // only the thread's own capability may kill it
+      if (tso->cap != cap) {
+        requestTermination(cap, tso, receiver);
+        break;
+      }
+#endif
+      // terminate this thread (it may not catch ThreadKilled!)
+      deleteThread(tso);
+    } else {
+      // otherwise: nothing to do, ignore message
+      IF_PAR_DEBUG(ports,
+                   debugBelch("WARN: Request from port (%d,%d,%d) "
+                              "to terminate thread %d (not connected).\n",
+                              (int) sender.machine, (int) sender.process,
+                              (int) sender.id, (int) tso->id));
+    }
+    break;
+
+    /* data messages: */
+  case PP_DATA:
+  case PP_HEAD:
+  case PP_CONSTR:
+    // unpack ports, check 1:1 connection,
+    // unpack data in the heap, update Blackhole.
+    // All done inside DataComms.c
+    processDataMsg(cap, opcode, recvBuffer);
+    // this will also unblock threads
+    break;
+
+  case PP_CONNECT:
+    // connect receiver port to sender (checking 1:1, one connection allowed)
+    connectInportByP(recvBuffer->receiver, recvBuffer->sender);
+    break;
+
+  case PP_BCAST:
+    // data for several inports, possibly to be relayed to other PEs
+    processBcastMsg(cap, recvBuffer);
+    break;
+
+  case PP_STATS:
+    // communication statistics: request, or answer to the main PE
+    processStatsMsg(pe, recvBuffer);
+    break;
+  case PP_EVENTLOG:
+    // eventlog data for the main PE, or a request to end the eventlog
+    processEventLogMsg(pe, recvBuffer);
+    break;
+  case PP_VALUE:
+    // value for a placeholder received before (-qL), updates it
+    processValueMsg(cap, recvBuffer);
+    break;
+
+  default:
+      /* Anything we're not prepared to deal with. */
+      barf("PE %d: Unexpected opcode %x from %x",
+           thisPE, opcode, pe);
+    } /* switch */
 }
 
-// called at shutdown, declared in Parallel.h
-void freeRecvBuffer(void) {
-  if (recvBuffer != NULL) { stgFree(recvBuffer); }
+// check the receive budget (-qR) after receiving msgs messages with
+// bytes of data, since start
+static bool recvBudgetUsed(Capability *cap USED_IF_NOT_THREADS,
+                           uint32_t msgs, uint32_t bytes, Time start) {
+#if !defined(THREADED_RTS)
+  // nothing else to do (in the threaded RTS, the communication task
+  // gives the capability back to the workers in between)
+  if (emptyRunQueue(cap)) {
+    return false;
+  }
+#endif
+  return ((RtsFlags.ParFlags.recvBudgetMsgs > 0 &&
+           msgs >= RtsFlags.ParFlags.recvBudgetMsgs) ||
+          (RtsFlags.ParFlags.recvBudgetBytes > 0 &&
+           bytes >= RtsFlags.ParFlags.recvBudgetBytes) ||
+          (RtsFlags.ParFlags.recvBudgetTime > 0 &&
+           getProcessElapsedTime() - start >= RtsFlags.ParFlags.recvBudgetTime));
 }
 
 static void processMessages(Capability *cap) {
   OpCode opcode;
   PEId pe;
-  Port sender, receiver;
-  StgTSO* tso; // for terminate messages
+  uint32_t length;
+  rtsPackBuffer *recvBuffer;
   bool eventEmitted = false;
-
-  initRecvBuffer();
+  uint32_t msgs = 0, bytes = 0; // received so far, for the budget
+  Time start = 0;
+  Time waitStart, waited = 0;
 
   IF_PAR_DEBUG(verbose,
                debugBelch("processing messages from other PEs\n"));
+  if (RtsFlags.ParFlags.recvBudgetTime > 0) {
+    start = getProcessElapsedTime();
+  }
+  ACQUIRE_PAR_LOCK();
   do {
-    // using raw MP interface... And we unpack at most the maximum
-    // size (MPSystem will determine and unpack the real size).
-    MP_recv(sizeof(StgWord)*DATASPACEWORDS,
-            (StgWord8*) recvBuffer, &opcode, &pe);
+    // using raw MP interface... The message is borrowed from the
+    // MP-System (in place in its transport buffer if possible), and
+    // processed (unpacked) from there. Everything that needs to live
+    // longer is copied by the processing functions.
+    // (only the first receive might block, the others are probed)
+    waitStart = (msgs == 0) ? stat_parClock() : 0;
+    recvBuffer = (rtsPackBuffer*) MP_recv_borrow(&opcode, &pe, &length);
+    if (msgs == 0) {
+      waited += stat_parClock() - waitStart;
+    }
 
     ASSERT(pe <= nPEs && pe > 0);
     ASSERT(ISOPCODE(opcode));
+    ASSERT(length <= sizeof(StgWord)*DATASPACEWORDS);
 
     if (!eventEmitted)  {
     //          edentrace: start communication event
@@ -718,116 +1004,38 @@ static void processMessages(Capability *cap) {
       traceEdenEventStartReceive(cap);
     }
 
-    IF_PAR_DEBUG(verbose,
-                 debugBelch("Received %s (Code %0d) from %d\n",
-                            getOpName(opcode),opcode,pe));
-    switch (opcode) {
-      /* system messages (one valid) */
-    case PP_FINISH:
-        IF_PAR_DEBUG(verbose,
-                     debugBelch("== received FINISH from [%d]\n", pe));
-        if (IAmMainThread) {
-            /* One of the child PEs has stopped (internal error). We could
-             *  inform the other children and go on, but the system is
-             *  unstable in case of global memory. We abort execution.
-             */
-          errorBelch("Error on child node [%d], aborting execution.\n", pe);
-        } else { // not IAmMainThread
-          ASSERT(pe == 1); // only the main PE (with logical No.1) may
-                           // send a FINISH to children.
-        }
-        // this will stop the main scheduling loop, makes all threads
-        // join and shut down the entire instance.
-        sched_state = SCHED_INTERRUPTING;
-        break;
-    case PP_NEWPE:
-    case PP_READY:
-    case PP_PETIDS:
-      barf("MP-System message %x found on scheduler level",
-           opcode);
-      /* When a new PE joins then potentially FISH & REVAL message may
-         reach PES before they are notified of the new PEs existence. The
-         only solution is to bounce/fail these messages back to the sender.
-
-         But we will worry about it once we start seeing these race
-         conditions! Currently, we assume a closed system. TODO: do
-         something about supporting an open system!
-      */
-      break;
-
-      /* control messages */
-    case PP_RFORK:
-      {
-        StgClosure *graph;
-
-        ASSERT(isRtsPort(recvBuffer->receiver) &&
-               recvBuffer->receiver.machine == thisPE);
-        // edentrace: emit an event receiveMessage(cap, recvBuffer)
-        traceReceiveMessageEvent(cap, opcode, recvBuffer);
-        graph = unpackGraph(recvBuffer, cap);
-        startNewProcess(cap, graph);
-
-        break;
+    if (opcode == PP_PACKET) {
+      // batched messages from one PE (see DataComms.c), processed in
+      // order, in place
+      StgWord8 *entry = (StgWord8*) recvBuffer;
+      StgWord8 *end = entry + length;
+      PacketEntry *hdr;
+
+      while (entry < end) {
+        hdr = (PacketEntry*) entry;
+        processMessage(cap, hdr->tag, pe,
+                       (rtsPackBuffer*) (entry + sizeof(PacketEntry)));
+        entry += sizeof(PacketEntry)
+                 + ROUNDUP_BYTES_TO_WDS(hdr->length) * sizeof(StgWord);
+        msgs++;
       }
-    case PP_TERMINATE:
-      // remote request to terminate a local thread
-      // ports: sender = a remote inport, receiver = a local thread
-      // receiver should be (thisPE, a process, a ThreadID)
-
-      receiver = recvBuffer->receiver;
-      sender = recvBuffer->sender;
-
-      // checks if 1. this thread exists
-      //           2. belongs to the process
-      // TODO: this is currently unimplemented.  what we want is to
-      // kill the thread with thread->id == receiver.id
-      tso = findTSOByP(receiver);
-      if (tso == NULL) {
-        // nothing to do
-        break;
-      }
-      // checks if 3. (still) has receiver set to this sender
-      if (equalPorts(*(MyReceiver(tso)), sender)) {
-
-        // edentrace: emit event receiveMessage(cap, recvBuffer TERMINATE)
-        traceReceiveMessageEvent(cap, opcode, recvBuffer);
-        // terminate this thread (it may not catch ThreadKilled!)
-        deleteThread(tso);
-      } else {
-        // otherwise: nothing to do, ignore message
-        IF_PAR_DEBUG(ports,
-                     debugBelch("WARN: Request from port (%d,%d,%d) "
-                                "to terminate thread %d (not connected).\n",
-                                (int) sender.machine, (int) sender.process,
-                                (int) sender.id, (int) tso->id));
-      }
-      break;
-
-      /* data messages: */
-    case PP_DATA:
-    case PP_HEAD:
-    case PP_CONSTR:
-      // unpack ports, check 1:1 connection,
-      // unpack data in the heap, update Blackhole.
-      // All done inside DataComms.c
-      processDataMsg(cap, opcode, recvBuffer);
-      // this will also unblock threads
-      break;
-
-    case PP_CONNECT:
-      // connect receiver port to sender (checking 1:1, one connection allowed)
-      connectInportByP(recvBuffer->receiver, recvBuffer->sender);
-      break;
+    } else {
+      processMessage(cap, opcode, pe, recvBuffer);
+      msgs++;
+    }
+    bytes += length;
 
-    default:
-        /* Anything we're not prepared to deal with. */
-        barf("PE %d: Unexpected opcode %x from %x",
-             thisPE, opcode, pe);
-      } /* switch */
+    MP_recv_release();
 
   } while (sched_state < SCHED_INTERRUPTING && // stop shortcut
+           !recvBudgetUsed(cap, msgs, bytes, start) && // let threads run
            MP_probe());       // While there are messages: process them
 
+  stat_receivedMsgs(msgs, bytes, waited);
+  // edentrace: how many messages were received, how many wait
+  traceInboxDepth(cap, msgs, bytes, MP_pending());
+  RELEASE_PAR_LOCK();
+
   // edentrace: EdenEventEndReceive
      if ( eventEmitted ) {
         traceEdenEventEndReceive(cap);
@@ -835,6 +1043,48 @@ static void processMessages(Capability *cap) {
   return;
 }  /* processMessages */
 
+/* endEventLogStream
+ *   With -qT, other PEs send their eventlog to the main PE (see
+ *   StreamEventLogWriter). At shutdown, the main PE asks them to end it
+ *   (PP_EVENTLOG, see collectPETraces). The buffers of all capabilities
+ *   are flushed, so these are stopped meanwhile. The stream writer drops
+ *   events posted later on (endTracing is called again at exit).
+ */
+static void endEventLogStream(Capability **pcap USED_IF_THREADS) {
+#if defined(TRACING)
+#if defined(THREADED_RTS)
+  Task *task = (*pcap)->running_task;
+
+  stopAllCapabilities(pcap, task);
+#endif
+  endTracing();
+#if defined(THREADED_RTS)
+  releaseAllCapabilities(n_capabilities, *pcap, task);
+#endif
+#endif
+}
+
+/* startHeldProcess
+ *   start a process which was held back for work stealing (see
+ *   DataComms.c), returns false if there is none.
+ */
+static bool startHeldProcess(Capability *cap) {
+  rtsPackBuffer *packet;
+  StgClosure *graph;
+
+  ACQUIRE_PAR_LOCK();
+  packet = takeHeldProcess();
+  if (packet == NULL) {
+    RELEASE_PAR_LOCK();
+    return false;
+  }
+  graph = unpackGraph(packet, cap);
+  stgFree(packet);
+  startNewProcess(cap, graph, false);
+  RELEASE_PAR_LOCK();
+  return true;
+}
+
 /* startNewProcess
  *   start a new process to evaluate data we usually received via
  *   processMessages (called from there).
@@ -842,9 +1092,18 @@ static void processMessages(Capability *cap) {
  * As opposed to "forking" a thread from haskell, a new processID is
  * assigned and the new process not supposed to share heap data with
  * other existing threads.
+ *
+ * In a threaded PE, processes are spread over the capabilities
+ * round-robin if requested (for processes received by the
+ * communication task), otherwise they start on cap.
  */
 
-void startNewProcess(Capability *cap, StgClosure* graph) {
+#if defined(THREADED_RTS)
+static uint32_t nextProcessCap = 0;
+#endif
+
+void startNewProcess(Capability *cap, StgClosure* graph,
+                     bool spread USED_IF_THREADS) {
   StgTSO *tso;
 
   IF_PAR_DEBUG(verbose,
@@ -864,12 +1123,320 @@ void startNewProcess(Capability *cap, StgClosure* graph) {
   IF_PAR_DEBUG(procs,
                printTSO(tso));
 
+#if defined(THREADED_RTS)
+  if (spread) {
+    Capability *target;
+
+    target = capabilities[nextProcessCap++ % enabled_capabilities];
+    if (target != cap) {
+      // handed over by a message (MSG_TRY_WAKEUP)
+      migrateThread(cap, tso, target);
+      return;
+    }
+  }
+#endif
+
   // schedule the thread (will go to the end of the run queue)
   scheduleThread(cap, tso);
 
   return;
 }
 
+#if defined(THREADED_RTS)
+/* -------------------------------------------------------------------------
+ * Terminating threads of other capabilities (threaded PEs)
+ *
+ * PP_TERMINATE messages are processed on the capability which the
+ * communication task holds. A thread living on another capability must
+ * be killed there: the request is queued (protected by the parallel
+ * lock), and the capability is woken up to kill the thread in
+ * scheduleFindWork.
+ * ------------------------------------------------------------------------- */
+
+static Port     *termRequests = NULL;
+static uint32_t nTermRequests = 0, termRequestsSize = 0;
+
+static void requestTermination(Capability *cap, StgTSO *tso, Port port) {
+  if (nTermRequests == termRequestsSize) {
+    termRequestsSize = (termRequestsSize == 0) ? 16 : 2 * termRequestsSize;
+    termRequests = (Port*)
+      stgReallocBytes(termRequests, termRequestsSize * sizeof(Port),
+                      "requestTermination");
+  }
+  termRequests[nTermRequests++] = port;
+
+  IF_PAR_DEBUG(procs,
+               debugBelch("thread %d to be terminated on cap %d\n",
+                          (int) tso->id, (int) tso->cap->no));
+  contextSwitchCapability(tso->cap);
+  prodCapability(tso->cap, cap->running_task);
+}
+
+static void scheduleTerminateThreads(Capability *cap) {
+  StgTSO *tso;
+  uint32_t i;
+
+  if (nTermRequests == 0) {
+    return; // no lock needed to find out
+  }
+
+  ACQUIRE_PAR_LOCK();
+  i = 0;
+  while (i < nTermRequests) {
+    tso = findTSOByP(termRequests[i]);
+    if (tso != NULL && tso->cap != cap) {
+      i++; // not ours, left for its capability
+      continue;
+    }
+    if (tso != NULL) {
+      deleteThread(tso);
+    }
+    // done (or thread gone meanwhile), drop the request
+    termRequests[i] = termRequests[--nTermRequests];
+  }
+  RELEASE_PAR_LOCK();
+}
+
+/* -------------------------------------------------------------------------
+ * The communication task (threaded PEs)
+ *
+ * Capabilities of a threaded PE never block in MP_recv. Instead, a
+ * dedicated OS thread polls the MP-System. When messages arrive, it
+ * takes a capability like a call into Haskell from outside (rts_lock)
+ * and processes them there: new processes are spread over the
+ * capabilities (see startNewProcess), threads blocked on received data
+ * are woken up by messages to their capabilities. Otherwise, it sends
+ * batched messages, wakes threads blocked on congested PEs (send gates,
+ * see DataComms.c) and does the work stealing (-qF) for the PE.
+ * ------------------------------------------------------------------------- */
+
+// polls before sleeping, and sleep time (usec) when there is nothing to do
+#define COMM_TASK_SPINS  100
+#define COMM_TASK_SLEEP  100
+
+static OSThreadId        commTaskId;
+static Mutex             commTaskMutex;
+static Condition         commTaskStopped;
+static bool              commTaskRunning = false;
+static volatile StgWord  commTaskStop = 0;
+
+// number of capabilities without running or runnable threads (unsynchronised)
+static uint32_t idleCapabilities(void) {
+  uint32_t i, n = 0;
+
+  for (i = 0; i < enabled_capabilities; i++) {
+    if (capabilities[i]->running_task == NULL
+        && emptyRunQueue(capabilities[i])) {
+      n++;
+    }
+  }
+  return n;
+}
+
+static void* OSThreadProcAttr commTaskLoop(void *arg STG_UNUSED) {
+  Capability *cap;
+  uint32_t idle, spins = 0;
+  bool messages, held, values, gates;
+
+  IF_PAR_DEBUG(verbose,
+               debugBelch("communication task started\n"));
+
+  while (!commTaskStop && sched_state < SCHED_INTERRUPTING) {
+    idle = idleCapabilities();
+
+    ACQUIRE_PAR_LOCK();
+    messages = MP_probe();
+    if (!messages) {
+      // when all capabilities are idle, send all batched messages,
+      // receivers might wait for them
+      flushSendBatches(idle == enabled_capabilities);
+      if (RtsFlags.ParFlags.stealing) {
+        if (idle == enabled_capabilities && heldProcessCount() == 0) {
+          fishForWork();
+        }
+        feedHungryPEs();
+      }
+    }
+    held = RtsFlags.ParFlags.stealing && idle > 0 && heldProcessCount() > 0;
+    values = outstandingRemoteRefs() > 0;
+    gates = sendGatesReady();
+    RELEASE_PAR_LOCK();
+
+    if (messages || held || gates) {
+      spins = 0;
+      cap = rts_lock();
+      if (messages) {
+        processMessages(cap);
+        if (takeEventLogEndRequest()) {
+          endEventLogStream(&cap);
+        }
+      }
+      if (RtsFlags.ParFlags.stealing && emptyRunQueue(cap)) {
+        startHeldProcess(cap);
+      }
+      if (values) {
+        sendRemoteValues();
+      }
+      if (gates) {
+        openSendGates(cap);
+      }
+      rts_unlock(cap);
+    } else if (spins < COMM_TASK_SPINS) {
+      spins++;
+      yieldThread();
+    } else {
+      // values for placeholders (-qL) are checked before sleeping, not
+      // to take a capability from the workers too often
+      if (values) {
+        cap = rts_lock();
+        sendRemoteValues();
+        rts_unlock(cap);
+      }
+#if defined(mingw32_HOST_OS)
+      Sleep(1);
+#else
+      struct timespec t = { 0, COMM_TASK_SLEEP * 1000 };
+      nanosleep(&t, NULL);
+#endif
+    }
+  }
+
+  IF_PAR_DEBUG(verbose,
+               debugBelch("communication task stopping\n"));
+  ACQUIRE_LOCK(&commTaskMutex);
+  commTaskRunning = false;
+  signalCondition(&commTaskStopped);
+  RELEASE_LOCK(&commTaskMutex);
+  return NULL;
+}
+
+// Declared in Parallel.h, called in RtsStartup.c
+void startCommTask(void) {
+  initMutex(&commTaskMutex);
+  initCondition(&commTaskStopped);
+  commTaskStop = 0;
+  commTaskRunning = true;
+
+  if (createOSThread(&commTaskId, "ghc_comm", commTaskLoop, NULL) != 0) {
+    barf("startCommTask: cannot create the communication task");
+  }
+}
+
+void stopCommTask(void) {
+  if (!commTaskRunning || osThreadId() == commTaskId) {
+    return;
+  }
+  ACQUIRE_LOCK(&commTaskMutex);
+  commTaskStop = 1;
+  while (commTaskRunning) {
+    waitCondition(&commTaskStopped, &commTaskMutex);
+  }
+  RELEASE_LOCK(&commTaskMutex);
+}
+#endif // THREADED_RTS
+
+/* -------------------------------------------------------------------------
+ * collectPEStats, collectPETraces
+ *
+ * Before shutting down, the main PE asks all other PEs for their
+ * communication statistics (for +RTS -s, see Stats.c), and with -qT for
+ * the rest of their eventlog (see endEventLogStream). The other PEs are
+ * still running then, and answer from their scheduler. Meanwhile,
+ * messages are processed as usual (by the communication task in a
+ * threaded PE). If a PE fails (PP_FINISH), we stop waiting. A PE which
+ * does not answer within ANSWER_TIMEOUT seconds (stuck, or its messages
+ * lost) is left out: shutdown goes on, report_summary prints "(no
+ * report)" for it, and the merged eventlog ends with the events which
+ * arrived from it. The main PE only polls here and never blocks in
+ * MP_recv.
+ * ------------------------------------------------------------------------- */
+
+// time (seconds) to wait for answers, and poll interval (usec)
+#define ANSWER_TIMEOUT  10
+#define ANSWER_SLEEP    100
+
+static uint32_t missingAnswers(uint32_t (*missing)(void)) {
+  uint32_t n;
+
+  ACQUIRE_PAR_LOCK();
+  n = missing();
+  RELEASE_PAR_LOCK();
+  return n;
+}
+
+// returns the number of PEs which did not answer
+static uint32_t awaitAnswers(uint32_t (*missing)(void)) {
+  Time deadline = getProcessElapsedTime() + SecondsToTime(ANSWER_TIMEOUT);
+  uint32_t n;
+#if !defined(THREADED_RTS)
+  bool messages;
+#endif
+
+  while ((n = missingAnswers(missing)) > 0
+         && sched_state < SCHED_INTERRUPTING) {
+    if (getProcessElapsedTime() >= deadline) {
+      IF_PAR_DEBUG(verbose,
+                   debugBelch("%d PEs did not answer at shutdown\n", n));
+      return n;
+    }
+#if !defined(THREADED_RTS)
+    ACQUIRE_PAR_LOCK();
+    messages = MP_probe();
+    if (!messages) {
+      // requests which could not be sent go out first
+      flushSendBatches(true);
+    }
+    RELEASE_PAR_LOCK();
+    if (messages) {
+      processMessages(capabilities[0]);
+      continue;
+    }
+#endif
+    // (in a threaded PE, the communication task receives the answers)
+#if defined(mingw32_HOST_OS)
+    Sleep(1);
+#else
+    struct timespec t = { 0, ANSWER_SLEEP * 1000 };
+    nanosleep(&t, NULL);
+#endif
+  }
+  return n;
+}
+
+// Declared in Parallel.h, called in RtsStartup.c
+void collectPEStats(void) {
+  if (!IAmMainThread || nPEs < 2
+      || RtsFlags.GcFlags.giveStats < SUMMARY_GC_STATS
+      || sched_state >= SCHED_INTERRUPTING) {
+    return;
+  }
+
+  ACQUIRE_PAR_LOCK();
+  requestPEStats();
+  RELEASE_PAR_LOCK();
+
+  awaitAnswers(missingPEStats);
+}
+
+// Declared in Parallel.h, called in RtsStartup.c
+void collectPETraces(void) {
+  if (!IAmMainThread || nPEs < 2 || !RtsFlags.ParFlags.streamTrace
+      || RtsFlags.TraceFlags.tracing != TRACE_EVENTLOG
+      || sched_state >= SCHED_INTERRUPTING) {
+    return;
+  }
+
+  ACQUIRE_PAR_LOCK();
+  requestPETraces();
+  RELEASE_PAR_LOCK();
+
+  if (awaitAnswers(missingPETraces) > 0) {
+    ACQUIRE_PAR_LOCK();
+    abandonPETraces();
+    RELEASE_PAR_LOCK();
+  }
+}
+
 #endif // PARALLEL_RTS
 
 
@@ -1148,7 +1715,9 @@ scheduleCheckBlockedThreads(Capability *cap USED_IF_NOT_THREADS)
 static void
 scheduleDetectDeadlock (Capability **pcap, Task *task)
 {
-#if defined(PARALLEL_RTS)
+#if defined(PARALLEL_RTS) && !defined(THREADED_RTS)
+    // an empty PE waits for messages (threaded PEs do the idle GC below,
+    // threads waiting for remote data are kept alive by the system TSO)
     return;
 #endif
 
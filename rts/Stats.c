@@ -173,6 +173,16 @@ initStats0(void)
         .any_work = 0,
         .no_work = 0,
         .scav_find_work = 0,
+        .msgs_sent = 0,
+        .msgs_received = 0,
+        .msg_bytes_sent = 0,
+        .msg_bytes_received = 0,
+        .packs = 0,
+        .packs_blocked = 0,
+        .unpacks = 0,
+        .pack_ns = 0,
+        .unpack_ns = 0,
+        .recv_blocked_ns = 0,
         .init_cpu_ns = 0,
         .init_elapsed_ns = 0,
         .mutator_cpu_ns = 0,
@@ -270,6 +280,104 @@ stat_endExit(void)
     getProcessTimes(&end_exit_cpu, &end_exit_elapsed);
 }
 
+#if defined(PARALLEL_RTS)
+/* -----------------------------------------------------------------------------
+   Communication statistics (parallel ways)
+
+   The counters of this PE are kept in stats and updated by DataComms.c
+   (messages sent), processMessages (messages received, time waiting in
+   MP_recv) and Pack.c (packing and unpacking graphs for messages), all
+   holding the parallel lock. The main PE collects the counters of the
+   other PEs at shutdown, for the +RTS -s summary.
+   -------------------------------------------------------------------------- */
+
+// counters of all PEs (main PE, at shutdown), NULL otherwise
+static ParStats *pe_stats = NULL;
+static uint32_t  pe_stats_count = 0;
+
+// elapsed time to measure packing and waiting, only taken with stats
+// enabled (0 otherwise)
+Time
+stat_parClock(void)
+{
+    if (RtsFlags.GcFlags.giveStats == NO_GC_STATS) {
+        return 0;
+    }
+    return getProcessElapsedTime();
+}
+
+// heap residency of this PE: live data after the last GC (in kbytes),
+// as a load measure for placement (see choosePE in DataComms.c)
+uint32_t
+stat_liveKBytes(void)
+{
+    return (uint32_t) (stats.gc.live_bytes / 1024);
+}
+
+void
+stat_sentMsgs(uint32_t msgs, uint64_t bytes)
+{
+    stats.msgs_sent += msgs;
+    stats.msg_bytes_sent += bytes;
+}
+
+void
+stat_receivedMsgs(uint32_t msgs, uint64_t bytes, Time blocked)
+{
+    stats.msgs_received += msgs;
+    stats.msg_bytes_received += bytes;
+    stats.recv_blocked_ns += blocked;
+}
+
+// result is the result of packToBuffer (size or error code)
+void
+stat_packed(int result, Time t)
+{
+    if (result == P_BLACKHOLE) {
+        stats.packs_blocked++;
+    } else if (!isPackError(result)) {
+        stats.packs++;
+    }
+    stats.pack_ns += t;
+}
+
+void
+stat_unpacked(Time t)
+{
+    stats.unpacks++;
+    stats.unpack_ns += t;
+}
+
+void
+stat_getParStats(ParStats *s)
+{
+    s->msgs_sent          = stats.msgs_sent;
+    s->msgs_received      = stats.msgs_received;
+    s->msg_bytes_sent     = stats.msg_bytes_sent;
+    s->msg_bytes_received = stats.msg_bytes_received;
+    s->packs              = stats.packs;
+    s->packs_blocked      = stats.packs_blocked;
+    s->unpacks            = stats.unpacks;
+    s->pack_ns            = stats.pack_ns;
+    s->unpack_ns          = stats.unpack_ns;
+    s->recv_blocked_ns    = stats.recv_blocked_ns;
+}
+
+// counters reported by another PE (main PE)
+void
+stat_setPEStats(uint32_t pe, ParStats *s)
+{
+    if (pe_stats == NULL) {
+        pe_stats_count = nPEs;
+        pe_stats = stgCallocBytes(pe_stats_count, sizeof(ParStats),
+                                  "stat_setPEStats");
+    }
+    if (pe > 0 && pe <= pe_stats_count) {
+        pe_stats[pe-1] = *s;
+    }
+}
+#endif
+
 void
 stat_startGCSync (gc_thread *gct)
 {
@@ -725,6 +833,70 @@ static void report_summary(const RTSSummaryStats* sum)
                 sum->sparks.fizzled);
 #endif
 
+#if defined(PARALLEL_RTS)
+    {
+        char temp2[512];
+
+        showStgWord64(stats.msgs_sent, temp, true/*commas*/);
+        showStgWord64(stats.msg_bytes_sent, temp2, true/*commas*/);
+        statsPrintf("  PE %d of %d: %s messages sent (%s bytes), ",
+                    thisPE, nPEs, temp, temp2);
+        showStgWord64(stats.msgs_received, temp, true/*commas*/);
+        showStgWord64(stats.msg_bytes_received, temp2, true/*commas*/);
+        statsPrintf("%s received (%s bytes)\n", temp, temp2);
+        statsPrintf("    %" FMT_Word64 " graphs packed in %.3fs "
+                    "(%" FMT_Word64 " blocked on blackholes), "
+                    "%" FMT_Word64 " unpacked in %.3fs\n",
+                    stats.packs, TimeToSecondsDbl(stats.pack_ns),
+                    stats.packs_blocked,
+                    stats.unpacks, TimeToSecondsDbl(stats.unpack_ns));
+        statsPrintf("    %.3fs waiting for messages\n\n",
+                    TimeToSecondsDbl(stats.recv_blocked_ns));
+    }
+
+    if (sum->pe_stats != NULL) {
+        uint32_t pe;
+
+        // a PE which reported has at least received the request, the
+        // others failed before answering
+        statsPrintf("  Communication of all PEs:\n");
+        statsPrintf("     PE    msgs out     bytes out     msgs in"
+                    "      bytes in    packs  blocked   pack s"
+                    "  unpacks unpack s   wait s\n");
+        for (pe = 0; pe < sum->pe_count; pe++) {
+            const ParStats *s = &sum->pe_stats[pe];
+            if (s->msgs_received == 0 && pe + 1 != thisPE) {
+                statsPrintf("  %5d  (no report)\n", pe + 1);
+                continue;
+            }
+            statsPrintf("  %5d %11" FMT_Word64 " %13" FMT_Word64
+                        " %11" FMT_Word64 " %13" FMT_Word64
+                        " %8" FMT_Word64 " %8" FMT_Word64 " %8.3f"
+                        " %8" FMT_Word64 " %8.3f %8.3f\n",
+                        pe + 1, s->msgs_sent, s->msg_bytes_sent,
+                        s->msgs_received, s->msg_bytes_received,
+                        s->packs, s->packs_blocked,
+                        TimeToSecondsDbl(s->pack_ns), s->unpacks,
+                        TimeToSecondsDbl(s->unpack_ns),
+                        TimeToSecondsDbl(s->recv_blocked_ns));
+        }
+        statsPrintf("    all %11" FMT_Word64 " %13" FMT_Word64
+                    " %11" FMT_Word64 " %13" FMT_Word64
+                    " %8" FMT_Word64 " %8" FMT_Word64 " %8.3f"
+                    " %8" FMT_Word64 " %8.3f %8.3f\n\n",
+                    sum->pe_stats_total.msgs_sent,
+                    sum->pe_stats_total.msg_bytes_sent,
+                    sum->pe_stats_total.msgs_received,
+                    sum->pe_stats_total.msg_bytes_received,
+                    sum->pe_stats_total.packs,
+                    sum->pe_stats_total.packs_blocked,
+                    TimeToSecondsDbl(sum->pe_stats_total.pack_ns),
+                    sum->pe_stats_total.unpacks,
+                    TimeToSecondsDbl(sum->pe_stats_total.unpack_ns),
+                    TimeToSecondsDbl(sum->pe_stats_total.recv_blocked_ns));
+    }
+#endif
+
     statsPrintf("  INIT    time  %7.3fs  (%7.3fs elapsed)\n",
                 TimeToSecondsDbl(stats.init_cpu_ns),
                 TimeToSecondsDbl(stats.init_elapsed_ns));
@@ -955,6 +1127,44 @@ static void report_machine_readable (const RTSSummaryStats * sum)
     MR_STAT("sparks_gcd", FMT_Word, sum->sparks.gcd);
     MR_STAT("sparks_fizzled", FMT_Word, sum->sparks.fizzled);
     MR_STAT("work_balance", "f", sum->work_balance);
+#endif
+
+    // next, communication of this PE and of all PEs (parallel ways)
+#if defined(PARALLEL_RTS)
+    MR_STAT("msgs_sent", FMT_Word64, stats.msgs_sent);
+    MR_STAT("msgs_received", FMT_Word64, stats.msgs_received);
+    MR_STAT("msg_bytes_sent", FMT_Word64, stats.msg_bytes_sent);
+    MR_STAT("msg_bytes_received", FMT_Word64, stats.msg_bytes_received);
+    MR_STAT("packs", FMT_Word64, stats.packs);
+    MR_STAT("packs_blocked", FMT_Word64, stats.packs_blocked);
+    MR_STAT("unpacks", FMT_Word64, stats.unpacks);
+    MR_STAT("pack_seconds", "f", TimeToSecondsDbl(stats.pack_ns));
+    MR_STAT("unpack_seconds", "f", TimeToSecondsDbl(stats.unpack_ns));
+    MR_STAT("recv_blocked_seconds", "f",
+            TimeToSecondsDbl(stats.recv_blocked_ns));
+    if (sum->pe_stats != NULL) {
+        MR_STAT("all_pes_msgs_sent", FMT_Word64,
+                sum->pe_stats_total.msgs_sent);
+        MR_STAT("all_pes_msgs_received", FMT_Word64,
+                sum->pe_stats_total.msgs_received);
+        MR_STAT("all_pes_msg_bytes_sent", FMT_Word64,
+                sum->pe_stats_total.msg_bytes_sent);
+        MR_STAT("all_pes_msg_bytes_received", FMT_Word64,
+                sum->pe_stats_total.msg_bytes_received);
+        MR_STAT("all_pes_packs", FMT_Word64, sum->pe_stats_total.packs);
+        MR_STAT("all_pes_packs_blocked", FMT_Word64,
+                sum->pe_stats_total.packs_blocked);
+        MR_STAT("all_pes_unpacks", FMT_Word64, sum->pe_stats_total.unpacks);
+        MR_STAT("all_pes_pack_seconds", "f",
+                TimeToSecondsDbl(sum->pe_stats_total.pack_ns));
+        MR_STAT("all_pes_unpack_seconds", "f",
+                TimeToSecondsDbl(sum->pe_stats_total.unpack_ns));
+        MR_STAT("all_pes_recv_blocked_seconds", "f",
+                TimeToSecondsDbl(sum->pe_stats_total.recv_blocked_ns));
+    }
+#endif
+
+#if defined(THREADED_RTS)
 
     // next, globals (other than internal counters)
     MR_STAT("n_capabilities", FMT_Word32, n_capabilities);
@@ -1225,6 +1435,30 @@ stat_exit (void)
                 gen_stats->sync_yield = gen->sync.yield;
     #endif // PROF_SPIN
             }
+
+    #if defined(PARALLEL_RTS)
+            // counters of all PEs (main PE, when collected)
+            if (pe_stats != NULL) {
+                uint32_t pe;
+                stat_getParStats(&pe_stats[thisPE-1]);
+                sum.pe_count = pe_stats_count;
+                sum.pe_stats = pe_stats;
+                for (pe = 0; pe < pe_stats_count; pe++) {
+                    ParStats *s = &pe_stats[pe];
+                    ParStats *t = &sum.pe_stats_total;
+                    t->msgs_sent          += s->msgs_sent;
+                    t->msgs_received      += s->msgs_received;
+                    t->msg_bytes_sent     += s->msg_bytes_sent;
+                    t->msg_bytes_received += s->msg_bytes_received;
+                    t->packs              += s->packs;
+                    t->packs_blocked      += s->packs_blocked;
+                    t->unpacks            += s->unpacks;
+                    t->pack_ns            += s->pack_ns;
+                    t->unpack_ns          += s->unpack_ns;
+                    t->recv_blocked_ns    += s->recv_blocked_ns;
+                }
+            }
+    #endif // PARALLEL_RTS
         }
 
         // Now we generate the report
@@ -1258,6 +1492,12 @@ stat_exit (void)
       stgFree(GC_coll_max_pause);
       GC_coll_max_pause = NULL;
     }
+#if defined(PARALLEL_RTS)
+    if (pe_stats) {
+      stgFree(pe_stats);
+      pe_stats = NULL;
+    }
+#endif
 }
 
 /* Note [Work Balance]
@@ -68,6 +68,34 @@ void      statDescribeGens( void );
 Time      stat_getElapsedGCTime(void);
 Time      stat_getElapsedTime(void);
 
+// Communication counters of one PE, as in RTSStats. The main PE collects
+// them from the other PEs at shutdown (PP_STATS, see DataComms.c).
+typedef struct ParStats_ {
+    uint64_t msgs_sent;
+    uint64_t msgs_received;
+    uint64_t msg_bytes_sent;
+    uint64_t msg_bytes_received;
+    uint64_t packs;
+    uint64_t packs_blocked;
+    uint64_t unpacks;
+    Time pack_ns;
+    Time unpack_ns;
+    Time recv_blocked_ns;
+} ParStats;
+
+#if defined(PARALLEL_RTS)
+// updated holding the parallel lock (threaded PEs)
+Time      stat_parClock(void);
+uint32_t  stat_liveKBytes(void);
+void      stat_sentMsgs(uint32_t msgs, uint64_t bytes);
+void      stat_receivedMsgs(uint32_t msgs, uint64_t bytes, Time blocked);
+void      stat_packed(int result, Time t);
+void      stat_unpacked(Time t);
+
+void      stat_getParStats(ParStats *s);
+void      stat_setPEStats(uint32_t pe, ParStats *s);
+#endif
+
 typedef struct GenerationSummaryStats_ {
     uint32_t collections;
     uint32_t par_collections;
@@ -111,6 +139,14 @@ typedef struct RTSSummaryStats_ {
 
     // one for each generation, 0 first
     GenerationSummaryStats* gc_summary_stats;
+
+#if defined(PARALLEL_RTS)
+    // main PE: one for each PE (1 first) which reported its counters,
+    // NULL on other PEs. pe_stats_total sums them up.
+    uint32_t pe_count;
+    ParStats* pe_stats;
+    ParStats pe_stats_total;
+#endif
 } RTSSummaryStats;
 
 #include "EndPrivate.h"
@@ -47,6 +47,12 @@ static bool eventlog_enabled;
 
 static const EventLogWriter *getEventLogWriter(void)
 {
+#if defined(PARALLEL_RTS)
+    // -qT: one eventlog, written by the main PE (see EventLogWriter.c)
+    if (RtsFlags.ParFlags.streamTrace) {
+        return &StreamEventLogWriter;
+    }
+#endif
     return rtsConfig.eventlog_writer;
 }
 
@@ -982,6 +988,34 @@ void traceSendReceiveLocalMessageEvent_ (OpCode msgtag, StgWord spid, StgWord st
       }
 }
 
+
+void traceInboxDepth_ (Capability *cap, uint32_t msgs, uint32_t bytes,
+                       uint32_t pending)
+{
+#if defined(DEBUG)
+    if (RtsFlags.TraceFlags.tracing == TRACE_STDERR) {
+        trace_stderr_("cap %d: received %u messages (%u bytes), "
+                      "%u bytes waiting \n", cap->no, msgs, bytes, pending);
+    } else
+#endif
+      {
+        postInboxDepthEvent (cap, msgs, bytes, pending);
+      }
+}
+
+void traceMessageCompression_ (OpCode msgtag, uint32_t raw, uint32_t sent)
+{
+#if defined(DEBUG)
+    if (RtsFlags.TraceFlags.tracing == TRACE_STDERR) {
+        trace_stderr_("message with Tag %d: %u bytes, %u bytes compressed \n",
+                      msgtag, raw, sent);
+    } else
+#endif
+      {
+        postMessageCompressionEvent (msgtag, raw, sent);
+      }
+}
+
 #endif /* PARALLEL_RTS */
 
 #endif /* TRACING */
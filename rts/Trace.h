@@ -378,6 +378,26 @@ void traceReceiveMessageEvent_(Capability *cap, OpCode msgtag, rtsPackBuffer *bu
     }
 void traceSendReceiveLocalMessageEvent_(OpCode msgtag,  StgWord spid, StgWord stid, StgWord rpid, StgWord rpoid);
 
+/*
+ * Record the inbox depth after receiving: messages and bytes received,
+ * bytes left waiting (when the receive budget was used up, see -qR)
+ */
+#define traceInboxDepth(cap, msgs, bytes, pending)       \
+    if (RTS_UNLIKELY(TRACE_sched)) {                      \
+      traceInboxDepth_(cap, msgs, bytes, pending);        \
+    }
+void traceInboxDepth_(Capability *cap, uint32_t msgs, uint32_t bytes,
+                      uint32_t pending);
+
+/*
+ * Record the size of a message before and after compression (-qZ)
+ */
+#define traceMessageCompression(mstag, raw, sent)        \
+    if (RTS_UNLIKELY(TRACE_sched)) {                      \
+      traceMessageCompression_(mstag, raw, sent);         \
+    }
+void traceMessageCompression_(OpCode msgtag, uint32_t raw, uint32_t sent);
+
 #endif // PARALLEL_RTS
 
 void traceTaskCreate_ (Task       *task,
@@ -452,6 +472,8 @@ void traceHeapProfSampleCostCentre(StgWord8 profile_id,
 #define traceSendMessageEvent(mstag, buf) /* nothing */
 #define traceReceiveMessageEvent(cap, mstag, buf) /* nothing */
 #define traceSendReceiveLocalMessageEvent(mstag, spid, stid, rpid, rpoid) /* nothing */
+#define traceInboxDepth(cap, msgs, bytes, pending) /* nothing */
+#define traceMessageCompression(mstag, raw, sent) /* nothing */
 #endif // PARALLEL_RTS
 #endif /* TRACING */
 
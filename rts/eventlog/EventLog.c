@@ -112,6 +112,8 @@ char *EventDesc[] = {
   [EVENT_SEND_MESSAGE]        = "Sending message",
   [EVENT_RECEIVE_MESSAGE]     = "Receiving message",
   [EVENT_SEND_RECEIVE_LOCAL_MESSAGE] = "Sending/Receiving local message",
+  [EVENT_INBOX_DEPTH]         = "Inbox depth",
+  [EVENT_MESSAGE_COMPRESSION] = "Message compression",
   [EVENT_HEAP_PROF_BEGIN]     = "Start of heap profile",
   [EVENT_HEAP_PROF_COST_CENTRE]   = "Cost center definition",
   [EVENT_HEAP_PROF_SAMPLE_BEGIN]  = "Start of heap profile sample",
@@ -515,6 +517,12 @@ initEventLogging(const EventLogWriter *ev_writer)
                                  + 2 * sizeof(EventProcessID)
                                  + sizeof(EventPortID);
             break;
+        case EVENT_INBOX_DEPTH: // (messages, bytes, pending_bytes)
+            eventTypes[t].size = 3 * sizeof(StgWord32);
+            break;
+        case EVENT_MESSAGE_COMPRESSION: // (tag, raw_bytes, sent_bytes)
+            eventTypes[t].size = sizeof(StgWord8) + 2 * sizeof(StgWord32);
+            break;
 
         case EVENT_HACK_BUG_T9003:
             eventTypes[t].size = 0;
@@ -1331,6 +1339,278 @@ void postSendReceiveLocalMessageEvent(OpCode msgtag, EventProcessID spid,
     postProcessID(eb, rpid);
     postPortID(eb, rpoid);
 }
+
+void postInboxDepthEvent(Capability *cap, StgWord32 msgs, StgWord32 bytes,
+                         StgWord32 pending)
+{
+    EventsBuf *eb;
+
+    eb = &capEventBuf[cap->no];
+
+    if (!hasRoomForEvent(eb, EVENT_INBOX_DEPTH)) {
+        // Flush event buffer to make room for new event.
+        printAndClearEventBuf(eb);
+    }
+
+    postEventHeader(eb, EVENT_INBOX_DEPTH);
+    postWord32(eb, msgs);
+    postWord32(eb, bytes);
+    postWord32(eb, pending);
+}
+
+void postMessageCompressionEvent(OpCode msgtag, StgWord32 raw,
+                                 StgWord32 sent)
+{
+    EventsBuf *eb;
+
+    eb = &eventBuf;
+
+    if (!hasRoomForEvent(eb, EVENT_MESSAGE_COMPRESSION)) {
+        // Flush event buffer to make room for new event.
+        printAndClearEventBuf(eb);
+    }
+
+    postEventHeader(eb, EVENT_MESSAGE_COMPRESSION);
+    postWord8(eb, msgtag);
+    postWord32(eb, raw);
+    postWord32(eb, sent);
+}
+
+/* Merging the eventlogs of all PEs into one (-qT, see EventLogWriter.c)
+ *
+ * The main PE writes the blocks of all PEs after its own header. They
+ * are rewritten in place: timestamps are moved to the time base of the
+ * main PE, and the capabilities, capsets and threads of PE p are
+ * renumbered, so that they do not clash with those of other PEs:
+ *   capability c -> (p-1) * MERGED_CAPS + c
+ *                   (events of no capability go to the first one of p)
+ *   capset s     -> (p-1) * MERGED_CAPSETS + s
+ *   thread t     -> (p-1) << 24 | t
+ * The strides are fixed, PEs may run with different numbers of
+ * capabilities (MERGED_CAPS * MAX_PES stays below the 16 bit cap number
+ * of no capability). Process ids in the Eden events are left as they are.
+ */
+#define MERGED_CAPS    256
+#define MERGED_CAPSETS 16
+
+#define BLOCK_MARKER_SIZE (sizeof(EventTypeNum) + sizeof(EventTimestamp) \
+                           + sizeof(StgWord32) + sizeof(EventTimestamp)   \
+                           + sizeof(EventCapNo))
+
+static inline StgWord16 peekWord16(StgWord8 *p)
+{
+    return (StgWord16)(p[0] << 8 | p[1]);
+}
+
+static inline StgWord32 peekWord32(StgWord8 *p)
+{
+    return (StgWord32)peekWord16(p) << 16 | peekWord16(p + 2);
+}
+
+static inline StgWord64 peekWord64(StgWord8 *p)
+{
+    return (StgWord64)peekWord32(p) << 32 | peekWord32(p + 4);
+}
+
+static inline void pokeWord16(StgWord8 *p, StgWord16 i)
+{
+    p[0] = (StgWord8)(i >> 8);
+    p[1] = (StgWord8)i;
+}
+
+static inline void pokeWord32(StgWord8 *p, StgWord32 i)
+{
+    pokeWord16(p, (StgWord16)(i >> 16));
+    pokeWord16(p + 2, (StgWord16)i);
+}
+
+static inline void pokeWord64(StgWord8 *p, StgWord64 i)
+{
+    pokeWord32(p, (StgWord32)(i >> 32));
+    pokeWord32(p + 4, (StgWord32)i);
+}
+
+static void mergeTimestamp(StgWord8 *p, StgInt64 offset)
+{
+    StgWord64 t = peekWord64(p);
+
+    if (offset < 0 && t < (StgWord64)(-offset)) {
+        t = 0;
+    } else {
+        t += offset;
+    }
+    pokeWord64(p, t);
+}
+
+static void mergeCap(StgWord8 *p, uint32_t pe)
+{
+    EventCapNo cap = peekWord16(p);
+
+    if (cap == (EventCapNo)(-1)) {
+        cap = 0;
+    }
+    pokeWord16(p, (EventCapNo)((pe - 1) * MERGED_CAPS + cap % MERGED_CAPS));
+}
+
+static void mergeCapset(StgWord8 *p, uint32_t pe)
+{
+    pokeWord32(p, peekWord32(p) + (pe - 1) * MERGED_CAPSETS);
+}
+
+static void mergeThread(StgWord8 *p, uint32_t pe)
+{
+    EventThreadID t = peekWord32(p);
+
+    if (t != 0) { // 0: no thread (blocked-on field of a stop event)
+        pokeWord32(p, (pe - 1) << 24 | t);
+    }
+}
+
+// renumber the fields of one event, p points to its payload
+static void mergeEvent(EventTypeNum tag, StgWord8 *p, uint32_t size,
+                       uint32_t pe)
+{
+    switch (tag) {
+    case EVENT_STOP_THREAD:         // (thread, status, blocked on thread)
+        if (size >= 10) {
+            mergeThread(p + 6, pe);
+        }
+        /* fallthrough */
+    case EVENT_CREATE_THREAD:       // (thread)
+    case EVENT_RUN_THREAD:          // (thread)
+    case EVENT_THREAD_RUNNABLE:     // (thread)
+    case EVENT_THREAD_LABEL:        // (thread, name)
+    case EVENT_ASSIGN_THREAD_TO_PROCESS: // (thread, process)
+        if (size >= 4) {
+            mergeThread(p, pe);
+        }
+        break;
+
+    case EVENT_MIGRATE_THREAD:      // (thread, new cap)
+    case EVENT_THREAD_WAKEUP:       // (thread, other cap)
+        if (size >= 6) {
+            mergeThread(p, pe);
+            mergeCap(p + 4, pe);
+        }
+        break;
+
+    case EVENT_SPARK_STEAL:         // (victim cap)
+    case EVENT_CAP_CREATE:          // (cap)
+    case EVENT_CAP_DELETE:          // (cap)
+    case EVENT_CAP_DISABLE:         // (cap)
+    case EVENT_CAP_ENABLE:          // (cap)
+        if (size >= 2) {
+            mergeCap(p, pe);
+        }
+        break;
+
+    case EVENT_CAPSET_ASSIGN_CAP:   // (capset, cap)
+    case EVENT_CAPSET_REMOVE_CAP:   // (capset, cap)
+        if (size >= 6) {
+            mergeCap(p + 4, pe);
+        }
+        /* fallthrough */
+    case EVENT_CAPSET_CREATE:       // (capset, capset type)
+    case EVENT_CAPSET_DELETE:       // (capset)
+    case EVENT_RTS_IDENTIFIER:      // (capset, name_version_string)
+    case EVENT_PROGRAM_ARGS:        // (capset, commandline_vector)
+    case EVENT_PROGRAM_ENV:         // (capset, environment_vector)
+    case EVENT_OSPROCESS_PID:       // (capset, pid)
+    case EVENT_OSPROCESS_PPID:      // (capset, parent_pid)
+    case EVENT_WALL_CLOCK_TIME:     // (capset, unix_epoch_seconds, nanoseconds)
+    case EVENT_HEAP_ALLOCATED:      // (heap_capset, alloc_bytes)
+    case EVENT_HEAP_SIZE:           // (heap_capset, size_bytes)
+    case EVENT_HEAP_LIVE:           // (heap_capset, live_bytes)
+    case EVENT_HEAP_INFO_GHC:       // (heap_capset, n_generations, ...)
+    case EVENT_GC_STATS_GHC:        // (heap_capset, generation, ...)
+        if (size >= 4) {
+            mergeCapset(p, pe);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+// one block, of size bytes (checked by the caller)
+static void mergeBlock(StgWord8 *block, StgWord32 size, uint32_t pe,
+                       StgInt64 offset)
+{
+    StgWord8 *p, *end;
+    EventTypeNum tag;
+    uint32_t esize;
+
+    // (type:16, time:64, size:32, end_time:64, cap:16)
+    mergeTimestamp(block + 2, offset);
+    mergeTimestamp(block + 14, offset);
+    mergeCap(block + 22, pe);
+
+    p = block + BLOCK_MARKER_SIZE;
+    end = block + size;
+    while (end - p >= (ptrdiff_t)(sizeof(EventTypeNum)
+                                  + sizeof(EventTimestamp))) {
+        tag = peekWord16(p);
+        mergeTimestamp(p + 2, offset);
+        p += sizeof(EventTypeNum) + sizeof(EventTimestamp);
+        if (tag >= NUM_GHC_EVENT_TAGS) {
+            return; // unknown, the rest of the block stays as it is
+        }
+        esize = eventTypes[tag].size;
+        if (esize == (uint32_t)EVENT_SIZE_DYNAMIC) {
+            if (end - p < (ptrdiff_t)sizeof(StgWord16)) {
+                return;
+            }
+            esize = peekWord16(p);
+            p += sizeof(StgWord16);
+        }
+        if (end - p < (ptrdiff_t)esize) {
+            return;
+        }
+        mergeEvent(tag, p, esize, pe);
+        p += esize;
+    }
+}
+
+// Rewrites the complete blocks at the start of data (size bytes, the
+// eventlog of PE pe without its header) for the merged eventlog, moving
+// timestamps by offset nanoseconds. Returns the length of these blocks.
+// *end is set when the end of the PE's events follows them, or when the
+// data is garbled (the rest is dropped then).
+size_t mergeEventLogBlocks(uint32_t pe, StgInt64 offset,
+                           StgWord8 *data, size_t size, bool *end)
+{
+    size_t pos = 0;
+    StgWord32 bsize;
+
+    *end = false;
+    while (size - pos >= sizeof(EventTypeNum)) {
+        if (peekWord16(data + pos) == EVENT_DATA_END) {
+            *end = true;
+            break;
+        }
+        if (peekWord16(data + pos) != EVENT_BLOCK_MARKER) {
+            errorBelch("eventlog of PE %d garbled, rest dropped", pe);
+            *end = true;
+            break;
+        }
+        if (size - pos < BLOCK_MARKER_SIZE) {
+            break;
+        }
+        bsize = peekWord32(data + pos + 10);
+        if (bsize < BLOCK_MARKER_SIZE) {
+            errorBelch("eventlog of PE %d garbled, rest dropped", pe);
+            *end = true;
+            break;
+        }
+        if (size - pos < bsize) {
+            break;
+        }
+        mergeBlock(data + pos, bsize, pe, offset);
+        pos += bsize;
+    }
+    return pos;
+}
 #endif //PARALLEL_RTS
 
 
@@ -147,6 +147,22 @@ void postReceiveMessageEvent(Capability *cap, OpCode msgtag, rtsPackBuffer* buf)
 
 void postSendReceiveLocalMessageEvent(OpCode msgtag, EventProcessID spid, EventThreadID stid, EventProcessID rpid, EventPortID rpoid);
 
+void postInboxDepthEvent(Capability *cap, StgWord32 msgs, StgWord32 bytes, StgWord32 pending);
+
+void postMessageCompressionEvent(OpCode msgtag, StgWord32 raw, StgWord32 sent);
+
+// merged eventlog of all PEs (-qT): rewrites the complete blocks at the
+// start of data in place, returns their length (see EventLog.c)
+size_t mergeEventLogBlocks(uint32_t pe, StgInt64 offset,
+                           StgWord8 *data, size_t size, bool *end);
+
+// the main PE's side of StreamEventLogWriter (see EventLogWriter.c)
+StgWord64 eventLogTimeBase(void);
+bool writeStreamedEventLog(PEId pe, StgWord64 time_base,
+                           void *eventlog, size_t eventlog_size);
+bool streamedEventLogEnded(PEId pe);
+void abandonStreamedEventLog(PEId pe);
+
 #endif //PARALLEL_RTS
 
 void postTaskCreateEvent (EventTaskId taskId,
@@ -250,6 +266,17 @@ INLINE_HEADER void postSendReceiveLocalMessageEvent(OpCode msgtag              S
 
 { /* nothing */ }
 
+INLINE_HEADER void postInboxDepthEvent(Capability *cap     STG_UNUSED,
+                                       StgWord32 msgs      STG_UNUSED,
+                                       StgWord32 bytes     STG_UNUSED,
+                                       StgWord32 pending   STG_UNUSED)
+{ /* nothing */ }
+
+INLINE_HEADER void postMessageCompressionEvent(OpCode msgtag   STG_UNUSED,
+                                               StgWord32 raw   STG_UNUSED,
+                                               StgWord32 sent  STG_UNUSED)
+{ /* nothing */ }
+
 //INLINE_HEADER inline StgWord64 time_ns(void STG_UNUSED){return 0; /* nothing */ }
 #endif // PARALLEL_RTS
 
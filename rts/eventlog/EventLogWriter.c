@@ -24,6 +24,9 @@
 
 #if defined(PARALLEL_RTS)
 #include "rts/Parallel.h" //need thisPE for parallel trace file name
+#include "GetTime.h"
+#include "Stats.h"
+#include "EventLog.h"
 
 #else
 // PID of the process that writes to event_log_filename (#4512)
@@ -143,3 +146,299 @@ const EventLogWriter FileEventLogWriter = {
     .flushEventLog = flushEventLogFile,
     .stopEventLogWriter = stopEventLogFileWriter
 };
+
+#if defined(PARALLEL_RTS) && defined(TRACING)
+/* -----------------------------------------------------------------------------
+ * Streaming the eventlogs of all PEs to the main PE (-qT)
+ *
+ * Other PEs do not write a file. Their eventlog is sent to the main PE
+ * in PP_EVENTLOG messages, at a low priority (see DataComms.c). The
+ * main PE writes one eventlog, named like the archive of zipTraceFiles
+ * but ending in .eventlog, while the program runs: its own header, then
+ * the blocks of all PEs, finally the end marker. Blocks are rewritten so
+ * that they fit into one eventlog (see mergeEventLogBlocks in
+ * EventLog.c), and merged by their start time: a block is written when
+ * every PE still running has a block waiting, the earliest one first.
+ * When more than STREAM_MERGE_WINDOW bytes wait (a PE which has been
+ * idle for long sends nothing), the earliest block is written anyway.
+ *
+ * The header of other PEs is not sent, it describes the same events.
+ * -------------------------------------------------------------------------- */
+
+#define STREAM_MERGE_WINDOW (16 * 1024 * 1024)
+
+// main PE: data of one PE not written yet. data[start..merged) are
+// rewritten complete blocks, data[merged..size) is not a complete block
+typedef struct PEStream_ {
+    StgWord8 *data;
+    size_t    start;
+    size_t    merged;
+    size_t    size;
+    size_t    capacity;
+    bool      ended;    // end of the PE's events seen
+} PEStream;
+
+static PEStream *pe_streams;     // main PE: one for each PE
+static size_t stream_waiting;    // main PE: bytes of blocks not written
+static PEId stream_pes;          // (nPEs is 0 after MP_quit)
+static bool stream_header_done;  // the first write is the header
+static bool stream_stopped;      // other PEs: data written later is dropped
+static StgWord64 stream_time_base;
+#if defined(THREADED_RTS)
+static Mutex stream_mutex;       // main PE: our own events and messages
+#endif
+
+// Time when the timestamps of this PE were 0, in ns since the epoch.
+// Declared in EventLog.h
+StgWord64 eventLogTimeBase(void)
+{
+    return stream_time_base;
+}
+
+static void
+initEventLogStreamWriter(void)
+{
+    StgWord64 sec;
+    StgWord32 nsec;
+    size_t len;
+
+    getUnixEpochTime(&sec, &nsec);
+    stream_time_base = sec * 1000000000 + nsec
+                       - TimeToNS(stat_getElapsedTime());
+    stream_header_done = false;
+    stream_stopped = false;
+
+    if (!IAmMainThread) {
+        return;
+    }
+
+#if defined(THREADED_RTS)
+    initMutex(&stream_mutex);
+#endif
+    stream_pes = nPEs;
+    stream_waiting = 0;
+    pe_streams = stgCallocBytes(stream_pes, sizeof(PEStream),
+                                "initEventLogStreamWriter");
+
+    // <argv>.parevents -> <argv>.eventlog
+    char *event_log_filename =
+        stgMallocBytes(strlen(pareventsName) + 1, "initEventLogStreamWriter");
+    strcpy(event_log_filename, pareventsName);
+    len = strlen(event_log_filename);
+    if (len >= 10 && !strcmp(event_log_filename + len - 10, ".parevents")) {
+        strcpy(event_log_filename + len - 10, ".eventlog");
+    }
+
+    if ((event_log_file = __rts_fopen(event_log_filename, "wb")) == NULL) {
+        sysErrorBelch(
+            "initEventLogStreamWriter: can't open %s", event_log_filename);
+        stg_exit(EXIT_FAILURE);
+    }
+
+    stgFree(event_log_filename);
+}
+
+// big endian fields of a block marker (type:16, time:64, size:32, ...)
+static StgWord64
+blockStartTime(StgWord8 *block)
+{
+    StgWord64 t = 0;
+    int i;
+
+    for (i = 2; i < 10; i++) {
+        t = t << 8 | block[i];
+    }
+    return t;
+}
+
+static StgWord32
+blockSize(StgWord8 *block)
+{
+    return (StgWord32)block[10] << 24 | (StgWord32)block[11] << 16
+         | (StgWord32)block[12] << 8 | (StgWord32)block[13];
+}
+
+// main PE: write waiting blocks in time order, as long as every PE still
+// running has one (or all of them, when force is set). Called holding
+// stream_mutex
+static bool
+writeMergedBlocks(bool force)
+{
+    PEStream *s, *first;
+    StgWord32 size;
+    PEId pe;
+    bool ok = true;
+
+    while (stream_waiting > 0) {
+        first = NULL;
+        for (pe = 1; pe <= stream_pes; pe++) {
+            s = &pe_streams[pe-1];
+            if (s->start < s->merged) {
+                if (first == NULL || blockStartTime(s->data + s->start)
+                                     < blockStartTime(first->data
+                                                      + first->start)) {
+                    first = s;
+                }
+            } else if (!s->ended && !force
+                       && stream_waiting <= STREAM_MERGE_WINDOW) {
+                return ok; // the earliest block might still come from pe
+            }
+        }
+        ASSERT(first != NULL);
+        size = blockSize(first->data + first->start);
+        ok = writeEventLogFile(first->data + first->start, size) && ok;
+        first->start += size;
+        stream_waiting -= size;
+        if (first->ended && first->start == first->merged) {
+            stgFree(first->data);
+            first->data = NULL;
+            first->start = first->merged = first->size = first->capacity = 0;
+        }
+    }
+    return ok;
+}
+
+// main PE: add data of pe to the merged eventlog. Declared in EventLog.h
+bool
+writeStreamedEventLog(PEId pe, StgWord64 time_base,
+                      void *eventlog, size_t eventlog_size)
+{
+    PEStream *s;
+    size_t done;
+    bool ended;
+    bool ok;
+
+    ASSERT(IAmMainThread && pe > 0 && pe <= stream_pes);
+
+    ACQUIRE_LOCK(&stream_mutex);
+    if (pe_streams == NULL) { // arrived after the end, dropped
+        RELEASE_LOCK(&stream_mutex);
+        return true;
+    }
+    s = &pe_streams[pe-1];
+    if (s->ended) {
+        RELEASE_LOCK(&stream_mutex);
+        return true;
+    }
+
+    if (s->start > 0) {
+        memmove(s->data, s->data + s->start, s->size - s->start);
+        s->merged -= s->start;
+        s->size -= s->start;
+        s->start = 0;
+    }
+    if (s->size + eventlog_size > s->capacity) {
+        s->capacity = s->size + eventlog_size;
+        s->data = stgReallocBytes(s->data, s->capacity,
+                                  "writeStreamedEventLog");
+    }
+    memcpy(s->data + s->size, eventlog, eventlog_size);
+    s->size += eventlog_size;
+
+    done = mergeEventLogBlocks(pe, (StgInt64)(time_base - stream_time_base),
+                               s->data + s->merged, s->size - s->merged,
+                               &ended);
+    s->merged += done;
+    stream_waiting += done;
+    if (ended) {
+        s->ended = true;
+        s->size = s->merged; // end marker, or garbled data
+    }
+    ok = writeMergedBlocks(false);
+    RELEASE_LOCK(&stream_mutex);
+    return ok;
+}
+
+// main PE: whether all events of pe have arrived. Declared in EventLog.h
+bool
+streamedEventLogEnded(PEId pe)
+{
+    bool ended;
+
+    ACQUIRE_LOCK(&stream_mutex);
+    ended = pe_streams != NULL && pe_streams[pe-1].ended;
+    RELEASE_LOCK(&stream_mutex);
+    return ended;
+}
+
+// main PE: pe did not end its eventlog in time. The complete blocks which
+// arrived are merged, the rest of its data (now or later) is dropped.
+// Declared in EventLog.h
+void
+abandonStreamedEventLog(PEId pe)
+{
+    PEStream *s;
+
+    ACQUIRE_LOCK(&stream_mutex);
+    if (pe_streams != NULL && !pe_streams[pe-1].ended) {
+        s = &pe_streams[pe-1];
+        s->ended = true;
+        s->size = s->merged;
+        writeMergedBlocks(false);
+    }
+    RELEASE_LOCK(&stream_mutex);
+}
+
+static bool
+writeEventLogStream(void *eventlog, size_t eventlog_size)
+{
+    if (!stream_header_done) {
+        stream_header_done = true;
+        return !IAmMainThread || writeEventLogFile(eventlog, eventlog_size);
+    }
+    if (IAmMainThread) {
+        return writeStreamedEventLog(thisPE, stream_time_base,
+                                     eventlog, eventlog_size);
+    }
+    if (!stream_stopped) {
+        queueEventLogData(eventlog, eventlog_size);
+    }
+    return true;
+}
+
+static void
+flushEventLogStream(void)
+{
+    if (IAmMainThread) {
+        flushEventLogFile();
+    }
+}
+
+// other PEs stop when the main PE asks them, and again at exit
+static void
+stopEventLogStreamWriter(void)
+{
+    StgWord8 end[2] = { EVENT_DATA_END >> 8, EVENT_DATA_END & 0xff };
+    PEId pe;
+
+    if (!IAmMainThread) {
+        stream_stopped = true;
+        return;
+    }
+    if (pe_streams == NULL) {
+        return;
+    }
+
+    ACQUIRE_LOCK(&stream_mutex);
+    writeMergedBlocks(true);
+    RELEASE_LOCK(&stream_mutex);
+    writeEventLogFile(end, sizeof(end));
+    stopEventLogFileWriter();
+    event_log_file = NULL;
+
+    for (pe = 1; pe <= stream_pes; pe++) {
+        if (pe_streams[pe-1].data != NULL) {
+            stgFree(pe_streams[pe-1].data);
+        }
+    }
+    stgFree(pe_streams);
+    pe_streams = NULL;
+}
+
+const EventLogWriter StreamEventLogWriter = {
+    .initEventLogWriter = initEventLogStreamWriter,
+    .writeEventLog = writeEventLogStream,
+    .flushEventLog = flushEventLogStream,
+    .stopEventLogWriter = stopEventLogStreamWriter
+};
+#endif // PARALLEL_RTS && TRACING
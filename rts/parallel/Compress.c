@@ -0,0 +1,179 @@
+/* Compress.c: fast LZ compression of messages between PEs
+ *
+ * implements Compress.h. The compressed data is a sequence of
+ *
+ *   | token | (literal length) | literals | offset | (match length) |
+ *
+ * where the token holds the number of literals (high 4 bits) and the
+ * match length minus LZ_MIN_MATCH (low 4 bits). A nibble value of 15
+ * continues in the following bytes (255 each, until a smaller one). The
+ * offset (2 bytes, little endian) refers back into the data produced so
+ * far. The last sequence has literals only and ends the data.
+ *
+ * Part of the Parallel Haskell Runtime System based on GHC.
+ * GHC's BSD license applies (see file LICENSE).
+ */
+
+#if defined(PARALLEL_RTS) // whole file
+
+#include "Rts.h"
+#include "Compress.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  12
+
+// positions of 4-byte sequences seen, by hash (compressing only)
+static uint32_t lzTable[1 << LZ_HASH_BITS];
+
+STATIC_INLINE uint32_t lzRead32(const StgWord8 *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+STATIC_INLINE uint32_t lzHash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+STATIC_INLINE StgWord8* lzPutLength(StgWord8 *op, uint32_t n) {
+    for (; n >= 255; n -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (StgWord8) n;
+    return op;
+}
+
+// one sequence: literals, then a match (unless mlen is 0, last sequence)
+static bool lzEmit(StgWord8 **opP, StgWord8 *oend, const StgWord8 *lit,
+                   uint32_t litlen, uint32_t offset, uint32_t mlen) {
+    StgWord8 *op = *opP;
+    StgWord8 token;
+
+    if ((StgWord) (oend - op) < 1 + litlen / 255 + 1 + litlen
+                                + 2 + mlen / 255 + 1) {
+        return false;
+    }
+    token = (StgWord8) ((litlen >= 15 ? 15 : litlen) << 4);
+    if (mlen > 0) {
+        token |= (mlen - LZ_MIN_MATCH >= 15 ? 15 : mlen - LZ_MIN_MATCH);
+    }
+    *op++ = token;
+    if (litlen >= 15) {
+        op = lzPutLength(op, litlen - 15);
+    }
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (mlen > 0) {
+        *op++ = (StgWord8) offset;
+        *op++ = (StgWord8) (offset >> 8);
+        if (mlen - LZ_MIN_MATCH >= 15) {
+            op = lzPutLength(op, mlen - LZ_MIN_MATCH - 15);
+        }
+    }
+    *opP = op;
+    return true;
+}
+
+uint32_t lzCompress(const StgWord8 *in, uint32_t length,
+                    StgWord8 *out, uint32_t maxOut) {
+    const StgWord8 *ip = in, *anchor = in, *end = in + length, *ref;
+    StgWord8 *op = out, *oend = out + stg_min(maxOut, length);
+    uint32_t seq, h, mlen;
+
+    memset(lzTable, 0, sizeof(lzTable));
+
+    while (length >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        seq = lzRead32(ip);
+        h = lzHash(seq);
+        ref = in + lzTable[h];
+        lzTable[h] = (uint32_t) (ip - in);
+
+        if (ref < ip && ip - ref <= LZ_MAX_OFFSET && lzRead32(ref) == seq) {
+            for (mlen = LZ_MIN_MATCH;
+                 ip + mlen < end && ref[mlen] == ip[mlen]; mlen++) {}
+            if (!lzEmit(&op, oend, anchor, ip - anchor, ip - ref, mlen)) {
+                return 0;
+            }
+            ip += mlen;
+            anchor = ip;
+        } else {
+            // skip faster through data which does not compress
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+
+    if (!lzEmit(&op, oend, anchor, end - anchor, 0, 0)
+        || op - out >= (StgInt) length) {
+        return 0;
+    }
+    return op - out;
+}
+
+STATIC_INLINE bool lzGetLength(const StgWord8 **ipP, const StgWord8 *iend,
+                               uint32_t max, uint32_t *n) {
+    const StgWord8 *ip = *ipP;
+    StgWord8 b;
+
+    do {
+        if (ip == iend || *n > max) {
+            return false;
+        }
+        b = *ip++;
+        *n += b;
+    } while (b == 255);
+    *ipP = ip;
+    return true;
+}
+
+bool lzDecompress(const StgWord8 *in, uint32_t length,
+                  StgWord8 *out, uint32_t outLength) {
+    const StgWord8 *ip = in, *iend = in + length;
+    StgWord8 *op = out, *oend = out + outLength, *ref;
+    uint32_t litlen, mlen, offset, i;
+    StgWord8 token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        litlen = token >> 4;
+        if (litlen == 15 && !lzGetLength(&ip, iend, outLength, &litlen)) {
+            return false;
+        }
+        if (litlen > (StgWord) (iend - ip) || litlen > (StgWord) (oend - op)) {
+            return false;
+        }
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+        if (ip == iend) {
+            break; // last sequence
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15 && !lzGetLength(&ip, iend, outLength, &mlen)) {
+            return false;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (StgWord) (op - out)
+            || mlen > (StgWord) (oend - op)) {
+            return false;
+        }
+        // byte by byte, the match may overlap what it produces
+        ref = op - offset;
+        for (i = 0; i < mlen; i++) {
+            op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return op == oend;
+}
+
+#endif // PARALLEL_RTS, whole file
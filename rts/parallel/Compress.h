@@ -0,0 +1,32 @@
+/* Compress.h: fast LZ compression of messages between PEs
+ *
+ * A small LZ77 compressor in the style of LZ4 (byte-oriented, no
+ * entropy coding), fast enough to pay off when the network is the
+ * bottleneck. The format is private to the RTS: both sides of a
+ * connection use this code.
+ *
+ * Part of the Parallel Haskell Runtime System based on GHC.
+ * GHC's BSD license applies (see file LICENSE).
+ */
+
+#if !defined(COMPRESS_H)
+#define COMPRESS_H
+
+#if defined(PARALLEL_RTS) // whole file
+
+/* Compresses length bytes from in into out (with room for maxOut bytes).
+   Returns the compressed size, or 0 if the data did not compress to
+   less than length bytes (or maxOut). Not reentrant (one hash table).
+*/
+uint32_t lzCompress(const StgWord8 *in, uint32_t length,
+                    StgWord8 *out, uint32_t maxOut);
+
+/* Decompresses length bytes from in into out, which must then contain
+   exactly outLength bytes. Returns false if the data is garbled.
+*/
+bool lzDecompress(const StgWord8 *in, uint32_t length,
+                  StgWord8 *out, uint32_t outLength);
+
+#endif // PARALLEL_RTS, whole file
+
+#endif // COMPRESS_H
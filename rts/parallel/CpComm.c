@@ -10,6 +10,8 @@
 
 #if defined(PARALLEL_RTS)&&defined(USE_COPY) /* whole file */
 
+#define _GNU_SOURCE /* sched_setaffinity, for pinning PEs (-qA) */
+
 /*
  * By including "Rts.h" here, we can use types like GlobalTaskId, etc.
  * Normally, Rts.h should be included before including this file "MPSystem.h",
@@ -39,6 +41,16 @@
 #include <sys/time.h>  /* gettimeofday() */
 #include <sys/wait.h>  /* wait() */
 
+#if defined(linux_HOST_OS)
+/* parked PEs wait on a futex in the shared memory region */
+#define CPW_USE_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+/* PEs can be pinned to cores and NUMA nodes (-qA) */
+#define CPW_USE_AFFINITY
+#include <sched.h>
+#endif
+
 /*============*
  * IPC Global *
  *============*/
@@ -96,11 +108,38 @@ static int cpw_sem_close(cpw_sem_t *sem);
  * Messages *
  *==========*/
 
+/* Messages are exchanged through one single-producer single-consumer
+ * ring per (sender, receiver) pair, located in the shared memory
+ * region. Each message is a record of a header followed by the data,
+ * padded to a multiple of StgWord. Records wrap around at the end of
+ * the ring, and messages larger than the free space are streamed in
+ * fragments (the receiver consumes while the sender writes).
+ *
+ * Head (written by the sender) and tail (written by the receiver) are
+ * monotonic byte counters; their difference is the amount of data in
+ * the ring. They are accessed with acquire/release atomics, no lock
+ * is involved.
+ */
+struct cpw_rec_hdr_tag {
+  StgWord32 tag;      /* OpCode */
+  StgWord32 length;   /* message data, in bytes */
+};
+typedef struct cpw_rec_hdr_tag cpw_rec_hdr_t;
+
+/* round up to a multiple of StgWord (record alignment in the ring) */
+#define CPW_ALIGN(n) (((n) + sizeof(StgWord) - 1) & ~(sizeof(StgWord) - 1))
+
+/* messages taken from the rings before the receiver asked for them
+ * (while waiting to send, or for a message sent to self), kept in a
+ * local FIFO queue */
 struct cpw_msg_tag {
   PEId     sender;
   OpCode   tag;
-  int      length;
-  StgWord *data;
+  uint32_t length;
+  uint32_t got;       /* bytes received (aligned), complete when
+                         got == CPW_ALIGN(length) */
+  StgWord8 *data;
+  struct cpw_msg_tag *next;
 };
 typedef struct cpw_msg_tag cpw_msg_t;
 
@@ -112,12 +151,37 @@ typedef struct cpw_msg_tag cpw_msg_t;
 #define CPW_SHM_PROT_FLGS (PROT_READ | PROT_WRITE)
 #define CPW_SHM_MMAP_FLGS (MAP_SHARED)
 
-struct cpw_shm_slot_tag {
-  cpw_msg_t               *addr;
-  short                   is_hole;
-  struct cpw_shm_slot_tag *next;
+/* avoid false sharing between counters written by different PEs */
+#define CPW_CACHE_LINE 64
+
+/* ring size: sendBufferSize units, rounded up to a power of 2 */
+#define CPW_RING_UNIT  (32*1024)
+#define CPW_RING_MIN   (64*1024)
+#define CPW_RING_MAX   (16*1024*1024)
+
+/* waiting: spin a little before parking, and wake up periodically to
+ * check for errors (a PE might have died) */
+#define CPW_SPIN_COUNT     200
+#define CPW_PARK_TIMEOUT   100 /* ms */
+
+/* per-PE parking place. Other PEs bump seq (and wake the PE) when they
+ * publish data for it or free space in one of its outgoing rings,
+ * but only if it is parked. */
+struct cpw_wake_tag {
+  volatile StgWord32 seq;
+  volatile StgWord32 parked;
+  char               pad[CPW_CACHE_LINE - 2*sizeof(StgWord32)];
 };
-typedef struct cpw_shm_slot_tag cpw_shm_slot_t;
+typedef struct cpw_wake_tag cpw_wake_t;
+
+/* ring header, head and tail on separate cache lines */
+struct cpw_ring_tag {
+  volatile StgWord head;  /* bytes written, by the sender */
+  char             pad1[CPW_CACHE_LINE - sizeof(StgWord)];
+  volatile StgWord tail;  /* bytes consumed, by the receiver */
+  char             pad2[CPW_CACHE_LINE - sizeof(StgWord)];
+};
+typedef struct cpw_ring_tag cpw_ring_t;
 
 struct cpw_shm_tag {
   char            unique_filename[CPW_MAX_FILENAME_LENGTH];
@@ -126,24 +190,42 @@ struct cpw_shm_tag {
   void            *base;
   StgWord16       *status;
   StgWord16       *counter;
-  cpw_shm_slot_t  **free_slots;
-  cpw_shm_slot_t  **msgs_read;
-  cpw_shm_slot_t  **msgs_write;
+  cpw_wake_t      *wake;      /* nPEs parking places */
+  cpw_ring_t      *rings;     /* nPEs x nPEs ring headers */
+  StgWord8        *ring_data; /* nPEs x nPEs ring buffers, page-aligned */
+  size_t          ring_size;  /* bytes per ring, power of 2 */
 };
 typedef struct cpw_shm_tag cpw_shm_t;
 
+/* ring from one PE to another, and its buffer (PEs numbered from 1).
+   The rings are ordered by receiver: all rings a PE receives from are
+   adjacent (and can be placed on its NUMA node, see cpw_pin_pe) */
+#define CPW_RING_IDX(from,to)  (((to)-1)*(int)nPEs + ((from)-1))
+#define CPW_RING(from,to)      (shared_memory.rings + CPW_RING_IDX(from,to))
+#define CPW_RING_DATA(from,to) (shared_memory.ring_data + \
+                                (size_t) CPW_RING_IDX(from,to) \
+                                * shared_memory.ring_size)
+
 static int cpw_shm_create(void);
 
 static void cpw_shm_check_errors(void);
 
 static int cpw_shm_send_msg(PEId toPE, OpCode tag, uint32_t length, StgWord8 *data);
+static int cpw_shm_send_vec(PEId toPE, OpCode tag, MPVec *vec, uint32_t count);
+static bool cpw_shm_send_ready(PEId toPE);
 static int cpw_shm_recv_msg(PEId *fromPE, OpCode *tag,
                             uint32_t *length, StgWord8 *data);
-static cpw_shm_slot_t* cpw_shm_acquire_slot(void);
-
+static StgWord8 *cpw_shm_lend_msg(PEId *fromPE, OpCode *tag,
+                                  uint32_t *length);
+static void cpw_shm_release_msg(void);
 
 static int cpw_shm_probe(void);
-static int cpw_shm_probe_sys(void);
+static StgWord cpw_shm_pending(void);
+static bool cpw_shm_drain(void);
+static void cpw_shm_recv_part(PEId fromPE, cpw_msg_t *msg);
+
+static void cpw_wait(bool (*ready)(void *arg), void *arg);
+static void cpw_wake(PEId pe);
 
 static int cpw_shm_free_pending_msg(void);
 static int cpw_shm_close(cpw_shm_t *shm);
@@ -151,11 +233,38 @@ static int cpw_shm_close(cpw_shm_t *shm);
 #if defined(DEBUG)
 static void cpw_shm_debug_info(cpw_shm_t *shm);
 #endif
+static void cpw_self_store_msg(PEId fromPE, OpCode tag,
+                               MPVec *vec, uint32_t count);
+static cpw_msg_t *cpw_self_take_msg(void);
 static int cpw_self_recv_msg(PEId *fromPE, OpCode *tag,
                              uint32_t *length, StgWord8 *data);
 static int cpw_self_probe(void);
 static int cpw_self_probe_sys(void);
 
+/*==========================*
+ * Pinning PEs (-qA, Linux) *
+ *==========================*/
+/* Every PE runs on a block of the CPUs this program may use (which
+ * respects cgroup cpusets), taken from a list sorted by NUMA node, so
+ * that PEs with neighbouring numbers share a node. A PE gets a single
+ * core when there are as many PEs as CPUs. The placement is computed
+ * before forking, children inherit it. */
+#if defined(CPW_USE_AFFINITY)
+#define CPW_MAX_NODES  64
+
+static int      cpw_cpus[CPU_SETSIZE];      /* usable CPUs, by node */
+static uint32_t cpw_cpu_node[CPU_SETSIZE];  /* their NUMA nodes */
+static uint32_t cpw_ncpus = 0;
+static uint32_t cpw_pe_cpus[MAX_PES];       /* first CPU of a PE (index) */
+static uint32_t cpw_pe_ncpus[MAX_PES];      /* its number of CPUs */
+
+static bool cpw_read_cpulist(int node, cpu_set_t *set);
+static void cpw_place_pes(void);
+static void cpw_pin_pe(void);
+#endif
+/* NUMA node of each PE, all 0 unless pinned */
+static uint32_t cpw_pe_node[MAX_PES];
+
 /*===========================*
  * Sync Point (not reusable) *
  *===========================*/
@@ -198,14 +307,25 @@ bool IAmMainThread = false;
 int cpw_state = CPW_NOT_STARTED; /* keep track of state, to avoid
                                     double-faults on error shutdown */
 
-int num_msgs = 0; /* How many messages can be stored in buffer */
-
-cpw_shm_slot_t *stored_msgs = NULL; /* Linked List used to free buffer */
+/* local queue of messages taken from the rings ahead of time, with
+   a tail pointer for appending */
+cpw_msg_t *stored_msgs = NULL, *stored_last = NULL;
+/* messages currently being taken from a ring (data incomplete), per
+   sending PE */
+cpw_msg_t **partial_msgs = NULL;
+/* receive positions in the rings, per sending PE. The ring tail stays
+   behind while a message is lent out in place (see cpw_shm_lend_msg) */
+StgWord *recv_pos = NULL;
+/* where the message lent out by MP_recv_borrow lives: a ring, a local
+   queue message, or the local buffer for wrapped-around messages */
+PEId      lent_ring = 0;
+cpw_msg_t *lent_msg = NULL;
+StgWord8  *lent_buf = NULL;
+size_t    lent_buf_size = 0;
 
 cpw_shm_t  shared_memory;        /* shared memory structure */
 cpw_sync_t sync_point;           /* used to synchronize nodes */
-cpw_sem_t  can_alloc, do_alloc;  /* synchronize buffer slots */
-cpw_sem_t  *w_sems, *r_sems;     /* synchronize msg queues */
+
 
 /**************************************************************
  * Startup and Shutdown routines (used inside ParInit.c only) */
@@ -253,6 +373,7 @@ bool MP_start(int* argc, char** argv[]) {
   return true;
 }
 
+
 /* MP_sync synchronises all nodes in a parallel computation:
  *  sets global var.:
  *    thisPE - GlobalTaskId: node's own task Id
@@ -265,19 +386,21 @@ bool MP_sync(void){
 
   /* now that sizes are known, create shared memory buffers and init */
 
-  /* set buffer sizes */
-  num_msgs = RtsFlags.ParFlags.sendBufferSize * (int)nPEs;
+  /* set ring size (bytes per sender/receiver pair) */
+  shared_memory.ring_size = CPW_RING_MIN;
+  while (shared_memory.ring_size < CPW_RING_MAX &&
+         shared_memory.ring_size <
+         (size_t) RtsFlags.ParFlags.sendBufferSize * CPW_RING_UNIT) {
+    shared_memory.ring_size *= 2;
+  }
   IF_PAR_DEBUG(mpcomm,
-               debugBelch(" Buffer: %i messages/%i PEs\n", num_msgs, nPEs));
+               debugBelch(" Buffer: %i PEs, rings of %i bytes\n",
+                          nPEs, (int)shared_memory.ring_size));
 
   /*
      init process
   */
 
-  /* allocate memory for semaphores */
-  w_sems = stgMallocBytes(sizeof(cpw_sem_t)*(int)nPEs, "cpwWrSems");
-  r_sems = stgMallocBytes(sizeof(cpw_sem_t)*(int)nPEs, "cpwReSems");
-
   /* create shared memory*/
   if (cpw_shm_create() != CPW_NOERROR) {
     barf(" MPSystem CpWay: error creating shared memory!\n");
@@ -287,18 +410,25 @@ bool MP_sync(void){
   /* create sync point */
   cpw_sync_create();
 
-  /* create semaphores */
-  cpw_sem_create(&can_alloc, num_msgs);
-  cpw_sem_create(&do_alloc, 1);
+  /* local state for receiving */
+  partial_msgs = stgMallocBytes(sizeof(cpw_msg_t*)*(int)nPEs,
+                                "cpwPartialMsgs");
+  recv_pos = stgMallocBytes(sizeof(StgWord)*(int)nPEs, "cpwRecvPos");
   int i;
   for (i = 0; i < (int)nPEs; i++) {
-    cpw_sem_create(&w_sems[i], 1);
-    cpw_sem_create(&r_sems[i], 0);
+    partial_msgs[i] = NULL;
+    recv_pos[i] = 0;
   }
 
   /* check errors before forking */
   cpw_shm_check_errors();
 
+#if defined(CPW_USE_AFFINITY)
+  if (RtsFlags.ParFlags.pinPEs) {
+    cpw_place_pes();
+  }
+#endif
+
   cpw_state = CPW_STARTING;
 
   /* start other processes */
@@ -327,6 +457,13 @@ bool MP_sync(void){
 
   /* check for fork errors */
   cpw_shm_check_errors();
+#if defined(CPW_USE_AFFINITY)
+  /* nothing is sent before the sync point, so each PE can claim its
+     receive rings first */
+  if (cpw_ncpus > 0) {
+    cpw_pin_pe();
+  }
+#endif
   /* wait until all nodes ready */
   cpw_sync_synchronize(&sync_point); /* Fails after CPW_SYNC_TIMEOUT seconds */
   cpw_state = CPW_RUNNING;
@@ -359,6 +496,9 @@ bool MP_quit(int isError){
   }
   cpw_state = CPW_STOPPING;
 
+  /* a lent message would hold back a ring tail */
+  cpw_shm_release_msg();
+
   if (IAmMainThread) {
     /* send FINISH to other PEs */
     int i;
@@ -369,6 +509,7 @@ bool MP_quit(int isError){
         IF_PAR_DEBUG(mpcomm,
                      debugBelch("sending FINISH failed, retry"));
         retryCount--;
+        usleep(1000);
       }
     }
 
@@ -376,9 +517,12 @@ bool MP_quit(int isError){
     IF_PAR_DEBUG(mpcomm,
                  debugBelch("Waiting for children to return.\n"));
     while (1) {
-      if(wait(NULL) < 0 && errno == ECHILD) {
+      /* keep taking in messages, children might wait for ring space */
+      cpw_shm_free_pending_msg();
+      if(waitpid(-1, NULL, WNOHANG) < 0 && errno == ECHILD) {
         break;
       }
+      usleep(1000);
     }
     IF_PAR_DEBUG(mpcomm,
                  debugBelch("All kids are safe home.\n"));
@@ -393,6 +537,7 @@ bool MP_quit(int isError){
       IF_PAR_DEBUG(mpcomm,
                    debugBelch("sending FINISH failed, retry"));
       retryCount--;
+      usleep(1000);
     }
     /* child must stay alive until answer arrives if error shutdown */
     if (retryCount != 0 && isError != 0) {
@@ -409,28 +554,31 @@ bool MP_quit(int isError){
 
 
   /* free unreceived messages */
-  if (cpw_shm_probe()) {
-    cpw_shm_free_pending_msg();
-  }
-  cpw_shm_slot_t *tmp = stored_msgs;
+  cpw_shm_free_pending_msg();
+  cpw_msg_t *tmp;
   while (stored_msgs != NULL) {
     tmp = stored_msgs->next;
-    stgFree(stored_msgs->addr->data);
-    stgFree(stored_msgs->addr);
+    stgFree(stored_msgs->data);
     stgFree(stored_msgs);
     stored_msgs = tmp;
   }
-
-  /* close semaphores */
-  cpw_sem_close(&can_alloc);
-  cpw_sem_close(&do_alloc);
+  stored_last = NULL;
   int i;
   for (i = 0; i < (int)nPEs; i++) {
-    cpw_sem_close(&w_sems[i]);
-    cpw_sem_close(&r_sems[i]);
+    if (partial_msgs[i] != NULL) {
+      stgFree(partial_msgs[i]->data);
+      stgFree(partial_msgs[i]);
+    }
+  }
+  stgFree(partial_msgs);
+  partial_msgs = NULL;
+  stgFree(recv_pos);
+  recv_pos = NULL;
+  if (lent_buf != NULL) {
+    stgFree(lent_buf);
+    lent_buf = NULL;
+    lent_buf_size = 0;
   }
-  stgFree(w_sems);
-  stgFree(r_sems);
 
   /* close synchronize barrier */
   cpw_sync_close(&sync_point);
@@ -493,6 +641,47 @@ bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length){
   }
 }
 
+/* - a gathering send, see MPSystem.h. The pieces are copied into the
+ *   ring one after the other (like writev), without an intermediate
+ *   buffer. */
+bool MP_sendv(PEId node, OpCode tag, MPVec *vec, uint32_t count) {
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("MP_sendv(%s, %" FMT_Word32 " pieces)\n",
+                          getOpName(tag), count));
+
+  /* check for errors */
+  cpw_shm_check_errors();
+
+  switch (cpw_shm_send_vec(node, tag, vec, count)) {
+  case CPW_NOERROR:
+    return true;
+  case CPW_SEND_FAIL:
+  default:
+    return false;
+  }
+}
+
+/* - a multicast, see MPSystem.h. The rings are per pair of PEs, so the
+ *   data is copied into the ring of each destination. */
+uint32_t MP_bcast(PEId *nodes, uint32_t count,
+                  OpCode tag, StgWord8 *data, uint32_t length) {
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (!MP_send(nodes[i], tag, data, length)) {
+      break;
+    }
+  }
+  return i;
+}
+
+/* - a non-blocking check whether a message to node can be sent, see
+ *   MPSystem.h. Sending fails when the ring to node is full.
+ */
+bool MP_send_ready(PEId node) {
+  return cpw_shm_send_ready(node);
+}
+
 /* - a blocking receive operation
  *   where system messages from main node have priority!
  * Effect:
@@ -519,27 +708,38 @@ uint32_t MP_recv(STG_UNUSED uint32_t maxlength, StgWord8 *destination, // IN
   /* check for errors */
   cpw_shm_check_errors();
 
-  /* receive message */
+  /* receive message (local queue first, sys_msgs in front) */
   uint32_t length;
-  if (cpw_self_probe()) {
-    /* might be a sys_msg in shm queue */
-    if(!cpw_self_probe_sys() && cpw_shm_probe_sys()) {
-      /* sys_msg now available in front of shm queue */
-      cpw_shm_recv_msg(sender, code, &length, destination);
-    }
-    else {
-      /* no sys_msg in shm queue; if in local queue, its in front pos */
-      cpw_self_recv_msg(sender, code, &length, destination);
-    }
-  }
-  else {
-    /* move sys_msg to front */
-    cpw_shm_probe_sys();
-    cpw_shm_recv_msg(sender, code, &length, destination);
-  }
+  cpw_shm_recv_msg(sender, code, &length, destination);
   return length;
 }
 
+/* - a blocking receive operation which lends the message data
+ *   (same priorities as MP_recv), see MPSystem.h.
+ *   Messages are lent in place from the rings where possible.
+ */
+StgWord8 *MP_recv_borrow(OpCode *code, PEId *sender, uint32_t *length) {
+  StgWord8 *data;
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("MP_recv_borrow()\n"));
+
+  /* check for errors */
+  cpw_shm_check_errors();
+
+  data = cpw_shm_lend_msg(sender, code, length);
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch(" borrowed a message from %i, tag = %i\n",
+                          *sender, *code));
+  return data;
+}
+
+/* - give back a message obtained by MP_recv_borrow */
+void MP_recv_release(void) {
+  cpw_shm_release_msg();
+}
+
 /* - a non-blocking probe operation
  * (unspecified sender, no receive buffers any more)
  */
@@ -550,12 +750,22 @@ bool MP_probe(void) {
   /* check for errors */
   cpw_shm_check_errors();
 
-  if(cpw_shm_probe() || cpw_self_probe())
+  if(cpw_self_probe() || cpw_shm_probe())
     return true;
   else
     return false;
 }
 
+/* - amount of data waiting (see cpw_shm_pending) */
+uint32_t MP_pending(void) {
+  return (uint32_t) stg_min(cpw_shm_pending(), HS_WORD32_MAX);
+}
+
+/* - the NUMA node of a PE when PEs are pinned (-qA), 0 otherwise */
+uint32_t MP_locality(PEId node) {
+  ASSERT(node > 0 && node <= nPEs);
+  return cpw_pe_node[node-1];
+}
 
 /*============*
  * Semaphores *
@@ -703,105 +913,28 @@ static void cpw_shm_debug_info(cpw_shm_t *shm) {
              "      \n"
              "      Structure Information:\n"
              "      - status (@%p): %i\n"
-             "        (ALGNMT: %i, is aligned: %s)\n"
              "      - counter (@%p): %i\n"
-             "        (ALGNMT: %i, is aligned: %s)\n"
-             "      - free_slots (@%p): %p\n"
-             "        (ALGNMT: %i, is aligned: %s)\n"
-             "      - msgs_read@%p:\n"
-             "        (ALGNMT: %i, is aligned: %s)\n"
-             "      - msgs_write@%p:\n"
-             "        (ALGNMT: %i, is aligned: %s)\n"
+             "      - wake (@%p): %i x %i bytes\n"
+             "      - rings (@%p): %i x %i bytes\n"
+             "      - ring data (@%p): %i x %i bytes\n"
              "\n",
              shm->unique_filename,
              (int)shm->size,
              shm->base,
-
              shm->status, *shm->status,
-             ALIGNMENT_WORD16,
-             (long)shm->status % ALIGNMENT_WORD16 ? "FALSE" : "TRUE",
-
              shm->counter, *shm->counter,
-             ALIGNMENT_WORD16,
-             (long)shm->counter % ALIGNMENT_WORD16 ? "FALSE" : "TRUE",
-
-             shm->free_slots, *shm->free_slots,
-             ALIGNMENT_VOID_P,
-             (long)shm->free_slots % ALIGNMENT_VOID_P ? "FALSE" : "TRUE",
-
-             shm->msgs_read,
-             ALIGNMENT_VOID_P,
-             (long)shm->msgs_read % ALIGNMENT_VOID_P ? "FALSE" : "TRUE",
-
-             shm->msgs_write,
-             ALIGNMENT_VOID_P,
-             (long)shm->msgs_write % ALIGNMENT_VOID_P ? "FALSE" : "TRUE");
-
-
-  debugBelch("free message slots:\n");
-  cpw_shm_slot_t *next_slot = *shm->free_slots;
-  int num = 0;
-  while (next_slot != NULL) {
-    num++;
-    debugBelch("- %i (@%p)\n"
-               "      | (ALGNMT: %" FMT_Word ", is aligned: %s)\n"
-               "      +-> points to message @%p\n"
-               "        |  (ALGNMT: %" FMT_Word ", is aligned: %s)\n"
-               "        +-> points to data @%p\n"
-               "              (ALGNMT: %i, is aligned: %s)\n",
-               num, next_slot,
-               sizeof(cpw_shm_slot_t),
-               (long)next_slot % sizeof(cpw_shm_slot_t) ? "FALSE" : "TRUE",
-               next_slot->addr,
-               sizeof(cpw_msg_t),
-               (long)next_slot->addr % sizeof(cpw_msg_t) ? "FALSE" : "TRUE",
-               next_slot->addr->data,
-#if SIZEOF_VOID_P == 8
-               ALIGNMENT_WORD64 ,
-               (long)next_slot->addr->data % ALIGNMENT_WORD64 ? "FALSE" : "TRUE"
-#else
-#if SIZEOF_VOID_P == 4
-               ALIGNMENT_WORD32 ,
-               (long)next_slot->addr->data % ALIGNMENT_WORD32 ? "FALSE" : "TRUE"
-#else
-#error GHC untested on this architecture: sizeof(void *) != 4 or 8
-#endif
-#endif
-               );
-    next_slot = next_slot->next;
-  }
-
-  debugBelch("total of %i free slots\n\n", num);
-  debugBelch("message queues:\n");
-  int i;
-  for (i = 0; i < (int)nPEs; i++) {
-    num = 0;
-    cpw_shm_slot_t *slot = shm->msgs_read[i];
-    while(slot != NULL && slot->is_hole == 0) {
-      num++;
-      printf("num is %i\n",num);
-      slot = slot->next;
+             shm->wake, (int)nPEs, (int)sizeof(cpw_wake_t),
+             shm->rings, (int)(nPEs*nPEs), (int)sizeof(cpw_ring_t),
+             shm->ring_data, (int)(nPEs*nPEs), (int)shm->ring_size);
+
+  if (shm->rings != NULL && thisPE > 0) {
+    debugBelch("incoming rings of PE %i:\n", thisPE);
+    PEId i;
+    for (i = 1; i <= nPEs; i++) {
+      cpw_ring_t *ring = CPW_RING(i, thisPE);
+      debugBelch("- from %i: head %" FMT_Word ", tail %" FMT_Word "\n",
+                 i, ring->head, ring->tail);
     }
-
-    debugBelch("- msgs_read[%i] (@%p)\n"
-               "      | (ALGNMT: %i, is aligned: %s)\n"
-               "      +-> points to slot @%p\n"
-               "      | +-> is hole = %i\n"
-               "      +-> has %i message linked\n\n",
-               i,&shm->msgs_read[i],
-               ALIGNMENT_VOID_P,
-               (long)&shm->msgs_read[i] % ALIGNMENT_VOID_P ? "FALSE" : "TRUE",
-               shm->msgs_read[i],  shm->msgs_read[i]->is_hole,
-               num);
-
-    debugBelch("- msgs_write[%i] (@%p)\n"
-               "      | (ALGNMT: %i, is aligned: %s)\n"
-               "      +-> points to slot @%p\n"
-               "        +-> is hole = %i\n",
-               i,&shm->msgs_write[i],
-               ALIGNMENT_VOID_P,
-               (long)&shm->msgs_write[i] % ALIGNMENT_VOID_P ? "FALSE" : "TRUE",
-               shm->msgs_write[i],shm->msgs_write[i]->is_hole);
   }
 }
 #endif
@@ -816,27 +949,17 @@ static int cpw_shm_create()
     errorBelch("Could not create a unique filename!\n");
     return CPW_SHM_FAIL;
   }
-  /* calculate memory size */
+  /* calculate memory size. mmap returns a page-aligned base, all parts
+     below start on a cache line, the ring data on a page (so that the
+     receive rings of a PE do not share pages with other data) */
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t headers =
+    CPW_CACHE_LINE /* status and counter */
+    + sizeof(cpw_wake_t) * (int)nPEs /* parking places */
+    + sizeof(cpw_ring_t) * (int)nPEs * (int)nPEs; /* ring headers */
+  headers = (headers + page - 1) / page * page;
   shared_memory.size =
-    ALIGNMENT_WORD16 + SIZEOF_WORD16 /* status */
-    + SIZEOF_WORD16 /* counter, is aligned when status is aligned */
-    + ALIGNMENT_VOID_P + SIZEOF_VOID_P /* freeslots */
-    + sizeof(cpw_shm_slot_t) + sizeof(cpw_shm_slot_t) * num_msgs
-                                      /* stack for free slots */
-    + sizeof(cpw_shm_slot_t) * (int)nPEs /* and additional holes */
-    + ALIGNMENT_VOID_P + SIZEOF_VOID_P * (int)nPEs /* root nodes for msg lists */
-    + SIZEOF_VOID_P * (int)nPEs /* root nodes for msg lists */
-    + sizeof(cpw_msg_t) + sizeof(cpw_msg_t) * num_msgs /* structure for msgs */
-    + sizeof(StgWord) * DATASPACEWORDS * num_msgs /* message data */
-#if SIZEOF_VOID_P == 8
-    + ALIGNMENT_WORD64; /* alignment for msg data */
-#else
-#if SIZEOF_VOID_P == 4
-    + ALIGNMENT_WORD32; /* alignment for msg data */
-#else
-#error GHC untested on this architecture: sizeof(void *) != 4 or 8
-#endif
-#endif
+    headers + shared_memory.ring_size * (int)nPEs * (int)nPEs; /* ring data */
 
   /* create shared memory region */
   shm_unlink(shared_memory.unique_filename); /* in unlikely case, unlink old */
@@ -878,312 +1001,695 @@ static int cpw_shm_create()
   shared_memory.file_descriptor = -1;
   shm_unlink(shared_memory.unique_filename);
 
-  /* set status */
-  size_t status_unaligned = (size_t) (shared_memory.base);
-  shared_memory.status  =
-    (StgWord16 *) (status_unaligned + ALIGNMENT_WORD16 -
-                   (status_unaligned % ALIGNMENT_WORD16));
+  /* set status and counter */
+  shared_memory.status = (StgWord16 *) shared_memory.base;
   *shared_memory.status = CPW_NOERROR;
-
-  /* set counter */
   shared_memory.counter = shared_memory.status + 1;
   *shared_memory.counter = 0;
 
-  /* generate msg slots */
-  cpw_shm_slot_t *free_list  = NULL;
-  size_t slots_unaligned = (size_t) shared_memory.base
-    + ALIGNMENT_WORD16 + SIZEOF_WORD16 * 2; /* status & counter */
-  shared_memory.free_slots =
-    (cpw_shm_slot_t **) ( slots_unaligned
-                          + ALIGNMENT_VOID_P
-                          - (slots_unaligned % ALIGNMENT_VOID_P));
-
-  /* start memory address of messages */
-  size_t msg_base_unaligned = (size_t) shared_memory.base
-    + ALIGNMENT_WORD16 + SIZEOF_WORD16 * 2 /* status & counter */
-    + ALIGNMENT_VOID_P + SIZEOF_VOID_P /* free_slots */
-    + sizeof(cpw_shm_slot_t) * (num_msgs+1+(int)nPEs) /* slots */
-    + ALIGNMENT_VOID_P + SIZEOF_VOID_P * (int)nPEs * 2 /* r/w pointer */
-    ;
-  cpw_msg_t *msg_base =
-    (cpw_msg_t *) (msg_base_unaligned
-                   + sizeof(cpw_msg_t)
-                   - (msg_base_unaligned % sizeof(cpw_msg_t)));
-
-
-  /* start memory address of data for messages */
-  size_t data_base_unaligned = (size_t) shared_memory.base
-    + ALIGNMENT_WORD16 + SIZEOF_WORD16 * 2 /* status & counter */
-    + ALIGNMENT_VOID_P + SIZEOF_VOID_P /* free_slots */
-    + sizeof(cpw_shm_slot_t) * (num_msgs+1+(int)nPEs) /* slots */
-    + ALIGNMENT_VOID_P + SIZEOF_VOID_P * (int)nPEs * 2 /* r/w pointer */
-    + sizeof(cpw_msg_t) + sizeof(cpw_msg_t) * num_msgs; /* messages */
-  StgWord *data_base = (StgWord *) (data_base_unaligned
-#if SIZEOF_VOID_P == 8
-                                      + ALIGNMENT_WORD64
-                                    - data_base_unaligned % ALIGNMENT_WORD64
-                                    /* message data */
-#else
-#if SIZEOF_VOID_P == 4
-                                      + ALIGNMENT_WORD32
-                                    - data_base_unaligned % ALIGNMENT_WORD32
-                                    /* message data */
-#else
-#error GHC untested on this architecture: sizeof(void *) != 4 or 8
-#endif
-#endif
-                                      );
+  /* parking places, ring headers, ring data (all zero after ftruncate:
+     nobody parked, all rings empty) */
+  shared_memory.wake =
+    (cpw_wake_t *) ((StgWord8 *) shared_memory.base + CPW_CACHE_LINE);
+  shared_memory.rings = (cpw_ring_t *) (shared_memory.wake + (int)nPEs);
+  shared_memory.ring_data = (StgWord8 *) shared_memory.base + headers;
 
-  size_t slot_base_unaligned = (size_t) shared_memory.base
-    + ALIGNMENT_WORD16 + SIZEOF_WORD16 /* status */
-    + SIZEOF_WORD16 /* counter, is aligned when status is aligned */
-    + ALIGNMENT_VOID_P + SIZEOF_VOID_P /* freeslots */
-    ;
+  /* finish */
+  return CPW_NOERROR;
+}
 
-  cpw_shm_slot_t *slot_base =
-    (cpw_shm_slot_t *) (slot_base_unaligned
-                        + sizeof(cpw_shm_slot_t)
-                        - (slot_base_unaligned % sizeof(cpw_shm_slot_t)));
+#if defined(CPW_USE_AFFINITY)
+/* read the CPUs of a NUMA node from sysfs (a list like "0-3,8-11"),
+   false if there is no such node */
+static bool cpw_read_cpulist(int node, cpu_set_t *set) {
+  char path[64];
+  FILE *f;
+  int from, to, sep;
+
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/node/node%d/cpulist", node);
+  f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+  CPU_ZERO(set);
+  while (fscanf(f, "%d", &from) == 1) {
+    to = from;
+    sep = fgetc(f);
+    if (sep == '-') {
+      if (fscanf(f, "%d", &to) != 1) {
+        break;
+      }
+      sep = fgetc(f);
+    }
+    for (; from <= to && from < CPU_SETSIZE; from++) {
+      CPU_SET(from, set);
+    }
+    if (sep != ',') {
+      break;
+    }
+  }
+  fclose(f);
+  return true;
+}
 
+/* compute the CPUs of every PE (in the main PE, before forking). PE i
+ * gets the i-th of nPEs equal blocks of the usable CPUs, cut off at the
+ * end of the node its block starts on. Without NUMA information in
+ * sysfs, all CPUs are on node 0. */
+static void cpw_place_pes(void) {
+  cpu_set_t usable, onNode;
+  uint32_t nodeOf[CPU_SETSIZE];
+  uint32_t first, last, n, i;
+  int cpu, node;
+
+  if (sched_getaffinity(0, sizeof(usable), &usable) != 0) {
+    sysErrorBelch("MPSystem CpWay: cannot read CPU affinity, "
+                  "PEs not pinned");
+    return;
+  }
 
-  /* holes */
-  cpw_shm_slot_t *hole_base  = slot_base + num_msgs;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    nodeOf[cpu] = 0;
+  }
+  for (node = 0; node < CPW_MAX_NODES; node++) {
+    if (cpw_read_cpulist(node, &onNode)) {
+      for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &onNode)) {
+          nodeOf[cpu] = (uint32_t) node;
+        }
+      }
+    }
+  }
 
-  int i;
-  for (i = 0; i < num_msgs; i++) {
-    /* next slot */
-    cpw_shm_slot_t *next = slot_base + i;
+  /* usable CPUs, sorted by node */
+  cpw_ncpus = 0;
+  for (node = 0; node < CPW_MAX_NODES; node++) {
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &usable) && nodeOf[cpu] == (uint32_t) node) {
+        cpw_cpus[cpw_ncpus] = cpu;
+        cpw_cpu_node[cpw_ncpus] = (uint32_t) node;
+        cpw_ncpus++;
+      }
+    }
+  }
+  if (cpw_ncpus == 0) {
+    return;
+  }
+
+  /* blocks of at least one CPU (PEs share CPUs if there are more PEs) */
+  for (i = 0; i < nPEs; i++) {
+    first = (uint32_t) ((StgWord64) i * cpw_ncpus / nPEs);
+    last  = (uint32_t) ((StgWord64) (i+1) * cpw_ncpus / nPEs);
+    n = 1;
+    while (first + n < last
+           && cpw_cpu_node[first + n] == cpw_cpu_node[first]) {
+      n++;
+    }
+    cpw_pe_cpus[i]  = first;
+    cpw_pe_ncpus[i] = n;
+    cpw_pe_node[i]  = cpw_cpu_node[first];
+  }
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("pinning %u PEs to %u CPUs\n", nPEs, cpw_ncpus));
+}
 
-    /* set next slot in list */
-    next->next = free_list;
-    /* set mem-address of message for this slot */
-    next->addr = msg_base + i;
-    /* set mem-address of data for this message */
-    next->addr->data = data_base + i*DATASPACEWORDS;
+/* pin this PE to its CPUs (inherited by all threads it starts later),
+ * and touch its receive rings first, which places their pages on its
+ * node (the kernel's default first-touch policy) */
+static void cpw_pin_pe(void) {
+  cpu_set_t set;
+  uint32_t i;
 
-    free_list = next;
+  CPU_ZERO(&set);
+  for (i = 0; i < cpw_pe_ncpus[thisPE-1]; i++) {
+    CPU_SET(cpw_cpus[cpw_pe_cpus[thisPE-1] + i], &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    sysErrorBelch("MPSystem CpWay: cannot pin PE %u", thisPE);
   }
-  *shared_memory.free_slots = free_list;
+  memset(CPW_RING_DATA(1, thisPE), 0,
+         shared_memory.ring_size * (int)nPEs);
 
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("PE %u on node %u, CPUs %d..%d\n", thisPE,
+                          cpw_pe_node[thisPE-1],
+                          cpw_cpus[cpw_pe_cpus[thisPE-1]],
+                          cpw_cpus[cpw_pe_cpus[thisPE-1]
+                                   + cpw_pe_ncpus[thisPE-1] - 1]));
+}
+#endif
 
-  /* initialize msg queues */
-  size_t msgs_r_unaligned = (size_t) shared_memory.base
-    + ALIGNMENT_WORD16 + SIZEOF_WORD16 /* status */
-    + SIZEOF_WORD16 /* counter, is aligned when status is aligned */
-    + ALIGNMENT_VOID_P + SIZEOF_VOID_P /* freeslots */
-    + sizeof(cpw_shm_slot_t) * (num_msgs+1+(int)nPEs) /* stack for free slots */
-    ;
-  shared_memory.msgs_read =
-    (cpw_shm_slot_t **)(msgs_r_unaligned
-                        + ALIGNMENT_VOID_P
-                        - (msgs_r_unaligned % ALIGNMENT_VOID_P));
-  shared_memory.msgs_write = shared_memory.msgs_read + (int)nPEs;
-  for (i = 0; i < (int)nPEs; i++) {
-    shared_memory.msgs_read[i] = hole_base+i;
-    shared_memory.msgs_write[i] = hole_base+i;
-    shared_memory.msgs_read[i]->is_hole = 1;
-    shared_memory.msgs_read[i]->next = NULL;
-    shared_memory.msgs_read[i]->addr = NULL;
+/* Parking and waking PEs.
+ *
+ * A PE which has to wait (for messages, or for space in a ring) parks
+ * on its own wake word, and other PEs wake it when they publish data
+ * for it or free space in its outgoing rings. Publishing (head/tail
+ * store) and the check for parked PEs are separated by a full fence, as
+ * are parking and re-checking the condition on the waiting side, so
+ * that one of the two always sees the other's update.
+ *
+ * Without futexes (non-Linux), parking is a short sleep.
+ */
+static void cpw_wait(bool (*ready)(void *arg), void *arg) {
+  cpw_wake_t *wake = &shared_memory.wake[thisPE-1];
+  StgWord32 seq;
+  int spins = 0;
+#if defined(CPW_USE_FUTEX)
+  struct timespec timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_nsec = CPW_PARK_TIMEOUT * 1000000;
+#endif
+
+  while (!ready(arg)) {
+    if (spins++ < CPW_SPIN_COUNT) {
+      continue;
+    }
+    /* another PE might have failed while we wait */
+    cpw_shm_check_errors();
+
+    seq = __atomic_load_n(&wake->seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&wake->parked, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!ready(arg)) {
+#if defined(CPW_USE_FUTEX)
+      /* returns immediately if seq has changed */
+      syscall(SYS_futex, &wake->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+#else
+      usleep(100);
+#endif
+    }
+    __atomic_store_n(&wake->parked, 0, __ATOMIC_RELAXED);
   }
+}
 
-  /* finish */
-  return CPW_NOERROR;
+/* wake up a PE if it is parked (called after publishing data/space) */
+static void cpw_wake(PEId pe) {
+  cpw_wake_t *wake = &shared_memory.wake[pe-1];
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&wake->parked, __ATOMIC_RELAXED)) {
+    __atomic_fetch_add(&wake->seq, 1, __ATOMIC_RELEASE);
+#if defined(CPW_USE_FUTEX)
+    syscall(SYS_futex, &wake->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+  }
 }
 
-/* try to send a message */
-static int cpw_shm_send_msg(PEId toPE, OpCode tag, uint32_t length, StgWord8 *data) {
-  cpw_shm_slot_t *free_slot = NULL;
+/* copy data into/out of a ring buffer at a (monotonic) position,
+   wrapping around at the end */
+static void cpw_ring_write(StgWord8 *rdata, StgWord pos,
+                           StgWord8 *src, size_t n) {
+  size_t off = pos & (shared_memory.ring_size - 1);
+  size_t first = stg_min(n, shared_memory.ring_size - off);
 
-  /* can we get a free slot? */
-  if (cpw_sem_trywait(&can_alloc) == CPW_SEM_WOULD_LOCK) {
+  memcpy(rdata + off, src, first);
+  memcpy(rdata, src + first, n - first);
+}
 
-    /* no, try to store a message */
-    free_slot = cpw_shm_acquire_slot();
+static void cpw_ring_read(StgWord8 *rdata, StgWord pos,
+                          StgWord8 *dest, size_t n) {
+  size_t off = pos & (shared_memory.ring_size - 1);
+  size_t first = stg_min(n, shared_memory.ring_size - off);
 
-    if (free_slot == NULL) {
-      /* could not store message, sending failed */
-      return CPW_SEND_FAIL;
-    }
+  memcpy(dest, rdata + off, first);
+  memcpy(dest + first, rdata, n - first);
+}
+
+/* data available in the ring of a sender (for the receiver) */
+STATIC_INLINE StgWord cpw_ring_used(PEId fromPE) {
+  return __atomic_load_n(&CPW_RING(fromPE, thisPE)->head, __ATOMIC_ACQUIRE)
+    - recv_pos[fromPE-1];
+}
+
+/* consume data from the ring of a sender up to position pos, and give
+ * the space back to the sender unless a message from this ring is lent
+ * out (then the tail is published when it is released) */
+static void cpw_ring_consume(PEId fromPE, StgWord pos) {
+  recv_pos[fromPE-1] = pos;
+  if (fromPE != lent_ring) {
+    __atomic_store_n(&CPW_RING(fromPE, thisPE)->tail, pos, __ATOMIC_RELEASE);
+    cpw_wake(fromPE);
   }
-  if (free_slot == NULL) {//    cpw_sem_wait(can_alloc);
-    cpw_sem_wait(&do_alloc);
+}
 
-    free_slot = *shared_memory.free_slots;
-    *shared_memory.free_slots = free_slot->next;
+/* free space in a ring (for the sender) */
+STATIC_INLINE StgWord cpw_ring_free(cpw_ring_t *ring) {
+  return shared_memory.ring_size
+    - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
 
-    cpw_sem_post(&do_alloc);
+/* whether a message of maximal size to toPE can be started without
+ * waiting for the receiver, using the same bound as cpw_shm_sendv (the
+ * local queue never fills up) */
+static bool cpw_shm_send_ready(PEId toPE) {
+  return (toPE == thisPE ||
+          cpw_ring_free(CPW_RING(thisPE, toPE)) >=
+          stg_min(sizeof(cpw_rec_hdr_t)
+                  + CPW_ALIGN(DATASPACEWORDS * sizeof(StgWord)),
+                  shared_memory.ring_size / 2));
+}
+
+/* wait conditions */
+static bool cpw_ready_inbox(void *arg STG_UNUSED) {
+  return (cpw_shm_probe() != 0);
+}
+
+static bool cpw_ready_ring(void *arg) {
+  return (cpw_ring_used(*(PEId *) arg) > 0);
+}
+
+static bool cpw_ready_space(void *arg) {
+  return (cpw_ring_free((cpw_ring_t *) arg) > 0 || cpw_shm_probe());
+}
+
+/* write n bytes of the pieces in vec, starting at byte offset off of
+ * their concatenation, into the ring at position pos */
+static void cpw_ring_write_vec(StgWord8 *rdata, StgWord pos,
+                               MPVec *vec, uint32_t count,
+                               StgWord off, StgWord n) {
+  uint32_t i;
+  StgWord  copy;
+
+  for (i = 0; i < count && n > 0; i++) {
+    if (off >= vec[i].length) {
+      off -= vec[i].length;
+      continue;
+    }
+    copy = stg_min(n, vec[i].length - off);
+    cpw_ring_write(rdata, pos, vec[i].data + off, copy);
+    pos += copy;
+    n -= copy;
+    off = 0;
   }
+}
 
-  /* copy message */
-  free_slot->is_hole = 1; /* free_slot to become new hole */
-  free_slot->next = NULL;
-  free_slot->addr->sender = thisPE;
-  free_slot->addr->tag    = tag;
-  free_slot->addr->length = length;
-  memcpy(free_slot->addr->data, data, length);
+/* try to send a message. Fails if the message cannot be started
+ * (the ring does not have room for the entire message, or half of
+ * the ring for large ones); large messages are then streamed, taking
+ * in our own incoming messages while waiting (the receiver might be
+ * sending to us at the same time). */
+static int cpw_shm_send_msg(PEId toPE, OpCode tag, uint32_t length, StgWord8 *data) {
+  MPVec vec;
 
+  vec.data = data;
+  vec.length = length;
+  return cpw_shm_send_vec(toPE, tag, &vec, 1);
+}
+
+/* the same for a message gathered from several pieces (MP_sendv) */
+static int cpw_shm_send_vec(PEId toPE, OpCode tag, MPVec *vec, uint32_t count) {
+  cpw_ring_t    *ring;
+  StgWord8      *rdata;
+  cpw_rec_hdr_t hdr;
+  StgWord       head, length, total, sent, chunk, copy;
+  uint32_t      i;
 
   IF_PAR_DEBUG(mpcomm,
-               debugBelch(" sending msg to %i, tag %i\n", toPE,
-                          free_slot->addr->tag));
+               debugBelch(" sending msg to %i, tag %i\n", toPE, tag));
 
-  /* enqueue message */
-  toPE--;
-  /* wait for other write to finish */
-  cpw_sem_wait(&w_sems[toPE]);
+  if (toPE == thisPE) {
+    /* no need to go through shared memory */
+    cpw_self_store_msg(thisPE, tag, vec, count);
+    return CPW_NOERROR;
+  }
 
-  cpw_shm_slot_t *hole = shared_memory.msgs_write[toPE];
-  hole->next = free_slot;
-  hole->addr = free_slot->addr;
-  free_slot->addr = NULL;
-  shared_memory.msgs_write[toPE] = free_slot; /* new hole */
-  hole->is_hole = 0;
-  /* finish */
-  cpw_sem_post(&w_sems[toPE]);
+  length = 0;
+  for (i = 0; i < count; i++) {
+    length += vec[i].length;
+  }
+  ASSERT(length <= DATASPACEWORDS * sizeof(StgWord));
+
+  ring  = CPW_RING(thisPE, toPE);
+  rdata = CPW_RING_DATA(thisPE, toPE);
+  total = CPW_ALIGN(length);
+
+  /* can we start? */
+  if (cpw_ring_free(ring) <
+      stg_min(sizeof(cpw_rec_hdr_t) + total, shared_memory.ring_size / 2)) {
+    /* no, take in own messages (receiver might wait for us) and fail */
+    cpw_shm_drain();
+    return CPW_SEND_FAIL;
+  }
+
+  /* header, then data as space permits */
+  head = ring->head;
+  hdr.tag = tag;
+  hdr.length = length;
+  cpw_ring_write(rdata, head, (StgWord8 *) &hdr, sizeof(cpw_rec_hdr_t));
+  head += sizeof(cpw_rec_hdr_t);
+
+  sent = 0;
+  while (1) {
+    chunk = stg_min(cpw_ring_free(ring) - (head - ring->head), total - sent);
+    if (chunk > 0 || sent == 0) {
+      /* copy data (padding is not copied) */
+      copy = (sent < length) ? stg_min(chunk, length - sent) : 0;
+      cpw_ring_write_vec(rdata, head, vec, count, sent, copy);
+      head += chunk;
+      sent += chunk;
+      __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+      cpw_wake(toPE);
+    }
+    if (sent == total) {
+      break;
+    }
+    /* wait for space, taking in own messages while waiting */
+    cpw_wait(cpw_ready_space, ring);
+    cpw_shm_drain();
+  }
 
-  /* wake receiver */
-  cpw_sem_post(&r_sems[toPE]);
   return CPW_NOERROR;
 }
 
-/* try to receive a message */
-/* if data == NULL, data are not copied (for error shutdown) */
-static int cpw_shm_recv_msg(PEId *fromPE, OpCode *tag,
-                            uint32_t *length, StgWord8 *data) {
-  int me = thisPE - 1;
+/* take the next message from the ring of a sender, waiting for data
+ * which is still being streamed. If data == NULL, data are not copied
+ * (for error shutdown). */
+static void cpw_shm_recv_ring(PEId fromPE, OpCode *tag,
+                              uint32_t *length, StgWord8 *data) {
+  cpw_ring_t    *ring = CPW_RING(fromPE, thisPE);
+  StgWord8      *rdata = CPW_RING_DATA(fromPE, thisPE);
+  cpw_rec_hdr_t hdr;
+  StgWord       tail, total, got, chunk, copy;
+
+  ASSERT(cpw_ring_used(fromPE) >= sizeof(cpw_rec_hdr_t));
+
+  tail = recv_pos[fromPE-1];
+  cpw_ring_read(rdata, tail, (StgWord8 *) &hdr, sizeof(cpw_rec_hdr_t));
+  tail += sizeof(cpw_rec_hdr_t);
+  *tag = hdr.tag;
+  *length = hdr.length;
+  total = CPW_ALIGN(hdr.length);
+
+  got = 0;
+  while (1) {
+    chunk = stg_min(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail,
+                    total - got);
+    if (chunk > 0 || got == 0) {
+      copy = (got < hdr.length) ? stg_min(chunk, hdr.length - got) : 0;
+      if (data != NULL) {
+        cpw_ring_read(rdata, tail, data + got, copy);
+      }
+      tail += chunk;
+      got += chunk;
+      cpw_ring_consume(fromPE, tail);
+    }
+    if (got == total) {
+      break;
+    }
+    /* sender is still writing */
+    cpw_wait(cpw_ready_ring, &fromPE);
+  }
+}
 
-  /* wait until msgs there */
-  cpw_sem_wait(&r_sems[me]);
+/* continue taking a message from the ring of a sender into the local
+ * message msg (possibly incomplete), as far as data is available */
+static void cpw_shm_recv_part(PEId fromPE, cpw_msg_t *msg) {
+  StgWord8   *rdata = CPW_RING_DATA(fromPE, thisPE);
+  StgWord    tail, chunk, copy;
+
+  tail = recv_pos[fromPE-1];
+  chunk = stg_min(cpw_ring_used(fromPE), CPW_ALIGN(msg->length) - msg->got);
+  if (chunk > 0) {
+    copy = (msg->got < msg->length)
+      ? stg_min(chunk, msg->length - msg->got) : 0;
+    cpw_ring_read(rdata, tail, msg->data + msg->got, copy);
+    msg->got += chunk;
+    cpw_ring_consume(fromPE, tail + chunk);
+  }
+}
 
+/* append a complete message to the local queue */
+STATIC_INLINE void cpw_self_append(cpw_msg_t *msg) {
+  msg->next = NULL;
+  if (stored_last == NULL) {
+    stored_msgs = msg;
+  } else {
+    stored_last->next = msg;
+  }
+  stored_last = msg;
+}
 
-  cpw_shm_slot_t *used_slot = shared_memory.msgs_read[me];
-  shared_memory.msgs_read[me] = used_slot->next;
+/* take all available messages (also incomplete ones) from the rings into
+ * the local queue, freeing space for their senders.
+ * Returns whether anything was taken. */
+static bool cpw_shm_drain(void) {
+  PEId fromPE;
+  cpw_msg_t *msg;
+  cpw_rec_hdr_t hdr;
+  bool taken = false;
+
+  for (fromPE = 1; fromPE <= nPEs; fromPE++) {
+    while (cpw_ring_used(fromPE) > 0) {
+      msg = partial_msgs[fromPE-1];
+      if (msg == NULL) {
+        /* new message, read header (written together with data) */
+        ASSERT(cpw_ring_used(fromPE) >= sizeof(cpw_rec_hdr_t));
+        cpw_ring_read(CPW_RING_DATA(fromPE, thisPE), recv_pos[fromPE-1],
+                      (StgWord8 *) &hdr, sizeof(cpw_rec_hdr_t));
+        cpw_ring_consume(fromPE,
+                         recv_pos[fromPE-1] + sizeof(cpw_rec_hdr_t));
+        msg = (cpw_msg_t *)stgMallocBytes(sizeof(cpw_msg_t), "StoredMsg");
+        msg->sender = fromPE;
+        msg->tag    = hdr.tag;
+        msg->length = hdr.length;
+        msg->got    = 0;
+        msg->data   = (StgWord8 *)stgMallocBytes(stg_max(hdr.length, 1),
+                                                 "StoredData");
+        partial_msgs[fromPE-1] = msg;
+      }
+      cpw_shm_recv_part(fromPE, msg);
+      taken = true;
+      if (msg->got == CPW_ALIGN(msg->length)) {
+        partial_msgs[fromPE-1] = NULL;
+        cpw_self_append(msg);
+      } else {
+        break; /* rest not there yet */
+      }
+    }
+  }
+  return taken;
+}
 
-  /* copy data */
-  *fromPE = used_slot->addr->sender;
-  *tag    = used_slot->addr->tag;
-  *length = used_slot->addr->length;
-  if (data != NULL)
-    memcpy(data, used_slot->addr->data, used_slot->addr->length);
+/* wait for the next message to receive (blocking). Messages in the
+ * local queue come first (they were taken from the rings earlier).
+ * System messages are preferred: anywhere in the local queue, at the
+ * front of the rings.
+ * Returns 0 if the message is at the front of the local queue, or
+ * else the sender in whose ring it starts. */
+static PEId cpw_shm_next_msg(void) {
+  static PEId recv_start = 1;
+  PEId i, pe, found;
+  cpw_rec_hdr_t hdr;
+
+  /* complete messages which were partially taken before */
+  for (pe = 1; pe <= nPEs; pe++) {
+    cpw_msg_t *msg = partial_msgs[pe-1];
+    while (msg != NULL && msg->got < CPW_ALIGN(msg->length)) {
+      cpw_wait(cpw_ready_ring, &pe);
+      cpw_shm_recv_part(pe, msg);
+    }
+    if (msg != NULL) {
+      partial_msgs[pe-1] = NULL;
+      cpw_self_append(msg);
+    }
+  }
 
+  while (1) {
+    if (cpw_self_probe()) {
+      cpw_self_probe_sys(); /* moves a sys msg to the front */
+      return 0;
+    }
 
-  IF_PAR_DEBUG(mpcomm,
-               debugBelch(" got a message from %i, tag = %i\n", *fromPE, *tag));
+    /* find a ring with data, preferring a system message. Start
+       after the last sender served, to be fair to all senders */
+    found = 0;
+    for (i = 0; i < nPEs; i++) {
+      pe = (recv_start + i - 1) % nPEs + 1;
+      if (cpw_ring_used(pe) > 0) {
+        cpw_ring_read(CPW_RING_DATA(pe, thisPE), recv_pos[pe-1],
+                      (StgWord8 *) &hdr, sizeof(cpw_rec_hdr_t));
+        if (found == 0 || ISSYSCODE(hdr.tag)) {
+          found = pe;
+        }
+        if (ISSYSCODE(hdr.tag)) {
+          break;
+        }
+      }
+    }
+    if (found != 0) {
+      recv_start = found % nPEs + 1;
+      return found;
+    }
 
-  /* freeing slot */
-  cpw_sem_wait(&do_alloc);
-  used_slot->next = *shared_memory.free_slots;
-  *shared_memory.free_slots = used_slot;
-  cpw_sem_post(&do_alloc);
-  /* wake waiting senders */
-  cpw_sem_post(&can_alloc);
+    /* wait until msgs there */
+    cpw_wait(cpw_ready_inbox, NULL);
+  }
+}
+
+/* receive a message (blocking), copying its data.
+ * If data == NULL, data are not copied (for error shutdown) */
+static int cpw_shm_recv_msg(PEId *fromPE, OpCode *tag,
+                            uint32_t *length, StgWord8 *data) {
+  PEId pe = cpw_shm_next_msg();
 
+  if (pe == 0) {
+    cpw_self_recv_msg(fromPE, tag, length, data);
+  } else {
+    *fromPE = pe;
+    cpw_shm_recv_ring(pe, tag, length, data);
+  }
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch(" got a message from %i, tag = %i\n", *fromPE, *tag));
   return CPW_NOERROR;
 }
 
-static cpw_shm_slot_t* cpw_shm_acquire_slot() {
-  int me = thisPE - 1;
-
-  if(cpw_sem_trywait(&r_sems[me]) == CPW_SEM_WOULD_LOCK)
-    return NULL;
+/* receive a message (blocking), lending its data until
+ * MP_recv_release. A message from the local queue is lent as it is. A
+ * message in a ring is lent in place if it is complete and does not
+ * wrap around the end of the ring; the ring tail is then held back so
+ * that the sender cannot overwrite it. Other messages are copied into
+ * a local buffer. */
+static StgWord8 *cpw_shm_lend_msg(PEId *fromPE, OpCode *tag,
+                                  uint32_t *length) {
+  PEId pe = cpw_shm_next_msg();
+  StgWord8 *rdata;
+  StgWord pos, total;
+  size_t off;
+  cpw_rec_hdr_t hdr;
+
+  ASSERT(lent_ring == 0 && lent_msg == NULL);
+
+  if (pe == 0) {
+    lent_msg = cpw_self_take_msg();
+    *fromPE = lent_msg->sender;
+    *tag    = lent_msg->tag;
+    *length = lent_msg->length;
+    return lent_msg->data;
+  }
+
+  *fromPE = pe;
+  rdata = CPW_RING_DATA(pe, thisPE);
+  pos = recv_pos[pe-1];
+  cpw_ring_read(rdata, pos, (StgWord8 *) &hdr, sizeof(cpw_rec_hdr_t));
+  total = CPW_ALIGN(hdr.length);
+  /* records are aligned and the ring size is a power of 2, so the
+     header itself never wraps */
+  off = (pos + sizeof(cpw_rec_hdr_t)) & (shared_memory.ring_size - 1);
+
+  if (cpw_ring_used(pe) >= sizeof(cpw_rec_hdr_t) + total &&
+      off + total <= shared_memory.ring_size) {
+    *tag = hdr.tag;
+    *length = hdr.length;
+    lent_ring = pe;
+    cpw_ring_consume(pe, pos + sizeof(cpw_rec_hdr_t) + total);
+    return rdata + off;
+  }
+
+  if (lent_buf_size < hdr.length) {
+    lent_buf_size = stg_max(hdr.length, 2 * lent_buf_size);
+    lent_buf = stgReallocBytes(lent_buf, lent_buf_size, "cpwLentBuffer");
+  }
+  cpw_shm_recv_ring(pe, tag, length, lent_buf);
+  return lent_buf;
+}
 
-  /* store message for later use */
-  cpw_shm_slot_t *new_node =
-    (cpw_shm_slot_t *)stgMallocBytes((int)sizeof(cpw_shm_slot_t), "StoredNode");
-  cpw_msg_t *new_msg  = (cpw_msg_t *)stgMallocBytes((int)sizeof(cpw_msg_t),
-                                                    "StoredMsg");
-  StgWord *new_data
-    = (StgWord *)stgMallocBytes((int)(sizeof(StgWord)*DATASPACEWORDS),
-                                "StoredData");
-  new_node->addr = new_msg;
-  new_node->next = NULL;
-  new_msg->data  = new_data;
+/* give back a lent message: publish the tail of its ring, or free a
+ * message from the local queue */
+static void cpw_shm_release_msg(void) {
+  PEId pe = lent_ring;
 
+  if (pe != 0) {
+    lent_ring = 0;
+    cpw_ring_consume(pe, recv_pos[pe-1]);
+  }
+  if (lent_msg != NULL) {
+    stgFree(lent_msg->data);
+    stgFree(lent_msg);
+    lent_msg = NULL;
+  }
+}
 
-  cpw_shm_slot_t *used_slot = shared_memory.msgs_read[me];
-  shared_memory.msgs_read[me] = used_slot->next;
+/* store a message in the local queue (sent to self) */
+static void cpw_self_store_msg(PEId fromPE, OpCode tag,
+                               MPVec *vec, uint32_t count) {
+  cpw_msg_t *msg = (cpw_msg_t *)stgMallocBytes(sizeof(cpw_msg_t),
+                                               "StoredMsg");
+  uint32_t length, i;
 
-  /* copy data */
-  new_msg->sender = used_slot->addr->sender;
-  new_msg->tag    = used_slot->addr->tag;
-  new_msg->length = used_slot->addr->length;
-  memcpy(new_data, used_slot->addr->data, used_slot->addr->length);
+  length = 0;
+  for (i = 0; i < count; i++) {
+    length += vec[i].length;
+  }
+  msg->sender = fromPE;
+  msg->tag    = tag;
+  msg->length = length;
+  msg->got    = CPW_ALIGN(length);
+  msg->data   = (StgWord8 *)stgMallocBytes(stg_max(length, 1), "StoredData");
+  length = 0;
+  for (i = 0; i < count; i++) {
+    memcpy(msg->data + length, vec[i].data, vec[i].length);
+    length += vec[i].length;
+  }
+  cpw_self_append(msg);
+}
 
+/* remove the message at the front of the local queue */
+static cpw_msg_t *cpw_self_take_msg(void) {
+  cpw_msg_t *msg = stored_msgs;
+  stored_msgs = msg->next;
   if (stored_msgs == NULL) {
-    stored_msgs = new_node;
+    stored_last = NULL;
   }
-  else {
-    cpw_shm_slot_t *insert = stored_msgs;
-    while(insert->next != NULL) {
-      insert = insert->next;
-    }
-    insert->next = new_node;
-  }
-
-  return used_slot;
+  return msg;
 }
 
 static int cpw_self_recv_msg(PEId *fromPE, OpCode *tag,
                              uint32_t *length, StgWord8 *data) {
-  cpw_shm_slot_t *used_slot = stored_msgs;
-  stored_msgs = used_slot->next;
+  cpw_msg_t *msg = cpw_self_take_msg();
 
   /* copy data */
-  *fromPE = used_slot->addr->sender;
-  *tag    = used_slot->addr->tag;
-  *length = used_slot->addr->length;
-  memcpy(data, used_slot->addr->data, used_slot->addr->length);
+  *fromPE = msg->sender;
+  *tag    = msg->tag;
+  *length = msg->length;
+  if (data != NULL)
+    memcpy(data, msg->data, msg->length);
 
-  stgFree(used_slot->addr->data);
-  stgFree(used_slot->addr);
-  stgFree(used_slot);
+  stgFree(msg->data);
+  stgFree(msg);
 
   return CPW_NOERROR;
 }
 
-/* test if messages available */
+/* test if messages available in the rings */
 static int cpw_shm_probe() {
-  switch(cpw_sem_trywait(&r_sems[thisPE-1])) {
-  case CPW_NOERROR:
-    cpw_sem_post(&r_sems[thisPE-1]);
-    return 1;
-  default:
-    return 0;
+  PEId pe;
+  for (pe = 1; pe <= nPEs; pe++) {
+    if (cpw_ring_used(pe) > 0) {
+      return 1;
+    }
   }
+  return 0;
 }
 
-/* test if a sys msg exists in shm queue
- if so sysmsg is moved to front of queue */
-static int cpw_shm_probe_sys(void) {
-  switch(cpw_sem_trywait(&r_sems[thisPE-1])) {
-  case CPW_NOERROR:
-  {
-    cpw_shm_slot_t *queue_front = shared_memory.msgs_read[thisPE-1];
-    cpw_shm_slot_t *pre_sys_slot = NULL;
-    cpw_shm_slot_t *sys_slot = queue_front;
-
-    while(!ISSYSCODE(sys_slot->addr->tag)) {
-      pre_sys_slot = sys_slot;
-      sys_slot = sys_slot->next;
-      if(sys_slot->is_hole == 1) {
-        cpw_sem_post(&r_sems[thisPE-1]); /* no msg taken */
-        return 0; /* no sys msgs found */
-      }
-    }
-    /* possibly move sysmsg to front */
-    if(pre_sys_slot != NULL) {
-      pre_sys_slot->next = sys_slot->next;
-      sys_slot->next = queue_front;
-      shared_memory.msgs_read[thisPE-1] = sys_slot;
-    }
+/* amount of data waiting: in the local queue, in messages being taken
+ * from a ring, and in the rings of all senders (including headers) */
+static StgWord cpw_shm_pending() {
+  cpw_msg_t *msg;
+  StgWord pending = 0;
+  PEId pe;
 
-    cpw_sem_post(&r_sems[thisPE-1]); /* no msg taken */
-    /* sys_msg now in front */
-    return 1;
+  for (msg = stored_msgs; msg != NULL; msg = msg->next) {
+    pending += msg->length;
   }
-  default:
-    return 0;
+  for (pe = 1; pe <= nPEs; pe++) {
+    if (partial_msgs[pe-1] != NULL) { // the rest is still in the ring
+      pending += partial_msgs[pe-1]->got;
+    }
+    pending += cpw_ring_used(pe);
   }
+  return pending;
 }
 
 static int cpw_self_probe() {
@@ -1196,22 +1702,25 @@ static int cpw_self_probe_sys(void) {
   switch(stored_msgs != NULL) {
   case 1:
     {
-      cpw_shm_slot_t *queue_front = stored_msgs;
-      cpw_shm_slot_t *pre_sys_slot = NULL;
-      cpw_shm_slot_t *sys_slot = queue_front;
-
-      while(!ISSYSCODE(sys_slot->addr->tag)) {
-        pre_sys_slot = sys_slot;
-        sys_slot = sys_slot->next;
-        if(sys_slot == NULL) {
+      cpw_msg_t *queue_front = stored_msgs;
+      cpw_msg_t *pre_sys_msg = NULL;
+      cpw_msg_t *sys_msg = queue_front;
+
+      while(!ISSYSCODE(sys_msg->tag)) {
+        pre_sys_msg = sys_msg;
+        sys_msg = sys_msg->next;
+        if(sys_msg == NULL) {
           return 0; /* no sys msgs found */
         }
       }
       /* possibly move sysmsg to front */
-      if(pre_sys_slot != NULL) {
-        pre_sys_slot->next = sys_slot->next;
-        sys_slot->next = queue_front;
-        stored_msgs = sys_slot;
+      if(pre_sys_msg != NULL) {
+        pre_sys_msg->next = sys_msg->next;
+        if (stored_last == sys_msg) {
+          stored_last = pre_sys_msg;
+        }
+        sys_msg->next = queue_front;
+        stored_msgs = sys_msg;
       }
       /* sys_msg now in front */
       return 1;
@@ -1221,22 +1730,20 @@ static int cpw_self_probe_sys(void) {
   }
 }
 
+/* take in and discard everything from the rings (shutdown) */
 static int cpw_shm_free_pending_msg() {
   IF_PAR_DEBUG(mpcomm,
                debugBelch("freeing pending messages\n"));
-  int me = thisPE - 1;
-
-  while(cpw_sem_trywait(&r_sems[me]) == CPW_NOERROR) {
-    cpw_shm_slot_t *used_slot = shared_memory.msgs_read[me];
-    shared_memory.msgs_read[me] = used_slot->next;
-
-    /* freeing slot */
-    cpw_sem_wait(&do_alloc);
-    used_slot->next = *shared_memory.free_slots;
-    *shared_memory.free_slots = used_slot;
-    cpw_sem_post(&do_alloc);
-    /* wake waiting senders */
-    cpw_sem_post(&can_alloc);
+  cpw_msg_t *msg;
+
+  while (cpw_shm_drain()) {
+    while (stored_msgs != NULL) {
+      msg = stored_msgs;
+      stored_msgs = msg->next;
+      stgFree(msg->data);
+      stgFree(msg);
+    }
+    stored_last = NULL;
   }
 
   IF_PAR_DEBUG(mpcomm,
@@ -1341,6 +1848,7 @@ static int cpw_sync_close(cpw_sync_t *syn) {
   return CPW_NOERROR;
 }
 
+
 #else  /* win32 code follows */
 
 #include <Windows.h>
@@ -1479,6 +1987,7 @@ static int cpw_shm_init(void);
 static void cpw_shm_check_errors(void);
 
 static int cpw_shm_send_msg(PEId toPE, OpCode tag, uint32_t length, StgWord8 *data);
+static int cpw_shm_send_vec(PEId toPE, OpCode tag, MPVec *vec, uint32_t count);
 static int cpw_shm_recv_msg(PEId *fromPE, OpCode *tag,
                             uint32_t *length, StgWord8 *data);
 static size_t cpw_shm_acquire_slot(void);
@@ -1537,6 +2046,9 @@ cpw_shm_t  shared_memory;        /* shared memory structure */
 char *args; /* Save string for argv in MPStart to use it in MPSync */
 char buffer[256];
 
+/* lent out by MP_recv_borrow (received messages are copied) */
+static StgWord8 *borrowBuffer = NULL;
+
 /**************************************************************
  * Startup and Shutdown routines (used inside ParInit.c only) */
 
@@ -1774,6 +2286,11 @@ bool MP_quit(int isError){
   /* close shared memory*/
   cpw_shm_close(&shared_memory);
 
+  if (borrowBuffer != NULL) {
+    stgFree(borrowBuffer);
+    borrowBuffer = NULL;
+  }
+
   /* indicate that quit has been executed */
   nPEs = 0;
 
@@ -1828,6 +2345,45 @@ bool MP_send(int node, OpCode tag, StgWord8 *data, int length){
   }
 }
 
+/* - a gathering send, see MPSystem.h. The pieces are copied into the
+ *   message slot one after the other. */
+bool MP_sendv(PEId node, OpCode tag, MPVec *vec, uint32_t count) {
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("MP_sendv()"));
+
+  /* check for errors */
+  cpw_shm_check_errors();
+
+  /* send */
+  switch (cpw_shm_send_vec(node, tag, vec, count)) {
+  case CPW_NOERROR:
+    return true;
+  case CPW_SEND_FAIL:
+  default:
+    return false;
+  }
+}
+
+/* - a multicast, see MPSystem.h */
+uint32_t MP_bcast(PEId *nodes, uint32_t count,
+                  OpCode tag, StgWord8 *data, uint32_t length) {
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (!MP_send(nodes[i], tag, data, length)) {
+      break;
+    }
+  }
+  return i;
+}
+
+/* - a non-blocking check whether a message to node can be sent, see
+ *   MPSystem.h. Always true, MP_send waits for a free slot.
+ */
+bool MP_send_ready(STG_UNUSED PEId node) {
+  return true;
+}
+
 /* - a blocking receive operation
  *   where system messages from main node have priority!
  * Effect:
@@ -1878,6 +2434,24 @@ uint32_t MP_recv(STG_UNUSED uint32_t maxlength, StgWord8 *destination, // IN
   return length;
 }
 
+/* - a blocking receive operation which lends the message data, see
+ *   MPSystem.h. Messages are copied out of the shared memory
+ *   slots into borrowBuffer, and lent from there.
+ */
+StgWord8 *MP_recv_borrow(OpCode *code, PEId *sender, uint32_t *length) {
+  if (borrowBuffer == NULL) {
+    borrowBuffer = (StgWord8 *)
+      stgMallocBytes(sizeof(StgWord)*DATASPACEWORDS, "borrowBuffer");
+  }
+  *length = MP_recv(sizeof(StgWord)*DATASPACEWORDS, borrowBuffer,
+                    code, sender);
+  return borrowBuffer;
+}
+
+/* - give back a message obtained by MP_recv_borrow (buffer is reused) */
+void MP_recv_release(void) {
+}
+
 /* - a non-blocking probe operation
  * (unspecified sender, no receive buffers any more)
  */
@@ -1896,6 +2470,27 @@ bool MP_probe(void) {
     return false;
 }
 
+/* - amount of data waiting: the messages taken into the local queue,
+ *   messages still in shared memory are not inspected (counted as one
+ *   byte) */
+uint32_t MP_pending(void) {
+  cpw_shm_slot_t *slot;
+  uint32_t pending = 0;
+
+  for (slot = stored_msgs; slot != NULL; slot = slot->next) {
+    pending += slot->addr->length;
+  }
+  if (cpw_shm_probe()) {
+    pending++;
+  }
+  return pending;
+}
+
+/* - locality domain of a node: PEs are not pinned here */
+uint32_t MP_locality(STG_UNUSED PEId node) {
+  return 0;
+}
+
 
 /*============*
  * Semaphores *
@@ -2431,7 +3026,25 @@ static int cpw_shm_init()
 /* try to send a message */
 static int cpw_shm_send_msg(PEId toPE, OpCode tag,
                             uint32_t length, StgWord8 *data) {
+  MPVec vec;
+
+  vec.data = data;
+  vec.length = length;
+  return cpw_shm_send_vec(toPE, tag, &vec, 1);
+}
+
+/* the same for a message gathered from several pieces (MP_sendv) */
+static int cpw_shm_send_vec(PEId toPE, OpCode tag,
+                            MPVec *vec, uint32_t count) {
   size_t free_slot_off = 0;
+  uint32_t length, i;
+
+  length = 0;
+  for (i = 0; i < count; i++) {
+    length += vec[i].length;
+  }
+  ASSERT(length <= DATASPACEWORDS * sizeof(StgWord));
+
   //printf("sending msg\n");
   /* can we get a free slot? */
   if (cpw_sem_trywait(shared_memory.hCan_alloc) == CPW_SEM_WOULD_LOCK) {
@@ -2473,8 +3086,12 @@ static int cpw_shm_send_msg(PEId toPE, OpCode tag,
   msg->sender = thisPE;
   msg->tag    = tag;
   msg->length = length;
-  memcpy((char*)shared_memory.base + shared_memory.data_start + msg->data,
-         data, length);
+  length = 0;
+  for (i = 0; i < count; i++) {
+    memcpy((char*)shared_memory.base + shared_memory.data_start + msg->data
+           + length, vec[i].data, vec[i].length);
+    length += vec[i].length;
+  }
 
   //printf(" sending msg to %i, tag %i\n", toPE,tag);
 
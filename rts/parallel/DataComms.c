@@ -21,7 +21,12 @@
 #include "RTTables.h"
 #include "PEOpCodes.h"
 #include "MPSystem.h"
+#include "Compress.h"
 #include "Trace.h"
+#include "Stats.h"
+#if defined(TRACING)
+#include "eventlog/EventLog.h" // streamed eventlogs (-qT)
+#endif
 
 #if defined(mingw32_HOST_OS)
 #define srand48(s) srand(s)
@@ -29,20 +34,128 @@
 #define lrand48() rand()
 #endif
 
+#include "Prelude.h" // Unit_closure, for send gates
 #include "Threads.h" // updateThunk
+#include "Messages.h" // messageBlackHole, for send gates
+#include "Stable.h" // freeStablePtr, for send gates
+#include "Capability.h" // run queue length, in choosePE
+#include "Hash.h" // threads waiting for deferred messages
 
 #include <unistd.h> // getpid, in choosePE
+#include <string.h> // memcpy, in appendPart
 
 PEId targetPE = 0;
 
+/* Load information for process placement:
+ *   Every message carries the run queue length and heap residency
+ *   (live data after its last GC, see stat_liveKBytes) of its sending
+ *   PE (filled in by sendMsg), which we keep in a table per PE
+ *   (recordPELoad, called by the scheduler for every message). The load
+ *   of this PE is always taken directly. When a process is placed on a
+ *   PE, we count one more thread there until it tells us otherwise, so
+ *   that a burst of rForks does not go to the same PE.
+ */
+typedef struct PELoad_ {
+  StgWord32 runQueueLength;
+  StgWord32 heapLive;
+} PELoad;
+
+static PELoad peLoad[MAX_PES];
+
+// processes held back for work stealing, see PP_FISH below
+
+// load of this PE, as sent in every message
+static StgWord32 currentRunQueueLength(void) {
+  StgWord32 n = heldProcessCount();
+  uint32_t i;
+
+  for (i = 0; i < n_capabilities; i++) {
+    n += capabilities[i]->n_run_queue;
+  }
+  return n;
+}
+
+void recordPELoad(PEId pe, rtsPackBuffer *msg) {
+  ASSERT(pe > 0 && pe <= nPEs);
+  peLoad[pe-1].runQueueLength = msg->runQueueLength;
+  peLoad[pe-1].heapLive = msg->heapLive;
+}
+
+// load comparison: run queue length first, then heap residency
+static bool lessLoaded(PEId a, PEId b) {
+  PELoad *la = &peLoad[a-1], *lb = &peLoad[b-1];
+
+  return (la->runQueueLength < lb->runQueueLength
+          || (la->runQueueLength == lb->runQueueLength
+              && la->heapLive < lb->heapLive));
+}
+
+// load comparison for placement: a PE in the locality domain of this
+// PE (the same NUMA node, with -qA) counts as less loaded than one in
+// another domain unless its run queue is longer by more than one
+static bool betterPlaced(PEId a, PEId b) {
+  uint32_t here = MP_locality(thisPE);
+  bool nearA = (MP_locality(a) == here), nearB = (MP_locality(b) == here);
+
+  if (nearA && !nearB) {
+    return (peLoad[a-1].runQueueLength
+            <= peLoad[b-1].runQueueLength + 1);
+  }
+  if (nearB && !nearA) {
+    return (peLoad[a-1].runQueueLength + 1
+            < peLoad[b-1].runQueueLength);
+  }
+  return lessLoaded(a, b);
+}
+
+// whether pe may be chosen at all (-qremote)
+static bool placeable(PEId pe) {
+  return (pe != thisPE || nPEs == 1
+          || !(RtsFlags.ParFlags.placement & PLACE_REMOTE));
+}
+
+// least loaded PE, scanning from targetPE (rotating, to spread ties)
+static PEId leastLoadedPE(bool remoteOnly) {
+  PEId pe, best = 0;
+  uint32_t i;
+
+  for (i = 0, pe = targetPE; i < nPEs; i++) {
+    if (placeable(pe) && (!remoteOnly || pe != thisPE)
+        && (best == 0 || betterPlaced(pe, best))) {
+      best = pe;
+    }
+    pe = (pe >= nPEs) ? 1 : (pe + 1);
+  }
+  targetPE = (targetPE >= nPEs) ? 1 : (targetPE + 1);
+  return (best == 0 ? thisPE : best);
+}
+
+// random PE which may be chosen
+static PEId randomPE(void) {
+  PEId pe;
+
+  do {
+    pe = 1 + (PEId) (lrand48() % nPEs);
+  } while (!placeable(pe));
+  return pe;
+}
+
 /*
- * ChoosePE selects a PE number between 1 and nPEs, either 'at
- * random' or round-robin, starting with thisPE+1
+ * ChoosePE selects a PE number between 1 and nPEs, by the placement
+ * policy (RtsFlags.ParFlags.placement, see Flags.h):
+ *  - round-robin, starting with thisPE+1 (default)
+ *  - 'at random' (-qrnd)
+ *  - the least loaded PE (-qrll)
+ *  - the less loaded of two random PEs (-qr2, "power of two choices")
+ *  - this PE, unless its run queue is longer than the one of the least
+ *    loaded other PE plus one (-qrloc)
+ * The load-based policies prefer PEs in the locality domain of this PE
+ * (see betterPlaced), which matters when PEs are pinned (-qA).
  */
 static PEId
 choosePE(void)
 {
-  PEId temp;
+  PEId temp, other;
 
   // initialisation
   if (targetPE == 0) {
@@ -50,19 +163,47 @@ choosePE(void)
     srand48(getpid());  // seed for random placement
   }
 
-  if (RtsFlags.ParFlags.placement & 1) // random
+  // own load is always up to date
+  peLoad[thisPE-1].runQueueLength = currentRunQueueLength();
+  peLoad[thisPE-1].heapLive = stat_liveKBytes();
+
+  switch (RtsFlags.ParFlags.placement & ~PLACE_REMOTE) {
+  case PLACE_RANDOM:
     temp = 1 + (PEId) (lrand48() % nPEs);
-  else {// round-robin
+    break;
+  case PLACE_LEASTLOAD:
+    temp = leastLoadedPE(false);
+    break;
+  case PLACE_TWOCHOICE:
+    temp = randomPE();
+    other = randomPE();
+    if (betterPlaced(other, temp)) {
+      temp = other;
+    }
+    break;
+  case PLACE_LOCALITY:
+    temp = leastLoadedPE(true);
+    if (placeable(thisPE)
+        && peLoad[thisPE-1].runQueueLength
+           <= peLoad[temp-1].runQueueLength + 1) {
+      temp = thisPE;
+    }
+    break;
+  default: // round-robin
     temp = targetPE;
     targetPE = (targetPE >= nPEs) ? 1 : (targetPE + 1);
   }
-  if ((RtsFlags.ParFlags.placement & 2) // no local placement
+  if ((RtsFlags.ParFlags.placement & PLACE_REMOTE) // no local placement
       && (temp ==  thisPE)) {
     temp = (temp ==  nPEs) ? 1 : (temp + 1);
   }
+
+  // a new process for temp, until it sends its own load
+  peLoad[temp-1].runQueueLength++;
+
   IF_PAR_DEBUG(procs,
-               debugBelch("chosen: %d, new targetPE == %d\n",
-                          temp,targetPE));
+               debugBelch("chosen: %d (load %d), new targetPE == %d\n",
+                          temp, peLoad[temp-1].runQueueLength, targetPE));
   return temp;
 }
 
@@ -82,7 +223,10 @@ choosePE(void)
  *
  * The rtsPackBuffer is defined to capture exactly this structure
  * (includes the sender and receiver), so we can just send it away
- * as-is and only have to compute the size.
+ * as-is and only have to compute the size. The id field numbers the
+ * parts of a graph sent in several messages (see PP_PART below).
+ * The header also carries the current load of the sending PE, for
+ * process placement (see choosePE above).
 
  * More on ports in RTTables.h, on packing data in Pack.c
  */
@@ -90,6 +234,11 @@ choosePE(void)
 // global pack buffer
 rtsPackBuffer *globalPackBuffer;
 
+#if defined(THREADED_RTS)
+// queue of eventlog data (-qT, all capabilities write), see PP_EVENTLOG
+static Mutex eventLogMutex;
+#endif
+
 // allocate the pack buffer. Called from ParInit (synchroniseSystem)
 void initPackBuffer(void) {
     IF_PAR_DEBUG(verbose, debugBelch("init pack buffer"));
@@ -100,11 +249,513 @@ void initPackBuffer(void) {
                            + DEBUG_HEADROOM * sizeof(StgWord),
                            "init pack buffer");
     }
+    // a batch of messages is sent as one message (see PP_PACKET below)
+    if (RtsFlags.ParFlags.batchSize > RtsFlags.ParFlags.packBufferSize) {
+        RtsFlags.ParFlags.batchSize = RtsFlags.ParFlags.packBufferSize;
+    }
+#if defined(THREADED_RTS)
+    initMutex(&eventLogMutex);
+#endif
 }
 
+// collected parts of rFork messages, and of data messages for unknown
+// inports (-qC), see PP_PART below
+static PendingParts *rforkParts[MAX_PES];
+static PendingParts *lostParts[MAX_PES];
+
+// messages batched per destination PE, see PP_PACKET below
+static void freeSendBatches(void);
+
+// packed messages kept when sending failed, see sendMsg below
+static bool flushDeferred(PEId pe);
+static void freeDeferredMsgs(void);
+
+// processes held back for work stealing, see PP_FISH below
+static void freeHeldProcesses(void);
+
+// broadcasts to be relayed, see PP_BCAST below
+static bool flushRelays(void);
+static void freeRelays(void);
+
+// statistics to be sent, see PP_STATS below
+static void sendStatsMsgs(void);
+
+// streamed eventlogs (-qT), see PP_EVENTLOG below
+static bool sendEventLogMsgs(bool all);
+static void freeEventLogData(void);
+
+// buffers for the dense encoding and compression, see sendMsg below
+static void freeCodingBuffers(void);
+
 // free allocated pack buffer. Called from ParInit (shutdownParallelSystem)
 void freePackBuffer(void) {
+    PEId pe;
+
     stgFree(globalPackBuffer);
+
+    // and parts of rFork messages which never completed
+    for (pe = 0; pe < MAX_PES; pe++) {
+        if (rforkParts[pe] != NULL) {
+            freePendingParts(rforkParts[pe]);
+            rforkParts[pe] = NULL;
+        }
+        if (lostParts[pe] != NULL) {
+            freePendingParts(lostParts[pe]);
+            lostParts[pe] = NULL;
+        }
+    }
+
+    freeSendBatches();
+    freeDeferredMsgs();
+    freeHeldProcesses();
+    freeRelays();
+    freeCodingBuffers();
+    freeEventLogData();
+}
+
+/* Batching small messages: PP_PACKET
+ *   Small messages (up to a quarter of RtsFlags.ParFlags.batchSize,
+ *   set by -qB) are not sent right away, but collected per destination
+ *   PE and sent together in one PP_PACKET message. Inside the packet,
+ *   each message is preceded by a PacketEntry header and padded to a
+ *   multiple of StgWord, so the receiver can process it in place.
+ *
+ *   A batch is sent out when the next message does not fit, before any
+ *   larger message to the same PE (keeping the message order), when it
+ *   has waited for RtsFlags.ParFlags.batchTime (-qBt, checked by the
+ *   scheduler), and when the scheduler is about to block waiting for
+ *   messages. A batch of one message is sent as this message.
+ */
+typedef struct SendBatch_ {
+  StgWord8 *data;   // PacketEntry headers and messages
+  uint32_t  size;   // bytes used
+  uint32_t  count;  // number of messages
+  Time      since;  // when the first message was added
+} SendBatch;
+
+static SendBatch sendBatches[MAX_PES];
+
+// send the batch for one PE. Returns false if sending failed (the
+// batch is kept for a later attempt)
+static bool flushBatch(PEId pe) {
+  SendBatch *batch = &sendBatches[pe-1];
+  PacketEntry *entry;
+  bool sent;
+
+  if (batch->count == 0) {
+    return true;
+  }
+
+  if (batch->count == 1) {
+    entry = (PacketEntry*) batch->data;
+    sent = MP_send(pe, entry->tag,
+                   batch->data + sizeof(PacketEntry), entry->length);
+  } else {
+    sent = MP_send(pe, PP_PACKET, batch->data, batch->size);
+  }
+
+  if (sent) {
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("sent batch of %d messages (%d bytes) to PE %d\n",
+                            batch->count, batch->size, pe));
+    batch->size = 0;
+    batch->count = 0;
+  }
+  return sent;
+}
+
+// add a message to the batch for its PE, sending the batch first if
+// the message does not fit. Returns false if that failed.
+static bool batchMsg(PEId pe, OpCode tag, StgWord8 *data, uint32_t size) {
+  SendBatch *batch = &sendBatches[pe-1];
+  uint32_t need = sizeof(PacketEntry)
+                  + ROUNDUP_BYTES_TO_WDS(size) * sizeof(StgWord);
+  PacketEntry *entry;
+
+  if (batch->size + need > RtsFlags.ParFlags.batchSize && !flushBatch(pe)) {
+    return false;
+  }
+
+  if (batch->data == NULL) {
+    batch->data = (StgWord8*) stgMallocBytes(RtsFlags.ParFlags.batchSize,
+                                             "sendBatch");
+  }
+  if (batch->count == 0) {
+    batch->since = getProcessElapsedTime();
+  }
+
+  entry = (PacketEntry*) (batch->data + batch->size);
+  entry->tag = tag;
+  entry->length = size;
+  memcpy(batch->data + batch->size + sizeof(PacketEntry), data, size);
+  batch->size += need;
+  batch->count++;
+  return true;
+}
+
+// send out batches which have waited long enough, or all batches if
+// force is set. Returns false if a batch could not be sent.
+// Declared in Parallel.h, used by the scheduler.
+bool flushSendBatches(bool force) {
+  PEId pe;
+  Time now = 0;
+  bool sent;
+
+  // broadcasts which could not be relayed yet go first
+  sent = flushRelays();
+  // then messages deferred to PEs without waiting senders (see sendMsg)
+  for (pe = 1; pe <= nPEs; pe++) {
+    sent = flushDeferred(pe) && sent;
+  }
+  sendStatsMsgs();
+
+  if (RtsFlags.ParFlags.batchSize == 0) {
+    // eventlog data last, it is not urgent (see PP_EVENTLOG below)
+    return sendEventLogMsgs(force) && sent;
+  }
+
+  for (pe = 1; pe <= nPEs; pe++) {
+    SendBatch *batch = &sendBatches[pe-1];
+    if (batch->count == 0) {
+      continue;
+    }
+    if (!force && now == 0) {
+      now = getProcessElapsedTime();
+    }
+    if (force || now - batch->since >= RtsFlags.ParFlags.batchTime) {
+      sent = flushBatch(pe) && sent;
+    }
+  }
+  return sendEventLogMsgs(force) && sent;
+}
+
+// free batch buffers (unsent messages are dropped, at shutdown)
+static void freeSendBatches(void) {
+  PEId pe;
+
+  for (pe = 0; pe < MAX_PES; pe++) {
+    if (sendBatches[pe].data != NULL) {
+      stgFree(sendBatches[pe].data);
+      sendBatches[pe].data = NULL;
+    }
+    sendBatches[pe].size = 0;
+    sendBatches[pe].count = 0;
+  }
+}
+
+/* Gathering large byte arrays
+ *   When packing into the global pack buffer for sendWrapper, the payload
+ *   of large byte arrays is not copied into the buffer, but left in the
+ *   heap (see PackSegments in Parallel.h). The buffer then contains holes,
+ *   and the message is sent with MP_sendv, taking buffer pieces and heap
+ *   data in turn. Such messages are never batched.
+ */
+static PackSegments packSegments;
+
+// the pieces of a message with holes (size in bytes, including the
+// header), buffer pieces and heap data in turn. Returns their number.
+static uint32_t gatherPieces(rtsPackBuffer *dataBuffer, uint32_t size,
+                             PackSegments *segments, MPVec *vec) {
+  StgWord8 *next = (StgWord8*) dataBuffer; // start of the next buffer piece
+  StgWord8 *hole;
+  uint32_t count = 0, i;
+
+  for (i = 0; i < segments->count; i++) {
+    hole = (StgWord8*) (dataBuffer->buffer + segments->seg[i].at);
+    if (hole > next) {
+      vec[count].data = next;
+      vec[count].length = hole - next;
+      count++;
+    }
+    vec[count].data = (StgWord8*) segments->seg[i].data;
+    vec[count].length = segments->seg[i].size * sizeof(StgWord);
+    count++;
+    next = hole + vec[count-1].length;
+  }
+  if ((StgWord8*) dataBuffer + size > next) {
+    vec[count].data = next;
+    vec[count].length = (StgWord8*) dataBuffer + size - next;
+    count++;
+  }
+  return count;
+}
+
+/* Deferred messages
+ *   MP_send_ready promises room for a message of maximal size, but
+ *   another capability may send in between, and a graph sent in parts
+ *   needs more than one message. A packed message which the MP-System
+ *   refuses is not thrown away (packing it again would only fail
+ *   again, see stg_yield_send): sendMsg_ copies it into a queue for its
+ *   PE, and it counts as sent (the sharing cache keeps the closures it
+ *   defines). Until the queue is empty, all later messages to this PE
+ *   queue behind it, to keep the message order. The sending thread
+ *   blocks on the send gate of the PE (see below) and openSendGates
+ *   sends the queue before waking it, the woken thread then finds its
+ *   message sent (see deferredWaits) instead of packing again.
+ */
+typedef struct DeferredMsg_ {
+  OpCode    tag;
+  uint32_t  size;   // bytes in data
+  StgWord   seq;    // number of the message, counting all deferred ones
+  StgWord8 *data;
+  struct DeferredMsg_ *next;
+} DeferredMsg;
+
+static DeferredMsg *deferredHead[MAX_PES], *deferredTail[MAX_PES];
+static StgWord deferredCount;         // messages deferred so far
+static StgWord deferredSent[MAX_PES]; // seq of the last one sent, per PE
+
+// threads waiting for a deferred message: thread id -> DeferredWait
+typedef struct DeferredWait_ {
+  PEId    pe;
+  StgWord seq;      // the last message of the thread
+} DeferredWait;
+
+static HashTable *deferredWaits = NULL;
+
+// append a message (given as pieces) to the queue of its PE
+static void deferMsg(PEId pe, OpCode tag, MPVec *vec, uint32_t count) {
+  DeferredMsg *msg;
+  uint32_t i, size = 0;
+
+  for (i = 0; i < count; i++) {
+    size += vec[i].length;
+  }
+  msg = (DeferredMsg*) stgMallocBytes(sizeof(DeferredMsg), "deferMsg");
+  msg->data = (StgWord8*) stgMallocBytes(size, "deferMsg");
+  msg->tag = tag;
+  msg->size = 0;
+  for (i = 0; i < count; i++) {
+    memcpy(msg->data + msg->size, vec[i].data, vec[i].length);
+    msg->size += vec[i].length;
+  }
+  msg->seq = ++deferredCount;
+  msg->next = NULL;
+  if (deferredTail[pe-1] == NULL) {
+    deferredHead[pe-1] = msg;
+  } else {
+    deferredTail[pe-1]->next = msg;
+  }
+  deferredTail[pe-1] = msg;
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("deferred %s (%d bytes) to PE %d\n",
+                          getOpName(tag), size, (int) pe));
+}
+
+// send the deferred messages for one PE (after its batch, which holds
+// older messages). Returns whether the queue is empty.
+static bool flushDeferred(PEId pe) {
+  DeferredMsg *msg;
+
+  if (deferredHead[pe-1] == NULL) {
+    return true;
+  }
+  if (!flushBatch(pe)) {
+    return false;
+  }
+  while ((msg = deferredHead[pe-1]) != NULL) {
+    if (!MP_send(pe, msg->tag, msg->data, msg->size)) {
+      return false;
+    }
+    deferredSent[pe-1] = msg->seq;
+    deferredHead[pe-1] = msg->next;
+    if (deferredHead[pe-1] == NULL) {
+      deferredTail[pe-1] = NULL;
+    }
+    stgFree(msg->data);
+    stgFree(msg);
+  }
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("sent deferred messages to PE %d\n", (int) pe));
+  return true;
+}
+
+// whether a PE can take a message of maximal size right now
+static bool sendReady(PEId pe) {
+  return (deferredHead[pe-1] == NULL && MP_send_ready(pe));
+}
+
+// free deferred messages (unsent ones are dropped, at shutdown)
+static void freeDeferredMsgs(void) {
+  DeferredMsg *msg;
+  PEId pe;
+
+  for (pe = 0; pe < MAX_PES; pe++) {
+    while ((msg = deferredHead[pe]) != NULL) {
+      deferredHead[pe] = msg->next;
+      stgFree(msg->data);
+      stgFree(msg);
+    }
+    deferredTail[pe] = NULL;
+  }
+  if (deferredWaits != NULL) {
+    freeHashTable(deferredWaits, stgFree);
+    deferredWaits = NULL;
+  }
+}
+
+/* Dense encoding (-qE)
+ *   Packed graphs sent in one message (PP_RFORK, PP_DATA, PP_HEAD,
+ *   PP_CONSTR) are encoded by encodePacket (Pack.c) if this makes them
+ *   smaller. The header is sent as it is, with format PACKET_ENCODED and
+ *   the size of the encoding, the receiver decodes the message before
+ *   processing it (decodeMsg). Graphs sent in parts, messages with heap
+ *   segments and broadcasts are sent plain, and plain messages are
+ *   always understood.
+ *
+ * Compression (-qZ<size>)
+ *   The payload of messages of at least <size> bytes (after encoding) is
+ *   compressed (lzCompress, Compress.c) if this makes it smaller, and
+ *   marked PACKET_COMPRESSED. This includes PP_PART messages, but not
+ *   messages with heap segments and broadcasts. The size of each message
+ *   before and after compression is traced (EVENT_MESSAGE_COMPRESSION).
+ */
+static rtsPackBuffer *encodeBuffer = NULL;
+static rtsPackBuffer *decodeBuffer = NULL;
+static rtsPackBuffer *compressBuffer = NULL;
+static rtsPackBuffer *decompressBuffer = NULL;
+
+// capacity of both buffers (payload), as the pack buffer
+#define CODING_BUFFER_BYTES (RtsFlags.ParFlags.packBufferSize \
+                             + DEBUG_HEADROOM * sizeof(StgWord))
+
+static void freeCodingBuffers(void) {
+  if (encodeBuffer != NULL) {
+    stgFree(encodeBuffer);
+    encodeBuffer = NULL;
+  }
+  if (decodeBuffer != NULL) {
+    stgFree(decodeBuffer);
+    decodeBuffer = NULL;
+  }
+  if (compressBuffer != NULL) {
+    stgFree(compressBuffer);
+    compressBuffer = NULL;
+  }
+  if (decompressBuffer != NULL) {
+    stgFree(decompressBuffer);
+    decompressBuffer = NULL;
+  }
+}
+
+// returns the message to send instead of msg (setting *size, in bytes
+// including the header), or msg itself if it is not encoded
+static rtsPackBuffer* encodeMsg(OpCode tag, rtsPackBuffer *msg,
+                                uint32_t *size) {
+  uint32_t bytes;
+
+  msg->format = PACKET_PLAIN;
+  msg->encodedSize = 0;
+  msg->compressedSize = 0;
+  if (!RtsFlags.ParFlags.encodePackets || msg->size == 0 || msg->id != 0
+      || (tag != PP_RFORK && tag != PP_DATA &&
+          tag != PP_HEAD && tag != PP_CONSTR)) {
+    return msg;
+  }
+
+  if (encodeBuffer == NULL) {
+    encodeBuffer = (rtsPackBuffer*)
+      stgMallocBytes(sizeof(rtsPackBuffer) + CODING_BUFFER_BYTES,
+                     "encodeMsg");
+  }
+  bytes = encodePacket(msg->buffer, msg->size,
+                       (StgWord8*) encodeBuffer->buffer, CODING_BUFFER_BYTES);
+  if (bytes == 0) {
+    return msg; // not smaller
+  }
+
+  memcpy(encodeBuffer, msg, sizeof(rtsPackBuffer));
+  encodeBuffer->format = PACKET_ENCODED;
+  encodeBuffer->encodedSize = bytes;
+  *size = sizeof(rtsPackBuffer) + bytes;
+  IF_PAR_DEBUG(pack,
+               debugBelch("encoded %s: %" FMT_Int " words in %d bytes\n",
+                          getOpName(tag), msg->size, bytes));
+  return encodeBuffer;
+}
+
+// the same for compression: msg (plain or encoded, *size bytes including
+// the header) is replaced by its compressed version if that is smaller
+static rtsPackBuffer* compressMsg(OpCode tag, rtsPackBuffer *msg,
+                                  uint32_t *size) {
+  uint32_t raw = *size - sizeof(rtsPackBuffer), bytes;
+
+  if (RtsFlags.ParFlags.compressMin == 0 ||
+      raw < RtsFlags.ParFlags.compressMin) {
+    return msg;
+  }
+
+  if (compressBuffer == NULL) {
+    compressBuffer = (rtsPackBuffer*)
+      stgMallocBytes(sizeof(rtsPackBuffer) + CODING_BUFFER_BYTES,
+                     "compressMsg");
+  }
+  bytes = lzCompress((StgWord8*) msg->buffer, raw,
+                     (StgWord8*) compressBuffer->buffer, CODING_BUFFER_BYTES);
+  traceMessageCompression(tag, raw, bytes == 0 ? raw : bytes);
+  if (bytes == 0) {
+    return msg; // not smaller
+  }
+
+  memcpy(compressBuffer, msg, sizeof(rtsPackBuffer));
+  compressBuffer->format |= PACKET_COMPRESSED;
+  compressBuffer->compressedSize = bytes;
+  *size = sizeof(rtsPackBuffer) + bytes;
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("compressed %s: %d bytes to %d\n",
+                          getOpName(tag), raw, bytes));
+  return compressBuffer;
+}
+
+rtsPackBuffer* decodeMsg(rtsPackBuffer *msg) {
+  uint32_t raw;
+
+  if (msg->format == PACKET_PLAIN) {
+    return msg;
+  }
+  if ((msg->format & ~(PACKET_ENCODED | PACKET_COMPRESSED)) != 0 ||
+      msg->size < 0 ||
+      (StgWord) msg->size * sizeof(StgWord) > CODING_BUFFER_BYTES) {
+    barf("decodeMsg: invalid message format %d (%" FMT_Int " words) "
+         "from PE %d", msg->format, msg->size, msg->sender.machine);
+  }
+
+  if (msg->format & PACKET_COMPRESSED) {
+    raw = (msg->format & PACKET_ENCODED) ? msg->encodedSize
+                                         : msg->size * sizeof(StgWord);
+    if (decompressBuffer == NULL) {
+      decompressBuffer = (rtsPackBuffer*)
+        stgMallocBytes(sizeof(rtsPackBuffer) + CODING_BUFFER_BYTES,
+                       "decodeMsg");
+    }
+    memcpy(decompressBuffer, msg, sizeof(rtsPackBuffer));
+    if (raw > CODING_BUFFER_BYTES ||
+        !lzDecompress((StgWord8*) msg->buffer, msg->compressedSize,
+                      (StgWord8*) decompressBuffer->buffer, raw)) {
+      barf("decodeMsg: garbled compressed message from PE %d",
+           msg->sender.machine);
+    }
+    decompressBuffer->format &= ~PACKET_COMPRESSED;
+    decompressBuffer->compressedSize = 0;
+    msg = decompressBuffer;
+    if (msg->format == PACKET_PLAIN) {
+      return msg;
+    }
+  }
+
+  if (decodeBuffer == NULL) {
+    decodeBuffer = (rtsPackBuffer*)
+      stgMallocBytes(sizeof(rtsPackBuffer) + CODING_BUFFER_BYTES,
+                     "decodeMsg");
+  }
+  memcpy(decodeBuffer, msg, sizeof(rtsPackBuffer));
+  if (!decodePacket((StgWord8*) msg->buffer, msg->encodedSize,
+                    decodeBuffer->buffer, msg->size)) {
+    barf("decodeMsg: garbled message from PE %d", msg->sender.machine);
+  }
+  decodeBuffer->format = PACKET_PLAIN;
+  decodeBuffer->encodedSize = 0;
+  return decodeBuffer;
 }
 
 /* sendMsg()
@@ -112,9 +763,23 @@ void freePackBuffer(void) {
  *  if buffer is not empty:  containing given packed graph
  * otherwise just using the sender/receiver fields
  */
+static bool sendMsg_(OpCode tag, rtsPackBuffer* dataBuffer,
+                     PackSegments *segments, bool keep);
+
 bool sendMsg(OpCode tag, rtsPackBuffer* dataBuffer) {
-  uint32_t size;
+  return sendMsg_(tag, dataBuffer, NULL, false);
+}
+
+// the same for a buffer with holes described by segments (unless NULL).
+// With keep set, a message which cannot be sent now is deferred (see
+// above), so sending never fails.
+static bool sendMsg_(OpCode tag, rtsPackBuffer* dataBuffer,
+                     PackSegments *segments, bool keep) {
+  static MPVec vec[2*MAX_PACK_SEGMENTS + 1];
+  uint32_t size, count;
   PEId     destinationPE = 0;
+  bool     sent;
+  rtsPackBuffer *msg;
 
   ASSERT(!(isNoPort(dataBuffer->sender)));
   ASSERT(!(isNoPort(dataBuffer->receiver)));
@@ -136,16 +801,66 @@ bool sendMsg(OpCode tag, rtsPackBuffer* dataBuffer) {
                           dataBuffer->receiver.process,
                           dataBuffer->receiver.id));
 
+  // piggyback the load of this PE (see choosePE)
+  dataBuffer->runQueueLength = currentRunQueueLength();
+  dataBuffer->heapLive = stat_liveKBytes();
+
   if (dataBuffer->size != 0) {
     size = sizeof(rtsPackBuffer) + dataBuffer->size*sizeof(StgWord);
   } else {
     size = sizeof(rtsPackBuffer);
   }
 
-  if (MP_send(destinationPE, tag, (StgWord8*) dataBuffer, size)) {
+  if (segments != NULL && segments->count > 0) {
+    // large byte arrays gathered from the heap (see above), after the
+    // messages batched before
+    dataBuffer->format = PACKET_PLAIN;
+    dataBuffer->encodedSize = 0;
+    dataBuffer->compressedSize = 0;
+    count = gatherPieces(dataBuffer, size, segments, vec);
+  } else {
+    // dense encoding and compression (see above), if enabled and smaller
+    msg = encodeMsg(tag, dataBuffer, &size);
+    msg = compressMsg(tag, msg, &size);
+    vec[0].data = (StgWord8*) msg;
+    vec[0].length = size;
+    count = 1;
+  }
+
+  if (deferredHead[destinationPE-1] != NULL) {
+    // messages deferred before go first, to keep the order
+    deferMsg(destinationPE, tag, vec, count);
+    sent = true;
+  } else if (count == 1 && RtsFlags.ParFlags.batchSize > 0 &&
+             size <= RtsFlags.ParFlags.batchSize / 4) {
+    // small message, batched (see PP_PACKET above)
+    sent = batchMsg(destinationPE, tag, vec[0].data, size);
+  } else {
+    // messages batched before go first, to keep the order
+    sent = flushBatch(destinationPE);
+    if (sent && count == 1) {
+      sent = MP_send(destinationPE, tag, vec[0].data, size);
+    } else if (sent) {
+      IF_PAR_DEBUG(mpcomm,
+                   debugBelch("sending %s (%d bytes) to PE %d in %d pieces\n",
+                              getOpName(tag), size, destinationPE, count));
+      sent = MP_sendv(destinationPE, tag, vec, count);
+    }
+  }
+  if (!sent && keep) {
+    deferMsg(destinationPE, tag, vec, count);
+    sent = true;
+  }
+
+  if (sent) {
+    stat_sentMsgs(1, size);
 
     // edentrace: emit event sendMessage(tag,dataBuffer)
-    traceSendMessageEvent(tag,dataBuffer);
+    // (parts are traced as one message, when the final part is sent,
+    // eventlog data is not traced in the eventlog)
+    if (tag != PP_PART && tag != PP_EVENTLOG) {
+      traceSendMessageEvent(tag,dataBuffer);
+    }
     IF_PAR_DEBUG(ports,
                  debugBelch("finished sending message to %d\n",
                             destinationPE));
@@ -160,7 +875,149 @@ bool sendMsg(OpCode tag, rtsPackBuffer* dataBuffer) {
 int fakeDataMsg(StgClosure *graph, Port sender, Port receiver,
                 Capability * cap, OpCode tag);
 
+// flush function for chunked packing: sends the full pack buffer as a
+// PP_PART message, with sender and receiver of the final message. Parts are
+// numbered from 1 (in the id field), the final message carries the number
+// of parts sent before it. The part carries the segments of its chunk.
+static bool sendPart(void *flushArg, uint32_t size) {
+  rtsPackBuffer *packedData = (rtsPackBuffer*) flushArg;
+
+  packedData->size = size;
+  packedData->id++;
+  IF_PAR_DEBUG(pack,
+               debugBelch("sending part %" FMT_Int " (%d words)\n",
+                          packedData->id, size));
+  return sendMsg_(PP_PART, packedData, &packSegments, true);
+}
+
+/* Send gates:
+ *   A thread sending to a congested PE (MP_send_ready is false, e.g.
+ *   -qq pack buffers in flight, or messages deferred to it) blocks
+ *   until the MP-System can take data for this PE again, instead of
+ *   retrying. Each congested PE with waiting threads has a gate: a
+ *   blackhole owned by the system, on which the threads block as on
+ *   remote data not yet received, so the waiting threads are queued in
+ *   its blocking queue. The gate is kept alive by a stable pointer.
+ *   openSendGates sends the deferred messages of PEs which are ready
+ *   again and updates their gates (which wakes their threads, who run
+ *   sendData# again). For MPI, MP_send_ready is where completed sends
+ *   are collected (completeSends).
+ */
+static StgStablePtr sendGate[MAX_PES]; // NULL: no thread waits for the PE
+
+// block tso on the gate of a congested PE, false if it cannot block
+static bool blockOnSendGate(StgTSO *tso, PEId pe) {
+  MessageBlackHole *msg;
+
+  if (sendGate[pe-1] == NULL) {
+    sendGate[pe-1] = getStablePtr((StgPtr) createBH(tso->cap));
+  }
+  msg = (MessageBlackHole*) allocate(tso->cap, sizeofW(MessageBlackHole));
+  SET_HDR(msg, &stg_MSG_BLACKHOLE_info, CCS_SYSTEM);
+  msg->tso = tso;
+  msg->bh  = (StgClosure*) deRefStablePtr(sendGate[pe-1]);
+
+  if (!messageBlackHole(tso->cap, msg)) {
+    return false;
+  }
+  tso->why_blocked = BlockedOnBlackHole;
+  tso->block_info.bh = msg;
+  return true;
+}
+
+// whether threads wait for a congested PE (called holding the parallel lock)
+bool sendGatesClosed(void) {
+  PEId pe;
+
+  for (pe = 1; pe <= nPEs; pe++) {
+    if (sendGate[pe-1] != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// whether a gate can be opened (called holding the parallel lock)
+bool sendGatesReady(void) {
+  PEId pe;
+
+  for (pe = 1; pe <= nPEs; pe++) {
+    if (sendGate[pe-1] != NULL && MP_send_ready(pe)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// wake the threads waiting for PEs which are ready again, returns
+// whether there were any
+bool openSendGates(Capability *cap) {
+  StgClosure *gate;
+  bool opened = false;
+  PEId pe;
+
+  ACQUIRE_PAR_LOCK();
+  for (pe = 1; pe <= nPEs; pe++) {
+    if (sendGate[pe-1] != NULL && MP_send_ready(pe) && flushDeferred(pe)) {
+      IF_PAR_DEBUG(mpcomm,
+                   debugBelch("PE %d ready again, waking senders\n",
+                              (int) pe));
+      gate = (StgClosure*) deRefStablePtr(sendGate[pe-1]);
+      freeStablePtr(sendGate[pe-1]);
+      sendGate[pe-1] = NULL;
+      updateThunk(cap, (StgTSO*) &stg_system_tso, gate, Unit_closure);
+      opened = true;
+    }
+  }
+  RELEASE_PAR_LOCK();
+  return opened;
+}
+
+// block tso until its last deferred message (to pe) has been sent.
+// Returns MSG_BLOCKED, or MSG_OK if it cannot block (the message goes
+// out with flushSendBatches then).
+static int waitDeferred(StgTSO *tso, PEId pe) {
+  DeferredWait *wait;
+
+  if (!blockOnSendGate(tso, pe)) {
+    return MSG_OK;
+  }
+  if (deferredWaits == NULL) {
+    deferredWaits = allocHashTable();
+  }
+  wait = (DeferredWait*) stgMallocBytes(sizeof(DeferredWait),
+                                        "waitDeferred");
+  wait->pe = pe;
+  wait->seq = deferredCount;
+  insertHashTable(deferredWaits, (StgWord) tso->id, wait);
+  return MSG_BLOCKED;
+}
+
+// whether tso waits for a deferred message (see waitDeferred)
+static bool awaitsDeferred(StgTSO *tso) {
+  return (deferredWaits != NULL &&
+          lookupHashTable(deferredWaits, (StgWord) tso->id) != NULL);
+}
+
+// a waiting thread which comes back to sendData#: false if its message
+// is still queued (it blocks again), true if it has been sent
+static bool deferredDone(StgTSO *tso) {
+  DeferredWait *wait;
+
+  wait = removeHashTable(deferredWaits, (StgWord) tso->id, NULL);
+  if (deferredSent[wait->pe-1] < wait->seq &&
+      blockOnSendGate(tso, wait->pe)) {
+    insertHashTable(deferredWaits, (StgWord) tso->id, wait);
+    return false;
+  }
+  stgFree(wait);
+  return true;
+}
+
 int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data);
+static int sendWrapper_(StgTSO *sendingtso, int mode, StgClosure *data);
+static int sendBcast(StgTSO *sendingtso, Port sender, uint32_t fanout,
+                     StgClosure *data);
 /* sendWrapper
  *
  * This function is intended as a lean interface for primitive
@@ -173,6 +1030,11 @@ int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data);
  *   2: stream data, one list element is sent
  *   3: single data, receiver's inport is closed
  *   4: rFork, receiver creates thread to evaluate received graph
+ *   5: add the receiver to the broadcast of the sending thread
+ *   6: broadcast single data to all receivers added before (closing
+ *      their inports), packed only once. Payload: fan-out of the
+ *      spanning tree along which PEs relay the data (0: sent by the
+ *      sender to all PEs), see PP_BCAST below.
  *
  * PLACEMENT HACK:
  *  "real" mode is (mode & 007), last 3 bits. Rest is payload data.
@@ -184,15 +1046,41 @@ int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data);
  *
  *  4 (rFork) is sent via a "process" port  (machine,process, 0 )
  *        and received on the RtsPort       (target ,  0    , 0 )
+ *
+ * In a threaded PE, the pack buffer and all tables are shared by the
+ * capabilities, sending holds the parallel lock.
  */
 int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data) {
+  int success;
+
+  ACQUIRE_PAR_LOCK();
+  if (awaitsDeferred(sendingtso)) {
+    // woken at the send gate after its message was deferred: it is not
+    // packed again (a broadcast goes on with the remaining receivers)
+    if (!deferredDone(sendingtso)) {
+      success = MSG_BLOCKED;
+    } else if ((mode & 007) == 6) {
+      success = sendWrapper_(sendingtso, mode, data);
+    } else {
+      success = MSG_OK;
+    }
+  } else {
+    success = sendWrapper_(sendingtso, mode, data);
+  }
+  RELEASE_PAR_LOCK();
+  return success;
+}
+
+static int sendWrapper_(StgTSO *sendingtso, int mode, StgClosure *data) {
 
   rtsPackBuffer *packedData = globalPackBuffer;
   uint32_t size; // packed size (returned by packToBuffer with error code bias)
+  uint32_t unpackedSize; // heap size of the graph
 
   OpCode sendTag = 0;
   int success=MSG_OK; // indicates successful packing, becomes return value
                       // codes defined in includes/rts/Constants.h
+  bool sent = false;  // deferred, the thread only waits for it to go out
 
   int m; // mode 0..7
   uint32_t d; // data payload inside mode
@@ -204,12 +1092,21 @@ int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data) {
 
   Port rtsPort = (Port) {0, 0, 0};
 
+  // data and stream messages may use the sharing cache for the receiver
+  // (-qC), not process creation (which may be passed on, see -qF)
+  PEId shareWith = 0;
+
   // set sender (partially, id only set when not sending an rFork)
   sender = (Port) { thisPE , MyProcess(sendingtso), 0 };
 
   receiver = MyReceiver(sendingtso);
   // for rFork, we need to protect the sendertso's receiver
 
+  // no parts sent yet, no graph
+  packedData->id = 0;
+  packedData->unpacked_size = 0;
+  packSegments.count = 0;
+
   // split mode into d and m:
   m = mode & 007;
   d = mode >> 3;
@@ -259,10 +1156,19 @@ int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data) {
     receiver->machine = d; // other machine's RtsPort
     goto packData; // brrr..
 
+  case 5: // add receiver to the broadcast of this thread
+    ASSERT(!(isNoPort(*receiver)));
+    addBcastReceiver(sendingtso, *receiver);
+    return MSG_OK;
+
+  case 6: // broadcast single data, d is the fan-out
+    sender.id = sendingtso->id;
+    return sendBcast(sendingtso, sender, d, data);
+
     /* insert new modes here, document them above and in
      * primops.txt.pp.
      *
-     * Possible free modes are 0,5,6,7 (see PLACEMENT HACK)
+     * Possible free modes are 0,7 (see PLACEMENT HACK)
      * and may carry payload data in higher bits.
      */
 
@@ -279,9 +1185,29 @@ int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data) {
       return fakeDataMsg(data, sender, *receiver, sendingtso->cap, sendTag);
     }
 
-    // pack the graph, needed in modes 2-4
-    size = packToBuffer(data, packedData->buffer, 
-                        RtsFlags.ParFlags.packBufferSize, sendingtso);
+    // destination congested: block before packing until it can take
+    // data again (other threads and destinations go on, see send gates)
+    if (!sendReady(receiver->machine)) {
+      IF_PAR_DEBUG(mpcomm,
+                   debugBelch("sendWrapper: PE %d congested\n",
+                              (int) receiver->machine));
+      success = blockOnSendGate(sendingtso, receiver->machine)
+                ? MSG_BLOCKED : MSG_FAILED;
+      break;
+    }
+
+    // pack the graph, needed in modes 2-4. Graphs which exceed the pack
+    // buffer are sent ahead in PP_PART messages (see sendPart above)
+    packedData->receiver = *receiver;
+    packedData->sender = sender;
+    if (m & 2) {
+      shareWith = receiver->machine;
+    }
+    size = packToBufferChunked(data, packedData->buffer,
+                               RtsFlags.ParFlags.packBufferSize
+                               / sizeof(StgWord),
+                               sendingtso, sendPart, packedData, shareWith,
+                               &packSegments, &unpackedSize);
 
     // graph might contain blackholes, in which case sendingtso
     // blocks (state set in packToBuffer, blocked when returning
@@ -291,15 +1217,16 @@ int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data) {
       case P_BLACKHOLE:
         success = MSG_BLOCKED;
         break;
-      case P_NOBUFFER:
-        stg_exit(EXIT_FAILURE);
       default:
+        // parts are deferred when sending them fails (see sendPart)
         stg_exit(EXIT_FAILURE);
       }
     } else {
       success = MSG_OK;
       // remove bias in size, adjust to StgWord unit
       packedData->size = (size - P_ERRCODEMAX) / sizeof(StgWord);
+      // the receiver allocates the graph in one go (see unpackGraph)
+      packedData->unpacked_size = unpackedSize;
     }
     break;
 
@@ -308,23 +1235,29 @@ int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data) {
 
   } // switch
 
-  if (success != MSG_BLOCKED) {
+  if (success == MSG_OK) {
     // successfully packed, or not packed at all => OK, send it away
     packedData->receiver = *receiver;
     packedData->sender = sender;
-    if ( !sendMsg(sendTag, packedData)) {
-      // failing send, return MSG_FAILED to the caller (primitive op.)
-      success = MSG_FAILED;
-    } else {
-      success = MSG_OK;
+    // a message which cannot be sent now is deferred, never packed again
+    sendMsg_(sendTag, packedData, &packSegments, true);
+    if (shareWith != 0) {
+      // the receiver knows the closures defined in the packet once it
+      // gets the message (deferred messages go before any later one)
+      commitSharing(shareWith, true);
+      commitRemoteRefs(true);
+    }
+    if (deferredHead[receiver->machine-1] != NULL) {
+      // the message (or a part of it) was deferred: wait until it is sent
+      success = waitDeferred(sendingtso, receiver->machine);
+      sent = true;
     }
-    RELEASE_LOCK(&pack_mutex);
 
     IF_PAR_DEBUG(mpcomm,
                  debugBelch("Sending message by thread %d returned code %d\n",
                             (int) sendingtso->id, success));
   }
-  if (success == MSG_BLOCKED || success == MSG_FAILED) {
+  if ((success == MSG_BLOCKED || success == MSG_FAILED) && !sent) {
     // in rFork case, packing might have failed, so RR-placement must
     // restore the last targetPE for the next call
     if ( m==4 && (mode >> 3) == 0) {
@@ -344,24 +1277,1195 @@ int sendWrapper(StgTSO *sendingtso, int mode, StgClosure *data) {
 
 
 
-/* Heap Data Messages: Data, Head, Constr
- *   contains a subgraph. Receiving triggers a new process which
- *   evaluates the sent subgraph (see Schedule.c::processMessages)
+/* Broadcast: PP_BCAST
+ *   A thread collects receivers (send mode 5) and then sends one graph
+ *   to all of them (send mode 6), as single data (PP_DATA) for each.
+ *   Receivers on this PE get the graph directly (fakeDataMsg). For the
+ *   others, the graph is packed only once, and the receivers are
+ *   appended to the packet:
  *
- *   Sending is triggered by a primitive operation.
+ *   | graph (g words) | receivers (3 words each) | g | receivers | fan-out |
+ *
+ *   The packet goes to all PEs with receivers, ordered by first
+ *   appearance. With a fan-out k > 0, PEs relay the packet along a
+ *   spanning tree: the sender (position 0) sends it to the PEs at
+ *   positions 1..k, the PE at position p to those at p*k+1..p*k+k.
+ *   Each PE unpacks the graph once for all its receivers.
+ *
+ *   When sending fails, the receivers which got the data (on PEs which
+ *   got the packet, and their subtrees) are removed, and the caller
+ *   retries for the others. Relaying PEs keep a packet which they
+ *   could not send, and retry when sending batched messages (see
+ *   flushSendBatches). Graphs which do not fit into the pack buffer,
+ *   and receivers too many for it (a small -qQ), are sent to each
+ *   receiver on its own (in parts).
  */
-void
-processDataMsg(Capability * cap, OpCode tag, rtsPackBuffer *gumPackBuffer) {
-  StgClosure *graph;
-  Inport* inport;
-  StgClosure *placeholder;
+#define BCAST_TRAILER 3 // words after the receivers
+
+// PEs with receivers in packet order, without the sending PE (root)
+static uint32_t bcastPEs(StgWord *ports, uint32_t count, PEId root,
+                         PEId *pes) {
+  bool seen[MAX_PES] = { false };
+  uint32_t i, n = 0;
+  PEId pe;
+
+  for (i = 0; i < count; i++) {
+    pe = (PEId) ports[3*i];
+    ASSERT(pe > 0 && pe <= nPEs);
+    if (pe != root && !seen[pe-1]) {
+      seen[pe-1] = true;
+      pes[n++] = pe;
+    }
+  }
+  return n;
+}
 
-  IF_PAR_DEBUG(pack,
-               debugBelch("Processing data message (%s, tag %#0x)\n",
-                          getOpName(tag), tag));
+// the PEs to which the PE at position pos relays the packet
+static uint32_t bcastChildren(uint32_t pos, uint32_t fanout,
+                              PEId *pes, uint32_t npes, PEId *children) {
+  uint32_t i, n = 0;
 
-  ASSERT(gumPackBuffer->receiver.process != 0);
-  inport = findInportByP(gumPackBuffer->receiver);
+  for (i = pos * fanout + 1; i <= npes && i <= pos * fanout + fanout; i++) {
+    children[n++] = pes[i-1];
+  }
+  return n;
+}
+
+// position of pe (1..npes), 0 if it has no receivers
+static uint32_t bcastPosition(PEId pe, PEId *pes, uint32_t npes) {
+  uint32_t i;
+
+  for (i = 0; i < npes; i++) {
+    if (pes[i] == pe) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// send a graph to each receiver of a broadcast on its own, as single
+// data (in parts if needed). Receivers which got it are removed, the
+// caller retries for the others. Returns sendWrapper return codes.
+static int sendBcastSingly(StgTSO *sendingtso, Receivers *receivers,
+                           StgClosure *data) {
+  Port saved = *MyReceiver(sendingtso);
+  int success = MSG_OK;
+  uint32_t i;
+
+  for (i = 0; i < receivers->count && success == MSG_OK; i++) {
+    setReceiver(sendingtso, receivers->ports[i].machine,
+                receivers->ports[i].process, receivers->ports[i].id);
+    success = sendWrapper_(sendingtso, 3, data);
+  }
+  if (success != MSG_OK && !awaitsDeferred(sendingtso)) {
+    i--; // this one failed, retry it
+  }
+  if (!isNoPort(saved)) {
+    setReceiver(sendingtso, saved.machine, saved.process, saved.id);
+  }
+  receivers->count -= i;
+  memmove(receivers->ports, receivers->ports + i,
+          receivers->count * sizeof(Port));
+  if (receivers->count == 0) {
+    clearBcastReceivers(sendingtso);
+  }
+  return success;
+}
+
+// broadcast a graph to the receivers collected by sendingtso. Returns
+// sendWrapper return codes.
+static int sendBcast(StgTSO *sendingtso, Port sender, uint32_t fanout,
+                     StgClosure *data) {
+  rtsPackBuffer *packedData = globalPackBuffer;
+  Receivers *receivers;
+  PEId pes[MAX_PES], children[MAX_PES];
+  uint32_t npes, nchildren, sent, words, trailer, i, j, pos;
+  uint32_t size; // packed size (with error code bias)
+  uint32_t unpackedSize; // heap size of the graph
+  uint32_t length; // of the message, in bytes
+  StgWord *t;
+
+  receivers = MyBcastReceivers(sendingtso);
+  if (receivers == NULL) {
+    return MSG_OK;
+  }
+
+  // receivers on this PE share the heap, no packing needed
+  for (i = 0, j = 0; i < receivers->count; i++) {
+    if (receivers->ports[i].machine == thisPE) {
+      fakeDataMsg(data, sender, receivers->ports[i],
+                  sendingtso->cap, PP_DATA);
+    } else {
+      receivers->ports[j++] = receivers->ports[i];
+    }
+  }
+  receivers->count = j;
+  if (receivers->count == 0) {
+    clearBcastReceivers(sendingtso);
+    return MSG_OK;
+  }
+
+  trailer = 3 * receivers->count + BCAST_TRAILER;
+  words = RtsFlags.ParFlags.packBufferSize / sizeof(StgWord);
+  if (trailer >= words) {
+    // the receivers alone do not fit into the pack buffer (small -qQ)
+    return sendBcastSingly(sendingtso, receivers, data);
+  }
+
+  // PEs and spanning tree, the same as the receivers compute them
+  t = packedData->buffer + words - trailer; // scratch space for now
+  for (i = 0; i < receivers->count; i++) {
+    t[3*i] = receivers->ports[i].machine;
+  }
+  npes = bcastPEs(t, receivers->count, thisPE, pes);
+  if (fanout == 0 || fanout > npes) {
+    fanout = npes; // the root sends to all PEs
+  }
+  nchildren = bcastChildren(0, fanout, pes, npes, children);
+
+  // destinations congested: block before packing until the PE can take
+  // data again, as in sendWrapper_. Batched messages go first, to keep
+  // the order.
+  for (i = 0; i < nchildren; i++) {
+    if (!sendReady(children[i]) || !flushBatch(children[i])) {
+      IF_PAR_DEBUG(mpcomm,
+                   debugBelch("sendBcast: PE %d congested\n",
+                              (int) children[i]));
+      return blockOnSendGate(sendingtso, children[i])
+             ? MSG_BLOCKED : MSG_FAILED;
+    }
+  }
+
+  size = packToBuffer(data, packedData->buffer, words - trailer,
+                      sendingtso, &unpackedSize);
+  if (isPackError(size)) {
+    switch (size) {
+    case P_BLACKHOLE:
+      return MSG_BLOCKED;
+    case P_NOBUFFER:
+      // too large for one packet, send it to each receiver on its own
+      return sendBcastSingly(sendingtso, receivers, data);
+    default:
+      stg_exit(EXIT_FAILURE);
+    }
+  }
+  words = (size - P_ERRCODEMAX) / sizeof(StgWord);
+
+  // append the receivers
+  t = packedData->buffer + words;
+  for (i = 0; i < receivers->count; i++) {
+    *t++ = receivers->ports[i].machine;
+    *t++ = receivers->ports[i].process;
+    *t++ = receivers->ports[i].id;
+  }
+  *t++ = words;
+  *t++ = receivers->count;
+  *t++ = fanout;
+
+  packedData->sender = sender;
+  packedData->receiver = NoPort; // receivers are in the packet
+  packedData->id = 0;
+  packedData->size = words + trailer;
+  packedData->unpacked_size = unpackedSize;
+  packedData->runQueueLength = currentRunQueueLength();
+  packedData->heapLive = stat_liveKBytes();
+  packedData->format = PACKET_PLAIN; // broadcasts are never encoded
+  packedData->encodedSize = 0;
+  packedData->compressedSize = 0;
+
+  length = sizeof(rtsPackBuffer) + packedData->size * sizeof(StgWord);
+  sent = MP_bcast(children, nchildren, PP_BCAST, (StgWord8*) packedData,
+                  length);
+  stat_sentMsgs(sent, (uint64_t) sent * length);
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("broadcast of %d words to %d receivers on %d PEs "
+                          "(fan-out %d), sent to %d of %d\n", words,
+                          receivers->count, npes, fanout, sent, nchildren));
+
+  // keep the receivers whose PE is not below one which got the packet
+  packedData->size = words;
+  for (i = 0, j = 0; i < receivers->count; i++) {
+    pos = bcastPosition(receivers->ports[i].machine, pes, npes);
+    while (pos > fanout) {
+      pos = (pos - 1) / fanout;
+    }
+    if (pos <= sent) {
+      // edentrace: emit event sendMessage(tag,dataBuffer)
+      packedData->receiver = receivers->ports[i];
+      traceSendMessageEvent(PP_DATA, packedData);
+    } else {
+      receivers->ports[j++] = receivers->ports[i];
+    }
+  }
+  receivers->count = j;
+  if (receivers->count == 0) {
+    clearBcastReceivers(sendingtso);
+    return MSG_OK;
+  }
+  // the rest goes when the first PE which refused is ready again
+  return blockOnSendGate(sendingtso, children[sent])
+         ? MSG_BLOCKED : MSG_FAILED;
+}
+
+// broadcast packets which could not be relayed yet, in order
+typedef struct BcastRelay_ {
+  struct BcastRelay_ *next;
+  rtsPackBuffer      *msg;    // copy of the packet
+  uint32_t            length; // in bytes
+  uint32_t            count;  // PEs still to send it to
+  PEId                pes[MAX_PES];
+} BcastRelay;
+
+static BcastRelay *relays = NULL, *relaysLast = NULL;
+
+// relay packets kept before, false if one could not be sent (yet)
+static bool flushRelays(void) {
+  BcastRelay *relay;
+  uint32_t sent;
+
+  while ((relay = relays) != NULL) {
+    sent = MP_bcast(relay->pes, relay->count, PP_BCAST,
+                    (StgWord8*) relay->msg, relay->length);
+    stat_sentMsgs(sent, (uint64_t) sent * relay->length);
+    relay->count -= sent;
+    memmove(relay->pes, relay->pes + sent, relay->count * sizeof(PEId));
+    if (relay->count > 0) {
+      return false;
+    }
+    relays = relay->next;
+    if (relays == NULL) {
+      relaysLast = NULL;
+    }
+    stgFree(relay->msg);
+    stgFree(relay);
+  }
+  return true;
+}
+
+// drop packets which were not relayed (at shutdown)
+static void freeRelays(void) {
+  BcastRelay *relay;
+
+  while ((relay = relays) != NULL) {
+    relays = relay->next;
+    stgFree(relay->msg);
+    stgFree(relay);
+  }
+  relaysLast = NULL;
+}
+
+// receive a broadcast: relay it, then update the local receivers'
+// inports with one copy of the graph. Declared in Parallel.h
+void processBcastMsg(Capability *cap, rtsPackBuffer *msg) {
+  PEId pes[MAX_PES], children[MAX_PES];
+  uint32_t npes, nchildren, sent, words, count, fanout, length, i;
+  StgWord *t, *ports;
+  StgClosure *graph = NULL, *placeholder;
+  Inport *inport;
+  Port receiver;
+
+  ASSERT(msg->size >= BCAST_TRAILER);
+  length = sizeof(rtsPackBuffer) + msg->size * sizeof(StgWord);
+  t = msg->buffer + msg->size - BCAST_TRAILER;
+  words  = t[0];
+  count  = t[1];
+  fanout = t[2];
+  ports  = msg->buffer + words;
+  ASSERT(words + 3 * count + BCAST_TRAILER == (StgWord) msg->size);
+
+  // relay first, other PEs should not wait for our unpacking
+  npes = bcastPEs(ports, count, msg->sender.machine, pes);
+  nchildren = bcastChildren(bcastPosition(thisPE, pes, npes), fanout,
+                            pes, npes, children);
+  if (nchildren > 0) {
+    // it is our load the PEs see
+    msg->runQueueLength = currentRunQueueLength();
+    msg->heapLive = stat_liveKBytes();
+    sent = (relays == NULL)
+           ? MP_bcast(children, nchildren, PP_BCAST, (StgWord8*) msg, length)
+           : 0;
+    stat_sentMsgs(sent, (uint64_t) sent * length);
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("relayed broadcast to %d of %d PEs\n",
+                            sent, nchildren));
+    if (sent < nchildren) {
+      BcastRelay *relay = (BcastRelay*)
+        stgMallocBytes(sizeof(BcastRelay), "processBcastMsg");
+      relay->msg = (rtsPackBuffer*) stgMallocBytes(length, "processBcastMsg");
+      memcpy(relay->msg, msg, length);
+      relay->length = length;
+      relay->count = nchildren - sent;
+      memcpy(relay->pes, children + sent, relay->count * sizeof(PEId));
+      relay->next = NULL;
+      if (relaysLast == NULL) {
+        relays = relay;
+      } else {
+        relaysLast->next = relay;
+      }
+      relaysLast = relay;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    receiver = (Port) { (PEId) ports[3*i], ports[3*i+1], ports[3*i+2] };
+    if (receiver.machine != thisPE) {
+      continue;
+    }
+    inport = findInportByP(receiver);
+    if (inport == NULL) {
+      IF_PAR_DEBUG(ports,
+                   errorBelch("broadcast to unknown inport: Port (%d,%"
+                              FMT_Word ",%" FMT_Word ")\n",
+                              receiver.machine, receiver.process,
+                              receiver.id));
+      continue;
+    }
+    if (graph == NULL) {
+      // unpack once, only the graph (receivers are behind it)
+      msg->size = words;
+      graph = unpackGraph(msg, cap);
+    }
+    placeholder = inport->closure;
+    ASSERT(isBlackhole(placeholder));
+    removeInportByP(receiver);
+
+    // edentrace: write event iff message is accepted
+    msg->receiver = receiver;
+    traceReceiveMessageEvent(cap, PP_DATA, msg);
+
+    // use system tso as owner when waking up blocked threads
+    updateThunk(cap, (StgTSO*) &stg_system_tso, placeholder, graph);
+  }
+}
+
+/* Messages in parts: PP_PART
+ *   Graphs which do not fit into the pack buffer are packed in chunks
+ *   (Pack.c::packToBufferChunked) and sent as PP_PART messages, numbered
+ *   from 1 in the id field. The final message (PP_DATA, PP_HEAD or
+ *   PP_RFORK) carries the number of parts sent before it.
+ *
+ *   The receiver collects the parts until the final message arrives,
+ *   per inport for data messages, and per sending PE for rFork messages
+ *   (sent to the RTS port, which has no inport). A sender which blocks
+ *   on a blackhole starts over with part 1, which discards what was
+ *   collected so far.
+ *
+ *   Data messages for unknown (or closed) inports are dropped, but with
+ *   the sharing cache (-qC) their packet still defines closures which
+ *   later messages refer to. Their parts are collected per sending PE
+ *   (lostParts), unpacked with the final message and freed, see
+ *   processLostDataMsg. Parts whose start went with a closed inport are
+ *   dropped.
+ */
+
+// where the parts for this message are collected (NULL if they are
+// dropped: unknown inport, without sharing cache)
+static PendingParts** pendingPartsFor(rtsPackBuffer *msg) {
+  Inport *inport;
+
+  ASSERT(msg->sender.machine > 0 && msg->sender.machine <= MAX_PES);
+  if (isRtsPort(msg->receiver)) {
+    return &rforkParts[msg->sender.machine - 1];
+  }
+  inport = findInportByP(msg->receiver);
+  if (inport != NULL) {
+    return &(inport->pending);
+  }
+  return (RtsFlags.ParFlags.sharingSlots > 0)
+         ? &lostParts[msg->sender.machine - 1] : NULL;
+}
+
+// free collected parts, declared in RTTables.h (inports are freed there)
+void freePendingParts(PendingParts *pending) {
+  stgFree(pending->msg);
+  stgFree(pending);
+}
+
+// append the payload of a message to the collected data
+static void appendPart(PendingParts *pending, rtsPackBuffer *msg) {
+  StgWord needed = pending->msg->size + msg->size;
+
+  if (needed > pending->capacity) {
+    while (needed > pending->capacity) {
+      pending->capacity *= 2;
+    }
+    pending->msg = (rtsPackBuffer*)
+      stgReallocBytes(pending->msg, sizeof(rtsPackBuffer)
+                      + pending->capacity * sizeof(StgWord), "appendPart");
+  }
+  memcpy(pending->msg->buffer + pending->msg->size, msg->buffer,
+         msg->size * sizeof(StgWord));
+  pending->msg->size = needed;
+  pending->parts++;
+}
+
+// collect a PP_PART message. Declared in Parallel.h
+void processPartMsg(rtsPackBuffer *part) {
+  PendingParts **pendingP, *pending;
+
+  IF_PAR_DEBUG(pack,
+               debugBelch("Received part %" FMT_Int " (%" FMT_Int
+                          " words) from PE %d\n",
+                          part->id, part->size, part->sender.machine));
+
+  pendingP = pendingPartsFor(part);
+  if (pendingP == NULL) {
+    IF_PAR_DEBUG(ports,
+                 errorBelch("part for unknown inport: Port (%d,%"
+                            FMT_Word ",%" FMT_Word ")\n",
+                            part->receiver.machine,
+                            part->receiver.process,
+                            part->receiver.id));
+    // ignore it, as processDataMsg will ignore the final message
+    return;
+  }
+
+  if (part->id != 1 && *pendingP == NULL
+      && pendingP == &lostParts[part->sender.machine - 1]) {
+    // the first parts went with an inport which was closed since
+    return;
+  }
+
+  if (part->id == 1 && *pendingP != NULL) {
+    // sender started over, drop what we have collected
+    freePendingParts(*pendingP);
+    *pendingP = NULL;
+  }
+
+  if (*pendingP == NULL) {
+    ASSERT(part->id == 1);
+    pending = (PendingParts*) stgMallocBytes(sizeof(PendingParts),
+                                             "processPartMsg");
+    pending->parts = 0;
+    pending->capacity = 2 * part->size;
+    pending->msg = (rtsPackBuffer*)
+      stgMallocBytes(sizeof(rtsPackBuffer)
+                     + pending->capacity * sizeof(StgWord), "processPartMsg");
+    *(pending->msg) = *part; // header only
+    pending->msg->size = 0;
+    *pendingP = pending;
+  }
+
+  ASSERT(part->id == (*pendingP)->parts + 1);
+  appendPart(*pendingP, part);
+}
+
+// join collected parts with the final message. Returns msg itself when it
+// was not preceded by parts, otherwise a new buffer (to be freed by the
+// caller) with the complete packet. Declared in Parallel.h
+rtsPackBuffer* joinParts(rtsPackBuffer *msg) {
+  PendingParts **pendingP, *pending;
+  rtsPackBuffer *joined;
+
+  pendingP = pendingPartsFor(msg);
+  if (pendingP == NULL || *pendingP == NULL) {
+    ASSERT(msg->id == 0);
+    return msg;
+  }
+
+  pending = *pendingP;
+  *pendingP = NULL;
+
+  if (msg->id == 0) {
+    // left over from a message which was started over, then sent whole
+    freePendingParts(pending);
+    return msg;
+  }
+  if (msg->id != pending->parts) {
+    barf("joinParts: message in %" FMT_Int " parts, %" FMT_Int " received",
+         msg->id, pending->parts);
+  }
+
+  appendPart(pending, msg);
+  joined = pending->msg;
+  stgFree(pending);
+  // the heap size of the graph is known when packing has finished
+  joined->unpacked_size = msg->unpacked_size;
+
+  IF_PAR_DEBUG(pack,
+               debugBelch("Joined %" FMT_Int " parts and final message, "
+                          "%" FMT_Int " words\n", msg->id, joined->size));
+  return joined;
+}
+
+/* Work stealing: PP_FISH, PP_NOWORK
+ *   With -qF, received rFork messages are not unpacked right away, but
+ *   held (still packed) in a queue. The scheduler starts the newest of
+ *   them only when its run queue is empty. An idle PE without held
+ *   processes sends a PP_FISH to another PE, which forwards its oldest
+ *   held process as a PP_RFORK, or answers PP_NOWORK. After PP_NOWORK,
+ *   the next PE is asked, until all have been asked (since the last
+ *   process was received). A PE which answered PP_NOWORK remembers
+ *   the fisher as hungry, and forwards the next held process to it.
+ *
+ *   Only processes which fit into one message are held, so they can
+ *   be forwarded as they are. Larger ones are started right away.
+ */
+typedef struct HeldProcesses_ {
+  rtsPackBuffer **msgs;     // circular buffer, oldest at first
+  uint32_t        first;
+  uint32_t        count;
+  uint32_t        capacity;
+} HeldProcesses;
+
+static HeldProcesses held;
+
+static bool     fishOut;    // our PP_FISH was not answered yet
+static PEId     fishTarget; // PE to ask next
+static uint32_t fishedPEs;  // PEs without work since we received one
+
+static bool     hungry[MAX_PES];     // answered PP_NOWORK, feed it
+static bool     noWorkDue[MAX_PES];  // sending PP_NOWORK failed, retry
+static uint32_t hungryPEs;           // PEs with either flag set
+
+// set or clear one of the flags above for pe, counting the PE in
+// hungryPEs once (whichever flags it has)
+static void setFeedFlag(bool *flags, PEId pe, bool value) {
+  bool before = hungry[pe-1] || noWorkDue[pe-1];
+  bool after;
+
+  flags[pe-1] = value;
+  after = hungry[pe-1] || noWorkDue[pe-1];
+  if (after && !before) {
+    hungryPEs++;
+  } else if (before && !after) {
+    hungryPEs--;
+  }
+}
+
+uint32_t heldProcessCount(void) {
+  return held.count;
+}
+
+// send a message without payload to the RTS port of pe
+static bool sendEmptyMsg(OpCode tag, PEId pe) {
+  rtsPackBuffer msg;
+
+  msg.sender = (Port) {thisPE, 0, 0};
+  msg.receiver = (Port) {pe, 0, 0};
+  msg.id = 0;
+  msg.size = 0;
+  msg.unpacked_size = 0;
+  return sendMsg(tag, &msg);
+}
+
+// forward the oldest held process to pe, false if sending failed
+static bool forwardHeldProcess(PEId pe) {
+  rtsPackBuffer *msg = held.msgs[held.first];
+
+  ASSERT(held.count > 0);
+
+  // it is our process now (sendMsg checks the sender)
+  msg->sender = (Port) {thisPE, 0, 0};
+  msg->receiver = (Port) {pe, 0, 0};
+  if (!sendMsg(PP_RFORK, msg)) {
+    return false;
+  }
+  IF_PAR_DEBUG(procs,
+               debugBelch("forwarded a process (%" FMT_Int " words) to PE %d\n",
+                          msg->size, pe));
+  stgFree(msg);
+  held.first = (held.first + 1) % held.capacity;
+  held.count--;
+  return true;
+}
+
+// keep a received process (copying it) instead of starting it, unless
+// work stealing is off or it is too large. Receiving a process ends
+// fishing. Declared in Parallel.h
+bool holdProcess(rtsPackBuffer *msg) {
+  rtsPackBuffer *copy;
+  rtsPackBuffer **msgs;
+  uint32_t size, i;
+
+  fishOut = false;
+  fishedPEs = 0;
+
+  if (!RtsFlags.ParFlags.stealing || nPEs == 1
+      || msg->size * sizeof(StgWord) > RtsFlags.ParFlags.packBufferSize) {
+    return false;
+  }
+
+  if (held.count == held.capacity) {
+    msgs = (rtsPackBuffer**)
+      stgMallocBytes((held.capacity == 0 ? 16 : 2 * held.capacity)
+                     * sizeof(rtsPackBuffer*), "holdProcess");
+    for (i = 0; i < held.count; i++) {
+      msgs[i] = held.msgs[(held.first + i) % held.capacity];
+    }
+    if (held.msgs != NULL) {
+      stgFree(held.msgs);
+    }
+    held.msgs = msgs;
+    held.first = 0;
+    held.capacity = (held.capacity == 0 ? 16 : 2 * held.capacity);
+  }
+
+  size = sizeof(rtsPackBuffer) + msg->size * sizeof(StgWord);
+  copy = (rtsPackBuffer*) stgMallocBytes(size, "holdProcess");
+  memcpy(copy, msg, size);
+  held.msgs[(held.first + held.count) % held.capacity] = copy;
+  held.count++;
+
+  IF_PAR_DEBUG(procs,
+               debugBelch("holding a process (%" FMT_Int " words), "
+                          "%d held\n", msg->size, held.count));
+  return true;
+}
+
+// the newest held process (to be unpacked and freed by the caller), or
+// NULL if there is none. Declared in Parallel.h
+rtsPackBuffer* takeHeldProcess(void) {
+  if (held.count == 0) {
+    return NULL;
+  }
+  held.count--;
+  return held.msgs[(held.first + held.count) % held.capacity];
+}
+
+// ask the next PE for a process, unless we are waiting for an answer
+// or have asked all of them. Declared in Parallel.h
+void fishForWork(void) {
+  if (!RtsFlags.ParFlags.stealing || nPEs == 1
+      || fishOut || fishedPEs >= nPEs - 1) {
+    return;
+  }
+
+  if (fishTarget == 0 || fishTarget == thisPE) {
+    fishTarget = (thisPE >= nPEs) ? 1 : (thisPE + 1);
+  }
+  if (sendEmptyMsg(PP_FISH, fishTarget)) {
+    IF_PAR_DEBUG(procs,
+                 debugBelch("fishing for work at PE %d\n", fishTarget));
+    fishOut = true;
+    do {
+      fishTarget = (fishTarget >= nPEs) ? 1 : (fishTarget + 1);
+    } while (fishTarget == thisPE);
+  }
+}
+
+// forward held processes to hungry PEs, and retry failed PP_NOWORK
+// answers. Declared in Parallel.h
+void feedHungryPEs(void) {
+  PEId pe;
+
+  if (hungryPEs == 0) {
+    return;
+  }
+  for (pe = 1; pe <= nPEs; pe++) {
+    if (noWorkDue[pe-1] && sendEmptyMsg(PP_NOWORK, pe)) {
+      setFeedFlag(noWorkDue, pe, false);
+    }
+    if (hungry[pe-1] && held.count > 0 && forwardHeldProcess(pe)) {
+      setFeedFlag(hungry, pe, false);
+    }
+  }
+}
+
+// answer a PP_FISH. Declared in Parallel.h
+void processFishMsg(PEId fisher) {
+  ASSERT(fisher > 0 && fisher <= nPEs);
+
+  if (held.count > 0 && forwardHeldProcess(fisher)) {
+    return;
+  }
+  setFeedFlag(hungry, fisher, true);
+  if (!noWorkDue[fisher-1] && !sendEmptyMsg(PP_NOWORK, fisher)) {
+    setFeedFlag(noWorkDue, fisher, true);
+  }
+}
+
+// our PP_FISH was answered without work. Declared in Parallel.h
+void processNoWorkMsg(PEId pe STG_UNUSED) {
+  fishOut = false;
+  fishedPEs++;
+}
+
+// drop held processes (at shutdown)
+static void freeHeldProcesses(void) {
+  while (held.count > 0) {
+    stgFree(takeHeldProcess());
+  }
+  if (held.msgs != NULL) {
+    stgFree(held.msgs);
+    held.msgs = NULL;
+  }
+  held.capacity = 0;
+  held.first = 0;
+}
+
+/* Communication statistics: PP_STATS
+ *   Before shutdown, the main PE sends an empty PP_STATS to all other
+ *   PEs (requestPEStats, see collectPEStats in Schedule.c). They answer
+ *   with a PP_STATS containing their counters (a ParStats, Stats.h),
+ *   which the main PE passes on to Stats.c for the +RTS -s summary.
+ *   Answers are not batched. Sending is retried by flushSendBatches when
+ *   it fails.
+ */
+static bool     statsDue[MAX_PES]; // PP_STATS to send to this PE
+static uint32_t statsDuePEs;       // PEs with the flag set
+static uint32_t statsMissing;      // main PE: answers not received yet
+
+#define STATS_WORDS ROUNDUP_BYTES_TO_WDS(sizeof(ParStats))
+
+// send a PP_STATS to pe, a request from the main PE or an answer with
+// our counters. False if sending failed.
+static bool sendStatsMsg(PEId pe) {
+  StgWord data[sizeofW(rtsPackBuffer) + STATS_WORDS];
+  rtsPackBuffer *msg = (rtsPackBuffer*) data;
+  ParStats stats;
+
+  msg->sender = (Port) {thisPE, 0, 0};
+  msg->receiver = (Port) {pe, 0, 0};
+  msg->id = 0;
+  msg->size = 0;
+  msg->unpacked_size = 0;
+  if (!IAmMainThread) {
+    stat_getParStats(&stats);
+    memcpy(msg->buffer, &stats, sizeof(ParStats));
+    msg->size = STATS_WORDS;
+  }
+  if (!sendMsg(PP_STATS, msg)) {
+    return false;
+  }
+  flushBatch(pe); // kept for flushSendBatches if it fails
+  return true;
+}
+
+// send PP_STATS messages which are due
+static void sendStatsMsgs(void) {
+  PEId pe;
+
+  if (statsDuePEs == 0) {
+    return;
+  }
+  for (pe = 1; pe <= nPEs; pe++) {
+    if (statsDue[pe-1] && sendStatsMsg(pe)) {
+      statsDue[pe-1] = false;
+      statsDuePEs--;
+    }
+  }
+}
+
+// main PE: ask all other PEs for their counters. Declared in Parallel.h
+void requestPEStats(void) {
+  PEId pe;
+
+  ASSERT(IAmMainThread);
+  statsMissing = nPEs - 1;
+  for (pe = 2; pe <= nPEs; pe++) {
+    if (!statsDue[pe-1]) {
+      statsDue[pe-1] = true;
+      statsDuePEs++;
+    }
+  }
+  sendStatsMsgs();
+}
+
+// main PE: PEs which have not answered yet. Declared in Parallel.h
+uint32_t missingPEStats(void) {
+  return statsMissing;
+}
+
+// a request (other PEs) or an answer (main PE). Declared in Parallel.h
+void processStatsMsg(PEId pe, rtsPackBuffer *msg) {
+  ParStats stats;
+
+  if (IAmMainThread) {
+    if (statsMissing > 0 &&
+        (StgWord) msg->size * sizeof(StgWord) >= sizeof(ParStats)) {
+      memcpy(&stats, msg->buffer, sizeof(ParStats));
+      stat_setPEStats(pe, &stats);
+      statsMissing--;
+    }
+    return;
+  }
+  if (!statsDue[pe-1]) {
+    statsDue[pe-1] = true;
+    statsDuePEs++;
+  }
+  sendStatsMsgs();
+}
+
+/* Streamed eventlogs: PP_EVENTLOG (-qT)
+ *   Other PEs send their eventlog to the main PE instead of writing a
+ *   file (see StreamEventLogWriter in EventLogWriter.c). The writer only
+ *   queues the data, which is sent from flushSendBatches after all other
+ *   messages: one message per call, all of it when forced (the scheduler
+ *   is about to block). A message carries the sender's time base and at
+ *   most packBufferSize bytes of eventlog data.
+ *   At shutdown, the main PE sends an empty PP_EVENTLOG to all other PEs
+ *   (requestPETraces, see collectPETraces in Schedule.c). They end their
+ *   eventlog from the scheduler (see endEventLogStream), and the rest of
+ *   it is sent, up to the end marker.
+ */
+typedef struct EventLogData_ {
+  struct EventLogData_ *next;
+  size_t   size;
+  size_t   sent;    // bytes sent already
+  StgWord8 data[];
+} EventLogData;
+
+// the payload of a PP_EVENTLOG with data, followed by the data
+typedef struct EventLogHeader_ {
+  StgWord64 timeBase; // sender's time 0, in ns since the epoch
+  StgWord64 size;     // bytes of eventlog data
+} EventLogHeader;
+
+static EventLogData  *eventLogFirst, *eventLogLast;
+static rtsPackBuffer *eventLogMsg;        // allocated on first use
+static bool           eventLogEndRequest; // main PE asked us to end it
+static bool           traceEndDue[MAX_PES]; // main PE: request to send
+static uint32_t       traceEndDuePEs;
+
+// queue eventlog data for the main PE (copied). Declared in Parallel.h
+void queueEventLogData(void *data, size_t size) {
+  EventLogData *d;
+
+  d = stgMallocBytes(sizeof(EventLogData) + size, "queueEventLogData");
+  d->next = NULL;
+  d->size = size;
+  d->sent = 0;
+  memcpy(d->data, data, size);
+
+  ACQUIRE_LOCK(&eventLogMutex);
+  if (eventLogLast == NULL) {
+    eventLogFirst = d;
+  } else {
+    eventLogLast->next = d;
+  }
+  eventLogLast = d;
+  RELEASE_LOCK(&eventLogMutex);
+}
+
+// send the next message of queued eventlog data, false if sending failed
+static bool sendEventLogData(EventLogData *d) {
+  EventLogHeader hdr;
+  size_t size;
+
+  if (eventLogMsg == NULL) {
+    eventLogMsg = stgMallocBytes(sizeof(rtsPackBuffer)
+                                 + RtsFlags.ParFlags.packBufferSize,
+                                 "sendEventLogData");
+  }
+  size = d->size - d->sent;
+  if (size > RtsFlags.ParFlags.packBufferSize - sizeof(EventLogHeader)) {
+    size = RtsFlags.ParFlags.packBufferSize - sizeof(EventLogHeader);
+  }
+
+  eventLogMsg->sender = (Port) {thisPE, 0, 0};
+  eventLogMsg->receiver = (Port) {1, 0, 0};
+  eventLogMsg->id = 0;
+  eventLogMsg->unpacked_size = 0;
+#if defined(TRACING)
+  hdr.timeBase = eventLogTimeBase();
+#else
+  hdr.timeBase = 0;
+#endif
+  hdr.size = size;
+  memcpy(eventLogMsg->buffer, &hdr, sizeof(EventLogHeader));
+  memcpy((StgWord8*) eventLogMsg->buffer + sizeof(EventLogHeader),
+         d->data + d->sent, size);
+  eventLogMsg->size = ROUNDUP_BYTES_TO_WDS(sizeof(EventLogHeader) + size);
+  if (!sendMsg(PP_EVENTLOG, eventLogMsg)) {
+    return false;
+  }
+  d->sent += size;
+  return true;
+}
+
+// send requests (main PE) or queued eventlog data (other PEs), one
+// message unless all is set. False if sending failed.
+static bool sendEventLogMsgs(bool all) {
+  EventLogData *d;
+  PEId pe;
+
+  if (IAmMainThread) {
+    for (pe = 2; traceEndDuePEs > 0 && pe <= nPEs; pe++) {
+      if (traceEndDue[pe-1] && sendEmptyMsg(PP_EVENTLOG, pe)) {
+        flushBatch(pe);
+        traceEndDue[pe-1] = false;
+        traceEndDuePEs--;
+      }
+    }
+    return traceEndDuePEs == 0;
+  }
+
+  do {
+    // the queue may grow while we send (but we are the only one taking
+    // data out of it)
+    ACQUIRE_LOCK(&eventLogMutex);
+    d = eventLogFirst;
+    RELEASE_LOCK(&eventLogMutex);
+    if (d == NULL) {
+      return true;
+    }
+    if (!sendEventLogData(d)) {
+      return false;
+    }
+    if (d->sent == d->size) {
+      ACQUIRE_LOCK(&eventLogMutex);
+      eventLogFirst = d->next;
+      if (eventLogFirst == NULL) {
+        eventLogLast = NULL;
+      }
+      RELEASE_LOCK(&eventLogMutex);
+      stgFree(d);
+    }
+  } while (all);
+  return true;
+}
+
+// drop unsent eventlog data (at shutdown)
+static void freeEventLogData(void) {
+  EventLogData *d;
+
+  while (eventLogFirst != NULL) {
+    d = eventLogFirst;
+    eventLogFirst = d->next;
+    stgFree(d);
+  }
+  eventLogLast = NULL;
+  if (eventLogMsg != NULL) {
+    stgFree(eventLogMsg);
+    eventLogMsg = NULL;
+  }
+}
+
+// main PE: ask all other PEs to end their eventlog. Declared in Parallel.h
+void requestPETraces(void) {
+  PEId pe;
+
+  ASSERT(IAmMainThread);
+  for (pe = 2; pe <= nPEs; pe++) {
+    if (!traceEndDue[pe-1]) {
+      traceEndDue[pe-1] = true;
+      traceEndDuePEs++;
+    }
+  }
+  sendEventLogMsgs(true);
+}
+
+// main PE: PEs whose eventlog has not ended yet. Declared in Parallel.h
+uint32_t missingPETraces(void) {
+  uint32_t n = 0;
+#if defined(TRACING)
+  PEId pe;
+
+  for (pe = 2; pe <= nPEs; pe++) {
+    if (!streamedEventLogEnded(pe)) {
+      n++;
+    }
+  }
+#endif
+  return n;
+}
+
+// main PE: stop waiting for the eventlog of PEs which did not end it, the
+// merged eventlog ends with what has arrived. Declared in Parallel.h
+void abandonPETraces(void) {
+#if defined(TRACING)
+  PEId pe;
+
+  for (pe = 2; pe <= nPEs; pe++) {
+    if (!streamedEventLogEnded(pe)) {
+      abandonStreamedEventLog(pe);
+    }
+  }
+#endif
+}
+
+// other PEs: whether the main PE asked us to end our eventlog (once).
+// Declared in Parallel.h
+bool takeEventLogEndRequest(void) {
+  bool request = eventLogEndRequest;
+
+  eventLogEndRequest = false;
+  return request;
+}
+
+// eventlog data (main PE) or a request to end it (other PEs). Declared
+// in Parallel.h
+void processEventLogMsg(PEId pe, rtsPackBuffer *msg) {
+  EventLogHeader hdr;
+  size_t size = (StgWord) msg->size * sizeof(StgWord);
+
+  if (!IAmMainThread) {
+    eventLogEndRequest = true;
+    return;
+  }
+  if (size < sizeof(EventLogHeader)) {
+    return;
+  }
+  memcpy(&hdr, msg->buffer, sizeof(EventLogHeader));
+  if (hdr.size > size - sizeof(EventLogHeader)) {
+    errorBelch("garbled eventlog data from PE %d", pe);
+    return;
+  }
+#if defined(TRACING)
+  writeStreamedEventLog(pe, hdr.timeBase,
+                        (StgWord8*) msg->buffer + sizeof(EventLogHeader),
+                        hdr.size);
+#endif
+}
+
+/* Remote references: PP_VALUE (-qL)
+ *   With -qL, a data message does not wait for blackholes (thunks under
+ *   evaluation) in its graph: the receiver gets a placeholder for each,
+ *   and its value when the blackhole has been updated (see Pack.c,
+ *   PackRemoteRef). The scheduler polls the blackholes (sendRemoteValues)
+ *   and sends each value to the RTS port of the receiving PE, with the
+ *   reference number in the id of the sender port. Values are packed for
+ *   that PE again (they may contain blackholes themselves), and sent in
+ *   parts if they do not fit into the pack buffer. Messages between two
+ *   PEs arrive in order, so the placeholder is known when its value
+ *   arrives. Process creation and broadcasts still block on blackholes.
+ */
+
+// pack and send the value of reference id to dest. False if this failed
+// (tried again later)
+static bool sendRemoteValue(StgClosure *value, PEId dest, StgWord id) {
+  rtsPackBuffer *packedData = globalPackBuffer;
+  uint32_t size, unpackedSize;
+  bool sent;
+
+  if (!MP_send_ready(dest)) {
+    return false;
+  }
+
+  packedData->sender = (Port) {thisPE, 0, id};
+  packedData->receiver = (Port) {dest, 0, 0};
+  packedData->id = 0;
+  packedData->unpacked_size = 0;
+  packSegments.count = 0;
+  size = packToBufferChunked(value, packedData->buffer,
+                             RtsFlags.ParFlags.packBufferSize
+                             / sizeof(StgWord),
+                             NULL, sendPart, packedData, dest,
+                             &packSegments, &unpackedSize);
+  if (isPackError(size)) {
+    if (size != P_NOBUFFER) {
+      // the value cannot be packed, the placeholder is never updated
+      errorBelch("value of remote reference %" FMT_Word " to PE %d "
+                 "cannot be sent (error %d)", id, (int) dest, (int) size);
+      return true;
+    }
+    return false;
+  }
+
+  packedData->size = (size - P_ERRCODEMAX) / sizeof(StgWord);
+  packedData->unpacked_size = unpackedSize;
+  sent = sendMsg_(PP_VALUE, packedData, &packSegments, true);
+  commitSharing(dest, sent);
+  commitRemoteRefs(sent);
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("sending value of remote reference %" FMT_Word
+                          " to PE %d: %s\n", id, (int) dest,
+                          sent ? "sent" : "failed"));
+  return sent;
+}
+
+// send the values of updated blackholes which went out as placeholders.
+// The caller holds a capability. Declared in Parallel.h
+void sendRemoteValues(void) {
+  StgClosure *value;
+  PEId dest;
+  StgWord id;
+  uint32_t i = 0;
+
+  ACQUIRE_PAR_LOCK();
+  // sending adds new references (at the end) when values contain
+  // blackholes, a removed one is replaced by the last
+  while (i < outstandingRemoteRefs()) {
+    value = remoteRefValue(i, &dest, &id);
+    if (value != NULL && sendRemoteValue(value, dest, id)) {
+      removeRemoteRef(i);
+    } else {
+      i++;
+    }
+  }
+  RELEASE_PAR_LOCK();
+}
+
+// the value for a placeholder: unpack it and update the placeholder.
+// Declared in Parallel.h
+void processValueMsg(Capability *cap, rtsPackBuffer *msg) {
+  rtsPackBuffer *packet;
+  StgClosure *graph, *placeholder;
+
+  // join with parts received before (if any)
+  packet = joinParts(msg);
+  placeholder = takePlaceholder(msg->sender.machine, msg->sender.id);
+
+  // unpacked in any case, the packet may define sharing cache slots
+  graph = unpackGraph(packet, cap);
+  if (placeholder == NULL) {
+    IF_PAR_DEBUG(ports,
+                 errorBelch("value for unknown remote reference %" FMT_Word
+                            " of PE %d\n", msg->sender.id,
+                            (int) msg->sender.machine));
+  } else {
+    ASSERT(isBlackhole(placeholder));
+    // edentrace: write event iff message is accepted
+    traceReceiveMessageEvent(cap, PP_VALUE, packet);
+    // use system tso as owner when waking up blocked threads
+    updateThunk(cap, (StgTSO*) &stg_system_tso, placeholder, graph);
+  }
+  if (packet != msg) {
+    stgFree(packet);
+  }
+}
+
+// a data message for an unknown (or closed) inport: the packet may define
+// closures of the sharing cache (-qC), which later messages refer to, so
+// it is unpacked (joined with its parts, see PP_PART) and dropped
+static void processLostDataMsg(Capability *cap, rtsPackBuffer *msg) {
+  PendingParts **pendingP, *pending;
+  rtsPackBuffer *packet;
+
+  pendingP = pendingPartsFor(msg);
+  if (pendingP == NULL) {
+    return;
+  }
+  pending = *pendingP;
+  if (msg->id != 0 && (pending == NULL || pending->parts != msg->id)) {
+    // the first parts went with the inport, the packet is incomplete
+    if (pending != NULL) {
+      freePendingParts(pending);
+      *pendingP = NULL;
+    }
+    return;
+  }
+
+  packet = joinParts(msg); // frees collected parts not used
+  if (packet->size > 0) {
+    unpackGraph(packet, cap);
+  }
+  if (packet != msg) {
+    stgFree(packet);
+  }
+}
+
+/* Heap Data Messages: Data, Head, Constr
+ *   contains a subgraph. Receiving triggers a new process which
+ *   evaluates the sent subgraph (see Schedule.c::processMessages)
+ *
+ *   Sending is triggered by a primitive operation.
+ */
+void
+processDataMsg(Capability * cap, OpCode tag, rtsPackBuffer *gumPackBuffer) {
+  StgClosure *graph;
+  Inport* inport;
+  StgClosure *placeholder;
+  rtsPackBuffer *packet;
+
+  IF_PAR_DEBUG(pack,
+               debugBelch("Processing data message (%s, tag %#0x)\n",
+                          getOpName(tag), tag));
+
+  ASSERT(gumPackBuffer->receiver.process != 0);
+  inport = findInportByP(gumPackBuffer->receiver);
 
   if (inport == NULL) {
     IF_PAR_DEBUG(ports,
@@ -370,7 +2474,8 @@ processDataMsg(Capability * cap, OpCode tag, rtsPackBuffer *gumPackBuffer) {
                             gumPackBuffer->receiver.machine,
                             gumPackBuffer->receiver.process,
                             gumPackBuffer->receiver.id));
-    // just ignore the message... (shrug)
+    // ignore the message, except for the sharing cache
+    processLostDataMsg(cap, gumPackBuffer);
     return;
   }
 
@@ -389,8 +2494,9 @@ processDataMsg(Capability * cap, OpCode tag, rtsPackBuffer *gumPackBuffer) {
   placeholder = inport->closure;
   ASSERT(isBlackhole(placeholder));
 
-  // unpack the graph
-  graph = unpackGraph(gumPackBuffer, cap);
+  // unpack the graph (joined with parts received before)
+  packet = joinParts(gumPackBuffer);
+  graph = unpackGraph(packet, cap);
 
   // replace placeholder by received data, possibly leaving port open
   switch(tag) {
@@ -422,7 +2528,10 @@ processDataMsg(Capability * cap, OpCode tag, rtsPackBuffer *gumPackBuffer) {
   }
 
     // edentrace: write event iff message is accepted
-  traceReceiveMessageEvent(cap,tag,gumPackBuffer);
+  traceReceiveMessageEvent(cap,tag,packet);
+  if (packet != gumPackBuffer) {
+    stgFree(packet);
+  }
   // and update the old blackhole
   IF_PAR_DEBUG(pack,
                debugBelch("Replacing Blackhole @ %p by node %p\n",
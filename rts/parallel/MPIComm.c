@@ -44,16 +44,44 @@ int finishRecvd=0;
 int mpiWorldSize;
 int mpiMyRank;
 
-// request for send operations, one for each comm. partner (dynamic!)
-// UNUSED YET, see MP_send()
-MPI_Request *commReq[MAX_PES];
-
-int maxMsgs;
-// MPI Message buffer, can hold maxMsgs messages to every PE.
-int bufsize;
-void *mpiMsgBuffer;
-MPI_Request *requests;
-int msgCount; // to detach/attach buffer to avoid buffer overflow
+/* Send buffers: MPI_Isend needs the data untouched until the send has
+ * completed, so messages are copied into send buffers. Buffers come in
+ * size classes (powers of 2, from 2^MPI_MIN_CLASS bytes up to the
+ * maximum message size), are allocated on demand and kept on a free
+ * list per class for reuse.
+ *
+ * Sends in flight are queued per destination PE. Completed sends are
+ * collected (MPI_Test) when sending, and when probing for messages
+ * (i.e. in every round of the scheduler loop).
+ *
+ * Backpressure: at most maxInFlight bytes (-qq<n> pack buffers) may
+ * be in flight to one PE (but one message is always allowed). Beyond
+ * that, sending to this PE fails until sends have completed, other
+ * destinations are not affected. MP_send_ready tells whether a
+ * destination can take a message of maximal size, so a sender can
+ * wait before packing.
+ */
+#define MPI_MIN_CLASS   8   // 256 bytes
+#define MPI_NUM_CLASSES 24  // up to 2^31 bytes
+
+typedef struct MPISend_ {
+  MPI_Request      request;
+  StgWord8        *buffer;
+  uint32_t         sizeClass;
+  uint32_t         length;    // bytes sent from the buffer
+  struct MPISend_ *next;
+} MPISend;
+
+// free send buffers, per size class
+static MPISend *sendFree[MPI_NUM_CLASSES];
+// sends in flight, per destination (oldest first), and their size
+static MPISend *sendQueue[MAX_PES];
+static StgWord64 inFlight[MAX_PES];
+static StgWord64 maxInFlight;
+static uint32_t sendsInFlight; // all destinations
+
+static void completeAllSends(void);
+static void freeSendBuffers(void);
 //request and buffer for Ping on sysComm
 MPI_Request sysRequest;
 int pingMessage=0;
@@ -72,6 +100,9 @@ struct _status
 // communicator for system messages
 MPI_Comm sysComm;
 
+// lent out by MP_recv_borrow, messages are received into it
+static StgWord8 *borrowBuffer = NULL;
+
 /**************************************************************
  * Startup and Shutdown routines (used inside ParInit.c only) */
 
@@ -148,40 +179,10 @@ bool MP_start(int* argc, char** argv[]) {
  *   Own ID is known before, but returned only here.
  */
 bool MP_sync(void) {
-  // initialise counters/constants and allocate/attach the buffer
-
-  // buffer size default is 20, use RTS option -qq<N> to change it
-  maxMsgs = RtsFlags.ParFlags.sendBufferSize;
-  // and resulting buffer space
-
-  // checks inside RtsFlags.c:
-  // DATASPACEWORDS * sizeof(StgWord) < INT_MAX / 2
-  // maxMsgs <= max(20,nPEs)
-  // Howver, they might be just too much in combination.
-  if (INT_MAX / sizeof(StgWord) < DATASPACEWORDS * maxMsgs) {
-      IF_PAR_DEBUG(mpcomm,
-              debugBelch("requested buffer sizes too large, adjusting...\n"));
-      do { maxMsgs--;
-      } while (maxMsgs > 0 &&
-               INT_MAX / sizeof(StgWord) < DATASPACEWORDS * maxMsgs);
-      if (maxMsgs == 0) {
-          // should not be possible with checks inside RtsFlags.c, see above
-          barf("pack buffer too large to allocate, aborting program.");
-      } else {
-          IF_PAR_DEBUG(mpcomm,
-                       debugBelch("send buffer size reduced to %d messages.\n",
-                                  maxMsgs));
-      }
-  }
-
-  bufsize = maxMsgs * DATASPACEWORDS * sizeof(StgWord);
-
-  mpiMsgBuffer = (void*) stgMallocBytes(bufsize, "mpiMsgBuffer");
-
-  requests = (MPI_Request*)
-    stgMallocBytes(maxMsgs * sizeof(MPI_Request),"requests");
-
-  msgCount = 0; // when maxMsgs reached
+  // send buffers are allocated on demand (see MP_send). Allow
+  // -qq<n> pack buffers in flight per destination, default 20.
+  maxInFlight = (StgWord64) RtsFlags.ParFlags.sendBufferSize
+                * DATASPACEWORDS * sizeof(StgWord);
 
   thisPE = mpiMyRank + 1;
 
@@ -309,8 +310,12 @@ bool MP_quit(int isError) {
   // end of q&d
 
   IF_PAR_DEBUG(mpcomm,
-               debugBelch("detaching MPI buffer\n"));
-  stgFree(mpiMsgBuffer);
+               debugBelch("freeing MPI send buffers\n"));
+  freeSendBuffers();
+  if (borrowBuffer != NULL) {
+    stgFree(borrowBuffer);
+    borrowBuffer = NULL;
+  }
 
   IF_PAR_DEBUG(mpcomm,
                debugBelch("Goodbye\n"));
@@ -322,64 +327,157 @@ bool MP_quit(int isError) {
   return true;
 }
 
+// size class for a message of length bytes
+static uint32_t sizeClass(uint32_t length) {
+  uint32_t c = 0;
+  while (c < MPI_NUM_CLASSES-1 &&
+         ((StgWord64)1 << (c + MPI_MIN_CLASS)) < length) {
+    c++;
+  }
+  return c;
+}
+
+// get a send buffer for a message of length bytes, from the free list
+// of its size class or freshly allocated
+static MPISend* getSendBuffer(uint32_t length) {
+  uint32_t c = sizeClass(length);
+  MPISend *send = sendFree[c];
+
+  if (send != NULL) {
+    sendFree[c] = send->next;
+  } else {
+    StgWord64 size = (StgWord64)1 << (c + MPI_MIN_CLASS);
+    // the largest messages do not need a full power of 2
+    size = stg_min(size, (StgWord64) DATASPACEWORDS * sizeof(StgWord));
+    send = (MPISend*) stgMallocBytes(sizeof(MPISend), "MPISend");
+    send->buffer = (StgWord8*) stgMallocBytes(size, "MPISendBuffer");
+    send->sizeClass = c;
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("new send buffer of %" FMT_Word64 " bytes\n",
+                            size));
+  }
+  return send;
+}
+
+// collect completed sends to one PE (0-based), returning their buffers
+// to the free lists
+static void completeSends(PEId node) {
+  MPISend **prev = &sendQueue[node];
+  MPISend *send;
+  int done;
+
+  while ((send = *prev) != NULL) {
+    MPI_Test(&send->request, &done, MPI_STATUS_IGNORE);
+    if (done) {
+      *prev = send->next;
+      inFlight[node] -= send->length;
+      sendsInFlight--;
+      send->next = sendFree[send->sizeClass];
+      sendFree[send->sizeClass] = send;
+    } else {
+      prev = &send->next;
+    }
+  }
+}
+
+static void completeAllSends(void) {
+  PEId node;
+
+  for (node = 0; sendsInFlight > 0 && node < nPEs; node++) {
+    completeSends(node);
+  }
+}
+
+// free all send buffers at shutdown (sends still in flight are
+// cancelled)
+static void freeSendBuffers(void) {
+  MPISend *send;
+  PEId node;
+  uint32_t c;
+
+  for (node = 0; node < MAX_PES; node++) {
+    while ((send = sendQueue[node]) != NULL) {
+      sendQueue[node] = send->next;
+      MPI_Cancel(&send->request);
+      MPI_Wait(&send->request, MPI_STATUS_IGNORE);
+      stgFree(send->buffer);
+      stgFree(send);
+    }
+    inFlight[node] = 0;
+  }
+  sendsInFlight = 0;
+
+  for (c = 0; c < MPI_NUM_CLASSES; c++) {
+    while ((send = sendFree[c]) != NULL) {
+      sendFree[c] = send->next;
+      stgFree(send->buffer);
+      stgFree(send);
+    }
+  }
+}
+
+// whether a destination (1-based) can take more data (see Backpressure)
+static bool readyToSend(PEId node, uint32_t length) {
+  completeSends(node-1);
+  return (sendQueue[node-1] == NULL ||
+          inFlight[node-1] + length <= maxInFlight);
+}
+
 bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length){
+  MPVec vec;
+
+  vec.data = data;
+  vec.length = length;
+  return MP_sendv(node, tag, &vec, 1);
+}
+
+bool MP_sendv(PEId node, OpCode tag, MPVec *vec, uint32_t count){
   /* MPI normally uses blocking send operations (MPI_*send). When
    * using nonblocking operations (MPI_I*send), dataspace must remain
    * untouched until the message has been delivered (MPI_Wait)!
    *
-   * We copy the data to be sent into the mpiMsgBuffer and call MPI_Isend.
-   * We can reuse slots in the buffer where messages are already delivered.
-   * The requests array stores a request for each send operation which
-   * can be tested by MPI_Testany for delivered messages.
-   * MP_send should return false to indicate a send failure (the
-   * message buffer has 0 free slots).
+   * We copy the data to be sent into a send buffer of its size class
+   * and call MPI_Isend, queueing the send for its destination (see
+   * "Send buffers" above). Completed sends give their buffers back.
+   * MP_send returns false to indicate a send failure when too much
+   * data is in flight to the destination (backpressure).
    *
+   * The pieces of a gathered message (MP_sendv) are copied into the
+   * send buffer one after the other, so large pieces are copied only
+   * once (instead of describing them by an MPI datatype, which would
+   * have to stay valid until the send completes).
    */
-  int sendIndex;
-  int hasFreeSpace;
-  //MPI_Status* status;
-
-  StgPtr sendPos; // used for pointer arithmetics, based on assumption that
-                  // sizeof(void*)==sizeof(StgWord) (see includes/stg/Types.h)
+  MPISend *send, **last;
+  uint32_t length, i;
 
   ASSERT(node > 0 && node <= nPEs);
 
+  length = 0;
+  for (i = 0; i < count; i++) {
+    length += vec[i].length;
+  }
 
   IF_PAR_DEBUG(mpcomm,
                debugBelch("MPI sending message to PE %u "
                           "(tag %d (%s), datasize %u)\n",
                           node, tag, getOpName(tag), length));
-  // adjust node no.
-  node--;
-  //case each slot in buffer has been used
-  if (msgCount == maxMsgs) {
-    // looking for free space in buffer
-    IF_PAR_DEBUG(mpcomm,
-                 debugBelch("looking for free space in buffer\n"));
-    MPI_Testany(msgCount, requests, &sendIndex, &hasFreeSpace,
-                MPI_STATUS_IGNORE);
-    // if (status->MPI_ERROR)
-    //   barf("a send operation returned an error with code %d"
-    //        "and sendIndex is %d and hasFreeSpace %d",
-    //        status->MPI_ERROR,  sendIndex,  hasFreeSpace);
-  }
-  //case still slots in buffer unused
-  else {
-    hasFreeSpace = 1;
-    sendIndex = msgCount++;
-  }
-  // send the message
-  if (!hasFreeSpace){
+
+  if (!readyToSend(node, length)) {
     IF_PAR_DEBUG(mpcomm,
                  debugBelch("MPI CANCELED sending message to PE %u "
-                          "(tag %d (%s), datasize %u)\n",
-                            node, tag, getOpName(tag), length));
+                            "(%" FMT_Word64 " bytes in flight)\n",
+                            node, inFlight[node-1]));
     return false;
   }
-  //calculate offset in mpiMsgBuffer
-  // using ptr. arithmetics and void* size (see includes/stg/Types.h)
-  sendPos = ((StgPtr)mpiMsgBuffer) + sendIndex * DATASPACEWORDS;
-  memcpy((void*)sendPos, data, length);
+  // adjust node no.
+  node--;
+
+  send = getSendBuffer(length);
+  send->length = 0;
+  for (i = 0; i < count; i++) {
+    memcpy(send->buffer + send->length, vec[i].data, vec[i].length);
+    send->length += vec[i].length;
+  }
 
   if (ISSYSCODE(tag)){
     // case system message (workaroud: send it on both communicators,
@@ -387,13 +485,45 @@ bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length){
       MPI_Isend(&pingMessage, 1, MPI_INT, node, tag,
               sysComm, &sysRequest);
   }
-  MPI_Isend(sendPos, length, MPI_BYTE, node, tag,
-            MPI_COMM_WORLD, &(requests[sendIndex]));
+  MPI_Isend(send->buffer, length, MPI_BYTE, node, tag,
+            MPI_COMM_WORLD, &send->request);
+
+  // append to the queue of this destination
+  send->next = NULL;
+  for (last = &sendQueue[node]; *last != NULL; last = &(*last)->next) {}
+  *last = send;
+  inFlight[node] += length;
+  sendsInFlight++;
+
   IF_PAR_DEBUG(mpcomm,
                debugBelch("Done sending message to PE %u\n", node+1));
   return true;
 }
 
+/* - a multicast, see MPSystem.h. MPI_Bcast is a collective operation
+ *   (all PEs would have to call it), so we send to each node, with a
+ *   send buffer per destination.
+ */
+uint32_t MP_bcast(PEId *nodes, uint32_t count,
+                  OpCode tag, StgWord8 *data, uint32_t length) {
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (!MP_send(nodes[i], tag, data, length)) {
+      break;
+    }
+  }
+  return i;
+}
+
+/* - a non-blocking check whether a message to node can be sent, see
+ *   MPSystem.h. False if a message of maximal size would exceed the
+ *   data in flight allowed for node.
+ */
+bool MP_send_ready(PEId node) {
+  return readyToSend(node, DATASPACEWORDS * sizeof(StgWord));
+}
+
 /* - a blocking receive operation
    where system messages from main node have priority! */
 
@@ -462,11 +592,32 @@ uint32_t MP_recv(uint32_t maxlength, StgWord8 *destination,
   return (uint32_t) size;
 }
 
+/* - a blocking receive operation which lends the message data, see
+ *   MPSystem.h. MPI does not expose its internal buffers,
+ *   messages are received into borrowBuffer and lent from there.
+ */
+StgWord8 *MP_recv_borrow(OpCode *code, PEId *sender, uint32_t *length) {
+  if (borrowBuffer == NULL) {
+    borrowBuffer = (StgWord8 *)
+      stgMallocBytes(sizeof(StgWord)*DATASPACEWORDS, "borrowBuffer");
+  }
+  *length = MP_recv(sizeof(StgWord)*DATASPACEWORDS, borrowBuffer,
+                    code, sender);
+  return borrowBuffer;
+}
+
+/* - give back a message obtained by MP_recv_borrow (buffer is reused) */
+void MP_recv_release(void) {
+}
+
 /* - a non-blocking probe operation (unspecified sender)
  */
 bool MP_probe(void){
   int flag = 0;
 
+  // collect completed sends (called in every round of the scheduler)
+  completeAllSends();
+
   // non-blocking probe: either flag is true and status filled, or no
   // message waiting to be received. Using ignore-status...
 
@@ -485,5 +636,23 @@ bool MP_probe(void){
   return (flag != 0);
 }
 
+/* - amount of data waiting: MPI only tells us about the next message */
+uint32_t MP_pending(void){
+  int flag = 0, size = 0;
+  MPI_Status st;
+
+  MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &st);
+  if (!flag) {
+    return 0;
+  }
+  MPI_Get_count(&st, MPI_BYTE, &size);
+  return (size > 0 ? (uint32_t) size : 1);
+}
+
+/* - locality domain of a node: not known to MPI */
+uint32_t MP_locality(PEId node STG_UNUSED){
+  return 0;
+}
+
 
 #endif /* whole file */
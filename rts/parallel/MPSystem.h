@@ -102,6 +102,50 @@ Needed functionality: */
 
 bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length);
 
+/* - a gathering send: sends one message (as MP_send) whose data is
+ *   given in several pieces, which are concatenated in the order given
+ *   (like writev). Avoids copying large pieces (residing elsewhere, for
+ *   instance in the heap) into one buffer before sending. The pieces
+ *   need to stay untouched only during the call.
+ *
+ * Parameters:
+ *   IN node     -- destination node, number between 1 and nPEs
+ *   IN tag      -- message tag
+ *   IN vec      -- the pieces of data (pieces of length zero allowed)
+ *   IN count    -- number of pieces
+ * Returns:
+ *   bool: success or failure inside comm. subsystem
+ */
+typedef struct MPVec_ {
+  StgWord8 *data;
+  uint32_t  length; // in bytes
+} MPVec;
+
+bool MP_sendv(PEId node, OpCode tag, MPVec *vec, uint32_t count);
+
+/* - a multicast: sends the same message (as MP_send) to several nodes.
+ *   Sending stops at the first node where it fails.
+ *
+ * Parameters:
+ *   IN nodes    -- destination nodes, numbers between 1 and nPEs
+ *   IN count    -- number of destination nodes
+ *   IN tag, data, length -- the message, as for MP_send
+ * Returns:
+ *   uint32_t: number of nodes the message was sent to (the first ones
+ *             in nodes), count if all sends succeeded
+ */
+uint32_t MP_bcast(PEId *nodes, uint32_t count,
+                  OpCode tag, StgWord8 *data, uint32_t length);
+
+/* - a non-blocking check whether the MP-System can take a message of
+ *   maximal size (DATASPACEWORDS words) to the given node right now,
+ *   i.e. MP_send is not expected to fail for lack of buffer space.
+ *   Senders check this before packing data. It is only a hint: other
+ *   capabilities may send in between (the sender then keeps its
+ *   packed message, see DataComms.c).
+ */
+bool MP_send_ready(PEId node);
+
 /* - a blocking receive operation
  *   where system messages from main node have priority!
  * Effect:
@@ -124,11 +168,47 @@ bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length);
 uint32_t MP_recv(uint32_t maxlength, StgWord8 *destination, // IN
                  OpCode *code, PEId *sender);               // OUT
 
+/* - a blocking receive operation which lends the message data instead
+ *   of copying it (same priorities as MP_recv)
+ * Effect:
+ *   A message is received from a peer, and a pointer to its data is
+ *   returned. Where the MP-System allows it, this points into the
+ *   transport buffer (shared memory), saving one copy of the message.
+ *   The data is aligned to a word boundary, and stays valid (and
+ *   writable) until MP_recv_release is called. Only one message can
+ *   be borrowed at a time; MP_send may be used while borrowing.
+ *
+ * Parameters:
+ *   OUT code   -- OpCode of message (aka message tag)
+ *   OUT sender -- originator of this message
+ *   OUT length -- amount of data (in bytes) received with message
+ * Returns:
+ *   StgWord8*: the message data
+ */
+StgWord8 *MP_recv_borrow(OpCode *code, PEId *sender, uint32_t *length);
+
+/* - give back a message obtained by MP_recv_borrow (no-op if none) */
+void MP_recv_release(void);
+
 /* - a non-blocking probe operation
  * (unspecified sender, no receive buffers any more)
  */
 bool MP_probe(void);
 
+/* - a non-blocking check how much data is waiting to be received
+ *   (in bytes), used to trace the inbox depth. Where the MP-System only
+ *   knows about the next message, this is a lower bound. 0 if and only
+ *   if MP_probe returns false.
+ */
+uint32_t MP_pending(void);
+
+/* - the locality domain (NUMA node) a node runs on, for process
+ *   placement: nodes in the same domain are cheaper to communicate
+ *   with. Where the MP-System does not know (or PEs are not pinned,
+ *   -qA), all nodes are in domain 0.
+ */
+uint32_t MP_locality(PEId node);
+
 #endif /* PARALLEL_RTS */
 
 #endif /* MPSYSTEM_H */
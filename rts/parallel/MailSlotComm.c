@@ -76,6 +76,9 @@ typedef struct SlotMsg_ {
 /* this is data space to copy messages (proc, tag, DATASPACEWORDS words) */
 SlotMsg* msg;
 
+/* lent out by MP_recv_borrow (data in msg is not aligned) */
+static StgWord8 *borrowBuffer = NULL;
+
 /* Helper to re-assemble a cmd line from argv, for CreateProcess */
 static char* mkCmdLineString(int argc, char ** argv);
 
@@ -481,6 +484,10 @@ bool MP_quit(int isError) {
   /* free data structures */
   stgFree(mailslot);
   stgFree(msg);
+  if (borrowBuffer != NULL) {
+    stgFree(borrowBuffer);
+    borrowBuffer = NULL;
+  }
 
   /* close mySlot read handle ... but how? no API */
 
@@ -513,6 +520,15 @@ bool MP_quit(int isError) {
  */
 
 bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length) {
+  MPVec vec;
+
+  vec.data = data;
+  vec.length = length;
+  return MP_sendv(node, tag, &vec, 1);
+}
+
+/* - a gathering send, see MPSystem.h */
+bool MP_sendv(PEId node, OpCode tag, MPVec *vec, uint32_t count) {
   /*
    * use the respective slot to send out the data (as a byte string)
    *
@@ -524,10 +540,11 @@ bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length) {
    * messages - we only send data messages with this routine.
    *
    * We use the custom type SlotMsg, and have a static "msg" to copy
-   * tag and data.
+   * tag and data (the pieces of the data one after the other).
    */
   DWORD rwCount;
   BOOL fRes;
+  uint32_t length, i;
 
   IF_PAR_DEBUG(mpcomm, debugBelch("MP_send(%s) to %i\n",
                                   getOpName(tag), node));
@@ -536,7 +553,11 @@ bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length) {
 
   msg->proc = thisPE;
   msg->tag  = tag;
-  memcpy(&msg->data, data, length);
+  length = 0;
+  for (i = 0; i < count; i++) {
+    memcpy(msg->data + length, vec[i].data, vec[i].length);
+    length += vec[i].length;
+  }
 
   // send "msg" of length+sizeof(SlotMsg) bytes to mailslot[ node-1 ]
   fRes = WriteFile(mailslot[node-1], (char*)msg, sizeof(SlotMsg)+length,
@@ -555,6 +576,24 @@ bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length) {
   return true;
 }
 
+/* - a multicast, see MPSystem.h */
+uint32_t MP_bcast(PEId *nodes, uint32_t count,
+                  OpCode tag, StgWord8 *data, uint32_t length) {
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    MP_send(nodes[i], tag, data, length); // fails with an error
+  }
+  return count;
+}
+
+/* - a non-blocking check whether a message to node can be sent, see
+ *   MPSystem.h. Mail slots are written synchronously.
+ */
+bool MP_send_ready(PEId node STG_UNUSED) {
+  return true;
+}
+
 /* - a blocking receive operation
  *   where system messages from main node have priority!
  * Effect:
@@ -612,6 +651,24 @@ int MP_recv(uint32_t maxlength, StgWord8 *destination, // IN
   return ((int)msgBytes - sizeof(SlotMsg));
 }
 
+/* - a blocking receive operation which lends the message data, see
+ *   MPSystem.h. Mail slot data follows an unaligned header
+ *   in msg, so messages are copied to borrowBuffer and lent from there.
+ */
+StgWord8 *MP_recv_borrow(OpCode *code, PEId *sender, uint32_t *length) {
+  if (borrowBuffer == NULL) {
+    borrowBuffer = (StgWord8 *)
+      stgMallocBytes(sizeof(StgWord)*DATASPACEWORDS, "borrowBuffer");
+  }
+  *length = MP_recv(sizeof(StgWord)*DATASPACEWORDS, borrowBuffer,
+                    code, sender);
+  return borrowBuffer;
+}
+
+/* - give back a message obtained by MP_recv_borrow (buffer is reused) */
+void MP_recv_release(void) {
+}
+
 /* - a non-blocking probe operation
  * (unspecified sender, no receive buffers any more)
  */
@@ -636,6 +693,28 @@ bool MP_probe(void) {
   return (msgBytes != MAILSLOT_NO_MESSAGE);
 }
 
+/* - amount of data waiting: the mailslot only tells us the size of the
+ *   next message */
+uint32_t MP_pending(void) {
+  DWORD fResult, msgBytes, msgCount;
+
+  fResult = GetMailslotInfo(mySlot, NULL,
+                            &msgBytes, &msgCount, NULL);
+  if (!fResult) {
+    sysErrorBelch("failed to GetMailslotInfo");
+    barf("Comm. system malfunction, aborting.");
+  }
+  if (msgBytes == MAILSLOT_NO_MESSAGE) {
+    return 0;
+  }
+  return (msgBytes > 0 ? (uint32_t) msgBytes : 1);
+}
+
+/* - locality domain of a node: not known here */
+uint32_t MP_locality(PEId node STG_UNUSED) {
+  return 0;
+}
+
 /* collate all args to a single string, passed to CreateProces */
 static char* mkCmdLineString(int argc, char ** argv) {
   int len = argc*3;
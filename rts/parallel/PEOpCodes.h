@@ -27,7 +27,7 @@
 ***********************************************************************/
 
 #define MIN_PEOPS               0x50
-#define MAX_PEOPS               0x5c
+#define MAX_PEOPS               0x62
 
 /* ************************** */
 /* Generic Parallel RTS */
@@ -53,6 +53,19 @@
 /* packet of msg.s - buffering */
 #define PP_PACKET               0x5c
 
+/* work stealing of unstarted processes */
+#define PP_FISH                 0x5d
+#define PP_NOWORK               0x5e
+
+/* one graph sent to several inports (on several PEs) */
+#define PP_BCAST                0x5f
+/* communication statistics, collected by the main PE at shutdown */
+#define PP_STATS                0x60
+/* eventlog data of a PE, streamed to the main PE (-qT) */
+#define PP_EVENTLOG             0x61
+/* value of a blackhole sent as a placeholder before (-qL) */
+#define PP_VALUE                0x62
+
 #define PEOP_NAMES \
     "Ready", "NewPE",      \
       "PETIDS","Finish",   \
@@ -62,7 +75,12 @@
       "Head","Constr",     \
       "Part",              \
       "Terminate",         \
-      "Packet"
+      "Packet",            \
+      "Fish","NoWork",     \
+      "Bcast",             \
+      "Stats",             \
+      "EventLog",          \
+      "Value"
 
 // simple validation method:
 #define ISOPCODE(code) (((code) <= MAX_PEOPS) && ((code) >= MIN_PEOPS))
@@ -100,6 +100,9 @@ int pvmParent; // the parent's address (parent is master node)
 
 int allPEs[MAX_PES]; // array of all PEs (mapping from logical node no.s to pvm addresses)
 
+// lent out by MP_recv_borrow, messages are unpacked into it
+static StgWord8 *borrowBuffer = NULL;
+
 /***************************************************
  * a handler for internal messages of the MP-System:
  *
@@ -530,6 +533,11 @@ bool MP_quit(int isError) {
   checkComms(pvm_exit(),
              "PVM: Failed to shut down pvm.");
 
+  if (borrowBuffer != NULL) {
+    stgFree(borrowBuffer);
+    borrowBuffer = NULL;
+  }
+
   /* indicate that quit has been executed */
   nPEs = 0;
 
@@ -562,6 +570,69 @@ bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length) {
   return true;
 }
 
+/* - a gathering send, see MPSystem.h. The pieces are packed in place
+ *   (PVM only records where they are), pvm_send copies them out of our
+ *   memory directly.
+ */
+bool MP_sendv(PEId node, OpCode tag, MPVec *vec, uint32_t count) {
+  uint32_t i;
+
+  ASSERT(node > 0); // node is valid PE number
+  ASSERT(node <= nPEs);
+  ASSERT(ISOPCODE(tag));
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("MP_sendv for PVM: sending %u pieces "
+                          "to %u with tag %x (%s)\n",
+                          count, node, tag, getOpName(tag)));
+  pvm_initsend(PvmDataInPlace);
+
+  for (i = 0; i < count; i++) {
+    if (vec[i].length > 0) {
+      pvm_pkbyte((char*) vec[i].data, (int)vec[i].length, 1);
+    }
+  }
+  checkComms(pvm_send(allPEs[node-1],tag),
+             "PVM:send failed");
+  return true;
+}
+
+/* - a multicast, see MPSystem.h. The data is packed once and sent by
+ *   pvm_mcast.
+ */
+uint32_t MP_bcast(PEId *nodes, uint32_t count,
+                  OpCode tag, StgWord8 *data, uint32_t length) {
+  int tids[MAX_PES];
+  uint32_t i;
+
+  ASSERT(count <= nPEs);
+  ASSERT(ISOPCODE(tag));
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("MP_bcast for PVM: sending buffer@%p "
+                          "(length %u) to %u PEs with tag %x (%s)\n",
+                          data, length, count, tag, getOpName(tag)));
+  for (i = 0; i < count; i++) {
+    ASSERT(nodes[i] > 0 && nodes[i] <= nPEs);
+    tids[i] = allPEs[nodes[i]-1];
+  }
+  pvm_initsend(PvmDataRaw);
+
+  if (length > 0) {
+      pvm_pkbyte((char*) data, (int)length, 1);
+  }
+  checkComms(pvm_mcast(tids, (int)count, tag),
+             "PVM:mcast failed");
+  return count;
+}
+
+/* - a non-blocking check whether a message to node can be sent, see
+ *   MPSystem.h. PVM buffers messages internally.
+ */
+bool MP_send_ready(PEId node STG_UNUSED) {
+  return true;
+}
+
 /* - a blocking receive operation
    where system messages have priority! */
 uint32_t MP_recv(uint32_t maxlength, StgWord8 *destination,
@@ -652,6 +723,24 @@ uint32_t MP_recv(uint32_t maxlength, StgWord8 *destination,
   return (uint32_t) bytes; // data and all variables set, ready
 }
 
+/* - a blocking receive operation which lends the message data, see
+ *   MPSystem.h. PVM messages have to be unpacked anyway,
+ *   into borrowBuffer, and are lent from there.
+ */
+StgWord8 *MP_recv_borrow(OpCode *code, PEId *sender, uint32_t *length) {
+  if (borrowBuffer == NULL) {
+    borrowBuffer = (StgWord8 *)
+      stgMallocBytes(sizeof(StgWord)*DATASPACEWORDS, "borrowBuffer");
+  }
+  *length = MP_recv(sizeof(StgWord)*DATASPACEWORDS, borrowBuffer,
+                    code, sender);
+  return borrowBuffer;
+}
+
+/* - give back a message obtained by MP_recv_borrow (buffer is reused) */
+void MP_recv_release(void) {
+}
+
 /* - a non-blocking probe operation (unspecified sender)
  */
 bool MP_probe(void){
@@ -659,4 +748,21 @@ bool MP_probe(void){
   return (pvm_probe(ANY_TASK, ANY_CODE) > 0);
 }
 
+/* - amount of data waiting: PVM only tells us about the next message */
+uint32_t MP_pending(void){
+  int buffer, bytes = 0, code, task;
+
+  buffer = pvm_probe(ANY_TASK, ANY_CODE);
+  if (buffer <= 0) {
+    return 0;
+  }
+  pvm_bufinfo(buffer, &bytes, &code, &task);
+  return (bytes > 0 ? (uint32_t) bytes : 1);
+}
+
+/* - locality domain of a node: not known to PVM */
+uint32_t MP_locality(PEId node STG_UNUSED){
+  return 0;
+}
+
 #endif /* PARALLEL_RTS && USE_PVM */
@@ -36,6 +36,10 @@
 #include "Hash.h"
 #include "Threads.h" // updateThunk
 #include "Messages.h" // messageBlackHole
+#include "Stable.h" // sharing cache between PEs
+#include "sm/Storage.h" // heap region for unpacking
+#include "sm/CNF.h" // compact regions, shipped as blocks
+#include "Stats.h" // counting packed and unpacked messages
 
 # if defined(DEBUG)
 # include "sm/Sanity.h"
@@ -96,6 +100,14 @@
 #define PLC     1L
 #define OFFSET  2L
 #define CLOSURE 3L
+// markers for the sharing cache between PEs (in-RTS only, see below)
+#define CACHEREF 4L // closure sent in an earlier message, slot follows
+#define CACHEDEF 5L // trailer: slots to define, after the closures
+// marker for closures in a compact region (in-RTS only, see PackCompact)
+#define COMPACT  6L
+// marker for a placeholder of a blackhole, reference number follows
+// (in-RTS only, see PackRemoteRef)
+#define REMOTEREF 7L
 // marker for small bitmap in PAP packing
 #define SMALL_BITMAP_TAG (~0UL)
 
@@ -120,8 +132,23 @@ extern const StgInfoTable BASE_SYM[];
 // use this one on info offsets taken from packets
 #define P_POINTER(val) ((StgWord)(val) + (StgWord) BASE_SYM)
 
+// the PE sending a packet is needed for the sharing cache only
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+#define USED_IF_SHARING
+#else
+#define USED_IF_SHARING STG_UNUSED
+#endif
+
+// the heap size of a graph (to allocate it in one region) is used by the
+// in-RTS version only
+#if defined(LIBRARY_CODE)
+#define USED_IF_IN_RTS STG_UNUSED
+#else
+#define USED_IF_IN_RTS
+#endif
+
 // padding for offsets into the already-packed data (failing lookup in the
-// hashtable will produce 0, but offset 0 would be the graph root without
+// visited table will produce 0, but offset 0 would be the graph root without
 // padding)
 #define PADDING 1
 
@@ -136,17 +163,160 @@ typedef struct ClosureQ_ {
     uint32_t tail;
 } ClosureQ;
 
+// visited table for packing (closure address -> offset): open addressing
+// with linear probing, keys are untagged closure addresses. Entries carry
+// the epoch (packing run) in which they were written, so the table is
+// reset in O(1) between packing runs by incrementing the epoch.
+typedef struct VisitEntry_ {
+    StgWord  key;
+    uint32_t offset;
+    uint32_t epoch;
+} VisitEntry;
+
+typedef struct VisitTable_ {
+    VisitEntry *entries;
+    uint32_t    size;  // power of 2
+    uint32_t    count; // entries in current epoch
+    uint32_t    epoch; // current epoch, never 0 (fresh entries have 0)
+} VisitTable;
+
+// offset table for unpacking (offset -> closure): offsets are dense
+// positions in the packet, so this is a plain array indexed by offset
+typedef struct UnpackOffsets_ {
+    StgClosure **closures; // NULL where no closure was registered
+    uint32_t     size;     // packet size + PADDING
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+    struct SharingCache_ *sharing; // of the sending PE, NULL if none
+    PEId from;                     // sending PE, 0 if none
+#endif
+} UnpackOffsets;
+
+#ifndef LIBRARY_CODE
+// heap region for unpacking one graph whose heap size is known (the
+// unpacked_size of a message): closures are allocated by bumping free up
+// to lim, in the order in which they are unpacked (breadth-first).
+// Smaller graphs get a piece of the nursery. Larger ones, and graphs for
+// an older generation (-qO), get block groups of their own, split into
+// single blocks (closures do not span blocks) which are linked to the
+// generation's blocks. Closures which do not fit (unknown size, or larger
+// than a block) are allocated as usual. See unpackGraph_.
+typedef struct UnpackRegion_ {
+    StgPtr      free;
+    StgPtr      lim;      // free == lim: full (or no region)
+    generation *gen;      // generation of the blocks, NULL for the nursery
+    bdescr     *bd;       // current block
+    bdescr     *last;     // last block of the current block group
+    W_          needed;   // words of the graph not yet allocated
+    W_          used;     // words allocated in blocks
+    StgClosure *recorded; // last closure put on the mutable list
+} UnpackRegion;
+
+// per-capability data kept between packing/unpacking runs:
+// - scratch space for serialisation (tryPackToMemory). Grows
+//   geometrically while packing (see growScratch), up to the maximum pack
+//   buffer size (RtsFlags.ParFlags.packBufferSize). Allocated on demand,
+//   and freed again after a packet which made it grow.
+// - the visited table for packing, and the offset array for unpacking
+// - the heap region of the graph being unpacked
+typedef struct PackCache_ {
+    StgWord     *scratch;
+    uint32_t     scratchSize; // in StgWords
+    VisitTable  *visited;
+    StgClosure **offsets;
+    uint32_t     offsetsSize; // in entries
+    UnpackRegion region;
+} PackCache;
+
+// options of one packing run (see packToBuffer_)
+typedef struct PackOptions_ {
+    // chunked packing: a full buffer is handed to flush (when not NULL)
+    PackFlushFn   flush;
+    void         *flushArg;
+    // per-capability tables, NULL if not known
+    PackCache    *cache;
+    // serialisation: buffer is the scratch space of the cache, which grows
+    // when full
+    bool          grow;
+    // receiving PE, for its sharing cache (-qC) and placeholders for
+    // blackholes (-qL), 0 if none
+    PEId          dest;
+    // payload of large byte arrays left out of the buffer, NULL if all
+    // data is copied into the buffer
+    PackSegments *segments;
+} PackOptions;
+#endif
+
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+// sharing cache between this PE and another one (-qC<n>): the sender
+// remembers up to n closures which it has sent to the other PE, and the
+// receiver keeps its copies alive in stable pointers. Both sides number
+// them by slot (0..n-1). Later messages refer to a remembered closure by
+// its slot (CACHEREF) instead of packing it (and its subgraph) again.
+//
+// A closure is remembered when it is packed for the same PE a second
+// time: the first time, only its address goes into the seen table, so
+// closures which are sent once do not evict others. Slots are reused
+// round robin. The slots defined by a packet follow the graph:
+//
+//   | graph | CACHEDEF | n | first slot | offset 1 | .. | offset n |
+//
+// and are applied after unpacking it (references in the same packet
+// still get the old closures). Packets sent in parts (PP_PART) define
+// nothing. The sender commits the slots defined in a message only when
+// the message was sent (commitSharing), messages between two PEs
+// arrive in order, and the receiver unpacks them even if the inport is
+// gone (see processDataMsg).
+typedef struct SharingCache_ {
+    // sending side
+    StgStablePtr *out;        // closures the other PE has, by slot
+    uint32_t      outCount;   // slots in use (they are filled in order)
+    uint32_t      next;       // next slot to define
+    HashTable    *index;      // untagged address -> slot+1, of out
+    bool          indexValid; // closures move in GC, rebuilt on demand
+    StgWord      *seen;       // addresses packed before (direct-mapped)
+    // slots defined in the message which is being sent, from slot next
+    // (before packing) onwards
+    StgStablePtr *pending;    // closure per slot
+    uint32_t      npending;
+    // receiving side
+    StgStablePtr *in;         // closures defined by the other PE, by slot
+    uint32_t      inCount;    // slots in use
+} SharingCache;
+#endif
+
 // packing state: buffer, queue, offset table
 typedef struct PackState_ {
     StgWord  *buffer;
     uint32_t  size;     // buffer size in StgWords
     uint32_t  position; // position in buffer, in StgWords
- // uint32_t unpacked_size;// record unpacked size? only interesting to debug
+    uint32_t  unpacked_size; // heap words needed to unpack the graph
 #ifndef LIBRARY_CODE
     StgTSO *tso;        // in-RTS version: may block when accessing a blackhole
+    // chunked packing: a full buffer is handed to flush (when not NULL),
+    // and packing continues at the start of the buffer
+    PackFlushFn flush;
+    void     *flushArg;
+    uint32_t  base;     // words handed out in previous chunks
+    // per-capability tables, NULL if not known (then the visited table is
+    // allocated for this packing run)
+    PackCache *cache;
+    // serialisation: buffer is the scratch space of the cache, which grows
+    // when full
+    bool      grow;
+    bool      overflow; // flush failed, or scratch at maximum size
+#if defined(PARALLEL_RTS)
+    // sharing cache for the receiving PE (-qC), NULL if not used
+    SharingCache *sharing;
+    // receiving PE which gets placeholders for blackholes (-qL), 0 if
+    // packing blocks on them instead
+    PEId remoteDest;
+#endif
+    // payload of large byte arrays left out of the buffer (for the current
+    // chunk), NULL if all data is copied into the buffer
+    PackSegments *segments;
 #endif
     ClosureQ  *queue;
-    HashTable *offsets;
+    VisitTable *visited;
 } PackState;
 
 // forward declarations
@@ -158,13 +328,22 @@ static void init(void) __attribute__((constructor));
 #if defined(LIBRARY_CODE)
 static PackState* initPacking(StgArrBytes *mutArr);
 #else
-static PackState* initRtsPacking(StgWord *buffer, uint32_t size, StgTSO *tso);
+static PackState* initRtsPacking(StgWord *buffer, uint32_t size, StgTSO *tso,
+                                 PackCache *cache);
 #endif
 static void donePacking(PackState *state);
 
+// visited table
+static VisitTable* initVisitTable(uint32_t bufsize);
+static void freeVisitTable(VisitTable *t);
+static void resetVisitTable(VisitTable *t);
+static void growVisitTable(VisitTable *t);
+STATIC_INLINE uint32_t hashVisited(VisitTable *t, StgWord key);
+
 // closure queue
 static ClosureQ* initClosureQ(uint32_t size);
 static void freeClosureQ(ClosureQ* q);
+static void growClosureQ(ClosureQ* q);
 STATIC_INLINE bool queueEmpty(ClosureQ* q);
 STATIC_INLINE uint32_t queueSize(ClosureQ* q);
 static void queueClosure(ClosureQ* q, StgClosure *closure);
@@ -202,7 +381,16 @@ int pmtryPackToBuffer(StgClosure* closure, StgArrBytes* mutArr);
 #else
 // in-RTS version: packToBuffer, declared in Parallel.h
 // int packToBuffer(StgClosure* closure,
-//                  StgWord *buffer, uint32_t bufsize, StgTSO *caller);
+//                  StgWord *buffer, uint32_t bufsize, StgTSO *caller,
+//                  uint32_t *unpackedSize);
+// packing in chunks, handing out full buffers (DataComms, PP_PART messages)
+// int packToBufferChunked(StgClosure* closure,
+//                         StgWord *buffer, uint32_t bufsize, StgTSO *caller,
+//                         PackFlushFn flush, void *flushArg, PEId dest,
+//                         PackSegments *segments, uint32_t *unpackedSize);
+static int packToBuffer_(StgClosure* closure,
+                         StgWord *buffer, uint32_t bufsize, StgTSO *caller,
+                         PackOptions *opts, uint32_t *unpackedSize);
 // serialisation into a Haskell Byte array, returning error codes on failure
 // StgClosure* tryPackToMemory(StgClosure* graphroot, StgTSO* tso,
 //                             Capability* cap);
@@ -216,12 +404,38 @@ static StgWord packClosure(PackState* p, StgClosure *closure);
 
 // low-level packing: fill one StgWord of data into the buffer
 STATIC_INLINE void Pack(PackState* p, StgWord data);
+#ifndef LIBRARY_CODE
+// chunked packing: hand out the full buffer, continue at its start
+static void flushChunk(PackState* p);
+// leaving out the payload of a large byte array (see PackSegments)
+static void packSegment(PackState* p, StgWord *data, uint32_t words);
+// data worth a segment (smaller data is copied into the buffer)
+#define SEGMENT_MIN_WORDS (LARGE_OBJECT_THRESHOLD/sizeof(W_))
+// serialisation: grow the scratch buffer (keeping its content)
+static void growScratch(PackState* p);
+static PackCache* getPackCache(Capability *cap);
+#endif
+
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+// sharing cache between PEs (-qC)
+static SharingCache* getSharingCache(PEId pe);
+STATIC_INLINE bool isShareable(StgClosure *closure, StgInfoTable *info);
+static bool packShared(PackState* p, StgClosure *closure);
+static uint32_t sharedSlot(SharingCache *c, StgWord key);
+static void packSharingDefs(PackState* p);
+static void endSharing(SharingCache *c, bool sent);
+static StgWord PackRemoteRef(PackState* p, StgClosure *closure);
+#endif
 
 // the workhorses: generic heap-alloc'ed (ptrs-first) closure
 static StgWord PackGeneric(PackState* p, StgClosure *closure);
 // and special cases
 static StgWord PackPAP(PackState* p, StgPAP *pap);
 static StgWord PackArray(PackState* p, StgClosure* array);
+#ifndef LIBRARY_CODE
+static StgWord PackCompact(PackState* p, StgClosure* closure);
+STATIC_INLINE StgCompactNFDataBlock *compactFirstBlock(StgClosure *closure);
+#endif
 
 /***************************************************************
  * unpacking
@@ -242,7 +456,9 @@ StgClosure* pmUnpackGraphWrapper(StgArrBytes* packBufferArray, Capability* cap);
 #endif
 
 // internal function working on the raw data buffer
-static StgClosure* unpackGraph_(StgWord *buffer, StgInt size, Capability* cap);
+static StgClosure* unpackGraph_(StgWord *buffer, StgInt size,
+                                uint32_t from, W_ heapWords,
+                                Capability* cap);
 
 // helper function to find next pointer (filling in pointers)
 STATIC_INLINE void locateNextParent(ClosureQ* q, StgClosure **parentP,
@@ -250,16 +466,42 @@ STATIC_INLINE void locateNextParent(ClosureQ* q, StgClosure **parentP,
                                     uint32_t* pvhsP);
 
 // core unpacking function
-static  StgClosure* UnpackClosure (ClosureQ* q, HashTable* offsets,
+static  StgClosure* UnpackClosure (ClosureQ* q, UnpackOffsets* offsets,
                                    StgWord **bufptrP, Capability* cap);
 
 // helpers
-STATIC_INLINE StgClosure *UnpackOffset(HashTable* offsets, StgWord **bufptrP);
+STATIC_INLINE StgClosure *UnpackOffset(UnpackOffsets* offsets,
+                                       StgWord **bufptrP);
 STATIC_INLINE  StgClosure *UnpackPLC(StgWord **bufptrP);
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+STATIC_INLINE StgClosure *UnpackShared(UnpackOffsets* offsets,
+                                       StgWord **bufptrP);
+STATIC_INLINE StgClosure *UnpackRemoteRef(UnpackOffsets* offsets,
+                                          StgWord **bufptrP, Capability *cap);
+static bool unpackSharingDefs(UnpackOffsets* offsets, StgWord **bufptrP,
+                              StgWord *end);
+#endif
 static StgClosure * UnpackPAP(ClosureQ *queue, StgInfoTable *info,
                               StgWord **bufptrP, Capability* cap);
 static StgClosure* UnpackArray(ClosureQ *queue, StgInfoTable* info,
                                StgWord **bufptrP, Capability* cap);
+#ifndef LIBRARY_CODE
+static StgClosure* UnpackCompact(UnpackOffsets* offsets,
+                                 StgWord **bufptrP, Capability* cap);
+#endif
+
+// heap region for the closures of a graph (in-RTS version)
+#if defined(LIBRARY_CODE)
+#define unpackAllocate(cap, n) allocate(cap, n)
+#else
+static void startUnpackRegion(Capability *cap, UnpackRegion *r, W_ words);
+static void endUnpackRegion(Capability *cap, UnpackRegion *r);
+static bool nextUnpackBlock(Capability *cap, UnpackRegion *r, W_ n);
+STATIC_INLINE StgPtr unpackAllocate(Capability *cap, W_ n);
+static void recordUnpacked(Capability *cap, UnpackRegion *r,
+                           StgClosure *parent, StgClosure *closure);
+static void recordUnpackedArray(Capability *cap, StgClosure *array);
+#endif
 
 
 /***********************************************
@@ -314,7 +556,7 @@ static void init(void) {
  * pack state and queue functions
  */
 
-// Pack state constructor, allocates space, queue and hash table.
+// Pack state constructor, allocates space, queue and visited table.
 #if defined(LIBRARY_CODE)
 // A mutable array is passed as the buffer space. Note that its size comes in
 // bytes, while internally all is managed in units of StgWord.
@@ -329,17 +571,20 @@ static PackState* initPacking(StgArrBytes *mutArr) {
     ret->size = mutArr->bytes / sizeof(StgWord);
 
     ret->position = 0;
+    ret->unpacked_size = 0;
 
     // create a closure queue "big enough" => about what the array can hold
     ret->queue = initClosureQ(ret->size / 2);
-    // new hash table
-    ret->offsets = allocHashTable();
+    // new visited table
+    ret->visited = initVisitTable(ret->size);
 
     return ret;
 }
 #else
-// in-RTS version uses a raw buffer instead of an array, and carries a tso
-static PackState* initRtsPacking(StgWord *buffer, uint32_t size, StgTSO *tso) {
+// in-RTS version uses a raw buffer instead of an array, and carries a tso.
+// The visited table of the cache is reused (and reset) if a cache is given.
+static PackState* initRtsPacking(StgWord *buffer, uint32_t size, StgTSO *tso,
+                                 PackCache *cache) {
     PackState *ret;
 
     ret = (PackState*) stgMallocBytes(sizeof(PackState), "pack state");
@@ -349,26 +594,117 @@ static PackState* initRtsPacking(StgWord *buffer, uint32_t size, StgTSO *tso) {
     ret->size = size;
 
     ret->position = 0;
+    ret->unpacked_size = 0;
     ret->tso = tso;
 
+    ret->flush = NULL;
+    ret->flushArg = NULL;
+    ret->base = 0;
+    ret->cache = cache;
+    ret->grow = false;
+    ret->overflow = false;
+#if defined(PARALLEL_RTS)
+    ret->sharing = NULL;
+    ret->remoteDest = 0;
+#endif
+    ret->segments = NULL;
+
     // create a closure queue "big enough" => about what the array can hold
     ret->queue = initClosureQ(ret->size / 2);
-    // new hash table
-    ret->offsets = allocHashTable();
+    // visited table: reuse the one of the cache, or a new one
+    if (cache != NULL) {
+        if (cache->visited == NULL) {
+            cache->visited = initVisitTable(size);
+        }
+        ret->visited = cache->visited;
+        resetVisitTable(ret->visited);
+    } else {
+        ret->visited = initVisitTable(size);
+    }
 
     return ret;
 }
 #endif
 
-// Pack state destructor: frees hashtable and queue. Mutable array used when
-// initialising has now been mutated.
+// Pack state destructor: frees visited table (unless cached) and queue.
+// Mutable array used when initialising has now been mutated.
 static void donePacking(PackState *state) {
-    freeHashTable(state->offsets, NULL);
+#ifndef LIBRARY_CODE
+    if (state->cache == NULL)
+#endif
+        freeVisitTable(state->visited);
     freeClosureQ(state->queue);
     stgFree(state);
     return;
 }
 
+// initialise a visited table, sized for a buffer of bufsize words. Every
+// packed closure takes at least 2 words, but most graphs do not fill the
+// buffer, so we start smaller and grow on demand.
+static VisitTable* initVisitTable(uint32_t bufsize) {
+    VisitTable *t;
+    uint32_t size = 256;
+
+    while (size < bufsize / 8 && size < (1 << 18)) {
+        size *= 2;
+    }
+
+    t = (VisitTable*) stgMallocBytes(sizeof(VisitTable), "visited table");
+    t->entries = (VisitEntry*)
+        stgMallocBytes(size * sizeof(VisitEntry), "visited table entries");
+    memset(t->entries, 0, size * sizeof(VisitEntry));
+    t->size = size;
+    t->count = 0;
+    t->epoch = 1;
+    return t;
+}
+
+static void freeVisitTable(VisitTable *t) {
+    stgFree(t->entries);
+    stgFree(t);
+}
+
+// forget all entries, by starting a new epoch. Only when the epoch counter
+// wraps around, entries need to be cleared.
+static void resetVisitTable(VisitTable *t) {
+    t->count = 0;
+    t->epoch++;
+    if (t->epoch == 0) {
+        memset(t->entries, 0, t->size * sizeof(VisitEntry));
+        t->epoch = 1;
+    }
+}
+
+// start index for a key (multiplicative hashing, closures are aligned)
+STATIC_INLINE uint32_t hashVisited(VisitTable *t, StgWord key) {
+    StgWord h = (key / sizeof(StgWord)) * (StgWord) 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (h ^ (h >> (sizeof(StgWord) * 4))) & (t->size - 1);
+}
+
+// double the table size, re-inserting the entries of the current epoch
+static void growVisitTable(VisitTable *t) {
+    VisitEntry *old = t->entries;
+    uint32_t oldSize = t->size, i, idx;
+
+    t->size = 2 * oldSize;
+    t->entries = (VisitEntry*)
+        stgMallocBytes(t->size * sizeof(VisitEntry), "visited table entries");
+    memset(t->entries, 0, t->size * sizeof(VisitEntry));
+
+    for (i = 0; i < oldSize; i++) {
+        if (old[i].epoch == t->epoch) {
+            idx = hashVisited(t, old[i].key);
+            while (t->entries[idx].epoch == t->epoch) {
+                idx = (idx + 1) & (t->size - 1);
+            }
+            t->entries[idx] = old[i];
+        }
+    }
+    PACKETDEBUG(debugBelch("visited table grown to %d entries (%d used)\n",
+                           t->size, t->count));
+    stgFree(old);
+}
+
 // initialise a closure queue for "size" many closures
 static ClosureQ* initClosureQ(uint32_t size) {
     ClosureQ* ret;
@@ -413,9 +749,9 @@ static void queueClosure(ClosureQ* q, StgClosure *closure) {
     uint32_t idx = (q->head == q->size - 1) ? 0 : q->head + 1;
 
     if (idx == q->tail) {
-        // queue full, stop (should not happen with sizes used here)
-        errorBelch("Pack.c: Closure Queue Overflow");
-        stg_exit(EXIT_FAILURE);
+        // queue full (graph larger than the buffer suggested), grow it
+        growClosureQ(q);
+        idx = q->head + 1;
     }
     q->queue[q->head] = closure;
     PACKETDEBUG(debugBelch(">__> Q: %p (%s) at %ld\n", closure,
@@ -424,6 +760,30 @@ static void queueClosure(ClosureQ* q, StgClosure *closure) {
 
 }
 
+// double the queue space, keeping the queued closures in order
+static void growClosureQ(ClosureQ* q) {
+    StgClosure** data;
+    uint32_t newSize, n;
+
+    newSize = (q->size < 8) ? 16 : 2 * q->size;
+    data = (StgClosure**)
+        stgMallocBytes(newSize * sizeof(StgClosure*), "cl.queue data");
+
+    // copy from tail to head, unwrapping the queue
+    for (n = 0; !queueEmpty(q); n++) {
+        data[n] = q->queue[q->tail];
+        q->tail = (q->tail == q->size-1) ? 0 : (q->tail + 1);
+    }
+    PACKETDEBUG(debugBelch(">__> Q: grown to %d entries (%d queued)\n",
+                           newSize, n));
+
+    stgFree(q->queue);
+    q->queue = data;
+    q->size  = newSize;
+    q->tail  = 0;
+    q->head  = n;
+}
+
 // dequeue a closure
 static StgClosure *deQueueClosure(ClosureQ* q) {
     if (!queueEmpty(q)) {
@@ -447,9 +807,27 @@ static StgClosure *deQueueClosure(ClosureQ* q) {
 
 // RegisterOffset records that/where the closure is packed
 STATIC_INLINE void registerOffset(PackState* p, StgClosure *closure) {
-    insertHashTable(p->offsets, UNTAG_CAST(StgWord, closure),
-                    // remove tag for offset
-                    (void *) (StgWord) (p->position + PADDING));
+    VisitTable *t = p->visited;
+    StgWord key = UNTAG_CAST(StgWord, closure); // remove tag for offset
+    uint32_t offset = p->position + PADDING;
+    uint32_t idx;
+#ifndef LIBRARY_CODE
+    // offsets count from the start of the first chunk
+    offset += p->base;
+#endif
+    // keep the load factor below 1/2
+    if (2 * (t->count + 1) > t->size) {
+        growVisitTable(t);
+    }
+    idx = hashVisited(t, key);
+    while (t->entries[idx].epoch == t->epoch) {
+        ASSERT(t->entries[idx].key != key); // registered only once
+        idx = (idx + 1) & (t->size - 1);
+    }
+    t->entries[idx].key = key;
+    t->entries[idx].offset = offset;
+    t->entries[idx].epoch = t->epoch;
+    t->count++;
     // note: offset is never 0 (indicates failing lookup), PADDING is 1
 }
 
@@ -457,17 +835,32 @@ STATIC_INLINE void registerOffset(PackState* p, StgClosure *closure) {
 // offsetFor returns 0 => closure has _not_ been packed
 // (root closure gets offset 1, see PADDING above)
 STATIC_INLINE StgWord offsetFor(PackState* p, StgClosure *closure) {
-    // avoid typecast warnings...
-    void* offset;
-    offset = lookupHashTable(p->offsets, UNTAG_CAST(StgWord, closure));
-                             // remove tag for offset
-    return (StgWord) offset;
+    VisitTable *t = p->visited;
+    StgWord key = UNTAG_CAST(StgWord, closure); // remove tag for offset
+    uint32_t idx;
+
+    idx = hashVisited(t, key);
+    while (t->entries[idx].epoch == t->epoch) {
+        if (t->entries[idx].key == key) {
+            return t->entries[idx].offset;
+        }
+        idx = (idx + 1) & (t->size - 1);
+    }
+    return 0;
 }
 
 // roomToPack checks if the buffer has enough space to pack the given size (in
 // StgWords). For GUM, it would also include queue size * FETCHME-size.
 STATIC_INLINE bool roomToPack(PackState* p, uint32_t size)
 {
+#ifndef LIBRARY_CODE
+    if (p->flush != NULL || p->grow) {
+        // chunked packing: closures may span chunks (Pack() flushes the
+        // full buffer), or the scratch buffer grows when full. We only
+        // stop when a flush has failed or the maximum size is reached.
+        return !p->overflow;
+    }
+#endif
     if ((p->position +  // where we are in the buffer right now
          size +         // space needed for the current closure
 #if defined(GUM)
@@ -667,7 +1060,7 @@ getClosureInfo(StgClosure* node, StgInfoTable* info,
  *   them in the packet somehow.
  *   => Closure pointers in the closure queue are stored *WITH TAGS*,
  *   and we pack the tags together with the closure.
- *   OTOH, *offsets* (HashTable entries) are stored without tags, in
+ *   OTOH, *offsets* (visited table keys) are stored without tags, in
  *   order to catch the case when two references with different tags
  *   exist (possible?)
  *   (the tag of the first occurrence will win, a problem?)
@@ -718,10 +1111,100 @@ STATIC_INLINE void PackOffset(PackState* p, StgWord offset) {
 
 // helper accessing the pack buffer
 STATIC_INLINE void Pack(PackState* p, StgWord data) {
+#ifndef LIBRARY_CODE
+    // the buffer can only run full when packing in chunks or into the
+    // scratch buffer (otherwise, roomToPack has been checked before)
+    if (p->position == p->size) {
+        if (p->grow) {
+            growScratch(p);
+        } else {
+            flushChunk(p);
+        }
+    }
+#endif
     ASSERT(p->position < p->size);
     p->buffer[p->position++] = data;
 }
 
+#ifndef LIBRARY_CODE
+// hand out the full buffer to the flush function and restart at its
+// beginning. Once a flush has failed, nothing is handed out any more, the
+// data is discarded until packClosure returns (see roomToPack).
+static void flushChunk(PackState* p) {
+    ASSERT(p->flush != NULL);
+
+    if (!p->overflow) {
+        PACKDEBUG(debugBelch("Pack buffer full, flushing chunk of %d words "
+                             "(%d words before)\n", p->position, p->base));
+        p->overflow = !p->flush(p->flushArg, p->position);
+    }
+    p->base += p->position;
+    p->position = 0;
+    if (p->segments != NULL) { // they referred to the chunk just handed out
+        p->segments->count = 0;
+    }
+}
+
+// the payload of a large byte array is not copied, its place in the buffer
+// is skipped and recorded as a segment (split when it spans chunks). When
+// the segment list is full, the rest is copied as usual.
+static void packSegment(PackState* p, StgWord *data, uint32_t words) {
+    PackSegments *segs = p->segments;
+    uint32_t n;
+
+    while (words > 0) {
+        if (p->position == p->size) {
+            flushChunk(p);
+        }
+        if (segs->count == MAX_PACK_SEGMENTS) {
+            break;
+        }
+        n = stg_min(words, p->size - p->position);
+        segs->seg[segs->count].at = p->position;
+        segs->seg[segs->count].size = n;
+        segs->seg[segs->count].data = data;
+        segs->count++;
+        PACKDEBUG(debugBelch("Segment of %d words at %d (data @ %p)\n",
+                             n, p->position, data));
+        p->position += n;
+        data += n;
+        words -= n;
+    }
+    while (words > 0) {
+        Pack(p, *data++);
+        words--;
+    }
+}
+
+// double the scratch buffer (realloc keeps the data packed so far), at most
+// up to the maximum pack buffer size. When the maximum is reached, data is
+// discarded until packClosure returns, and packing fails with P_NOBUFFER.
+static void growScratch(PackState* p) {
+    PackCache *cache = p->cache;
+    uint32_t maxSize, newSize;
+
+    ASSERT(p->buffer == cache->scratch && p->size == cache->scratchSize);
+
+    maxSize = RtsFlags.ParFlags.packBufferSize / sizeof(StgWord);
+    if (p->overflow || p->size >= maxSize) {
+        p->overflow = true;
+        p->position = 0;
+        return;
+    }
+
+    newSize = (p->size > maxSize / 2) ? maxSize : 2 * p->size;
+    PACKDEBUG(debugBelch("Scratch buffer full, growing from %d to %d words\n",
+                         p->size, newSize));
+    cache->scratch = (StgWord*)
+        stgReallocBytes(cache->scratch, newSize * sizeof(StgWord),
+                        "growScratch");
+    cache->scratchSize = newSize;
+
+    p->buffer = cache->scratch;
+    p->size = newSize;
+}
+#endif
+
 #if defined(LIBRARY_CODE)
 // pmtryPackToBuffer: interface function called by the foreign primop.
 // Returns packed size (in bytes!) + P_ERRCODEMAX when successful, or
@@ -756,12 +1239,11 @@ int pmtryPackToBuffer(StgClosure* closure, StgArrBytes* mutArr) {
 
     /* Record how much space the graph needs in packet and in heap */
     size = p->position; // need to offset it for the primop to recognise errors
-    // globalPackBuffer->unpacked_size = unpacked_size; XXX unpackedSize
 
     PACKDEBUG(debugBelch("** Finished packing graph %p (%s); "
                          "packed size: %d words; size of graph: %d\n",
                          closure, info_type(UNTAG_CLOSURE(closure)),
-                         size, 0)); // globalPackBuffer->unpacked_size));
+                         size, p->unpacked_size));
 
     /* done packing */
     donePacking(p);
@@ -778,10 +1260,98 @@ int pmtryPackToBuffer(StgClosure* closure, StgArrBytes* mutArr) {
 // Returns packed size (in bytes!) + P_ERRCODEMAX when successful, or
 // error codes upon failure
 int packToBuffer(StgClosure* closure,
-                 StgWord *buffer, uint32_t bufsize, StgTSO *caller) {
+                 StgWord *buffer, uint32_t bufsize, StgTSO *caller,
+                 uint32_t *unpackedSize) {
+    int result;
+    PackOptions opts = {
+        .cache = (caller != NULL) ? getPackCache(caller->cap) : NULL
+    };
+#if defined(PARALLEL_RTS)
+    Time start = stat_parClock();
+#endif
+
+    result = packToBuffer_(closure, buffer, bufsize, caller, &opts,
+                           unpackedSize);
+#if defined(PARALLEL_RTS)
+    stat_packed(result, stat_parClock() - start);
+#endif
+    return result;
+}
+
+#if defined(PARALLEL_RTS)
+// the flush function of packToBufferChunked, wrapped to measure the time
+// for sending chunks, which does not count as pack time
+typedef struct TimedFlush_ {
+    PackFlushFn flush;
+    void       *flushArg;
+    Time        time;
+} TimedFlush;
+
+static bool timedFlush(void *flushArg, uint32_t size) {
+    TimedFlush *t = (TimedFlush*) flushArg;
+    Time start = stat_parClock();
+    bool ok;
+
+    ok = t->flush(t->flushArg, size);
+    t->time += stat_parClock() - start;
+    return ok;
+}
+#endif
+
+// packToBufferChunked: graphs which do not fit into the buffer are packed
+// in chunks. Whenever the buffer is full, it is handed to the flush function
+// (with its size in words), and packing continues at its start. The
+// concatenated chunks form one ordinary packet (offsets count from the start
+// of the first chunk). Returns the size of the last chunk (in bytes!) +
+// P_ERRCODEMAX, or an error code; P_NOBUFFER if a flush has failed.
+// With a dest PE (not 0), the packet may use the sharing cache for dest,
+// and references to placeholders for blackholes (-qL), the caller has to
+// call commitSharing and commitRemoteRefs after sending it.
+// With segments, the payload of large byte arrays stays in the heap, the
+// segments of each chunk have to be sent along with it (by the flush
+// function, and by the caller for the last chunk).
+int packToBufferChunked(StgClosure* closure,
+                        StgWord *buffer, uint32_t bufsize, StgTSO *caller,
+                        PackFlushFn flush, void *flushArg, PEId dest,
+                        PackSegments *segments, uint32_t *unpackedSize) {
+    int result;
+    PackOptions opts = {
+        .flush    = flush,
+        .flushArg = flushArg,
+        .cache    = (caller != NULL) ? getPackCache(caller->cap) : NULL,
+        .dest     = dest,
+        .segments = segments
+    };
+#if defined(PARALLEL_RTS)
+    TimedFlush timed = { flush, flushArg, 0 };
+    Time start = stat_parClock();
+#endif
+
+    ASSERT(flush != NULL);
+#if defined(PARALLEL_RTS)
+    opts.flush = timedFlush;
+    opts.flushArg = &timed;
+#endif
+    result = packToBuffer_(closure, buffer, bufsize, caller, &opts,
+                           unpackedSize);
+#if defined(PARALLEL_RTS)
+    stat_packed(result, stat_parClock() - start - timed.time);
+#endif
+    return result;
+}
+
+// common worker for the above, and for packing into the (growing) scratch
+// buffer of a PackCache (tryPackToMemory, opts->grow). In the latter case,
+// buffer and bufsize must be the cache's scratch space, which may move while
+// packing. The heap words needed for the graph are stored in *unpackedSize
+// (unless NULL).
+static int packToBuffer_(StgClosure* closure,
+                         StgWord *buffer, uint32_t bufsize, StgTSO *caller,
+                         PackOptions *opts, uint32_t *unpackedSize) {
     int errcode = P_SUCCESS; // error code returned by PackClosure
     PackState* p;
     uint32_t size;
+    bool chunked USED_IF_DEBUG;
 
     PACKDEBUG( {
             char fpstr[MAX_FINGER_PRINT_LEN];
@@ -789,36 +1359,82 @@ int packToBuffer(StgClosure* closure,
             debugBelch("RTS packs subgraph @ %p\nGraph fingerprint is\n"
                        "\t{%s}\n", closure, fpstr);
         });
-    p = initRtsPacking(buffer, bufsize, caller);
+    p = initRtsPacking(buffer, bufsize, caller, opts->cache);
+    p->flush = opts->flush;
+    p->flushArg = opts->flushArg;
+    p->grow = opts->grow;
+#if defined(PARALLEL_RTS)
+    p->sharing = (opts->dest != 0) ? getSharingCache(opts->dest) : NULL;
+    p->remoteDest = RtsFlags.ParFlags.remoteRefs ? opts->dest : 0;
+#endif
+    ASSERT(opts->segments == NULL || !opts->grow);
+    p->segments = opts->segments;
+    if (p->segments != NULL) {
+        p->segments->count = 0;
+    }
 
     queueClosure(p->queue, closure);
     do {
         errcode = packClosure(p, deQueueClosure(p->queue));
+        if (errcode == P_SUCCESS && p->overflow) {
+            // a chunk could not be handed out, caller should retry
+            errcode = P_NOBUFFER;
+        }
         if (errcode != P_SUCCESS) {
+#if defined(PARALLEL_RTS)
+            if (p->sharing != NULL) { // nothing is sent
+                endSharing(p->sharing, false);
+            }
+            commitRemoteRefs(false);
+#endif
             donePacking(p);
             return (errcode);
             // small value => error (real size offset by P_ERRCODEMAX)
         }
     } while (!queueEmpty(p->queue));
 
+#if defined(PARALLEL_RTS)
+    // slots of the sharing cache defined by this packet
+    if (p->sharing != NULL) {
+        packSharingDefs(p);
+    }
+#endif
+
     /* Check for buffer overflow (again) */
-    ASSERT((p->position + DBG_HEADROOM) < p->size);
+    ASSERT(p->flush != NULL || p->grow
+           || (p->position + DBG_HEADROOM) < p->size);
     IF_DEBUG(sanity, // write magic end-of-buffer word
-             p->buffer[p->position++] = END_OF_BUFFER_MARKER);
+             Pack(p, END_OF_BUFFER_MARKER));
+    if (p->overflow) { // possible when flushing for the marker
+#if defined(PARALLEL_RTS)
+        if (p->sharing != NULL) {
+            endSharing(p->sharing, false);
+        }
+        commitRemoteRefs(false);
+#endif
+        donePacking(p);
+        return P_NOBUFFER;
+    }
 
     /* Record how much space the graph needs in packet and in heap */
     size = p->position; // need to offset it for the primop to recognise errors
-    // unpacked_size = p->unpacked_size; XXX unpackedSize
+    if (unpackedSize != NULL) {
+        *unpackedSize = p->unpacked_size;
+    }
+    chunked = p->base != 0;
+    buffer = p->buffer; // scratch buffer might have moved
 
     PACKDEBUG(debugBelch("** Finished packing graph %p (%s); "
-                         "packed size: %d words; size of graph: %d\n",
+                         "packed size: %d words (%d in earlier chunks); "
+                         "size of graph: %d\n",
                          closure, info_type(UNTAG_CLOSURE(closure)),
-                         size, 0)); // globalPackBuffer->unpacked_size));
+                         size, p->base, p->unpacked_size));
 
     /* done packing */
     donePacking(p);
 
-    IF_DEBUG(sanity, checkPacket(buffer, size));
+    // a chunked packet can only be checked when all chunks are joined
+    IF_DEBUG(sanity, if (!chunked) checkPacket(buffer, size));
 
     size = size*sizeof(StgWord) + P_ERRCODEMAX;
     // need offset to recognise errors in primop
@@ -826,35 +1442,81 @@ int packToBuffer(StgClosure* closure,
     return (int) size;
 }
 
-// pack, then copy the buffer into newly (Haskell-)allocated space
-// (unless packing was blocked, in which case we return the error code)
+// the capability's cached packing data, allocated on first use (the
+// tables inside are allocated when first needed)
+static PackCache* getPackCache(Capability *cap) {
+    PackCache *cache = cap->pack_cache;
+
+    if (cache == NULL) {
+        cache = (PackCache*) stgMallocBytes(sizeof(PackCache), "pack cache");
+        cache->scratch = NULL;
+        cache->scratchSize = 0;
+        cache->visited = NULL;
+        cache->offsets = NULL;
+        cache->offsetsSize = 0;
+        cache->region.free = cache->region.lim = NULL;
+        cache->region.gen = NULL;
+        cache->region.bd = cache->region.last = NULL;
+        cap->pack_cache = cache;
+    }
+    return cache;
+}
+
+// free the cached data, called from Capability.c::freeCapability.
+// Declared in Parallel.h
+void freePackCache(Capability *cap) {
+    PackCache *cache = cap->pack_cache;
+
+    if (cache != NULL) {
+        if (cache->scratch != NULL) {
+            stgFree(cache->scratch);
+        }
+        if (cache->visited != NULL) {
+            freeVisitTable(cache->visited);
+        }
+        if (cache->offsets != NULL) {
+            stgFree(cache->offsets);
+        }
+        stgFree(cache);
+        cap->pack_cache = NULL;
+    }
+}
+
+// pack into the capability's scratch buffer, then copy the packet into
+// newly (Haskell-)allocated space (unless packing was blocked, in which case
+// we return the error code). The scratch buffer grows geometrically while
+// packing (no repeated packing on buffer overflow). It is kept for the next
+// call at its initial size, a grown one is freed (otherwise, each
+// capability would hold up to the maximum pack buffer size for good).
 // This implements primitive serialize# and #trySerialize (if tso==NULL).
 StgClosure* tryPackToMemory(StgClosure* graphroot,
                             StgTSO* tso, Capability* cap) {
-    StgWord *buffer;
-    StgWord packedSize, trySize;
-    StgArrBytes* wordArray;
+    PackCache *cache;
+    PackOptions opts = { .grow = true };
+    StgWord packedSize;
+    StgArrBytes* wordArray = NULL;
+    uint32_t initialSize;
 
 #define ONEMEGABYTE 1048576
-    trySize = ONEMEGABYTE; // start with 1MB buffer, increase if it fails
-
-    buffer = (StgWord*) stgMallocBytes(trySize, "serialize buffer");
-    packedSize = packToBuffer(graphroot, buffer, trySize, tso);
-
-    while (packedSize == P_NOBUFFER // packing failed due to buffer overflow
-           && trySize <= RtsFlags.ParFlags.packBufferSize) {
-        // increase and retry (until max, given as RtsFlag)
-        stgFree(buffer);
-        trySize += ONEMEGABYTE;
-        buffer = (StgWord*) stgMallocBytes(trySize, "serialize buffer");
-        packedSize = packToBuffer(graphroot, buffer, trySize, tso);
+    // start with 1MB (or the maximum, if smaller), grows when needed
+    initialSize = stg_min(ONEMEGABYTE, RtsFlags.ParFlags.packBufferSize)
+                  / sizeof(StgWord);
+
+    cache = getPackCache(cap);
+    if (cache->scratch == NULL) {
+        cache->scratchSize = initialSize;
+        cache->scratch = (StgWord*)
+            stgMallocBytes(cache->scratchSize * sizeof(StgWord),
+                           "serialize buffer");
     }
+    opts.cache = cache;
+    packedSize = packToBuffer_(graphroot, cache->scratch, cache->scratchSize,
+                               tso, &opts, NULL);
 
-    // here: not failing due to NOBUFFER
+    // here: P_NOBUFFER only if the maximum size was exceeded
 
     if (isPackError(packedSize)) {
         // packing hit an error, return this error to caller
-        stgFree(buffer);
 #ifndef DEBUG
         // if we are not debugging, crash the system upon impossible cases.
         if (packedSize == P_IMPOSSIBLE) {
@@ -862,22 +1524,438 @@ StgClosure* tryPackToMemory(StgClosure* graphroot,
             // never returns
         }
 #endif
+    } else {
+        packedSize -= P_ERRCODEMAX; // now size is correct, in bytes
+
+        // allocate space to hold an array
+        //   +---------+----------+------------------------+
+        //   |ARR_WORDS| n_bytes  | data (array of words)  |
+        //   +---------+----------+------------------------+
+        wordArray = (StgArrBytes*)
+            allocate(cap, sizeofW(StgArrBytes) + packedSize / sizeof(StgWord));
+        SET_HDR(wordArray, &stg_ARR_WORDS_info, CCS_SYSTEM);
+        wordArray->bytes = packedSize;
+        memcpy((void*) &(wordArray->payload), cache->scratch, packedSize);
+    }
+
+    // a scratch buffer which has grown is not kept
+    if (cache->scratchSize > initialSize) {
+        PACKDEBUG(debugBelch("Freeing scratch buffer of %d words\n",
+                             cache->scratchSize));
+        stgFree(cache->scratch);
+        cache->scratch = NULL;
+        cache->scratchSize = 0;
+    }
+
+    if (wordArray == NULL) {
         return ((StgClosure*) packedSize);
     }
+    return ((StgClosure*) wordArray);
+}
+#endif
 
-    packedSize -= P_ERRCODEMAX; // now size is correct, in bytes
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+/*******************************************************************
+ * Sharing cache between PEs (-qC<n>), see SharingCache above.
+ *
+ * The caches are allocated on first use, one per other PE, and are
+ * accessed with the parallel lock held (packing for a message,
+ * unpacking a received one, and after GC).
+ */
+static SharingCache **sharingCaches = NULL;
+static uint32_t sharingPEs = 0; // nPEs is 0 after shutdown
 
-    // allocate space to hold an array
-    //   +---------+----------+------------------------+
-    //   |ARR_WORDS| n_bytes  | data (array of words)  |
-    //   +---------+----------+------------------------+
-    wordArray = (StgArrBytes*) allocate(cap, 2 + packedSize / sizeof(StgWord));
-    SET_HDR(wordArray, &stg_ARR_WORDS_info, CCS_SYSTEM);
-    wordArray->bytes = packedSize;
-    memcpy((void*) &(wordArray->payload), buffer, packedSize);
-    stgFree(buffer);
+static SharingCache* getSharingCache(PEId pe) {
+    uint32_t n = RtsFlags.ParFlags.sharingSlots;
+    SharingCache *c;
 
-    return ((StgClosure*) wordArray);
+    if (n == 0 || pe == thisPE || pe == 0 || pe > nPEs) {
+        return NULL;
+    }
+    if (sharingCaches == NULL) {
+        sharingCaches = (SharingCache**)
+            stgCallocBytes(nPEs, sizeof(SharingCache*), "sharing caches");
+        sharingPEs = nPEs;
+    }
+    c = sharingCaches[pe-1];
+    if (c == NULL) {
+        c = (SharingCache*) stgMallocBytes(sizeof(SharingCache),
+                                           "sharing cache");
+        c->out = (StgStablePtr*)
+            stgMallocBytes(n * sizeof(StgStablePtr), "sharing cache");
+        c->outCount = 0;
+        c->next = 0;
+        c->index = allocHashTable();
+        c->indexValid = true;
+        c->seen = (StgWord*) stgCallocBytes(n, sizeof(StgWord),
+                                            "sharing cache");
+        c->pending = (StgStablePtr*)
+            stgMallocBytes(n * sizeof(StgStablePtr), "sharing cache");
+        c->npending = 0;
+        c->in = (StgStablePtr*)
+            stgMallocBytes(n * sizeof(StgStablePtr), "sharing cache");
+        c->inCount = 0;
+        sharingCaches[pe-1] = c;
+    }
+    return c;
+}
+
+// worth remembering: immutable heap closures with pointers (which may
+// lead to a large subgraph). Thunks are not, they are updated.
+STATIC_INLINE bool isShareable(StgClosure *closure, StgInfoTable *info) {
+    switch (info->type) {
+    case CONSTR:
+    case CONSTR_1_0:
+    case CONSTR_2_0:
+    case CONSTR_1_1:
+        return HEAP_ALLOCED(closure) && info->layout.payload.ptrs > 0;
+    case FUN:
+    case FUN_1_0:
+    case FUN_2_0:
+    case FUN_1_1:
+        return info->layout.payload.ptrs > 0;
+    case MUT_ARR_PTRS_FROZEN_CLEAN:
+    case MUT_ARR_PTRS_FROZEN_DIRTY:
+#if __GLASGOW_HASKELL__ >= 709
+    case SMALL_MUT_ARR_PTRS_FROZEN_CLEAN:
+    case SMALL_MUT_ARR_PTRS_FROZEN_DIRTY:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+// direct-mapped seen table, same hashing as the visited table
+STATIC_INLINE uint32_t hashSeen(StgWord key) {
+    StgWord h = (key / sizeof(StgWord)) * (StgWord) 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (h ^ (h >> (sizeof(StgWord) * 4)))
+           % RtsFlags.ParFlags.sharingSlots;
+}
+
+// the slot (+1) in which the receiver has the closure at address key,
+// 0 if it does not have it. The index is rebuilt after GC.
+static uint32_t sharedSlot(SharingCache *c, StgWord key) {
+    uint32_t i;
+
+    if (!c->indexValid) {
+        freeHashTable(c->index, NULL);
+        c->index = allocHashTable();
+        for (i = 0; i < c->outCount; i++) {
+            insertHashTable(c->index,
+                            UNTAG_CAST(StgWord, deRefStablePtr(c->out[i])),
+                            (void*) (StgWord) (i + 1));
+        }
+        c->indexValid = true;
+    }
+    return (uint32_t) (StgWord) lookupHashTable(c->index, key);
+}
+
+// packs a reference if the receiver has the closure already (and returns
+// true). Otherwise, a closure which is packed for this PE the second time
+// gets a new slot (defined after the graph, see packSharingDefs), unless
+// all slots are being defined in this message already.
+static bool packShared(PackState* p, StgClosure *closure) {
+    SharingCache *c = p->sharing;
+    StgWord key = UNTAG_CAST(StgWord, closure);
+    uint32_t slot, h;
+
+    slot = sharedSlot(c, key);
+    if (slot != 0) {
+        PACKETDEBUG(debugBelch("*>~~ Packing %p as sharing cache slot %d\n",
+                               closure, slot-1));
+        Pack(p, CACHEREF);
+        Pack(p, (StgWord) (slot-1));
+        return true;
+    }
+
+    h = hashSeen(key);
+    if (c->seen[h] != key) {
+        c->seen[h] = key;
+    } else if (c->npending < RtsFlags.ParFlags.sharingSlots) {
+        slot = c->next;
+        PACKETDEBUG(debugBelch("*>~~ Defining sharing cache slot %d as %p\n",
+                               slot, closure));
+        c->pending[slot] = getStablePtr((StgPtr) closure);
+        c->npending++;
+        c->next = (slot + 1) % RtsFlags.ParFlags.sharingSlots;
+    }
+    return false;
+}
+
+// append the slots defined in this packet (offsets of their closures),
+// if the packet is sent in one piece and has room for them. Otherwise
+// they are dropped.
+static void packSharingDefs(PackState* p) {
+    SharingCache *c = p->sharing;
+    uint32_t n = RtsFlags.ParFlags.sharingSlots;
+    uint32_t i, slot;
+
+    if (c->npending == 0) {
+        return;
+    }
+    if (p->base != 0 || p->overflow
+        || p->position + 3 + c->npending + DBG_HEADROOM >= p->size) {
+        endSharing(c, false);
+        return;
+    }
+
+    slot = (c->next + n - c->npending) % n;
+    Pack(p, CACHEDEF);
+    Pack(p, (StgWord) c->npending);
+    Pack(p, (StgWord) slot);
+    for (i = 0; i < c->npending; i++, slot = (slot + 1) % n) {
+        Pack(p, offsetFor(p, (StgClosure*) deRefStablePtr(c->pending[slot])));
+    }
+}
+
+// slots defined while packing a message become valid when it was sent,
+// otherwise they are dropped (and defined again when packing again)
+static void endSharing(SharingCache *c, bool sent) {
+    uint32_t n = RtsFlags.ParFlags.sharingSlots;
+    uint32_t i, slot;
+    StgWord key;
+
+    // the slots from next (before packing) onwards
+    slot = (c->next + n - c->npending) % n;
+    for (i = 0; i < c->npending; i++, slot = (slot + 1) % n) {
+        if (!sent) {
+            freeStablePtr(c->pending[slot]);
+            continue;
+        }
+        if (slot < c->outCount) {
+            if (c->indexValid) {
+                key = UNTAG_CAST(StgWord, deRefStablePtr(c->out[slot]));
+                removeHashTable(c->index, key, NULL);
+            }
+            freeStablePtr(c->out[slot]);
+        } else {
+            ASSERT(slot == c->outCount);
+            c->outCount++;
+        }
+        c->out[slot] = c->pending[slot];
+        if (c->indexValid) {
+            key = UNTAG_CAST(StgWord, deRefStablePtr(c->out[slot]));
+            insertHashTable(c->index, key, (void*) (StgWord) (slot + 1));
+        }
+    }
+    if (!sent) {
+        c->next = (c->next + n - c->npending) % n;
+    }
+    c->npending = 0;
+}
+
+// called after sending (or failing to send) a message packed for pe.
+// Declared in Parallel.h
+void commitSharing(PEId pe, bool sent) {
+    SharingCache *c;
+
+    if (sharingCaches == NULL || pe == 0 || pe > sharingPEs) {
+        return;
+    }
+    c = sharingCaches[pe-1];
+    if (c != NULL && c->npending != 0) {
+        endSharing(c, sent);
+    }
+}
+
+// closures have moved in GC: the index is rebuilt when next used, and
+// addresses in the seen tables are stale. Called from GC.c
+void updateSharingCaches(void) {
+    uint32_t i;
+
+    if (sharingCaches == NULL) {
+        return;
+    }
+    ACQUIRE_PAR_LOCK();
+    for (i = 0; i < sharingPEs; i++) {
+        if (sharingCaches[i] != NULL) {
+            sharingCaches[i]->indexValid = false;
+            memset(sharingCaches[i]->seen, 0,
+                   RtsFlags.ParFlags.sharingSlots * sizeof(StgWord));
+        }
+    }
+    RELEASE_PAR_LOCK();
+}
+
+// free the caches at shutdown. The stable pointers go away with the
+// stable pointer table. Declared in Parallel.h
+void freeSharingCaches(void) {
+    uint32_t i;
+    SharingCache *c;
+
+    if (sharingCaches == NULL) {
+        return;
+    }
+    for (i = 0; i < sharingPEs; i++) {
+        c = sharingCaches[i];
+        if (c != NULL) {
+            stgFree(c->out);
+            freeHashTable(c->index, NULL);
+            stgFree(c->seen);
+            stgFree(c->pending);
+            stgFree(c->in);
+            stgFree(c);
+        }
+    }
+    stgFree(sharingCaches);
+    sharingCaches = NULL;
+    sharingPEs = 0;
+}
+
+/*******************************************************************
+ * Remote references (-qL)
+ *
+ * A blackhole in a data message (a thunk under evaluation) does not
+ * block the sending thread: it is packed as a reference to a
+ * placeholder, and its value is sent on its own once the blackhole has
+ * been updated (PP_VALUE, see DataComms.c):
+ *
+ *   | REMOTEREF | id |
+ *
+ * The sender keeps the blackholes in stable pointers, with the receiving
+ * PE and the reference number (id). The references packed for a message
+ * become valid when it was sent (commitRemoteRefs), as for the sharing
+ * cache. The receiver unpacks a blackhole owned by the system tso (as
+ * for an inport) as the placeholder, which threads needing the value
+ * block on, and keeps it by sending PE and id until the value arrives.
+ *
+ * This is the FETCH_ME of GUM without global addresses: the value is
+ * pushed to the one receiver when it is there, nothing is fetched.
+ * Accessed with the parallel lock held.
+ */
+typedef struct RemoteRef_ {
+    StgStablePtr bh;   // the blackhole (updated later)
+    PEId         dest; // PE with the placeholder
+    StgWord      id;
+} RemoteRef;
+
+static RemoteRef *remoteRefs = NULL;
+static uint32_t   remoteRefsCount = 0;   // entries, the pending ones last
+static uint32_t   remoteRefsSize = 0;
+static uint32_t   remoteRefsPending = 0; // packed for the current message
+static StgWord    nextRemoteRef = 1;
+
+// receiving side: placeholders by sending PE, id -> stable pointer + 1
+// (stable pointer 0 is valid)
+static HashTable **placeholders = NULL;
+static uint32_t    placeholderPEs = 0;
+
+// packs a reference to a placeholder for the blackhole, to be updated
+// with its value on p->remoteDest
+static StgWord PackRemoteRef(PackState* p, StgClosure *closure) {
+    RemoteRef *r;
+
+    if (!roomToPack(p, 2)) {
+        return P_NOBUFFER;
+    }
+    if (remoteRefsCount == remoteRefsSize) {
+        remoteRefsSize = (remoteRefsSize == 0) ? 64 : 2 * remoteRefsSize;
+        remoteRefs = (RemoteRef*)
+            stgReallocBytes(remoteRefs, remoteRefsSize * sizeof(RemoteRef),
+                            "remote references");
+    }
+    r = &remoteRefs[remoteRefsCount++];
+    remoteRefsPending++;
+    r->bh = getStablePtr((StgPtr) UNTAG_CLOSURE(closure));
+    r->dest = p->remoteDest;
+    r->id = nextRemoteRef++;
+
+    PACKETDEBUG(debugBelch("*>## Packing blackhole %p as remote reference %"
+                           FMT_Word " for PE %d\n", closure, r->id,
+                           (int) r->dest));
+
+    // references to the blackhole in the same packet are offsets
+    registerOffset(p, closure);
+    Pack(p, REMOTEREF);
+    Pack(p, r->id);
+    return P_SUCCESS;
+}
+
+// called after sending (or failing to send) a message packed for a dest
+// PE: the references packed for it are kept if it was sent, otherwise
+// dropped (and packed again, with new numbers). Declared in Parallel.h
+void commitRemoteRefs(bool sent) {
+    if (!sent) {
+        for (; remoteRefsPending > 0; remoteRefsPending--) {
+            freeStablePtr(remoteRefs[--remoteRefsCount].bh);
+        }
+    }
+    remoteRefsPending = 0;
+}
+
+// references waiting for their value. Declared in Parallel.h
+uint32_t outstandingRemoteRefs(void) {
+    return remoteRefsCount - remoteRefsPending;
+}
+
+// the value of reference i, with its PE and number, once the blackhole
+// has been updated. NULL while it is under evaluation. Declared in
+// Parallel.h
+StgClosure* remoteRefValue(uint32_t i, PEId *dest, StgWord *id) {
+    StgClosure *bh;
+
+    ASSERT(i < remoteRefsCount - remoteRefsPending);
+    bh = (StgClosure*) deRefStablePtr(remoteRefs[i].bh);
+    if (isBlackhole(bh)) {
+        return NULL;
+    }
+    *dest = remoteRefs[i].dest;
+    *id = remoteRefs[i].id;
+    return bh;
+}
+
+// drops reference i when its value was sent, the last one takes its
+// place. Declared in Parallel.h
+void removeRemoteRef(uint32_t i) {
+    ASSERT(remoteRefsPending == 0 && i < remoteRefsCount);
+    freeStablePtr(remoteRefs[i].bh);
+    remoteRefs[i] = remoteRefs[--remoteRefsCount];
+}
+
+// the placeholder for reference id of pe, removed from the table. NULL
+// if there is none. Declared in Parallel.h
+StgClosure* takePlaceholder(PEId pe, StgWord id) {
+    StgStablePtr sp;
+    StgClosure *placeholder;
+    void *entry;
+
+    if (placeholders == NULL || pe == 0 || pe > placeholderPEs
+        || placeholders[pe-1] == NULL) {
+        return NULL;
+    }
+    entry = removeHashTable(placeholders[pe-1], id, NULL);
+    if (entry == NULL) {
+        return NULL;
+    }
+    sp = (StgStablePtr) ((StgWord) entry - 1);
+    placeholder = (StgClosure*) deRefStablePtr(sp);
+    freeStablePtr(sp);
+    return placeholder;
+}
+
+// free the tables at shutdown (values which were not sent are dropped).
+// The stable pointers go away with the stable pointer table. Declared in
+// Parallel.h
+void freeRemoteRefs(void) {
+    uint32_t i;
+
+    if (remoteRefs != NULL) {
+        stgFree(remoteRefs);
+        remoteRefs = NULL;
+    }
+    remoteRefsCount = remoteRefsSize = remoteRefsPending = 0;
+    if (placeholders == NULL) {
+        return;
+    }
+    for (i = 0; i < placeholderPEs; i++) {
+        if (placeholders[i] != NULL) {
+            freeHashTable(placeholders[i], NULL);
+        }
+    }
+    stgFree(placeholders);
+    placeholders = NULL;
+    placeholderPEs = 0;
 }
 #endif
 
@@ -917,6 +1995,25 @@ loop:
     // code relies on info-pointers being word-aligned (they are tagged)
     ASSERT(info == UNTAG_CAST(StgInfoTable*, info));
 
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+    // the receiving PE may have the closure from an earlier message
+    if (p->sharing != NULL && isShareable(closure, info)
+        && packShared(p, closure)) {
+        return P_SUCCESS;
+    }
+#endif
+
+#ifndef LIBRARY_CODE
+    // closures inside a compact region which is in the packet already
+    // refer to the region (see PackCompact)
+    if (HEAP_ALLOCED(closure)
+        && (Bdescr((StgPtr) closure)->flags & BF_COMPACT) != 0
+        && info->type != COMPACT_NFDATA
+        && offsetFor(p, (StgClosure*) compactFirstBlock(closure)) != 0) {
+        return PackCompact(p, closure);
+    }
+#endif
+
     switch (info->type) {
 
         // follows order of ClosureTypes.h...
@@ -1054,6 +2151,13 @@ loop:
             case TSO: // blackhole without blocking queue
             case BLOCKING_QUEUE: // another thread already blocked here
 
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+                // With -qL, the receiver gets a placeholder for the
+                // blackhole, and its value later (see PackRemoteRef)
+                if (p->remoteDest != 0) {
+                    return PackRemoteRef(p, closure);
+                }
+#endif
 #ifndef LIBRARY_CODE
                 // For the in-RTS version: If the calling TSO is known, it can
                 // block on this Blackhole until it is updated/data arrives.
@@ -1182,13 +2286,14 @@ loop:
 
 #if __GLASGOW_HASKELL__ >= 801
     case COMPACT_NFDATA:
-        // a chain of blocks full of self-contained NFData. We could
-        // choose to serialise the entire chain of blocks, but would
-        // then have to fix all included intra-region pointers. There
-        // is support for doing this in CNF.[ch], but using CNF here
-        // would be like a bus pulling a passenger train.
+        // a chain of blocks full of self-contained NFData, shipped as
+        // raw blocks (the receiver fixes the pointers, see PackCompact)
+#ifndef LIBRARY_CODE
+        return PackCompact(p, closure);
+#else
         goto unsupported;
 #endif
+#endif
 
 unsupported:
         PACKDEBUG(errorBelch("Pack: packing type %s (%p) not implemented",
@@ -1267,14 +2372,23 @@ static StgWord PackGeneric(PackState* p, StgClosure* closure)
         queueClosure(p->queue, ((StgClosure *) *(((StgPtr)closure)+(HEADERSIZE+vhs)+i)));
     }
 
-    // pack non-ptrs
+    // pack non-ptrs. The payload of a large byte array is left in the heap
+    // when the caller gathers segments (large objects do not move, and no
+    // GC happens before the packet is sent).
+#ifndef LIBRARY_CODE
+    if (p->segments != NULL && closure->header.info == &stg_ARR_WORDS_info
+        && nonptrs >= SEGMENT_MIN_WORDS
+        && (Bdescr((StgPtr) closure)->flags & BF_LARGE)) {
+        packSegment(p, ((StgPtr)closure)+HEADERSIZE+vhs+ptrs, nonptrs);
+    } else
+#endif
     for (i = 0; i < nonptrs; ++i) {
         Pack(p, (StgWord)*(((StgPtr)closure)+(HEADERSIZE+vhs)+ptrs+i));
     }
 
     ASSERT(HEADERSIZE+vhs+ptrs+nonptrs==size); // no slop in closure, all packed
 
-    // unpacked_size += size; XXX unpacked_size in PackState
+    p->unpacked_size += size;
 
 #if defined(GUM)
     // Record that this is a revertable black hole so that we can fill
@@ -1432,7 +2546,7 @@ static StgWord PackPAP(PackState *p, StgPAP *pap) {
     if (!roomToPack(p, hsize + n_args + 1 + bsizeW))
         return P_NOBUFFER;
 
-    // XXX unpacked_size += hsize + 1 + n_args; // == closure_size(pap)
+    p->unpacked_size += hsize + 1 + n_args; // == closure_size(pap)
 
     // register closure
     registerOffset(p, (StgClosure*) pap);
@@ -1500,7 +2614,7 @@ static StgWord PackPAP(PackState *p, StgPAP *pap) {
             } else {
                 // bit not set => pointer
                 queueClosure(p->queue, (StgClosure*) *ptr);
-                // XXX unpacked_size += sizeofW(StgInd); // unpacking creates IND
+                p->unpacked_size += sizeofW(StgInd); // unpacking creates IND
             }
             ptr++;
             bitmap = bitmap >> 1;
@@ -1613,10 +2727,111 @@ static StgWord PackArray(PackState *p, StgClosure *closure) {
     for (i=0; i<payloadsize; i++)
         queueClosure(p->queue, ((StgMutArrPtrs *) closure)->payload[i]);
 
-    // unpacked_size += closure_sizeW(closure); XXX unpacked_size
+    p->unpacked_size += closure_sizeW(closure);
+
+    return P_SUCCESS;
+}
+
+#ifndef LIBRARY_CODE
+// Packing compact regions (CNF.c): a compact region (Compact#) is shipped
+// as its chain of blocks, copied verbatim. The receiver allocates the same
+// number of blocks and adopts them with compactFixupPointers, which adjusts
+// the pointers inside the region to the new block addresses. No closure of
+// the region is traversed on either side. Closures inside a region which is
+// in the packet already (the data of the Compact, usually) refer to it
+// instead of being packed again:
+//
+//   | COMPACT | tag | 0 | block | offset | base | n | size 1 | data 1 | ..
+//                                                   .. | size n | data n |
+//   | COMPACT | tag | region | block | offset |
+//
+// block and offset (in words) locate the closure in the chain of blocks,
+// region is the offset of the packet entry which contains the blocks. The
+// address of BASE_SYM is included because the blocks contain plain info
+// pointers: the receiving PE needs to have the binary at the same address
+// (as for compact regions serialised by the libraries).
+//
+// Closures inside a region which is not (yet) in the packet are packed as
+// usual. The blocks of a compact never move (compacts are collected as a
+// whole), so their data can be left in the heap when the caller gathers
+// segments.
+
+// the first block of the compact region a closure lives in. Its address
+// identifies the region in the visited table (no closure lives there).
+STATIC_INLINE StgCompactNFDataBlock *compactFirstBlock(StgClosure *closure) {
+    return (StgCompactNFDataBlock*)
+        ((W_) objectGetCompact(closure) - sizeof(StgCompactNFDataBlock));
+}
+
+static StgWord PackCompact(PackState* p, StgClosure* closure) {
+    StgCompactNFDataBlock *first, *block, *b;
+    bdescr *bd;
+    StgWord tag, region, index, words, size, nblocks;
 
+    tag = GET_CLOSURE_TAG(closure);
+    closure = UNTAG_CLOSURE(closure);
+
+    first = compactFirstBlock(closure);
+    block = objectGetCompactBlock(closure);
+    for (index = 0, b = first; b != block; b = b->next) {
+        index++;
+    }
+    region = offsetFor(p, (StgClosure*) first);
+
+    // the blocks are packed unless the region is in the packet already
+    size = 5;
+    nblocks = 0;
+    if (region == 0) {
+        size += 2;
+        for (b = first; b != NULL; b = b->next) {
+            bd = Bdescr((StgPtr) b);
+            size += 1 + (bd->free - bd->start);
+            nblocks++;
+        }
+    }
+
+    PACKETDEBUG(debugBelch("*>== %p (%s): packing compact region %p "
+                           "(%" FMT_Word " blocks, %" FMT_Word " words)\n",
+                           closure, info_type(closure), first,
+                           nblocks, size));
+
+    if (!roomToPack(p, size))
+        return P_NOBUFFER;
+
+    registerOffset(p, closure);
+    if (region == 0) {
+        registerOffset(p, (StgClosure*) first);
+    }
+
+    Pack(p, COMPACT);
+    Pack(p, tag);
+    Pack(p, region);
+    Pack(p, index);
+    Pack(p, (StgWord) ((StgPtr) closure - (StgPtr) block));
+
+    if (region == 0) {
+        Pack(p, (StgWord) BASE_SYM);
+        Pack(p, nblocks);
+        for (b = first; b != NULL; b = b->next) {
+            bd = Bdescr((StgPtr) b);
+            words = bd->free - bd->start;
+            Pack(p, words);
+            if (p->segments != NULL && words >= SEGMENT_MIN_WORDS) {
+                packSegment(p, (StgWord*) b, words);
+            } else {
+                StgWord *data = (StgWord*) b;
+                while (words > 0) {
+                    Pack(p, *data++);
+                    words--;
+                }
+            }
+        }
+    }
+
+    // the blocks are not part of the unpacked_size (allocated separately)
     return P_SUCCESS;
 }
+#endif
 
 /*******************************************************************
  *   unpacking a graph structure:
@@ -1655,7 +2870,8 @@ StgClosure* unpackGraphWrapper(StgArrBytes* packBufferArray, Capability* cap)
     buffer = (StgWord*) packBufferArray->payload;
 
     // unpack. Might return NULL in case the buffer was inconsistent.
-    newGraph = unpackGraph_(buffer, size, cap);
+    // The heap size of the graph is not known here.
+    newGraph = unpackGraph_(buffer, size, 0, 0, cap);
 
     return (newGraph == NULL ? (StgClosure *) P_GARBLED : newGraph);
 }
@@ -1665,6 +2881,9 @@ StgClosure*
 unpackGraph(rtsPackBuffer *packBuffer, Capability* cap) {
 
   StgClosure *graphroot;
+#if defined(PARALLEL_RTS)
+  Time start = stat_parClock();
+#endif
 
   IF_DEBUG(sanity, // do a sanity check on the incoming packet
            checkPacket(packBuffer->buffer, packBuffer->size));
@@ -1673,12 +2892,17 @@ unpackGraph(rtsPackBuffer *packBuffer, Capability* cap) {
                        ", heapsize=%" FMT_Word ")\nUnpacking closures...\n",
                        packBuffer->size, packBuffer->unpacked_size));
 
-  graphroot = unpackGraph_(packBuffer->buffer, packBuffer->size, cap);
+  graphroot = unpackGraph_(packBuffer->buffer, packBuffer->size,
+                           packBuffer->sender.machine,
+                           (W_) packBuffer->unpacked_size, cap);
 
   // if this fails outside the library code, complain and abort the program
   if (graphroot == NULL) {
     barf("Failure during unpacking, aborting program");
   }
+#if defined(PARALLEL_RTS)
+  stat_unpacked(stat_parClock() - start);
+#endif
 
   // wipe the pack buffer if we do sanity checks.
   // Only valid for the in-RTS version where data is never reused
@@ -1697,19 +2921,57 @@ unpackGraph(rtsPackBuffer *packBuffer, Capability* cap) {
 // (used with with an immutable Haskell ByteArray# as buffer for
 // deserialisation). This function returns NULL upon
 // errors/inconsistencies in buffer (avoiding to abort the program).
-static StgClosure* unpackGraph_(StgWord *buffer, StgInt size, Capability* cap) {
+// from is the PE which sent the packet (sharing cache), 0 if none.
+// heapWords is the heap size of the graph (unpacked_size), 0 if unknown.
+// If known, all closures are allocated in one region (see UnpackRegion).
+static StgClosure* unpackGraph_(StgWord *buffer, StgInt size,
+                                uint32_t from USED_IF_SHARING,
+                                W_ heapWords USED_IF_IN_RTS,
+                                Capability* cap) {
     StgWord* bufptr;
     StgClosure *closure, *parent, *graphroot;
     uint32_t pptr = 0, pptrs = 0, pvhs = 0;
     uint32_t currentOffset;
-    HashTable* offsets;
+    UnpackOffsets offsets;
     ClosureQ* queue;
+#ifndef LIBRARY_CODE
+    PackCache *cache;
+    UnpackRegion *region;
+#endif
 
     PACKDEBUG(debugBelch("Unpacking buffer @ %p (%" FMT_Word " words)\n",
                          buffer, size));
     IF_DEBUG(sanity, checkPacket(buffer, size));
 
-    offsets = allocHashTable();
+    // offset table: one (cleared) entry per word of the packet
+    offsets.size = size + PADDING;
+#if defined(LIBRARY_CODE)
+    offsets.closures = (StgClosure**)
+        stgMallocBytes(offsets.size * sizeof(StgClosure*), "unpack offsets");
+#else
+    // reusing the capability's array
+    cache = getPackCache(cap);
+    if (cache->offsetsSize < offsets.size) {
+        if (cache->offsets != NULL) {
+            stgFree(cache->offsets);
+        }
+        cache->offsetsSize = stg_max(offsets.size, 2 * cache->offsetsSize);
+        cache->offsets = (StgClosure**)
+            stgMallocBytes(cache->offsetsSize * sizeof(StgClosure*),
+                           "unpack offsets");
+    }
+    offsets.closures = cache->offsets;
+#endif
+    memset(offsets.closures, 0, offsets.size * sizeof(StgClosure*));
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+    offsets.sharing = getSharingCache(from);
+    offsets.from = from;
+#endif
+#ifndef LIBRARY_CODE
+    region = &cache->region;
+    startUnpackRegion(cap, region, heapWords);
+#endif
+
     queue   = initClosureQ(size);
 
     graphroot = parent = (StgClosure *) NULL;
@@ -1721,7 +2983,7 @@ static StgClosure* unpackGraph_(StgWord *buffer, StgInt size, Capability* cap) {
 
         // Compute the offset to register for future back references
         // If this is itself an offset, or a PLC, we do not store anything
-        if (*bufptr == OFFSET || *bufptr == PLC) {
+        if (*bufptr == OFFSET || *bufptr == PLC || *bufptr == CACHEREF) {
             currentOffset = 0;
         } else {
             currentOffset = ((uint32_t) (bufptr - buffer)) + PADDING;
@@ -1731,13 +2993,17 @@ static StgClosure* unpackGraph_(StgWord *buffer, StgInt size, Capability* cap) {
         // Unpack one closure (or offset or PLC). This allocates heap
         // space, checks for PLC/offset etc. The returned pointer is
         // tagged with the tag found in the info pointer.
-        closure = UnpackClosure (queue, offsets, &bufptr, cap);
+        closure = UnpackClosure (queue, &offsets, &bufptr, cap);
 
         if (closure == NULL) {
             // something is wrong with the packet, give up immediately
             // we do not try to find out details of what is wrong...
             PACKDEBUG(debugBelch("Unpacking error at address %p",bufptr));
-            freeHashTable(offsets, NULL);
+#if defined(LIBRARY_CODE)
+            stgFree(offsets.closures);
+#else
+            endUnpackRegion(cap, region);
+#endif
             freeClosureQ(queue);
             return (StgClosure *) NULL;
         }
@@ -1747,7 +3013,8 @@ static StgClosure* unpackGraph_(StgWord *buffer, StgInt size, Capability* cap) {
             PACKETDEBUG(debugBelch("---> Entry in Offset Table: (%d, %p)\n",
                                    currentOffset, closure));
             // note that the offset is stored WITH TAG
-            insertHashTable(offsets, currentOffset, (void*) closure);
+            ASSERT(currentOffset < offsets.size);
+            offsets.closures[currentOffset] = closure;
         }
 
         // Set the pointer in the parent to point to chosen
@@ -1764,6 +3031,12 @@ static StgClosure* unpackGraph_(StgWord *buffer, StgInt size, Capability* cap) {
 
             // write ptr to new closure into parent at current position (pptr)
             ((StgPtr) parent)[HEADERSIZE + pvhs + pptr] = (StgWord) closure;
+#ifndef LIBRARY_CODE
+            // write barrier for a region in an older generation
+            if (region->gen != NULL && region->gen != g0) {
+                recordUnpacked(cap, region, parent, closure);
+            }
+#endif
         }
 
         // Locate next parent pointer (incr ppr, dequeue next closure at end)
@@ -1778,10 +3051,31 @@ static StgClosure* unpackGraph_(StgWord *buffer, StgInt size, Capability* cap) {
         // save the state. Not supported here.
 
         PACKDEBUG(errorBelch("Pack buffer overrun"));
+#if defined(LIBRARY_CODE)
+        stgFree(offsets.closures);
+#else
+        endUnpackRegion(cap, region);
+#endif
+        freeClosureQ(queue);
         return (StgClosure *) NULL;
     }
 
-    freeHashTable(offsets, NULL);
+#ifndef LIBRARY_CODE
+    endUnpackRegion(cap, region);
+#endif
+
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+    // slots of the sharing cache defined by the packet (after the graph)
+    if (size > (bufptr - buffer) && *bufptr == CACHEDEF
+        && !unpackSharingDefs(&offsets, &bufptr, buffer + size)) {
+        freeClosureQ(queue);
+        return (StgClosure *) NULL;
+    }
+#endif
+
+#if defined(LIBRARY_CODE)
+    stgFree(offsets.closures);
+#endif
     freeClosureQ(queue);
 
     // check magic end-of-buffer word
@@ -1803,6 +3097,197 @@ static StgClosure* unpackGraph_(StgWord *buffer, StgInt size, Capability* cap) {
     return graphroot;
 }
 
+#ifndef LIBRARY_CODE
+/*******************************************************************
+ * Heap region for unpacking (see UnpackRegion)
+ *******************************************************************/
+
+// reserves the region for a graph of words heap words (none if 0). Graphs
+// of at least -qO bytes go to the oldest generation.
+static void startUnpackRegion(Capability *cap, UnpackRegion *r, W_ words) {
+    r->free = r->lim = NULL;
+    r->gen = NULL;
+    r->bd = r->last = NULL;
+    r->needed = words;
+    r->used = 0;
+    r->recorded = NULL;
+
+    if (words == 0) {
+        return;
+    }
+#if defined(PARALLEL_RTS)
+    if (RtsFlags.ParFlags.unpackOldGen > 0
+        && words * sizeof(W_) >= RtsFlags.ParFlags.unpackOldGen) {
+        r->gen = oldest_gen;
+    }
+#endif
+    if (r->gen == NULL && words < LARGE_OBJECT_THRESHOLD/sizeof(W_)) {
+        // fits into a nursery block
+        r->free = allocate(cap, words);
+        r->lim = r->free + words;
+        r->needed = 0;
+    } else if (r->gen == NULL) {
+        r->gen = g0;
+    }
+    // blocks are taken when the first closure is allocated
+
+    PACKDEBUG(debugBelch("Unpacking %" FMT_Word " heap words into %s\n",
+                         words, r->gen == NULL ? "the nursery" :
+                         (r->gen == g0 ? "new blocks" : "the oldest gen.")));
+}
+
+// closes the region: unused nursery space is given back, the words in
+// blocks are accounted for
+static void endUnpackRegion(Capability *cap, UnpackRegion *r) {
+    if (r->gen == NULL) {
+        // the nursery block might have been used since (allocate)
+        if (r->free != NULL && cap->r.rCurrentAlloc != NULL
+            && cap->r.rCurrentAlloc->free == r->lim) {
+            cap->r.rCurrentAlloc->free = r->free;
+        }
+    } else if (r->bd != NULL) {
+        r->bd->free = r->free;
+        r->used += r->free - r->bd->start;
+
+        ACQUIRE_SM_LOCK;
+        r->gen->n_words += r->used;
+        if (r->gen == g0) {
+            // not in the nursery: counts towards the next GC like large
+            // objects do (see doYouWantToGC)
+            g0->n_new_large_words += r->used;
+        }
+        RELEASE_SM_LOCK;
+        cap->total_allocated += r->used;
+    }
+    r->free = r->lim = NULL;
+    r->gen = NULL;
+    r->bd = r->last = NULL;
+}
+
+// moves the region to its next block for a closure of n words, taking a
+// new block group when needed. False if the region is a piece of the
+// nursery (or none), or the closure does not fit into a block.
+static bool nextUnpackBlock(Capability *cap, UnpackRegion *r, W_ n) {
+    bdescr *bd;
+    W_ blocks, i;
+
+    if (r->gen == NULL || n > BLOCK_SIZE_W) {
+        return false;
+    }
+
+    if (r->bd != NULL) {
+        r->bd->free = r->free;
+        r->used += r->free - r->bd->start;
+    }
+    if (r->bd != NULL && r->bd != r->last) {
+        r->bd++; // the blocks of a group are adjacent
+    } else {
+        // blocks for the rest of the graph (not beyond a megablock, where
+        // block descriptors are missing)
+        blocks = stg_max(n, r->needed) / BLOCK_SIZE_W + 1;
+        blocks = stg_min(blocks, BLOCKS_PER_MBLOCK);
+
+        ACQUIRE_SM_LOCK;
+        bd = allocGroupOnNode(cap->node, blocks);
+        // single blocks, as in the nursery (see allocNursery), at the
+        // start of the generation's block list
+        for (i = 0; i < blocks; i++) {
+            initBdescr(&bd[i], r->gen, r->gen);
+            bd[i].blocks = 1;
+            // as all blocks of the heap outside the nursery
+            bd[i].flags = BF_EVACUATED;
+            bd[i].free = bd[i].start;
+            bd[i].link = (i + 1 < blocks) ? &bd[i+1] : r->gen->blocks;
+        }
+        r->gen->blocks = bd;
+        r->gen->n_blocks += blocks;
+        RELEASE_SM_LOCK;
+
+        PACKETDEBUG(debugBelch("%" FMT_Word " blocks for unpacking @ %p\n",
+                               blocks, bd->start));
+        r->bd = bd;
+        r->last = &bd[blocks - 1];
+    }
+    r->free = r->bd->start;
+    r->lim = r->bd->start + BLOCK_SIZE_W;
+    return true;
+}
+
+// allocation of a closure while unpacking: in the region if it fits,
+// otherwise as usual
+STATIC_INLINE StgPtr unpackAllocate(Capability *cap, W_ n) {
+    UnpackRegion *r = &cap->pack_cache->region;
+    StgPtr p;
+
+    if (r->free + n > r->lim && !nextUnpackBlock(cap, r, n)) {
+        return allocate(cap, n);
+    }
+    p = r->free;
+    r->free += n;
+    r->needed -= stg_min(n, r->needed);
+    return p;
+}
+
+// write barrier for a region in an older generation: closures pointing to
+// younger ones (allocated outside the region, or from the sharing cache)
+// go on the mutable list, once. Pointers are filled in parent by parent.
+static void recordUnpacked(Capability *cap, UnpackRegion *r,
+                           StgClosure *parent, StgClosure *closure) {
+    uint32_t gen_no;
+
+    if (parent == r->recorded || !HEAP_ALLOCED(closure)) {
+        return;
+    }
+    gen_no = Bdescr((StgPtr) parent)->gen_no;
+    if (Bdescr((StgPtr) closure)->gen_no >= gen_no) {
+        return;
+    }
+    switch (get_itbl(parent)->type) {
+    case MUT_ARR_PTRS_DIRTY: // on the list already (recordUnpackedArray)
+#if __GLASGOW_HASKELL__ >= 709
+    case SMALL_MUT_ARR_PTRS_DIRTY:
+#endif
+        break;
+    default:
+        recordMutableCap(parent, cap, gen_no);
+    }
+    r->recorded = parent;
+}
+
+// mutable arrays in an older generation are always on its mutable list,
+// and dirty, as the GC skips clean ones (see scavenge_mutable_list). The
+// elements are filled later, all cards are marked.
+static void recordUnpackedArray(Capability *cap, StgClosure *array) {
+    uint32_t gen_no;
+
+    switch (get_itbl(array)->type) {
+    case MUT_ARR_PTRS_CLEAN:
+    case MUT_ARR_PTRS_DIRTY:
+        gen_no = Bdescr((StgPtr) array)->gen_no;
+        if (gen_no == 0) {
+            return;
+        }
+        SET_INFO(array, &stg_MUT_ARR_PTRS_DIRTY_info);
+        memset(mutArrPtrsCard((StgMutArrPtrs*) array, 0), 1,
+               mutArrPtrsCards(((StgMutArrPtrs*) array)->ptrs));
+        break;
+#if __GLASGOW_HASKELL__ >= 709
+    case SMALL_MUT_ARR_PTRS_CLEAN:
+    case SMALL_MUT_ARR_PTRS_DIRTY:
+        gen_no = Bdescr((StgPtr) array)->gen_no;
+        if (gen_no == 0) {
+            return;
+        }
+        SET_INFO(array, &stg_SMALL_MUT_ARR_PTRS_DIRTY_info);
+        break;
+#endif
+    default:
+        return;
+    }
+    recordMutableCap(array, cap, gen_no);
+}
+#endif
+
 // locateNextParent finds the next pointer field in the parent
 // closure, retrieve information about its variable header size and
 // no. of pointers. If the current parent has been completely unpacked
@@ -1874,7 +3359,7 @@ STATIC_INLINE void locateNextParent(ClosureQ* q, StgClosure** parentP,
 // in the queue, but stored it WITHOUT TAG in the offset table (as a
 // key, value was the offset).
 static  StgClosure*
-UnpackClosure (ClosureQ* q, HashTable* offsets,
+UnpackClosure (ClosureQ* q, UnpackOffsets* offsets,
                StgWord **bufptrP, Capability* cap) {
     StgClosure *closure;
     uint32_t size,ptrs,nonptrs,vhs,i;
@@ -1895,6 +3380,19 @@ UnpackClosure (ClosureQ* q, HashTable* offsets,
         case OFFSET:
             closure = UnpackOffset(offsets, bufptrP);
             break;
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+        case CACHEREF: // closure from an earlier message (tagged as well)
+            closure = UnpackShared(offsets, bufptrP);
+            break;
+        case REMOTEREF: // placeholder for a value sent later
+            closure = UnpackRemoteRef(offsets, bufptrP, cap);
+            break;
+#endif
+#ifndef LIBRARY_CODE
+        case COMPACT: // closure in a compact region (tagged as well)
+            closure = UnpackCompact(offsets, bufptrP, cap);
+            break;
+#endif
         case CLOSURE:
 
             (*bufptrP)++; // skip marker
@@ -1989,7 +3487,7 @@ UnpackClosure (ClosureQ* q, HashTable* offsets,
                                 , size, info_type_by_ip(INFO_PTR_TO_STRUCT(ip)),
                                 ptrs, nonptrs, vhs));
 
-                closure = (StgClosure*) allocate(cap, size);
+                closure = (StgClosure*) unpackAllocate(cap, size);
 
                 // Remember, the generic closure layout is as follows:
                 //     +------------------------------------------------+
@@ -2021,6 +3519,11 @@ UnpackClosure (ClosureQ* q, HashTable* offsets,
 
                 ASSERT(HEADERSIZE+vhs+ptrs+nonptrs == size);
 
+#ifndef LIBRARY_CODE
+                // small mutable arrays in an older generation
+                recordUnpackedArray(cap, closure);
+#endif
+
                 queueClosure(q, closure);
                 break;
 
@@ -2042,11 +3545,12 @@ UnpackClosure (ClosureQ* q, HashTable* offsets,
     return TAG_CLOSURE(tag, closure);
 }
 
-// look up the closure's address for an offset in the hashtable
+// look up the closure's address for an offset in the offset table
 // advance buffer pointer while reading data
-STATIC_INLINE StgClosure *UnpackOffset(HashTable* offsets, StgWord **bufptrP) {
+STATIC_INLINE StgClosure *UnpackOffset(UnpackOffsets* offsets,
+                                       StgWord **bufptrP) {
     StgClosure* existing;
-    int offset;
+    uint32_t offset;
 
     ASSERT((long) **bufptrP == OFFSET);
 
@@ -2056,8 +3560,9 @@ STATIC_INLINE StgClosure *UnpackOffset(HashTable* offsets, StgWord **bufptrP) {
     (*bufptrP)++; // skip offset
 
     ASSERT(offset != 0);
-    // find this closure in an offset hashtable (we can have several packets)
-    existing = (StgClosure *) lookupHashTable(offsets, offset);
+    // find this closure in the offset table. Offsets outside the packet
+    // mean the packet is garbled, treated like a failing lookup
+    existing = (offset < offsets->size) ? offsets->closures[offset] : NULL;
 
     PACKETDEBUG(debugBelch("*<__ Unpacked indirection to closure %p"
                            " (was OFFSET %d)", existing, offset));
@@ -2068,6 +3573,118 @@ STATIC_INLINE StgClosure *UnpackOffset(HashTable* offsets, StgWord **bufptrP) {
     return existing;
 }
 
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+// look up a closure which the sending PE defined in its sharing cache
+// (advancing buffer pointer while reading). NULL if the slot is invalid.
+STATIC_INLINE StgClosure *UnpackShared(UnpackOffsets* offsets,
+                                       StgWord **bufptrP) {
+    SharingCache *c = offsets->sharing;
+    StgWord slot;
+
+    ASSERT((long) **bufptrP == CACHEREF);
+
+    (*bufptrP)++; // skip marker
+    slot = **bufptrP;
+    (*bufptrP)++; // skip slot
+
+    if (c == NULL || slot >= c->inCount) {
+        errorBelch("Unpacking: invalid sharing cache slot %" FMT_Word, slot);
+        return (StgClosure *) NULL;
+    }
+
+    PACKETDEBUG(debugBelch("*<__ Unpacked closure %p from sharing cache "
+                           "slot %" FMT_Word "\n",
+                           deRefStablePtr(c->in[slot]), slot));
+
+    return (StgClosure *) deRefStablePtr(c->in[slot]);
+}
+
+// unpack a reference to a value which the sending PE sends later: a new
+// placeholder, kept until the value arrives (see PackRemoteRef)
+STATIC_INLINE StgClosure *UnpackRemoteRef(UnpackOffsets* offsets,
+                                          StgWord **bufptrP, Capability *cap) {
+    StgClosure *placeholder;
+    StgStablePtr sp;
+    PEId from = offsets->from;
+    StgWord id;
+
+    ASSERT((long) **bufptrP == REMOTEREF);
+
+    (*bufptrP)++; // skip marker
+    id = **bufptrP;
+    (*bufptrP)++; // skip reference number
+
+    if (from == 0 || from > nPEs) {
+        errorBelch("Unpacking: unexpected remote reference %" FMT_Word, id);
+        return (StgClosure *) NULL;
+    }
+    if (placeholders == NULL) {
+        placeholders = (HashTable**)
+            stgCallocBytes(nPEs, sizeof(HashTable*), "placeholders");
+        placeholderPEs = nPEs;
+    }
+    if (placeholders[from-1] == NULL) {
+        placeholders[from-1] = allocHashTable();
+    }
+
+    placeholder = createBH(cap);
+    sp = getStablePtr((StgPtr) placeholder);
+    insertHashTable(placeholders[from-1], id, (void*) ((StgWord) sp + 1));
+
+    PACKETDEBUG(debugBelch("*<## Unpacked placeholder %p for remote "
+                           "reference %" FMT_Word " of PE %d\n",
+                           placeholder, id, (int) from));
+    return placeholder;
+}
+
+// define the slots of the sharing cache listed after the graph (by the
+// offsets of their closures). The sender defines slots in order, so the
+// first one is at most the number of slots in use. Returns false if the
+// data is invalid.
+static bool unpackSharingDefs(UnpackOffsets* offsets, StgWord **bufptrP,
+                              StgWord *end) {
+    SharingCache *c = offsets->sharing;
+    uint32_t n = RtsFlags.ParFlags.sharingSlots;
+    StgWord count, slot, offset, i;
+    StgClosure *closure;
+
+    ASSERT((long) **bufptrP == CACHEDEF);
+
+    if (c == NULL || end - *bufptrP < 3) {
+        errorBelch("Unpacking: unexpected sharing cache data");
+        return false;
+    }
+    count = (*bufptrP)[1];
+    slot  = (*bufptrP)[2];
+    (*bufptrP) += 3;
+    if (count > n || slot > c->inCount || slot >= n
+        || (StgWord) (end - *bufptrP) < count) {
+        errorBelch("Unpacking: invalid sharing cache slots (%" FMT_Word
+                   " from %" FMT_Word ")", count, slot);
+        return false;
+    }
+
+    for (i = 0; i < count; i++, slot = (slot + 1) % n) {
+        offset = *(*bufptrP)++;
+        closure = (offset < offsets->size) ? offsets->closures[offset] : NULL;
+        if (closure == NULL || slot > c->inCount) {
+            errorBelch("Unpacking: invalid sharing cache slot %" FMT_Word,
+                       slot);
+            return false;
+        }
+        PACKETDEBUG(debugBelch("*<__ Sharing cache slot %" FMT_Word
+                               " defined as %p\n", slot, closure));
+        if (slot < c->inCount) {
+            freeStablePtr(c->in[slot]);
+        } else {
+            c->inCount++;
+        }
+        c->in[slot] = getStablePtr((StgPtr) closure);
+    }
+    return true;
+}
+#endif
+
 // unpack a static address (advancing buffer pointer while reading)
 STATIC_INLINE  StgClosure *UnpackPLC(StgWord **bufptrP) {
     StgClosure* plc;
@@ -2133,7 +3750,7 @@ static StgClosure * UnpackPAP(ClosureQ *queue, StgInfoTable *info,
     }
     PACKETDEBUG(debugBelch("allocating %d heap words for a PAP (%d args)\n",
                            size,  n_args));
-    pap = (StgPtr) allocate(cap, size);
+    pap = (StgPtr) unpackAllocate(cap, size);
 
     // fill in info ptr (extracted and given as argument by caller)
     pap[0] = (StgWord) info;
@@ -2171,7 +3788,7 @@ static StgClosure * UnpackPAP(ClosureQ *queue, StgInfoTable *info,
                 // pointer to it on the stack
                 StgInd *ind;
                 // allocate a new closure
-                ind = (StgInd*) allocate(cap, sizeofW(StgInd));
+                ind = (StgInd*) unpackAllocate(cap, sizeofW(StgInd));
                 SET_HDR(ind, &stg_IND_info, CCS_SYSTEM); // set ccs
                 // zero the indirectee field (should be filled later)
                 ind->indirectee = (StgClosure*) NULL;
@@ -2203,7 +3820,7 @@ static StgClosure * UnpackPAP(ClosureQ *queue, StgInfoTable *info,
                 // pointer to it on the stack
                 StgInd *ind;
                 // allocate a new closure
-                ind = (StgInd*) allocate(cap, sizeofW(StgInd));
+                ind = (StgInd*) unpackAllocate(cap, sizeofW(StgInd));
                 SET_HDR(ind, &stg_IND_info, CCS_SYSTEM); // set ccs
                 // zero the indirectee field (should be filled later)
                 ind->indirectee = (StgClosure*) NULL;
@@ -2262,7 +3879,7 @@ static StgClosure* UnpackArray(ClosureQ *queue, StgInfoTable* info,
     PACKETDEBUG(debugBelch("Unpacking ptrs array, %" FMT_Word
                            " ptrs, size %d\n",
                            (StgWord) *((*bufptrP)+1), size));
-    array = (StgMutArrPtrs *) allocate(cap, size);
+    array = (StgMutArrPtrs *) unpackAllocate(cap, size);
 
     // set area 0 (Blackhole-test in unpacking and card table)
     memset(array, 0, size*sizeof(StgWord));
@@ -2271,6 +3888,10 @@ static StgClosure* UnpackArray(ClosureQ *queue, StgInfoTable* info,
         ((StgPtr) array)[size] = (StgWord) *(*bufptrP)++;
     // correct first word (info ptr, stored with offset in packet)
     ((StgPtr)array)[0] = (StgWord) info;
+#ifndef LIBRARY_CODE
+    // in an older generation, the array needs to be on the mutable list
+    recordUnpackedArray(cap, (StgClosure*) array);
+#endif
     // and enqueue it, pointers will be filled in subsequently
     queueClosure(queue, (StgClosure*)array);
 
@@ -2281,6 +3902,645 @@ static StgClosure* UnpackArray(ClosureQ *queue, StgInfoTable* info,
 
 
 #ifndef LIBRARY_CODE
+// free the blocks of a compact region from a packet which could not be
+// adopted. With adopted, compactFixupPointers has moved them from the
+// blocks being imported to the compact objects of g0.
+static void dropCompact(StgCompactNFDataBlock *first, bool adopted) {
+    StgCompactNFData *str = (StgCompactNFData*)
+        ((W_) first + sizeof(StgCompactNFDataBlock));
+    bdescr *bd = Bdescr((StgPtr) first);
+    StgWord blocks = str->totalW / BLOCK_SIZE_W;
+
+    ACQUIRE_SM_LOCK;
+    if (adopted) {
+        dbl_link_remove(bd, &g0->compact_objects);
+        g0->n_compact_blocks -= blocks;
+    } else {
+        dbl_link_remove(bd, &g0->compact_blocks_in_import);
+        g0->n_compact_blocks_in_import -= blocks;
+    }
+    RELEASE_SM_LOCK;
+    compactFree(str);
+}
+
+// unpacking a closure in a compact region (see PackCompact), adopting the
+// blocks of the region if they are included. Returns NULL in case of errors.
+static StgClosure* UnpackCompact(UnpackOffsets* offsets,
+                                 StgWord **bufptrP, Capability* cap) {
+    StgCompactNFDataBlock *first, *block;
+    StgCompactNFData *str;
+    StgClosure *closure;
+    StgWord tag, region, index, offset, nblocks, words, i;
+
+    ASSERT((long) **bufptrP == COMPACT);
+
+    (*bufptrP)++; // skip marker
+    tag    = *(*bufptrP)++;
+    region = *(*bufptrP)++;
+    index  = *(*bufptrP)++;
+    offset = *(*bufptrP)++;
+
+    if (region != 0) {
+        // the region came earlier in this packet
+        if (region >= offsets->size || offsets->closures[region] == NULL) {
+            errorBelch("Invalid compact region reference in packet");
+            return (StgClosure *) NULL;
+        }
+        str = objectGetCompact(UNTAG_CLOSURE(offsets->closures[region]));
+        first = (StgCompactNFDataBlock*)
+            ((W_) str - sizeof(StgCompactNFDataBlock));
+    } else {
+        if (*(*bufptrP)++ != (StgWord) BASE_SYM) {
+            errorBelch("Compact region from a binary loaded at a "
+                       "different address");
+            return (StgClosure *) NULL;
+        }
+        nblocks = *(*bufptrP)++;
+        if (nblocks == 0) {
+            errorBelch("Empty compact region in packet");
+            return (StgClosure *) NULL;
+        }
+
+        // copy the blocks. Each block is linked to its predecessor when
+        // allocated, the header of the last one ends the chain.
+        first = block = NULL;
+        for (i = 0; i < nblocks; i++) {
+            words = *(*bufptrP)++;
+            block = compactAllocateBlock(cap, words * sizeof(StgWord), block);
+            memcpy(block, *bufptrP, words * sizeof(StgWord));
+            *bufptrP += words;
+            if (first == NULL) {
+                first = block;
+            }
+        }
+        str = (StgCompactNFData*) ((W_) first + sizeof(StgCompactNFDataBlock));
+        str->hash = NULL; // only used while compacting at the sender
+
+        // the closure at its old address, to be fixed up with the region
+        for (i = 0, block = first; i < index && block != NULL; i++) {
+            block = block->next;
+        }
+        if (block == NULL) {
+            errorBelch("Invalid block index in compact region");
+            dropCompact(first, false);
+            return (StgClosure *) NULL;
+        }
+        closure = (StgClosure*) ((StgPtr) block->self + offset);
+        closure = (StgClosure*)
+            compactFixupPointers(str, TAG_CLOSURE(tag, closure));
+        if (closure == NULL) {
+            errorBelch("Could not adopt compact region from packet");
+            dropCompact(first, true);
+            return (StgClosure *) NULL;
+        }
+        PACKETDEBUG(debugBelch("Adopted compact region %p "
+                               "(%" FMT_Word " blocks)\n", str, nblocks));
+        return closure;
+    }
+
+    for (i = 0, block = first; i < index && block != NULL; i++) {
+        block = block->next;
+    }
+    if (block == NULL ||
+        (StgPtr) block + offset >= Bdescr((StgPtr) block)->free) {
+        errorBelch("Invalid closure position in compact region");
+        return (StgClosure *) NULL;
+    }
+    closure = (StgClosure*) ((StgPtr) block + offset);
+    return TAG_CLOSURE(tag, closure);
+}
+
+#if defined(PARALLEL_RTS) && !defined(LIBRARY_CODE)
+/*******************************************************************
+ * Dense encoding of packets (-qE, rtsPackBuffer.format PACKET_ENCODED)
+ *
+ * The packet format spends a StgWord on every marker, info offset and
+ * field. For sending, encodePacket walks the packet (as checkPacket does)
+ * and writes it as a stream of byte tokens, decodePacket restores the
+ * packet word for word, so that unpacking (and offsets, sharing cache
+ * slots) is not affected:
+ *
+ *   0x80|i          closure with info i of the dictionary (i < 128), and
+ *                   the number of words recorded there. Then its fields.
+ *   0x40|i          static closure i of the dictionary (i < 64)
+ *   CLOSURE info n  closure with a new info offset (svarint) and n words
+ *                   (uvarint), added to the dictionary. Then n fields.
+ *   CLOSURE_IDX i   closure with info i of the dictionary (uvarint)
+ *   CLOSURE_N i n   the same, with another number of words (recorded)
+ *   PLC addr        new static closure (svarint), added to the dictionary
+ *   PLC_IDX i       static closure i of the dictionary (uvarint)
+ *   OFFSET d        back reference, d = position + PADDING - offset
+ *   CACHEREF slot   sharing cache slot (uvarint)
+ *   REMOTEREF id    placeholder reference (uvarint)
+ *   RAW n           n words as they are (compact regions)
+ *   WORDS n         n fields (after the graph: sharing cache definitions,
+ *                   end marker; or data the walk does not understand)
+ *
+ * Fields are one byte if the value is below 0xF0 (nullary constructor
+ * tags, small Ints and Chars), otherwise a byte 0xF0+k (0xF8+k for the
+ * complement of the value, for small negative numbers) followed by k+1
+ * bytes. The payload of byte arrays is copied as it is. The dictionaries
+ * are built in the same order on both sides and start empty for every
+ * packet.
+ */
+#define ENC_PLC           0x01
+#define ENC_PLC_IDX       0x02
+#define ENC_OFFSET        0x03
+#define ENC_CLOSURE       0x04
+#define ENC_CLOSURE_IDX   0x05
+#define ENC_CLOSURE_N     0x06
+#define ENC_CACHEREF      0x07
+#define ENC_RAW           0x08
+#define ENC_WORDS         0x09
+#define ENC_REMOTEREF     0x0a
+#define ENC_PLC_SHORT     0x40
+#define ENC_CLOSURE_SHORT 0x80
+
+#define ENC_MAX_VARINT ((BITS_IN(StgWord) + 6) / 7)
+#define ENC_MAX_FIELD  (1 + sizeof(StgWord))
+
+// dictionary of info offsets (with the closure size) or static closures
+#define ENC_DICT_SIZE 1024
+#define ENC_HASH_SIZE (2 * ENC_DICT_SIZE)
+typedef struct EncDict_ {
+    StgWord  key[ENC_DICT_SIZE];
+    uint32_t n[ENC_DICT_SIZE];      // closures: words after the marker - 1
+    bool     arr[ENC_DICT_SIZE];    // closures: byte array (decoding)
+    uint32_t count;
+    // encoding: hash index key -> entry, slots valid with the current stamp
+    uint32_t stamp;
+    uint32_t slotStamp[ENC_HASH_SIZE];
+    uint16_t slotEntry[ENC_HASH_SIZE];
+} EncDict;
+
+// used with the parallel lock held (sending, processing a message)
+static EncDict encPLCs, encInfos, decPLCs, decInfos;
+
+static void resetDict(EncDict *d) {
+    d->count = 0;
+    d->stamp++;
+    if (d->stamp == 0) { // wrapped around, old stamps could match
+        memset(d->slotStamp, 0, sizeof(d->slotStamp));
+        d->stamp = 1;
+    }
+}
+
+// index of key in the dictionary, or -1 (*slot is then where to add it)
+static int findInDict(EncDict *d, StgWord key, uint32_t *slot) {
+    uint32_t h;
+
+    h = (uint32_t) ((key >> 3) * 2654435761UL) & (ENC_HASH_SIZE - 1);
+    while (d->slotStamp[h] == d->stamp) {
+        if (d->key[d->slotEntry[h]] == key) {
+            return d->slotEntry[h];
+        }
+        h = (h + 1) & (ENC_HASH_SIZE - 1);
+    }
+    *slot = h;
+    return -1;
+}
+
+// adds an entry unless the dictionary is full (decoding: slot ignored)
+static void addToDict(EncDict *d, StgWord key, uint32_t n, bool arr,
+                      uint32_t *slot) {
+    if (d->count == ENC_DICT_SIZE) {
+        return;
+    }
+    d->key[d->count] = key;
+    d->n[d->count] = n;
+    d->arr[d->count] = arr;
+    if (slot != NULL) {
+        d->slotStamp[*slot] = d->stamp;
+        d->slotEntry[*slot] = (uint16_t) d->count;
+    }
+    d->count++;
+}
+
+STATIC_INLINE StgWord8* putUVarint(StgWord8 *out, StgWord v) {
+    while (v >= 0x80) {
+        *out++ = (StgWord8) (v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (StgWord8) v;
+    return out;
+}
+
+STATIC_INLINE StgWord8* putSVarint(StgWord8 *out, StgInt v) {
+    return putUVarint(out, ((StgWord) v << 1)
+                           ^ (StgWord) (v >> (BITS_IN(StgWord) - 1)));
+}
+
+STATIC_INLINE StgWord8* putField(StgWord8 *out, StgWord w) {
+    StgWord8 mark = 0xF0;
+    uint32_t k;
+
+    if (w < 0xF0) {
+        *out++ = (StgWord8) w;
+        return out;
+    }
+    if (~w < w) {
+        w = ~w;
+        mark = 0xF8;
+    }
+    for (k = 1; k < sizeof(StgWord) && (w >> (8 * k)) != 0; k++) {}
+    *out++ = mark + (k - 1);
+    for (; k > 0; k--, w >>= 8) {
+        *out++ = (StgWord8) w;
+    }
+    return out;
+}
+
+STATIC_INLINE bool getUVarint(StgWord8 **inP, StgWord8 *end, StgWord *v) {
+    StgWord8 *in = *inP;
+    StgWord r = 0;
+    uint32_t shift = 0;
+
+    do {
+        if (in == end || shift >= BITS_IN(StgWord)) {
+            return false;
+        }
+        r |= (StgWord) (*in & 0x7f) << shift;
+        shift += 7;
+    } while (*in++ & 0x80);
+    *inP = in;
+    *v = r;
+    return true;
+}
+
+STATIC_INLINE bool getSVarint(StgWord8 **inP, StgWord8 *end, StgWord *v) {
+    StgWord u;
+
+    if (!getUVarint(inP, end, &u)) {
+        return false;
+    }
+    *v = (u >> 1) ^ (StgWord) (-(StgInt) (u & 1));
+    return true;
+}
+
+STATIC_INLINE bool getField(StgWord8 **inP, StgWord8 *end, StgWord *v) {
+    StgWord8 *in = *inP;
+    StgWord r = 0;
+    uint32_t k, i;
+
+    if (in == end) {
+        return false;
+    }
+    if (*in < 0xF0) {
+        *v = *in;
+        *inP = in + 1;
+        return true;
+    }
+    k = (*in & 7) + 1;
+    if (k > sizeof(StgWord) || end - in < (StgInt) (k + 1)) {
+        return false;
+    }
+    for (i = 0; i < k; i++) {
+        r |= (StgWord) in[1 + i] << (8 * i);
+    }
+    *v = (*in >= 0xF8) ? ~r : r;
+    *inP = in + 1 + k;
+    return true;
+}
+
+// byte arrays: the fields after the header and size are copied as they are
+STATIC_INLINE bool isByteArrayInfo(StgWord infoOffset) {
+    StgInfoTable *ip = UNTAG_CAST(StgInfoTable*, P_POINTER(infoOffset));
+
+    return INFO_PTR_TO_STRUCT(ip)->type == ARR_WORDS;
+}
+
+// words of a closure entry in the packet after the CLOSURE marker (info
+// offset first), as packed by PackGeneric, PackPAP and PackArray. Returns
+// 0 if the entry looks wrong.
+static uint32_t closureEntryWords(StgWord *entry, uint32_t avail,
+                                  uint32_t *ptrs) {
+    StgInfoTable *ip;
+    uint32_t size, nonptrs, vhs, hsize, bsize;
+    StgWord bitmap;
+
+    ip = UNTAG_CAST(StgInfoTable*, P_POINTER(entry[0]));
+    if (!LOOKS_LIKE_INFO_PTR((StgWord) ip) || avail <= HEADERSIZE + 2) {
+        return 0;
+    }
+    switch (INFO_PTR_TO_STRUCT(ip)->type) {
+    case PAP:
+    case AP:
+        // header, bitmap tag and bitmap, the non-pointers of the stack
+        hsize = (INFO_PTR_TO_STRUCT(ip)->type == PAP)
+                ? HEADERSIZE + 1 : sizeofW(StgThunkHeader) + 1;
+        if (avail < hsize + 2 || entry[hsize] != SMALL_BITMAP_TAG) {
+            return 0;
+        }
+        bitmap = entry[hsize + 1];
+        bsize = BITMAP_SIZE(bitmap);
+        bitmap = BITMAP_BITS(bitmap);
+        for (nonptrs = 0; bsize > 0; bsize--, bitmap >>= 1) {
+            nonptrs += bitmap & 1;
+        }
+        *ptrs = 1 + BITMAP_SIZE(entry[hsize + 1]) - nonptrs;
+        size = hsize + 2 + nonptrs;
+        break;
+    case MUT_ARR_PTRS_CLEAN:
+    case MUT_ARR_PTRS_DIRTY:
+    case MUT_ARR_PTRS_FROZEN_CLEAN:
+    case MUT_ARR_PTRS_FROZEN_DIRTY:
+        // header, ptrs and size, no card table
+        *ptrs = ((StgMutArrPtrs*) entry)->ptrs;
+        size = HEADERSIZE + 2;
+        break;
+    default:
+        getClosureInfo((StgClosure*) entry, INFO_PTR_TO_STRUCT(ip),
+                       &size, ptrs, &nonptrs, &vhs);
+        size = HEADERSIZE + vhs + nonptrs;
+    }
+    return (size <= avail) ? size : 0;
+}
+
+// words of a COMPACT entry in the packet (see PackCompact), 0 if it does
+// not fit
+static uint32_t compactEntryWords(StgWord *entry, uint32_t avail) {
+    uint32_t words, nblocks, i;
+
+    if (avail < 5) {
+        return 0;
+    }
+    if (entry[2] != 0) {
+        return 5; // refers to a region earlier in the packet
+    }
+    if (avail < 7) {
+        return 0;
+    }
+    nblocks = entry[6];
+    for (words = 7, i = 0; i < nblocks; i++) {
+        if (words >= avail || entry[words] >= avail - words) {
+            return 0;
+        }
+        words += 1 + entry[words];
+    }
+    return words;
+}
+
+// encodes the packet in buffer (size words) into out. Returns the size of
+// the encoding in bytes, or 0 if it would not be smaller than the packet
+// (or maxBytes).
+uint32_t encodePacket(StgWord *buffer, uint32_t size,
+                      StgWord8 *out, uint32_t maxBytes) {
+    StgWord8 *start = out, *end;
+    uint32_t pos = 0, words, fields, ptrs, slot, i;
+    StgInt openptrs = 1;
+    StgWord tag;
+    int idx;
+
+    end = out + stg_min(maxBytes, size * sizeof(StgWord));
+    resetDict(&encPLCs);
+    resetDict(&encInfos);
+
+    // the graph (see checkPacket), one pointer open initially (the root)
+    while (openptrs > 0 && pos < size) {
+        if (end - out < (StgInt) (1 + 2 * ENC_MAX_VARINT)) {
+            return 0;
+        }
+        tag = buffer[pos];
+
+        if ((tag == PLC || tag == OFFSET || tag == CACHEREF
+             || tag == REMOTEREF) && pos + 2 <= size) {
+            if (tag == PLC) {
+                idx = findInDict(&encPLCs, buffer[pos + 1], &slot);
+                if (idx < 0) {
+                    *out++ = ENC_PLC;
+                    out = putSVarint(out, (StgInt) buffer[pos + 1]);
+                    addToDict(&encPLCs, buffer[pos + 1], 0, false, &slot);
+                } else if (idx < 64) {
+                    *out++ = ENC_PLC_SHORT | idx;
+                } else {
+                    *out++ = ENC_PLC_IDX;
+                    out = putUVarint(out, idx);
+                }
+            } else if (tag == OFFSET) {
+                *out++ = ENC_OFFSET;
+                out = putSVarint(out, (StgInt) (pos + PADDING)
+                                      - (StgInt) buffer[pos + 1]);
+            } else {
+                *out++ = (tag == CACHEREF) ? ENC_CACHEREF : ENC_REMOTEREF;
+                out = putUVarint(out, buffer[pos + 1]);
+            }
+            pos += 2;
+        } else if (tag == COMPACT) {
+            words = compactEntryWords(buffer + pos, size - pos);
+            if (words == 0) {
+                break;
+            }
+            if ((StgWord) (end - out)
+                < 1 + ENC_MAX_VARINT + words * sizeof(StgWord)) {
+                return 0;
+            }
+            *out++ = ENC_RAW;
+            out = putUVarint(out, words);
+            memcpy(out, buffer + pos, words * sizeof(StgWord));
+            out += words * sizeof(StgWord);
+            pos += words;
+        } else if (tag == CLOSURE && pos + 1 < size) {
+            words = closureEntryWords(buffer + pos + 1, size - pos - 1, &ptrs);
+            if (words == 0) {
+                break;
+            }
+            // words after the info offset, the first ones as fields
+            words--;
+            fields = isByteArrayInfo(buffer[pos + 1])
+                     ? stg_min(words, HEADERSIZE) : words;
+
+            idx = findInDict(&encInfos, buffer[pos + 1], &slot);
+            if (idx < 0) {
+                *out++ = ENC_CLOSURE;
+                out = putSVarint(out, (StgInt) buffer[pos + 1]);
+                out = putUVarint(out, words);
+                addToDict(&encInfos, buffer[pos + 1], words, false, &slot);
+            } else if (encInfos.n[idx] != words) {
+                *out++ = ENC_CLOSURE_N;
+                out = putUVarint(out, idx);
+                out = putUVarint(out, words);
+                encInfos.n[idx] = words;
+            } else if (idx < 128) {
+                *out++ = ENC_CLOSURE_SHORT | idx;
+            } else {
+                *out++ = ENC_CLOSURE_IDX;
+                out = putUVarint(out, idx);
+            }
+            pos += 2;
+
+            if ((StgWord) (end - out) < fields * ENC_MAX_FIELD
+                                        + (words - fields) * sizeof(StgWord)) {
+                return 0;
+            }
+            for (i = 0; i < fields; i++) {
+                out = putField(out, buffer[pos++]);
+            }
+            memcpy(out, buffer + pos, (words - fields) * sizeof(StgWord));
+            out += (words - fields) * sizeof(StgWord);
+            pos += words - fields;
+
+            openptrs += ptrs;
+        } else {
+            break; // the rest is copied as fields, see below
+        }
+        openptrs--;
+    }
+
+    // what follows the graph (sharing cache definitions, end marker)
+    if (pos < size) {
+        if (end - out < (StgInt) (1 + ENC_MAX_VARINT)) {
+            return 0;
+        }
+        *out++ = ENC_WORDS;
+        out = putUVarint(out, size - pos);
+        for (; pos < size; pos++) {
+            if (end - out < (StgInt) ENC_MAX_FIELD) {
+                return 0;
+            }
+            out = putField(out, buffer[pos]);
+        }
+    }
+
+    if ((StgWord) (out - start) >= size * sizeof(StgWord)) {
+        return 0;
+    }
+    return out - start;
+}
+
+// decodes length bytes from in into the packet buffer, which has to be
+// size words long. Returns false if the data is garbled.
+bool decodePacket(StgWord8 *in, uint32_t length,
+                  StgWord *buffer, uint32_t size) {
+    StgWord8 *end = in + length;
+    uint32_t pos = 0, fields, i;
+    StgWord token, v, idx, words;
+    bool arr;
+
+    resetDict(&decPLCs);
+    resetDict(&decInfos);
+
+    while (in < end) {
+        token = *in++;
+
+        if (token >= ENC_CLOSURE_SHORT
+            || token == ENC_CLOSURE || token == ENC_CLOSURE_IDX
+            || token == ENC_CLOSURE_N) {
+            if (token == ENC_CLOSURE) {
+                if (!getSVarint(&in, end, &v)
+                    || !getUVarint(&in, end, &words)
+                    || !LOOKS_LIKE_INFO_PTR((StgWord)
+                          UNTAG_CAST(StgInfoTable*, P_POINTER(v)))) {
+                    return false;
+                }
+                arr = isByteArrayInfo(v);
+                addToDict(&decInfos, v, words, arr, NULL);
+            } else {
+                if (token >= ENC_CLOSURE_SHORT) {
+                    idx = token & ~ENC_CLOSURE_SHORT;
+                } else if (!getUVarint(&in, end, &idx)) {
+                    return false;
+                }
+                if (idx >= decInfos.count) {
+                    return false;
+                }
+                v = decInfos.key[idx];
+                words = decInfos.n[idx];
+                arr = decInfos.arr[idx];
+                if (token == ENC_CLOSURE_N) {
+                    if (!getUVarint(&in, end, &words)) {
+                        return false;
+                    }
+                    decInfos.n[idx] = words;
+                }
+            }
+            if (words > size || pos + 2 + words > size) {
+                return false;
+            }
+            fields = arr ? stg_min(words, HEADERSIZE) : words;
+            buffer[pos++] = CLOSURE;
+            buffer[pos++] = v;
+            for (i = 0; i < fields; i++) {
+                if (!getField(&in, end, &buffer[pos++])) {
+                    return false;
+                }
+            }
+            if ((StgWord) (end - in) < (words - fields) * sizeof(StgWord)) {
+                return false;
+            }
+            memcpy(buffer + pos, in, (words - fields) * sizeof(StgWord));
+            in += (words - fields) * sizeof(StgWord);
+            pos += words - fields;
+            continue;
+        }
+
+        switch (token) {
+        case ENC_PLC:
+        case ENC_PLC_IDX:
+        case ENC_OFFSET:
+        case ENC_CACHEREF:
+        case ENC_REMOTEREF:
+            if (pos + 2 > size) {
+                return false;
+            }
+            if (token == ENC_PLC) {
+                if (!getSVarint(&in, end, &v)) {
+                    return false;
+                }
+                addToDict(&decPLCs, v, 0, false, NULL);
+            } else if (token == ENC_PLC_IDX) {
+                if (!getUVarint(&in, end, &idx) || idx >= decPLCs.count) {
+                    return false;
+                }
+                v = decPLCs.key[idx];
+            } else if (token == ENC_OFFSET) {
+                if (!getSVarint(&in, end, &v)) {
+                    return false;
+                }
+                v = (StgWord) (pos + PADDING) - v;
+            } else if (!getUVarint(&in, end, &v)) {
+                return false;
+            }
+            buffer[pos++] = (token == ENC_PLC || token == ENC_PLC_IDX) ? PLC
+                            : (token == ENC_OFFSET) ? OFFSET
+                            : (token == ENC_CACHEREF) ? CACHEREF : REMOTEREF;
+            buffer[pos++] = v;
+            break;
+        case ENC_RAW:
+            if (!getUVarint(&in, end, &words) || words > size - pos
+                || (StgWord) (end - in) < words * sizeof(StgWord)) {
+                return false;
+            }
+            memcpy(buffer + pos, in, words * sizeof(StgWord));
+            in += words * sizeof(StgWord);
+            pos += words;
+            break;
+        case ENC_WORDS:
+            if (!getUVarint(&in, end, &words) || words > size - pos) {
+                return false;
+            }
+            for (; words > 0; words--) {
+                if (!getField(&in, end, &buffer[pos++])) {
+                    return false;
+                }
+            }
+            break;
+        default:
+            if (token >= ENC_PLC_SHORT && token < ENC_CLOSURE_SHORT) {
+                idx = token & ~ENC_PLC_SHORT;
+                if (idx >= decPLCs.count || pos + 2 > size) {
+                    return false;
+                }
+                buffer[pos++] = PLC;
+                buffer[pos++] = decPLCs.key[idx];
+                break;
+            }
+            return false;
+        }
+    }
+    return pos == size;
+}
+#endif
+
 // creating new heap closures:
 
 // creating a black hole (to receive remote data), owned by the system tso
@@ -2787,13 +5047,20 @@ static void checkPacket(StgWord* buffer, uint32_t size) {
         // unpackclosure essentials are mimicked here
         tag = *bufptr; // marker in buffer (PLC | OFFSET | CLOSURE)
 
-        if (tag == PLC) {
+        if (tag == PLC || tag == CACHEREF) {
             bufptr++; // skip marker
             // check that this looks like a PLC (static data)
             // which is however complicated when code and data mix... TODO
+            // (sharing cache slots are checked when unpacking)
 
             bufptr++; // move forward
             packsize += 2;
+        } else if (tag == REMOTEREF) {
+            bufptr++; // skip marker
+            // a placeholder, a valid offset
+            insertHashTable(offsets, (StgWord) (bufptr - buffer), bufptr);
+            bufptr++; // skip reference number
+            packsize += 2;
         } else if (tag == OFFSET) {
             bufptr++; // skip marker
             if (!lookupHashTable(offsets, *bufptr)) {
@@ -2802,6 +5069,31 @@ static void checkPacket(StgWord* buffer, uint32_t size) {
             }
             bufptr++; // move forward
             packsize += 2;
+#ifndef LIBRARY_CODE
+        } else if (tag == COMPACT) {
+            StgWord i, nblocks;
+
+            bufptr++; // skip marker
+            // a closure in a compact region (see PackCompact), a valid
+            // offset. The region blocks are not checked.
+            insertHashTable(offsets, (StgWord) (bufptr - buffer), bufptr);
+            if (bufptr[1] != 0 && !lookupHashTable(offsets, bufptr[1])) {
+                barf("invalid compact region offset %" FMT_Word " in packet "
+                     " at position %p", bufptr[1], bufptr);
+            }
+            if (bufptr[1] == 0) {
+                nblocks = bufptr[5];
+                bufptr += 6;
+                packsize += 7;
+                for (i = 0; i < nblocks; i++) {
+                    packsize += 1 + *bufptr;
+                    bufptr += 1 + *bufptr;
+                }
+            } else {
+                bufptr += 4;
+                packsize += 5;
+            }
+#endif
         } else if (tag == CLOSURE) {
             bufptr++; // skip marker
 
@@ -2880,6 +5172,22 @@ static void checkPacket(StgWord* buffer, uint32_t size) {
 
     } while (openptrs != 0 && packsize < size);
 
+    if (openptrs == 0 && packsize < size && *bufptr == CACHEDEF) {
+        // sharing cache slots defined by the packet: count, first slot,
+        // and the offsets of the closures
+        StgWord i, count = bufptr[1];
+
+        bufptr += 3;
+        packsize += 3;
+        for (i = 0; i < count && packsize < size; i++, packsize++) {
+            if (!lookupHashTable(offsets, *bufptr)) {
+                barf("invalid sharing cache offset %" FMT_Word " in packet "
+                     " at position %p", *bufptr,  bufptr);
+            }
+            bufptr++;
+        }
+    }
+
     PACKDEBUG(debugBelch(" traversed %" FMT_Word " words.", packsize));
 
     if (openptrs != 0) {
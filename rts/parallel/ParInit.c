@@ -41,6 +41,34 @@ struct timeval startupTime;
 struct timezone startupTimeZone;
 PEId pes; // remember nPEs after shutdown
 #endif //TRACING
+
+#if defined(THREADED_RTS)
+/* The parallel lock (see Parallel.h). Recursive: processing a message
+ * calls into the runtime tables, which lock for themselves when called
+ * from a primitive operation.
+ */
+static Mutex      par_mutex;
+static OSThreadId par_owner;
+static uint32_t   par_depth = 0;
+
+void acquireParLock(void) {
+  if (par_depth > 0 && par_owner == osThreadId()) {
+    par_depth++;
+    return;
+  }
+  ACQUIRE_LOCK(&par_mutex);
+  par_owner = osThreadId();
+  par_depth = 1;
+}
+
+void releaseParLock(void) {
+  ASSERT(par_depth > 0 && par_owner == osThreadId());
+  if (--par_depth == 0) {
+    RELEASE_LOCK(&par_mutex);
+  }
+}
+#endif
+
 /* For flag handling see RtsFlags.h */
 
 void
@@ -54,6 +82,9 @@ shutdownParallelSystem(StgInt n)
                    (int) n);
                );
 
+  // the communication task is stopped already, unless we exit on error
+  ACQUIRE_PAR_LOCK();
+
   // JB 11/2006: write stop event, close trace file. Done here to
   // avoid a race condition if trace files merged by main node
   // automatically.
@@ -62,16 +93,19 @@ shutdownParallelSystem(StgInt n)
 
   MP_quit(n);
 
-  // free allocated space (send/receive buffers)
+  // free allocated space (send buffers, receive buffers are freed
+  // inside MP_quit)
   freePackBuffer();
-  freeRecvBuffer();
   /*
   freeMoreBuffers();
   */
 
   // and runtime tables
   freeRTT();
+  freeSharingCaches();
+  freeRemoteRefs();
 
+  RELEASE_PAR_LOCK();
 }
 
 /*
@@ -147,6 +181,10 @@ void zipTraceFiles(void) {
   if (!IAmMainThread || RtsFlags.TraceFlags.tracing != TRACE_EVENTLOG) {
     return;
   }
+  // with -qT, the main PE has written one eventlog already
+  if (RtsFlags.ParFlags.streamTrace) {
+    return;
+  }
 
   // see rts/eventlog/EventLog.c, must match naming convention there
     prog = stgMallocBytes(strlen(prog_name) + 1, "initEventLogging");
@@ -221,6 +259,10 @@ void zipTraceFiles(void) {
 void
 startupParallelSystem(int* argc, char **argv[]) {
 
+#if defined(THREADED_RTS)
+  initMutex(&par_mutex);
+#endif
+
   //  getStartTime(); // init start time (in RtsUtils.*)
 
   // write Event for machine startup here, before
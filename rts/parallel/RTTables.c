@@ -40,6 +40,14 @@ ProcessData* processtable;
 
 HashTable *threadproctable, *threadrecvtable;
 
+// Receivers of a broadcast, ThreadID->Receivers* (see sendWrapper)
+HashTable *threadbcasttable;
+
+// Indexes for lookups by ID: ProcessId->ProcessData*, InportId->Inport*
+// (inport IDs are unique per PE), and ThreadID->TSO for the threads
+// in processes. TSOs move in GC, the latter is updated in updateRTT.
+HashTable *proctable, *inporttable, *threadtsotable;
+
 // ID factory; Both IDs are StgWords, unlikely to
 // be too small. Any ID 0 is reserved for the system, so these vars
 // hold the _existing_ max.IDs so far, respectively.
@@ -59,6 +67,8 @@ void killProcess_(ProcessData* p);
 Inport* addInport_(ProcessData *p, StgClosure *blackhole);
 bool updateTSOList(ProcessData *p);
 void updateInports(ProcessData *p);
+STATIC_INLINE void freeInport(Inport *inport);
+STATIC_INLINE void unlinkInport(ProcessData *p, Inport *inport);
 
 // action if 1 to 1 check fails:
 void CommCheckFailed(void) {
@@ -79,6 +89,32 @@ void initRTT(void) {
   //  dummyPort.machine = thisPE;
   threadproctable = allocHashTable();
   threadrecvtable = allocHashTable();
+  threadbcasttable = allocHashTable();
+  proctable = allocHashTable();
+  inporttable = allocHashTable();
+  threadtsotable = allocHashTable();
+}
+
+// free an inport, including message parts received for it
+STATIC_INLINE void freeInport(Inport *inport) {
+  removeHashTable(inporttable, inport->id, inport);
+  if (inport->pending != NULL) {
+    freePendingParts(inport->pending);
+  }
+  stgFree(inport);
+}
+
+// remove an inport from the list of its process (not freeing it)
+STATIC_INLINE void unlinkInport(ProcessData *p, Inport *inport) {
+  if (inport->prev == NULL) {
+    ASSERT(p->inports == inport);
+    p->inports = inport->next;
+  } else {
+    inport->prev->next = inport->next;
+  }
+  if (inport->next != NULL) {
+    inport->next->prev = inport->prev;
+  }
 }
 
 // free space allocated by runtime table: we expect it to be empty!
@@ -87,6 +123,10 @@ void freePort(void* port);
 void freePort(void* port) {
   stgFree(port);
 }
+static void freeReceivers(void* receivers) {
+  stgFree(((Receivers*) receivers)->ports);
+  stgFree(receivers);
+}
 void freeRTT(void) {
 
   // we might end up here due to a failure at startup.
@@ -109,7 +149,7 @@ void freeRTT(void) {
       while ( last->inports != NULL ) {
         inport = last->inports;
         last->inports = inport->next;
-        stgFree(inport);
+        freeInport(inport);
       }
       // and free the process table entry
       stgFree(last);
@@ -118,6 +158,12 @@ void freeRTT(void) {
   }
   freeHashTable(threadproctable, NULL); // do not free entries
   freeHashTable(threadrecvtable, freePort); // free allocated ports
+  freeHashTable(threadbcasttable, freeReceivers);
+  freeHashTable(proctable, NULL);    // entries freed above
+  freeHashTable(inporttable, NULL);
+  freeHashTable(threadtsotable, NULL);
+  threadproctable = threadrecvtable = threadbcasttable = NULL;
+  proctable = inporttable = threadtsotable = NULL;
 }
 
 // Port comparison, is trivial...
@@ -145,6 +191,7 @@ void newProcess(StgTSO* firstTSO) {
 
   newProc = (ProcessData*) stgMallocBytes(sizeof(ProcessData),
                                           "New Process");
+  ACQUIRE_PAR_LOCK();
   newProc->id = ++procmax;
 
   IF_PAR_DEBUG(procs,
@@ -156,15 +203,22 @@ void newProcess(StgTSO* firstTSO) {
   newProc->tsos = 1;
 
   insertHashTable(threadproctable, firstTSO->id, (void*) newProc->id);
+  insertHashTable(threadtsotable, firstTSO->id, firstTSO);
 
+  newProc->prev = NULL;
   newProc->next = processtable;
+  if (processtable != NULL) {
+    processtable->prev = newProc;
+  }
   processtable = newProc;
+  insertHashTable(proctable, newProc->id, newProc);
 
   // edentrace: new process
 
   traceCreateProcess(newProc->id);
   //edentrace: assign thread to (new) process
   traceAssignThreadToProcessEvent(firstTSO->cap, firstTSO->id, newProc->id);
+  RELEASE_PAR_LOCK();
 }
 
 // used virtually for every action messages (from other machines) only
@@ -173,7 +227,7 @@ void newProcess(StgTSO* firstTSO) {
 // find a process by its id:
 STATIC_INLINE
 ProcessData* findProcess(StgWord processId) {
-  ProcessData* p = processtable;
+  ProcessData* p;
 
   if ( processId > procmax ) {
     // impossible!
@@ -182,10 +236,7 @@ ProcessData* findProcess(StgWord processId) {
     return NULL; // caller supposed to handle this accurately (fail or ignore op.)
   }
 
-  while(p != NULL) {
-    if (p->id == processId) break;
-    p = p->next;
-  }
+  p = lookupHashTable(proctable, processId);
   if (p == NULL)
     debugBelch("findProcess: non-existent process %d\n",
                (int)processId);
@@ -203,7 +254,6 @@ ProcessData* findProcess(StgWord processId) {
 
 void killProcess_(ProcessData *p) {
   Inport *inport, *inports;
-  ProcessData* temp;
   rtsPackBuffer termMsgBuffer;
 
   // p is our process
@@ -214,15 +264,17 @@ void killProcess_(ProcessData *p) {
   IF_PAR_DEBUG(procs,
                debugBelch("killing Process %d at %p.\n",
                           (int) p->id, p));
-  temp = processtable;
-  ASSERT(NULL != temp);
-  if (p == temp) {
-    processtable = temp->next;
+  ASSERT(NULL != processtable);
+  if (p->prev == NULL) {
+    ASSERT(p == processtable);
+    processtable = p->next;
   } else {
-    while (p != temp->next )
-      temp = temp->next;
-    temp->next = p->next;
+    p->prev->next = p->next;
   }
+  if (p->next != NULL) {
+    p->next->prev = p->prev;
+  }
+  removeHashTable(proctable, p->id, p);
 
   // edentrace kill process
   traceKillProcess(p->id);
@@ -255,7 +307,7 @@ void killProcess_(ProcessData *p) {
       // buffer messages and send all at once, in a separate procedure.
     }
     inports = inports->next;
-    stgFree(inport);
+    freeInport(inport);
   }
 
   p->id = 0;
@@ -292,11 +344,18 @@ Inport* addInport_(ProcessData *p, StgClosure *blackhole) {
   trace(RtsFlags.TraceFlags.user, "newInport (%d,%d), blackhole %p\n",
         (int) p->id, (int) newIn->id, blackhole);
 
+  newIn->process = p->id;
   newIn->closure = blackhole;
   newIn->sender = NoPort;
+  newIn->pending = NULL;
 
+  newIn->prev = NULL;
   newIn->next = p->inports;
+  if (p->inports != NULL) {
+    p->inports->prev = newIn;
+  }
   p->inports = newIn;
+  insertHashTable(inporttable, newIn->id, newIn);
 
   return newIn;
 }
@@ -305,8 +364,11 @@ Inport* addInport_(ProcessData *p, StgClosure *blackhole) {
 StgWord
 addInport(StgWord processId, StgClosure* blackhole ) {
   Inport* newIn;
-  ProcessData* p = findProcess(processId);
+  ProcessData* p;
+  StgWord id;
 
+  ACQUIRE_PAR_LOCK();
+  p = findProcess(processId);
   if (p == NULL) {
     barf("addInport: no process found!");
   }
@@ -314,7 +376,9 @@ addInport(StgWord processId, StgClosure* blackhole ) {
       debugBelch("new inport for process %d:\n",
                  (int) processId));
   newIn = addInport_(p, blackhole);
-  return newIn->id;
+  id = newIn->id;
+  RELEASE_PAR_LOCK();
+  return id;
 }
 
 
@@ -322,15 +386,11 @@ addInport(StgWord processId, StgClosure* blackhole ) {
 // locate an inport in a process: called when receiving data
 STATIC_INLINE
 Inport* findInport(StgWord processId, StgWord id){
-  // FIND_IN_LIST(FIND_IN_LIST(processId,processtable)->inports,id);
-  ProcessData* p = findProcess(processId);
-
-  if (p != NULL) {
-    Inport* i = p->inports;
-    while(i != NULL) {
-      if (i->id == id) { return i; }
-      i = i->next;
-    }
+  Inport* i = lookupHashTable(inporttable, id);
+
+  // the inport exists as long as its process exists
+  if (i != NULL && i->process == processId) {
+    return i;
   }
   return NULL;
 }
@@ -380,6 +440,7 @@ void setReceiver(StgTSO* tso, PEId pe, StgWord proc, StgWord id) {
         (int) tso->id, (int) pe, (int) proc, (int) id );
 
   // reconnection allowed, remove old entry.
+  ACQUIRE_PAR_LOCK();
   oldPort = lookupHashTable(threadrecvtable, tso->id);
   if (oldPort != NULL) {
     stgFree(oldPort);
@@ -394,6 +455,7 @@ void setReceiver(StgTSO* tso, PEId pe, StgWord proc, StgWord id) {
   portInHashTable->id      = id;
 
   insertHashTable(threadrecvtable, tso->id, portInHashTable);
+  RELEASE_PAR_LOCK();
 
   return;
 }
@@ -404,7 +466,7 @@ void setReceiver(StgTSO* tso, PEId pe, StgWord proc, StgWord id) {
 void removeInport(StgWord processId, StgWord inportId) {
   ProcessData *p;
 
-  Inport **last, *remv;
+  Inport *remv;
 
   IF_PAR_DEBUG(ports,
       debugBelch("remove inport %d from process %d\n",
@@ -419,27 +481,17 @@ void removeInport(StgWord processId, StgWord inportId) {
 
   ASSERT(p != NULL);
 
-  last = &(p->inports);
-  remv = p->inports;
-  while (remv != NULL && remv->id != inportId) {
-      ASSERT(*last == remv); // INV: last points to remv (from
-      // previous one or process entry)
-      last = &(remv->next);
-      remv = remv->next;
-  }
+  remv = findInport(processId, inportId);
 
   if (remv == NULL) {// not found!
-    ASSERT(last != NULL && *last == NULL);
     IF_PAR_DEBUG(ports,
          debugBelch("Inport %d: not found in process %d.\n",
                     (uint32_t) inportId, (uint32_t) processId));
   } else {
     // found, remove and free it.
-    // last points to the field where remv was referenced in the list
-    ASSERT(remv);
-    *last = remv->next;
+    unlinkInport(p, remv);
 
-    stgFree(remv);
+    freeInport(remv);
     IF_PAR_DEBUG(ports,
          debugBelch("inport %d removed (process %d)\n",
                     (int) inportId, (int) p->id));
@@ -457,7 +509,8 @@ void addTSO(StgWord processId, StgTSO* tso) {
   }
 
   ASSERT(processId != 0);
-  p = findProcess(processId);;
+  ACQUIRE_PAR_LOCK();
+  p = findProcess(processId);
 
   IF_PAR_DEBUG(procs,
                debugBelch("add thread %d to process %d\n",
@@ -467,6 +520,7 @@ void addTSO(StgWord processId, StgTSO* tso) {
   ASSERT(p != NULL);
 
   insertHashTable(threadproctable, tso->id, (void*) processId);
+  insertHashTable(threadtsotable, tso->id, tso);
   p->tsos += 1;
 
   // newThreadEvent emitted only here (thread is created before), we
@@ -475,16 +529,13 @@ void addTSO(StgWord processId, StgTSO* tso) {
   // edentrace: new thread (now in schedule.c)
   // edentrace: assign thread to (existing) process
   traceAssignThreadToProcessEvent(tso->cap, tso->id, processId);
+  RELEASE_PAR_LOCK();
   return;
 
 }
 
 // find a TSO in a process: needed for external termination..
-// Avoiding to touch the TSO struct, we need to traverse a list of all
-// threads per GC "step", for all steps. See Threads.c::printAllThreads.
-
 StgTSO* findTSO(StgWord processId, StgWord id) {
-  uint32_t g;
   StgTSO *t;
   StgWord proc;
   ProcessData *p = findProcess(processId);
@@ -513,42 +564,19 @@ StgTSO* findTSO(StgWord processId, StgWord id) {
     return NULL;
   }
 
-  // see Threads.c::printAllThreads
-  /*
-  // if thread is not blocked, it is listed in one capability
-  for (i=0; i < n_capabilities; i++) {
-    cap = &capabilities[i];
-    t = cap->run_queue_hd;
-    while (t != END_TSO_QUEUE) {
-      if (t->id == id)
-        return t;
-      else 
-        t = t->_link;
-    }
-  }
-  */
-  // otherwise, thread could be blocked. Traverse all generations.
-  // NB: this looks at non-blocked threads again, so only do the 2nd loop
-  for (g = 0; g < RtsFlags.GcFlags.generations; g++) {
-    t = generations[g].threads;
-    while(t != END_TSO_QUEUE) {
-      if (t->id == id) {
-        return t;
-      } else {
-        t = t->global_link;
-      }
-    }
-  }
+  t = lookupHashTable(threadtsotable, id);
 
-  // If we reach here, something is very wrong(tm): the thread does not exist,
-  // but we found it earlier in the threadproctable (otherwise would be
-  // proc=0, early exit. Complain (in debug mode)!
-  ASSERT(false);
-  return NULL;
+  // t is NULL if the thread was garbage collected without finishing
+  // (see updateThreadTSOTable), although still registered in its process
+  IF_PAR_DEBUG(procs,
+               if (t == NULL) {
+                 debugBelch("findTSO: thread %" FMT_Word " is gone\n", id);
+               });
+  return t;
 }
 
 // remove a thread from a process (does NOT terminate it!)
-void removeTSO(StgWord id) {
+static void removeTSO_(StgWord id) {
   ProcessData *p;
   StgWord proc;
 
@@ -569,11 +597,13 @@ void removeTSO(StgWord id) {
     return ; // virtually "removed", shrug (might be a finalizer?)
   } else {
     Port* registeredPort = NULL;
+    Receivers* receivers = NULL;
 
     ASSERT(p != NULL);
     ASSERT(p->tsos != 0); // we have a process with >= 1 thread
 
     removeHashTable(threadproctable, id, (void*) proc);
+    removeHashTable(threadtsotable, id, NULL);
 
     // remove (+ deallocate) potential entry in threadrecvtable
     registeredPort = lookupHashTable(threadrecvtable, id);
@@ -581,6 +611,12 @@ void removeTSO(StgWord id) {
       removeHashTable(threadrecvtable, id, registeredPort);
       stgFree(registeredPort);
     }
+    // and receivers of a broadcast which was not sent
+    receivers = lookupHashTable(threadbcasttable, id);
+    if (receivers != NULL) {
+      removeHashTable(threadbcasttable, id, receivers);
+      freeReceivers(receivers);
+    }
 
     // edentrace: emit killthread event (now in schedule.c)
 
@@ -593,6 +629,12 @@ void removeTSO(StgWord id) {
   }
 }
 
+void removeTSO(StgWord id) {
+  ACQUIRE_PAR_LOCK();
+  removeTSO_(id);
+  RELEASE_PAR_LOCK();
+}
+
 /* Garbage collection of inports and blocked TSOs
  *
  * In a system with a single heap, threads blocked on a blackhole
@@ -626,7 +668,6 @@ void removeTSO(StgWord id) {
 
 void updateInports(ProcessData *p) {
   Inport *inp, *temp;
-  Inport **last;
 
   rtsPackBuffer termMsgBuffer;
 
@@ -644,11 +685,7 @@ void updateInports(ProcessData *p) {
   termMsgBuffer.sender.machine=thisPE;
   termMsgBuffer.sender.process=p->id;
 
-  last = &(p->inports);
-
   while(inp != NULL) {
-    ASSERT(*last == inp);
-
     temp = inp;       // only work on temp, inp set to next
     inp = inp->next;
 
@@ -673,38 +710,63 @@ void updateInports(ProcessData *p) {
         sendMsg(PP_TERMINATE, &termMsgBuffer);
         // TODO handle send failure (buffer messages)
       }
-      *last = inp; // skip temp reference (inp already set to next)
-      stgFree(temp); // and remove the inport
-    } else {
-      // inport is alive, BH field already updated, nothing more to do
-      last = &(temp->next);
+      unlinkInport(p, temp); // inp already set to next
+      freeInport(temp); // and remove the inport
     }
+    // otherwise, inport is alive, BH field already updated
+  }
+}
+
+// helper: enter the new address of a live TSO into the new table
+static void updateThreadTSO(void *newtable, StgWord id, const void *tso) {
+  StgClosure *c;
+
+  c = isAlive((StgClosure*) tso);
+  if (c != NULL) {
+    insertHashTable((HashTable*) newtable, id, c);
+  } else {
+    IF_PAR_DEBUG(procs,
+                 debugBelch("thread %" FMT_Word " is garbage\n", id));
+  }
+}
+
+// update the hash table ThreadID->TSO after GC: TSOs have moved, dead
+// ones are dropped. The table is copied, not changed while traversed.
+static void updateThreadTSOTable(void) {
+  HashTable *newtable;
+
+  if (threadtsotable == NULL) { // not initialised yet
+    return;
   }
+  newtable = allocHashTable();
+  mapHashTable(threadtsotable, newtable, updateThreadTSO);
+  freeHashTable(threadtsotable, NULL);
+  threadtsotable = newtable;
 }
 
 void updateRTT(void) {
-  ProcessData *p;
+  ProcessData *p, *next;
 
   IF_PAR_DEBUG(procs,
                debugBelch("updateRTTable: processtable %p\n",
                           processtable));
+
+  ACQUIRE_PAR_LOCK();
+
+  updateThreadTSOTable();
   if (processtable != NULL) {
     p = processtable;
     while (p != NULL) {
       IF_PAR_DEBUG(procs,
                    debugBelch("updating process %d (table @ %p)\n",
                               (int) p->id, p));
+      next = p->next;
       if (p->tsos == 0) {
-        StgWord killID;
-        killID = p->id;
         killProcess_(p); // invalidates p, updates processtable!
-        // advance to ID after killID in processtable (assumes ID monotonicity)
-        p = processtable;
-        while (p != NULL && p->id < killID) p = p->next;
       } else {
         updateInports(p);
-        p = p->next;
       }
+      p = next;
     }
     IF_PAR_DEBUG(procs,
                  debugBelch("UpdateRTTable done\n"));
@@ -712,6 +774,7 @@ void updateRTT(void) {
     IF_PAR_DEBUG(procs,
                  debugBelch("No Processes, table is NULL!\n"));
   }
+  RELEASE_PAR_LOCK();
 }
 
 // EXTERNAL INTERFACE:
@@ -732,7 +795,12 @@ StgTSO* findTSOByP(Port p) {
 }
 
 StgWord MyProcess(StgTSO* tso) {
-  return (StgWord) lookupHashTable(threadproctable, tso->id);
+  StgWord proc;
+
+  ACQUIRE_PAR_LOCK();
+  proc = (StgWord) lookupHashTable(threadproctable, tso->id);
+  RELEASE_PAR_LOCK();
+  return proc;
 }
 
 Port* MyReceiver(StgTSO* tso) {
@@ -745,4 +813,41 @@ Port* MyReceiver(StgTSO* tso) {
   }
 }
 
+// add a receiver to the broadcast of a TSO (allocated on first use)
+void addBcastReceiver(StgTSO* tso, Port receiver) {
+  Receivers* receivers;
+
+  receivers = (Receivers*) lookupHashTable(threadbcasttable, tso->id);
+  if (receivers == NULL) {
+    receivers = (Receivers*) stgMallocBytes(sizeof(Receivers),
+                                            "addBcastReceiver");
+    receivers->count = 0;
+    receivers->capacity = 8;
+    receivers->ports = (Port*) stgMallocBytes(8 * sizeof(Port),
+                                              "addBcastReceiver");
+    insertHashTable(threadbcasttable, tso->id, receivers);
+  }
+  if (receivers->count == receivers->capacity) {
+    receivers->capacity *= 2;
+    receivers->ports = (Port*)
+      stgReallocBytes(receivers->ports, receivers->capacity * sizeof(Port),
+                      "addBcastReceiver");
+  }
+  receivers->ports[receivers->count++] = receiver;
+}
+
+Receivers* MyBcastReceivers(StgTSO* tso) {
+  return (Receivers*) lookupHashTable(threadbcasttable, tso->id);
+}
+
+void clearBcastReceivers(StgTSO* tso) {
+  Receivers* receivers;
+
+  receivers = (Receivers*) lookupHashTable(threadbcasttable, tso->id);
+  if (receivers != NULL) {
+    removeHashTable(threadbcasttable, tso->id, receivers);
+    freeReceivers(receivers);
+  }
+}
+
 #endif // PARALLEL_HASKELL, whole file
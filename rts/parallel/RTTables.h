@@ -33,6 +33,9 @@
  *
  * Processes and inports are stored as linked lists, and found by IDs,
  * which are StgWords and stored inside the linked structure.(2)
+ * The IDs are indexed by hash tables, so messages (which refer to
+ * processes and inports by ID) find them in constant time. The lists
+ * are doubly linked to remove entries in constant time.
  * 
 
  * We use the TSOs ID as an outport ID. The receiver (inport) is
@@ -45,6 +48,13 @@
  * keep the TSO structure untouched, this version of the module uses
  * two hash tables and interface functions for this purpose.
  *
+ * In a threaded PE, the tables are shared by all capabilities. The
+ * functions called by primitive operations and the scheduler
+ * (MyProcess, addTSO, addInport, setReceiver, newProcess, removeTSO)
+ * and updateRTT take the parallel lock (see Parallel.h), all others
+ * are called with the lock held (while processing a message or
+ * sending data).
+ *
  ***********************************************/
 
 #if !defined(RTTABLES_H)
@@ -94,16 +104,34 @@ extern Port RtsPort, NoPort;
 // Port comparison
 bool equalPorts(Port p, Port q);
 
+// Data of a message which arrives in several PP_PART messages, collected
+// until the final message arrives. See DataComms.c
+typedef struct PendingParts_ {
+  StgInt         parts;    // number of parts received so far
+  StgWord        capacity; // allocated payload space, in StgWords
+  rtsPackBuffer *msg;      // header of the first part, accumulated payload
+} PendingParts;
+
 typedef struct Inport_ {
   struct Inport_ *next;
+  struct Inport_ *prev;
   StgWord id;
+  StgWord process;     // ID of the owning process
   StgClosure *closure; // update after GC!
   Port sender;         // can be mergeport!
-  StgPtr pendingUnpack;// stores Pack.c::UnpackInfo
+  PendingParts *pending;// PP_PART data received so far (DataComms.c)
 } Inport;
 
+// receivers of a broadcast (one graph sent to several inports)
+typedef struct Receivers_ {
+  uint32_t count;
+  uint32_t capacity;
+  Port    *ports;
+} Receivers;
+
 typedef struct ProcessData_ {
   struct ProcessData_ *next;
+  struct ProcessData_ *prev;
   StgWord  id;
   uint16_t tsos; // counter only
   Inport*  inports;
@@ -174,7 +202,8 @@ void removeInport(StgWord processId, StgWord inportId);
 // called by primop "fork#"
 void addTSO(StgWord processId, StgTSO* tso);
 
-// find a TSO in a process:
+// find a TSO in a process (by a hash table thread ID->TSO, rebuilt
+// on demand after GC, as TSOs move):
 // not called from outside
 StgTSO* findTSO(StgWord processId, StgWord tsoId);
 
@@ -200,11 +229,20 @@ void removeInportByP(Port p);
 // Schedule.c:
 StgTSO* findTSOByP(Port p);
 
+// DataComms.c: free the PP_PART data collected for an inport
+void freePendingParts(PendingParts *pending);
+
 // new functions for accessing the hash tables:
 // tso -> processID/ receiverPort
 StgWord MyProcess(StgTSO* tso);
 Port* MyReceiver(StgTSO* tso);
 
+// receivers of a broadcast: collected per TSO (send mode 5), used and
+// cleared when the data is sent (send mode 6), see DataComms.c
+void addBcastReceiver(StgTSO* tso, Port receiver);
+Receivers* MyBcastReceivers(StgTSO* tso);
+void clearBcastReceivers(StgTSO* tso);
+
 #endif // PARALLEL_HASKELL, whole file
 
 #endif // RTTABLES_H
@@ -0,0 +1,1172 @@
+/*
+ * Generalised RTE for parallel Haskells.
+ *
+ * File: ghc/rts/parallel/TCPComm.c
+ *
+ * Purpose: map generalised Comm.functions to TCP sockets,
+ * abstracting from the concrete MP-System
+ *
+ * PEs on different machines are connected directly, without any
+ * middleware: every pair of PEs shares one persistent TCP connection,
+ * messages are sent as frames (header with length and OpCode, then
+ * the data). The connections are non-blocking, and watched by epoll
+ * (Linux) or poll (elsewhere).
+ *
+ * Startup (MP_start, MP_sync): the PEs are described by the
+ * environment (all PEs need the same description):
+ *
+ *  EDEN_TCP_HOSTS    - PE addresses, "host[:port]" separated by commas
+ *                      or white space, PE 1 (main PE) first,
+ *  EDEN_TCP_HOSTFILE - or a file with one "host[:port]" per line
+ *                      ('#' starts a comment),
+ *  EDEN_TCP_PE       - the number of this PE (1..nPEs),
+ *  EDEN_TCP_PORT     - port of PE 1 for entries without a port, PE n
+ *                      uses this port + n-1 (default 7700),
+ *  EDEN_TCP_BUFFER   - socket buffer sizes in bytes (suffixes k, m),
+ *                      leaving them to the OS when not set.
+ *
+ * Each of these PEs is started by hand (or ssh); nPEs is the number of
+ * hosts, or -N<n> if given (at most the number of hosts).
+ *
+ * Without hosts, the main PE starts -N<n> PEs on localhost itself (by
+ * fork, as the copy way does), for testing.
+ *
+ * PE n listens on its address, connects to PEs 1..n-1 and accepts the
+ * connections of PEs n+1..nPEs.
+ */
+
+#if defined(PARALLEL_RTS) && defined(USE_TCP)  /* whole file */
+
+#include "Rts.h"      // general Rts definitions
+#include "MPSystem.h" // general interface for message passing
+
+#include "RtsUtils.h" // utilities for error msg., allocation, etc.
+#include "PEOpCodes.h" // message codes
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(linux_HOST_OS)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set instead
+#endif
+
+/* Global conditions defined here. */
+// main thread (PE 1 in logical numbering)
+bool IAmMainThread = false; // Set for the main thread
+// nPEs, thisPE
+PEId nPEs = 0; // number of PEs in system
+PEId thisPE=0; // node's own ID
+
+PEId setnPEsArg(int *argc, char **argv);
+
+#define TCP_BASE_PORT        7700
+#define TCP_CONNECT_TIMEOUT  60000 // ms, until all PEs have to be up
+#define TCP_CHUNK            65536 // receive staging buffer, bytes
+#define TCP_MAX_IOV          64    // frames written at once
+#define TCP_MAGIC            0xEDE7CF00
+
+// frame header, sent before the data of each message (in host byte
+// order, like the packed data itself)
+typedef struct TCPHeader_ {
+  StgWord32 length;
+  StgWord32 tag;
+} TCPHeader;
+
+// a received message, data follows the structure (word-aligned)
+typedef struct TCPMsg_ {
+  struct TCPMsg_ *next;
+  PEId      sender;
+  OpCode    tag;
+  uint32_t  length;
+  StgWord   data[];
+} TCPMsg;
+
+typedef struct TCPQueue_ {
+  TCPMsg   *head, *tail;
+} TCPQueue;
+
+// a queued send, header and data (length bytes, done of them sent)
+typedef struct TCPSend_ {
+  struct TCPSend_ *next;
+  uint32_t  length;
+  uint32_t  done;
+  StgWord8  data[];
+} TCPSend;
+
+typedef struct TCPPeer_ {
+  int       fd;        // -1 when closed
+  bool      watchOut;  // registered for writing (queue not empty)
+  bool      finished;  // FINISH received from this PE
+  // sending
+  TCPSend  *sendHead, *sendTail;
+  StgWord64 queued;    // bytes in the queue
+  // receiving: frames are read in chunks into a staging buffer, only
+  // the data of large messages is read into the message directly
+  StgWord8 *in;
+  uint32_t  inStart, inEnd;
+  TCPMsg   *msg;       // message being received
+  uint32_t  msgDone;   // bytes of msg received
+} TCPPeer;
+
+// PE addresses (startup), peers by PE number
+static char    *peHost[MAX_PES+1];
+static int      pePort[MAX_PES+1];
+static int      listenFd = -1;
+static bool     forkPEs = false; // no hosts, main PE starts PEs locally
+static TCPPeer  peers[MAX_PES+1];
+static int      socketBuffer = 0;
+
+// Backpressure: at most maxInFlight bytes (-qq<n> pack buffers) may be
+// queued for one PE (but one message is always allowed). Beyond that,
+// sending to this PE fails until the queue has been written.
+static StgWord64 maxInFlight;
+
+// received messages, in order of arrival. System messages have a
+// queue of their own, which is taken first.
+static TCPQueue inbox = { NULL, NULL }, inboxSys = { NULL, NULL };
+static StgWord64 inboxBytes = 0;
+static uint32_t inboxCount = 0;
+// lent out by MP_recv_borrow
+static TCPMsg  *borrowed = NULL;
+
+static enum { TCP_NOT_STARTED, TCP_RUNNING, TCP_STOPPING, TCP_STOPPED }
+  tcpState = TCP_NOT_STARTED;
+
+#if defined(linux_HOST_OS)
+static int epollFd = -1;
+#endif
+
+static void tcpPoll(int timeout);
+static void tcpWrite(PEId pe);
+static void tcpClosePeer(PEId pe);
+static TCPMsg* dequeue(TCPQueue *q);
+
+/**************************************************************
+ * Startup helpers */
+
+// size from the environment, with suffixes k and m
+static int envSize(const char *name) {
+  char *val = getenv(name), *end;
+  long size;
+
+  if (val == NULL) return 0;
+  size = strtol(val, &end, 10);
+  if (*end == 'k' || *end == 'K') size *= 1024;
+  if (*end == 'm' || *end == 'M') size *= 1024*1024;
+  return (int) size;
+}
+
+// add a "host[:port]" entry for PE n
+static void addHost(PEId n, char *entry, int basePort) {
+  char *colon = strrchr(entry, ':');
+
+  if (n > MAX_PES) {
+    barf("TCP: too many hosts given (at most %d PEs)", MAX_PES);
+  }
+  if (colon != NULL) {
+    *colon = '\0';
+    pePort[n] = atoi(colon+1);
+  } else {
+    pePort[n] = basePort + n - 1;
+  }
+  peHost[n] = stgMallocBytes(strlen(entry)+1, "TCPHost");
+  strcpy(peHost[n], entry);
+}
+
+// read PE addresses from EDEN_TCP_HOSTS or EDEN_TCP_HOSTFILE, returns
+// the number of hosts (0 if none are given)
+static PEId readHosts(void) {
+  char *hosts = getenv("EDEN_TCP_HOSTS");
+  char *file  = getenv("EDEN_TCP_HOSTFILE");
+  int basePort = TCP_BASE_PORT;
+  char line[256], *entry, *save;
+  PEId n = 0;
+
+  if (getenv("EDEN_TCP_PORT") != NULL) {
+    basePort = atoi(getenv("EDEN_TCP_PORT"));
+  }
+
+  if (hosts != NULL) {
+    char *copy = stgMallocBytes(strlen(hosts)+1, "TCPHosts");
+    strcpy(copy, hosts);
+    for (entry = strtok_r(copy, ", \t\n", &save); entry != NULL;
+         entry = strtok_r(NULL, ", \t\n", &save)) {
+      addHost(++n, entry, basePort);
+    }
+    stgFree(copy);
+  } else if (file != NULL) {
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+      barf("TCP: cannot open host file %s", file);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+      char *hash = strchr(line, '#');
+      if (hash != NULL) *hash = '\0';
+      entry = strtok_r(line, " \t\r\n", &save);
+      if (entry != NULL) {
+        addHost(++n, entry, basePort);
+      }
+    }
+    fclose(f);
+  }
+  return n;
+}
+
+// socket options for a connection between PEs
+static void setupSocket(int fd) {
+  int on = 1;
+
+  // messages are batched by DataComms already, send them right away
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#if defined(SO_NOSIGPIPE)
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  if (socketBuffer > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &socketBuffer, sizeof(int));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &socketBuffer, sizeof(int));
+  }
+}
+
+// listening socket on the given port (0: any), returns the port
+static int listenOn(int *fd, int port, bool local) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int on = 1;
+
+  *fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (*fd < 0) {
+    barf("TCP: cannot create socket (%s)", strerror(errno));
+  }
+  setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  // accepted sockets inherit the buffer sizes
+  setupSocket(*fd);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(local ? INADDR_LOOPBACK : INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(*fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+      listen(*fd, MAX_PES) != 0) {
+    barf("TCP: cannot listen on port %d (%s)", port, strerror(errno));
+  }
+  getsockname(*fd, (struct sockaddr*) &addr, &len);
+  return ntohs(addr.sin_port);
+}
+
+// blocking write/read of a few bytes during startup
+static void writeAll(int fd, void *data, size_t length) {
+  StgWord8 *p = data;
+  ssize_t n;
+
+  while (length > 0) {
+    n = send(fd, p, length, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      barf("TCP: startup write failed (%s)", strerror(errno));
+    }
+    p += n;
+    length -= n;
+  }
+}
+
+static void readAll(int fd, void *data, size_t length) {
+  StgWord8 *p = data;
+  ssize_t n;
+
+  while (length > 0) {
+    n = recv(fd, p, length, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      barf("TCP: startup read failed (%s)",
+           n == 0 ? "connection closed" : strerror(errno));
+    }
+    p += n;
+    length -= n;
+  }
+}
+
+// connect to PE n (which might not be listening yet)
+static int connectTo(PEId n) {
+  struct addrinfo hints, *res;
+  char port[16];
+  int fd, err, waited = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%d", pePort[n]);
+  err = getaddrinfo(peHost[n], port, &hints, &res);
+  if (err != 0) {
+    barf("TCP: cannot resolve %s (%s)", peHost[n], gai_strerror(err));
+  }
+
+  while (1) {
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+      barf("TCP: cannot create socket (%s)", strerror(errno));
+    }
+    setupSocket(fd);
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) break;
+    err = errno;
+    close(fd);
+    if ((err != ECONNREFUSED && err != ETIMEDOUT && err != EINTR)
+        || waited >= TCP_CONNECT_TIMEOUT) {
+      barf("TCP: cannot connect to PE %u at %s:%d (%s)",
+           n, peHost[n], pePort[n], strerror(err));
+    }
+    usleep(100000);
+    waited += 100;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+static void addPeer(PEId n, int fd) {
+  TCPPeer *p = &peers[n];
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  p->fd = fd;
+  p->in = stgMallocBytes(TCP_CHUNK, "TCPStaging");
+  p->inStart = p->inEnd = 0;
+#if defined(linux_HOST_OS)
+  {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = n;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      barf("TCP: epoll_ctl failed (%s)", strerror(errno));
+    }
+  }
+#endif
+}
+
+// connect this PE to all others: to the ones before it, then accept
+// the ones after it. Each connection starts with a hello (magic, PE).
+static void connectAll(void) {
+  StgWord32 hello[2];
+  PEId n;
+  int fd;
+
+#if defined(linux_HOST_OS)
+  epollFd = epoll_create(MAX_PES);
+  if (epollFd < 0) {
+    barf("TCP: epoll_create failed (%s)", strerror(errno));
+  }
+#endif
+
+  for (n = 1; n < thisPE; n++) {
+    fd = connectTo(n);
+    hello[0] = TCP_MAGIC;
+    hello[1] = thisPE;
+    writeAll(fd, hello, sizeof(hello));
+    addPeer(n, fd);
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("TCP: connected to PE %u\n", n));
+  }
+  for (n = thisPE + 1; n <= nPEs; n++) {
+    do {
+      fd = accept(listenFd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+      barf("TCP: accept failed (%s)", strerror(errno));
+    }
+    readAll(fd, hello, sizeof(hello));
+    if (hello[0] != TCP_MAGIC || hello[1] <= thisPE || hello[1] > nPEs
+        || peers[hello[1]].fd >= 0) {
+      barf("TCP: unexpected connection (PE %u)", hello[1]);
+    }
+    addPeer(hello[1], fd);
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("TCP: accepted PE %u\n", hello[1]));
+  }
+  close(listenFd);
+  listenFd = -1;
+}
+
+/**************************************************************
+ * Startup and Shutdown routines (used inside ParInit.c only) */
+
+/* MP_start starts up the node:
+ *   - connects to the MP-System used,
+ *   - determines wether we are main thread
+ *   - starts up other nodes in case we are first and
+ *     the MP-System requires to spawn nodes from here.
+ * Parameters:
+ *     IN/OUT argc - int*    : prog. arg. count
+ *     IN/OUT argv  - char***: program arguments
+ * Returns: Bool: success or failure
+ *
+ * TCP Version: reads the PE addresses (see top of file). Connecting
+ * (and starting PEs on localhost) happens in MP_sync, when the RTS
+ * flags are known.
+ */
+bool MP_start(int* argc, char** argv[]) {
+  PEId hosts, pes;
+  PEId n;
+
+  pes = setnPEsArg(argc, *argv);
+  hosts = readHosts();
+
+  for (n = 0; n <= MAX_PES; n++) {
+    peers[n].fd = -1;
+  }
+
+  if (hosts == 0) {
+    // no hosts given: start PEs on localhost
+    forkPEs = true;
+    nPEs = pes ? pes : 1;
+    thisPE = 1;
+  } else {
+    if (pes > hosts) {
+      barf("TCP: %u PEs requested, but only %u hosts given", pes, hosts);
+    }
+    nPEs = pes ? pes : hosts;
+    thisPE = getenv("EDEN_TCP_PE") ? (PEId) atoi(getenv("EDEN_TCP_PE")) : 1;
+    if (thisPE < 1 || thisPE > nPEs) {
+      barf("TCP: EDEN_TCP_PE (%u) not between 1 and %u", thisPE, nPEs);
+    }
+  }
+  IAmMainThread = (thisPE == 1);
+  socketBuffer = envSize("EDEN_TCP_BUFFER");
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("TCP: PE %u of %u (%s)\n", thisPE, nPEs,
+                          forkPEs ? "localhost" : "hosts given"));
+  return true;
+}
+
+/* MP_sync synchronises all nodes in a parallel computation:
+ * sets:
+ *     thisPE - GlobalTaskId: node's own task Id
+ *                     (logical node address for messages)
+ * Returns: Bool: success (1) or failure (0)
+ *
+ * TCP Version: connects all PEs with each other. When starting PEs on
+ * localhost, all listening sockets are created before forking, so
+ * every PE knows all ports and can connect right away.
+ */
+bool MP_sync(void) {
+  maxInFlight = (StgWord64) RtsFlags.ParFlags.sendBufferSize
+                * DATASPACEWORDS * sizeof(StgWord);
+
+  if (forkPEs) {
+    int fds[MAX_PES+1];
+    PEId n;
+
+    for (n = 1; n <= nPEs; n++) {
+      pePort[n] = listenOn(&fds[n], 0, true);
+      peHost[n] = stgMallocBytes(sizeof("127.0.0.1"), "TCPHost");
+      strcpy(peHost[n], "127.0.0.1");
+    }
+    for (n = 2; n <= nPEs; n++) {
+      pid_t child = fork();
+      if (child < 0) {
+        barf("TCP: error starting other processes!");
+      }
+      if (child == 0) {
+        // we are the child
+        thisPE = n;
+        IAmMainThread = false;
+        break;
+      }
+    }
+    // keep only our own listening socket
+    for (n = 1; n <= nPEs; n++) {
+      if (n == thisPE) {
+        listenFd = fds[n];
+      } else {
+        close(fds[n]);
+      }
+    }
+  } else {
+    listenOn(&listenFd, pePort[thisPE], false);
+  }
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("Node %u synchronising.\n", thisPE));
+
+  // returns when all connections are up
+  connectAll();
+  tcpState = TCP_RUNNING;
+  return true;
+}
+
+/* MP_quit disconnects current node from MP-System:
+ * Parameters:
+ *     IN isError - error number, 0 if normal exit
+ * Returns: Bool: success (1) or failure (0)
+ *
+ * TCP Version: the main PE sends FINISH to all others and waits until
+ * they have closed their connections. Other PEs send FINISH to the
+ * main PE (on error, they wait for its answer), write what is still
+ * queued, and close their connections.
+ */
+bool MP_quit(int isError) {
+  StgWord data[1] = {isError};
+  PEId n;
+  bool open;
+  TCPMsg *msg;
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch(" MP_quit()\n"));
+
+  if (tcpState != TCP_RUNNING) {
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("MP_quit: wasn't started, skipping.\n"));
+    tcpState = TCP_STOPPED;
+    nPEs = 0;
+    return false;
+  }
+  tcpState = TCP_STOPPING;
+  MP_recv_release();
+
+  if (IAmMainThread) {
+    for (n = 2; n <= nPEs; n++) {
+      MP_send(n, PP_FINISH, (StgWord8*) data, sizeof(StgWord));
+    }
+    // wait for all connections to be closed (taking in messages, other
+    // PEs might wait to write)
+    do {
+      tcpPoll(100);
+      open = false;
+      for (n = 2; n <= nPEs; n++) {
+        open = open || peers[n].fd >= 0;
+      }
+    } while (open);
+    if (forkPEs) {
+      while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {}
+    }
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("All PEs have left.\n"));
+  } else {
+    MP_send(1, PP_FINISH, (StgWord8*) data, sizeof(StgWord));
+    // on error, stay until the main PE answers
+    while (isError != 0 && !peers[1].finished && peers[1].fd >= 0) {
+      tcpPoll(100);
+    }
+    // write what is queued
+    do {
+      open = false;
+      for (n = 1; n <= nPEs; n++) {
+        open = open || (peers[n].fd >= 0 && peers[n].sendHead != NULL);
+      }
+      if (open) tcpPoll(100);
+    } while (open);
+  }
+
+  for (n = 1; n <= nPEs; n++) {
+    if (peers[n].fd >= 0) {
+      tcpClosePeer(n);
+    }
+    if (peHost[n] != NULL) {
+      stgFree(peHost[n]);
+      peHost[n] = NULL;
+    }
+  }
+  while ((msg = dequeue(&inboxSys)) != NULL
+         || (msg = dequeue(&inbox)) != NULL) {
+    stgFree(msg);
+  }
+  inboxBytes = 0;
+  inboxCount = 0;
+#if defined(linux_HOST_OS)
+  close(epollFd);
+  epollFd = -1;
+#endif
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("Goodbye\n"));
+  tcpState = TCP_STOPPED;
+  /* indicate that quit has been executed */
+  nPEs = 0;
+
+  return true;
+}
+
+/**************************************************************
+ * Connections */
+
+static void enqueue(TCPQueue *q, TCPMsg *msg) {
+  msg->next = NULL;
+  if (q->tail == NULL) {
+    q->head = msg;
+  } else {
+    q->tail->next = msg;
+  }
+  q->tail = msg;
+}
+
+static TCPMsg* dequeue(TCPQueue *q) {
+  TCPMsg *msg = q->head;
+
+  if (msg != NULL) {
+    q->head = msg->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+  }
+  return msg;
+}
+
+static void deliver(TCPMsg *msg) {
+  enqueue(ISSYSCODE(msg->tag) ? &inboxSys : &inbox, msg);
+  inboxBytes += msg->length;
+  inboxCount++;
+}
+
+static TCPMsg* newMsg(PEId sender, OpCode tag, uint32_t length) {
+  TCPMsg *msg = stgMallocBytes(sizeof(TCPMsg) + length, "TCPMsg");
+  msg->sender = sender;
+  msg->tag = tag;
+  msg->length = length;
+  return msg;
+}
+
+// a connection is closed (or has failed): drop what is queued for it.
+// If the main PE, or another PE from the main PE's view, goes away
+// while running, this is reported as a FINISH from it.
+static void tcpClosePeer(PEId pe) {
+  TCPPeer *p = &peers[pe];
+  TCPSend *send;
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("TCP: connection to PE %u closed\n", pe));
+#if defined(linux_HOST_OS)
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, p->fd, NULL);
+#endif
+  close(p->fd);
+  p->fd = -1;
+  while ((send = p->sendHead) != NULL) {
+    p->sendHead = send->next;
+    stgFree(send);
+  }
+  p->sendTail = NULL;
+  p->queued = 0;
+  stgFree(p->in);
+  p->in = NULL;
+  if (p->msg != NULL) {
+    stgFree(p->msg);
+    p->msg = NULL;
+  }
+
+  if (tcpState == TCP_RUNNING && !p->finished
+      && (IAmMainThread || pe == 1)) {
+    TCPMsg *msg = newMsg(pe, PP_FINISH, sizeof(StgWord));
+    msg->data[0] = 1;
+    p->finished = true;
+    deliver(msg);
+  }
+}
+
+// a complete message has arrived
+static void received(PEId pe) {
+  TCPPeer *p = &peers[pe];
+
+  if (p->msg->tag == PP_FINISH) {
+    p->finished = true;
+  }
+  deliver(p->msg);
+  p->msg = NULL;
+}
+
+// take frames out of the staging buffer
+static void parseStaging(PEId pe) {
+  TCPPeer *p = &peers[pe];
+  uint32_t avail, n;
+
+  while ((avail = p->inEnd - p->inStart) > 0) {
+    if (p->msg == NULL) {
+      TCPHeader hdr;
+      if (avail < sizeof(TCPHeader)) break;
+      memcpy(&hdr, p->in + p->inStart, sizeof(TCPHeader));
+      p->inStart += sizeof(TCPHeader);
+      // no PE sends more than a pack buffer (with its header) at once
+      if (!ISOPCODE(hdr.tag)
+          || hdr.length > DATASPACEWORDS * sizeof(StgWord)) {
+        barf("TCP: corrupt frame from PE %u (tag %#x, %u bytes)",
+             pe, hdr.tag, hdr.length);
+      }
+      p->msg = newMsg(pe, hdr.tag, hdr.length);
+      p->msgDone = 0;
+    } else {
+      n = stg_min(avail, p->msg->length - p->msgDone);
+      memcpy((StgWord8*) p->msg->data + p->msgDone, p->in + p->inStart, n);
+      p->inStart += n;
+      p->msgDone += n;
+    }
+    if (p->msg->length == p->msgDone) {
+      received(pe);
+    }
+  }
+  // keep the start of a header
+  memmove(p->in, p->in + p->inStart, p->inEnd - p->inStart);
+  p->inEnd -= p->inStart;
+  p->inStart = 0;
+}
+
+// read what is there from a connection
+static void tcpRead(PEId pe) {
+  TCPPeer *p = &peers[pe];
+  ssize_t n;
+
+  while (p->fd >= 0) {
+    if (p->msg != NULL && p->inEnd == 0 &&
+        p->msg->length - p->msgDone >= TCP_CHUNK) {
+      // data of a large message: directly into the message
+      n = recv(p->fd, (StgWord8*) p->msg->data + p->msgDone,
+               p->msg->length - p->msgDone, 0);
+      if (n > 0) {
+        p->msgDone += n;
+        if (p->msg->length == p->msgDone) {
+          received(pe);
+        }
+      }
+    } else {
+      n = recv(p->fd, p->in + p->inEnd, TCP_CHUNK - p->inEnd, 0);
+      if (n > 0) {
+        p->inEnd += n;
+        parseStaging(pe);
+      }
+    }
+    if (n == 0) {
+      tcpClosePeer(pe);
+    } else if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      if (errno == ECONNRESET) {
+        tcpClosePeer(pe);
+      } else {
+        barf("TCP: receive from PE %u failed (%s)", pe, strerror(errno));
+      }
+    }
+  }
+}
+
+// register for writing when there is something queued
+static void tcpWatch(PEId pe) {
+#if defined(linux_HOST_OS)
+  TCPPeer *p = &peers[pe];
+  bool want = (p->sendHead != NULL);
+  struct epoll_event ev;
+
+  if (p->fd < 0 || want == p->watchOut) return;
+  ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+  ev.data.u32 = pe;
+  epoll_ctl(epollFd, EPOLL_CTL_MOD, p->fd, &ev);
+  p->watchOut = want;
+#else
+  (void) pe; // poll looks at the queues
+#endif
+}
+
+// write the queued frames to a connection, several at a time
+static void tcpWrite(PEId pe) {
+  TCPPeer *p = &peers[pe];
+  struct iovec iov[TCP_MAX_IOV];
+  struct msghdr mh;
+  TCPSend *send;
+  ssize_t n;
+  int count;
+
+  while (p->fd >= 0 && p->sendHead != NULL) {
+    count = 0;
+    for (send = p->sendHead; send != NULL && count < TCP_MAX_IOV;
+         send = send->next) {
+      iov[count].iov_base = send->data + send->done;
+      iov[count].iov_len  = send->length - send->done;
+      count++;
+    }
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = count;
+    n = sendmsg(p->fd, &mh, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      if (errno == EPIPE || errno == ECONNRESET) {
+        tcpClosePeer(pe);
+        return;
+      }
+      barf("TCP: send to PE %u failed (%s)", pe, strerror(errno));
+    }
+    p->queued -= n;
+    while (n > 0) {
+      send = p->sendHead;
+      if ((uint32_t) n < send->length - send->done) {
+        send->done += n;
+        break;
+      }
+      n -= send->length - send->done;
+      p->sendHead = send->next;
+      stgFree(send);
+    }
+    if (p->sendHead == NULL) {
+      p->sendTail = NULL;
+    } else if (p->sendHead->done > 0) {
+      break; // socket full
+    }
+  }
+  tcpWatch(pe);
+}
+
+// wait (at most timeout ms, -1: no limit) for connections to be ready,
+// then read and write
+static void tcpPoll(int timeout) {
+#if defined(linux_HOST_OS)
+  struct epoll_event ev[MAX_PES];
+  int i, n;
+
+  n = epoll_wait(epollFd, ev, MAX_PES, timeout);
+  if (n < 0 && errno != EINTR) {
+    barf("TCP: epoll_wait failed (%s)", strerror(errno));
+  }
+  for (i = 0; i < n; i++) {
+    PEId pe = ev[i].data.u32;
+    if (ev[i].events & EPOLLOUT) {
+      tcpWrite(pe);
+    }
+    if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      tcpRead(pe);
+    }
+  }
+#else
+  struct pollfd fds[MAX_PES];
+  PEId pes[MAX_PES];
+  PEId pe;
+  int i, n, count = 0;
+
+  for (pe = 1; pe <= nPEs; pe++) {
+    if (peers[pe].fd >= 0) {
+      fds[count].fd = peers[pe].fd;
+      fds[count].events = POLLIN | (peers[pe].sendHead ? POLLOUT : 0);
+      pes[count++] = pe;
+    }
+  }
+  n = poll(fds, count, timeout);
+  if (n < 0 && errno != EINTR) {
+    barf("TCP: poll failed (%s)", strerror(errno));
+  }
+  for (i = 0; n > 0 && i < count; i++) {
+    if (fds[i].revents & POLLOUT) {
+      tcpWrite(pes[i]);
+    }
+    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+      tcpRead(pes[i]);
+    }
+  }
+#endif
+}
+
+/**************************************************************
+ * Sending and receiving */
+
+// whether a destination can take more data (see Backpressure)
+static bool readyToSend(PEId node, uint32_t length) {
+  TCPPeer *p = &peers[node];
+
+  if (p->sendHead != NULL) {
+    tcpWrite(node);
+  }
+  return (p->sendHead == NULL || p->queued + length <= maxInFlight);
+}
+
+bool MP_send(PEId node, OpCode tag, StgWord8 *data, uint32_t length) {
+  MPVec vec;
+
+  vec.data = data;
+  vec.length = length;
+  return MP_sendv(node, tag, &vec, 1);
+}
+
+bool MP_sendv(PEId node, OpCode tag, MPVec *vec, uint32_t count) {
+  /* When nothing is queued for the destination, the frame is written
+   * right away from the given pieces (no copy). What the socket does
+   * not take is copied into a queued send, written (together with
+   * later frames) when the socket is ready again.
+   */
+  TCPPeer *p = &peers[node];
+  struct iovec iov[TCP_MAX_IOV];
+  struct msghdr mh;
+  TCPHeader hdr;
+  TCPSend *send;
+  uint32_t length, i, skip, at;
+  ssize_t n = 0;
+
+  ASSERT(node > 0 && node <= nPEs);
+
+  length = 0;
+  for (i = 0; i < count; i++) {
+    length += vec[i].length;
+  }
+
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("TCP sending message to PE %u "
+                          "(tag %d (%s), datasize %u)\n",
+                          node, tag, getOpName(tag), length));
+
+  if (node == thisPE) {
+    TCPMsg *msg = newMsg(node, tag, length);
+    for (i = 0, at = 0; i < count; i++) {
+      memcpy((StgWord8*) msg->data + at, vec[i].data, vec[i].length);
+      at += vec[i].length;
+    }
+    deliver(msg);
+    return true;
+  }
+  if (p->fd < 0) {
+    // PE has gone, the message is lost
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("TCP: PE %u has left, message dropped\n", node));
+    return true;
+  }
+  // FINISH is always sent, even when much is queued
+  if (tag != PP_FINISH && !readyToSend(node, length)) {
+    IF_PAR_DEBUG(mpcomm,
+                 debugBelch("TCP CANCELED sending message to PE %u "
+                            "(%" FMT_Word64 " bytes queued)\n",
+                            node, p->queued));
+    return false;
+  }
+
+  hdr.length = length;
+  hdr.tag = tag;
+
+  if (p->sendHead == NULL && count < TCP_MAX_IOV) {
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(TCPHeader);
+    for (i = 0; i < count; i++) {
+      iov[i+1].iov_base = vec[i].data;
+      iov[i+1].iov_len = vec[i].length;
+    }
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = count + 1;
+    do {
+      n = sendmsg(p->fd, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      if (errno == EPIPE || errno == ECONNRESET) {
+        tcpClosePeer(node);
+        return true;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        barf("TCP: send to PE %u failed (%s)", node, strerror(errno));
+      }
+      n = 0;
+    }
+    if ((uint32_t) n == sizeof(TCPHeader) + length) {
+      return true;
+    }
+  }
+
+  // queue the rest of the frame (skipping the n bytes written)
+  send = stgMallocBytes(sizeof(TCPSend) + sizeof(TCPHeader) + length
+                        - n, "TCPSend");
+  send->next = NULL;
+  send->length = sizeof(TCPHeader) + length - n;
+  send->done = 0;
+  at = 0;
+  skip = n;
+  if (skip < sizeof(TCPHeader)) {
+    memcpy(send->data, (StgWord8*) &hdr + skip, sizeof(TCPHeader) - skip);
+    at = sizeof(TCPHeader) - skip;
+    skip = 0;
+  } else {
+    skip -= sizeof(TCPHeader);
+  }
+  for (i = 0; i < count; i++) {
+    if (skip >= vec[i].length) {
+      skip -= vec[i].length;
+      continue;
+    }
+    memcpy(send->data + at, vec[i].data + skip, vec[i].length - skip);
+    at += vec[i].length - skip;
+    skip = 0;
+  }
+  ASSERT(at == send->length);
+
+  if (p->sendTail == NULL) {
+    p->sendHead = send;
+  } else {
+    p->sendTail->next = send;
+  }
+  p->sendTail = send;
+  p->queued += send->length;
+  tcpWatch(node);
+  return true;
+}
+
+/* - a multicast, see MPSystem.h: sent to each node in turn. */
+uint32_t MP_bcast(PEId *nodes, uint32_t count,
+                  OpCode tag, StgWord8 *data, uint32_t length) {
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (!MP_send(nodes[i], tag, data, length)) {
+      break;
+    }
+  }
+  return i;
+}
+
+/* - a non-blocking check whether a message to node can be sent, see
+ *   MPSystem.h. False if a message of maximal size would exceed the
+ *   data allowed to be queued for node.
+ */
+bool MP_send_ready(PEId node) {
+  if (node == thisPE || peers[node].fd < 0) {
+    return true;
+  }
+  return readyToSend(node, DATASPACEWORDS * sizeof(StgWord));
+}
+
+// next message to receive, system messages first (NULL if none)
+static TCPMsg* takeMsg(void) {
+  TCPMsg *msg;
+
+  msg = dequeue(&inboxSys);
+  if (msg == NULL) {
+    msg = dequeue(&inbox);
+  }
+  if (msg != NULL) {
+    inboxBytes -= msg->length;
+    inboxCount--;
+  }
+  return msg;
+}
+
+// blocking wait for the next message
+static TCPMsg* waitMsg(void) {
+  TCPMsg *msg;
+
+  while ((msg = takeMsg()) == NULL) {
+    tcpPoll(-1);
+  }
+  IF_PAR_DEBUG(mpcomm,
+               debugBelch("TCP Message from PE %u with code %d.\n",
+                          msg->sender, msg->tag));
+  return msg;
+}
+
+/* - a blocking receive operation
+   where system messages from main node have priority! */
+uint32_t MP_recv(uint32_t maxlength, StgWord8 *destination,
+                 OpCode *retcode, PEId *sender) {
+  TCPMsg *msg = waitMsg();
+  uint32_t length = msg->length;
+
+  if (maxlength < length) {
+    barf("wrong TCP message length (%u, too big)!!!", length);
+  }
+  memcpy(destination, msg->data, length);
+  *retcode = msg->tag;
+  *sender = msg->sender;
+  stgFree(msg);
+  return length;
+}
+
+/* - a blocking receive operation which lends the message data, see
+ *   MPSystem.h. Messages are received into buffers of their own, which
+ *   are lent out directly.
+ */
+StgWord8 *MP_recv_borrow(OpCode *code, PEId *sender, uint32_t *length) {
+  MP_recv_release();
+  borrowed = waitMsg();
+  *code = borrowed->tag;
+  *sender = borrowed->sender;
+  *length = borrowed->length;
+  return (StgWord8*) borrowed->data;
+}
+
+/* - give back a message obtained by MP_recv_borrow */
+void MP_recv_release(void) {
+  if (borrowed != NULL) {
+    stgFree(borrowed);
+    borrowed = NULL;
+  }
+}
+
+/* - a non-blocking probe operation (unspecified sender)
+ */
+bool MP_probe(void) {
+  // read and write what is ready (called in every round of the
+  // scheduler)
+  tcpPoll(0);
+  return (inboxSys.head != NULL || inbox.head != NULL);
+}
+
+/* - amount of data waiting: all complete messages received */
+uint32_t MP_pending(void) {
+  StgWord64 bytes;
+
+  if (!MP_probe()) {
+    return 0;
+  }
+  bytes = stg_max(inboxBytes, inboxCount);
+  return (uint32_t) stg_min(bytes, (StgWord64) UINT32_MAX);
+}
+
+/* - locality domain of a node: not known here (hosts are not grouped) */
+uint32_t MP_locality(PEId node STG_UNUSED) {
+  return 0;
+}
+
+/* scans argv to find an argument "-N<num>", and sets nPEs to the
+ * given num value. If the value is negative, mpcomm debug flag is set
+ * (not documented). Furthermore, the -N argument is removed from
+ * argv, and argc reduced.
+ * Returns the nPEs value found, 0 if nothing found.
+ */
+PEId setnPEsArg(int *argc, char **argv) {
+  char **currArg, **lastArg;
+  bool inRTS, finishedRTS;
+  int i;
+  PEId pes;
+
+  inRTS = finishedRTS = false;
+  pes = 0;
+  i = *argc;
+  currArg = argv;
+  lastArg = argv;
+
+  while (i-- > 0) {
+    if ( !finishedRTS && inRTS && (*currArg)[0]=='-' && (*currArg)[1]=='N') {
+      // the PE flag we want. Parse it and only advance currArg, decrease argc
+      if ((*currArg)[2]=='-') { // negative number, debug mode
+        RtsFlags.ParFlags.Debug.mpcomm = true;
+        pes = (PEId)atoi((*currArg)+3);
+      } else {
+        pes = (PEId)atoi((*currArg)+2);
+      }
+      currArg++;
+      (*argc)--;
+    } else {
+      // check for interesting flags
+      if      (strcmp(*currArg, "--RTS") == 0) finishedRTS = true;
+      else if (strcmp(*currArg, "--") == 0)    finishedRTS = true;
+      else if (strcmp(*currArg, "+RTS") == 0)  inRTS = true;
+      else if (strcmp(*currArg, "-RTS") == 0)  inRTS = false;
+      // copy argument to its new place
+      *lastArg++ = *currArg++;
+    }
+  }
+  return pes;
+}
+
+#endif /* whole file */
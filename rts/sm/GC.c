@@ -455,6 +455,8 @@ GarbageCollect (uint32_t collect_gen,
   // IsAlive() works... Inports to garbage-collected blackholes will
   // be closed, sending a message to the sender if known.
   updateRTT();
+  // closures remembered for other PEs have moved
+  updateSharingCaches();
 #endif
 
 #if defined(THREADED_RTS)
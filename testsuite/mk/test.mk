@@ -123,6 +123,25 @@ else
 RUNTEST_OPTS += -e ghc_with_dynamic_rts=0
 endif
 
+# parallel ways (pc: -parcp, pm: -parmpi, pt: -partcp)
+ifeq "$(filter pc, $(GhcRTSWays))" "pc"
+RUNTEST_OPTS += -e ghc_with_parcp=1
+else
+RUNTEST_OPTS += -e ghc_with_parcp=0
+endif
+
+ifeq "$(filter pm, $(GhcRTSWays))" "pm"
+RUNTEST_OPTS += -e ghc_with_parmpi=1
+else
+RUNTEST_OPTS += -e ghc_with_parmpi=0
+endif
+
+ifeq "$(filter pt, $(GhcRTSWays))" "pt"
+RUNTEST_OPTS += -e ghc_with_partcp=1
+else
+RUNTEST_OPTS += -e ghc_with_partcp=0
+endif
+
 ifeq "$(GhcWithInterpreter)" "NO"
 RUNTEST_OPTS += -e config.have_interp=False
 else ifeq "$(GhcStage)" "1"
@@ -0,0 +1,66 @@
+-- The Eden primitives (expectData#, connectToPort#, sendData#) in IO, as
+-- used by the tests of the parallel RTS. Needs a parallel way.
+
+{-# LANGUAGE MagicHash #-}
+{-# LANGUAGE UnboxedTuples #-}
+
+module EdenPrims
+  ( ChanName
+  , createC, connectC, sendData, spawn, addBcast, bcast, selfPe
+  , modeStream, modeData
+  , bytesSent
+  ) where
+
+import Data.Word (Word32, Word64)
+import Foreign.Ptr (Ptr)
+import Foreign.Storable (peek)
+import GHC.Exts
+import GHC.IO
+import GHC.Stats (getRTSStats, msg_bytes_sent)
+
+foreign import ccall unsafe "&thisPE" thisPEPtr :: Ptr Word32
+
+data ChanName = ChanName !Int !Int !Int -- PE, process, inport
+
+-- Eden send modes, see sendWrapper in rts/parallel/DataComms.c
+modeConnect, modeStream, modeData :: Int
+modeConnect = 1
+modeStream  = 2
+modeData    = 3
+
+-- a new inport, and the data which will arrive there
+createC :: IO (ChanName, a)
+createC = do
+  pe <- selfPe
+  IO $ \s -> case expectData# s of
+    (# s', p, i, x #) -> (# s', (ChanName pe (I# p) (I# i), x) #)
+
+-- the current thread sends to the inport from now on
+connectC :: ChanName -> IO ()
+connectC (ChanName (I# pe) (I# p) (I# i)) = do
+  IO $ \s -> case connectToPort# pe p i s of s' -> (# s', () #)
+  sendData modeConnect ()
+
+sendData :: Int -> a -> IO ()
+sendData (I# m) x = IO $ \s -> case sendData# m x s of s' -> (# s', () #)
+
+-- runs an action as a new process on a PE
+spawn :: Int -> IO () -> IO ()
+spawn pe = sendData (4 + pe * 8)
+
+-- the PE we run on
+selfPe :: IO Int
+selfPe = fmap fromIntegral (peek thisPEPtr)
+
+-- the receiver of the current thread gets the next broadcast
+addBcast :: IO ()
+addBcast = sendData 5 ()
+
+-- sends data to all receivers added before, relayed by their PEs in a
+-- tree with the given fan-out (0: the sender sends to all PEs)
+bcast :: Int -> a -> IO ()
+bcast fanout = sendData (6 + fanout * 8)
+
+-- bytes this PE has sent to others (needs +RTS -T)
+bytesSent :: IO Word64
+bytesSent = fmap msg_bytes_sent getRTSStats
@@ -0,0 +1,189 @@
+/*
+ * Checks the eventlog which the main PE writes for all PEs with -qT
+ * (see rts/eventlog/EventLogWriter.c), run on two PEs:
+ *
+ *   - the header declares the events, the data ends with DATA_END
+ *   - there are blocks of capability 0 (PE 1) and 256 (the first one
+ *     of PE 2), no block without a capability, and capset 16 (the
+ *     first one of PE 2) is created
+ *   - the blocks are in the order of their start time
+ *
+ * Prints "merged eventlog ok", or what is wrong on stderr.
+ */
+
+#include "Rts.h"
+#include "rts/EventLogFormat.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PE2_CAP    256
+#define PE2_CAPSET 16
+
+static StgWord8 *data;
+static size_t size, pos;
+
+// event sizes by type, from the header (-2 if not declared)
+static int32_t eventSize[0x10000];
+
+static bool failed(const char *what)
+{
+    fprintf(stderr, "EventLogCheck: %s (at byte %lu)\n",
+            what, (unsigned long) pos);
+    return false;
+}
+
+// big endian, as the eventlog
+static bool get(uint32_t bytes, StgWord64 *value)
+{
+    uint32_t i;
+
+    if (size - pos < bytes) {
+        return false;
+    }
+    *value = 0;
+    for (i = 0; i < bytes; i++) {
+        *value = *value << 8 | data[pos++];
+    }
+    return true;
+}
+
+static bool expect(StgWord32 marker, const char *what)
+{
+    StgWord64 w;
+
+    return (get(4, &w) && w == marker) || failed(what);
+}
+
+static bool readHeader(void)
+{
+    StgWord64 w, num, esize, len;
+    uint32_t i;
+
+    for (i = 0; i < 0x10000; i++) {
+        eventSize[i] = -2;
+    }
+    if (!expect(EVENT_HEADER_BEGIN, "no header")
+        || !expect(EVENT_HET_BEGIN, "no event types")) {
+        return false;
+    }
+    for (;;) {
+        if (!get(4, &w)) {
+            return failed("event types truncated");
+        }
+        if (w != EVENT_ET_BEGIN) {
+            break;
+        }
+        if (!get(2, &num) || !get(2, &esize) || !get(4, &len)
+            || size - pos < len) {
+            return failed("event type truncated");
+        }
+        pos += len; // description
+        if (!get(4, &len) || size - pos < len) {
+            return failed("event type truncated");
+        }
+        pos += len; // extension
+        if (!expect(EVENT_ET_END, "event type not ended")) {
+            return false;
+        }
+        eventSize[num] = (esize == 0xffff) ? -1 : (int32_t) esize;
+    }
+    if (w != EVENT_HET_END) {
+        return failed("event types not ended");
+    }
+    return expect(EVENT_HEADER_END, "header not ended")
+        && expect(EVENT_DATA_BEGIN, "no data");
+}
+
+static bool readEvents(void)
+{
+    StgWord64 type, time, esize, w, lastStart = 0;
+    bool cap0 = false, capPE2 = false, capsetPE2 = false;
+    size_t payload;
+
+    for (;;) {
+        if (!get(2, &type)) {
+            return failed("no end of data");
+        }
+        if (type == EVENT_DATA_END) {
+            break;
+        }
+        if (eventSize[type] == -2 || !get(8, &time)) {
+            return failed("unknown event");
+        }
+        if (eventSize[type] == -1) {
+            if (!get(2, &esize)) {
+                return failed("event truncated");
+            }
+        } else {
+            esize = (StgWord64) eventSize[type];
+        }
+        if (size - pos < esize) {
+            return failed("event truncated");
+        }
+        payload = pos;
+
+        switch (type) {
+        case EVENT_BLOCK_MARKER: // (size, end_time, capability)
+            pos += 4 + 8;
+            get(2, &w);
+            if (w == (EventCapNo) -1) {
+                return failed("block without a capability");
+            }
+            cap0 = cap0 || w == 0;
+            capPE2 = capPE2 || w == PE2_CAP;
+            if (time < lastStart) {
+                return failed("block earlier than the one before");
+            }
+            lastStart = time;
+            break;
+        case EVENT_CAPSET_CREATE: // (capset, capset_type)
+            get(4, &w);
+            capsetPE2 = capsetPE2 || w == PE2_CAPSET;
+            break;
+        default:
+            break;
+        }
+        pos = payload + esize;
+    }
+
+    if (pos != size) {
+        return failed("data after the end");
+    }
+    if (!cap0 || !capPE2) {
+        return failed("no blocks of one of the PEs");
+    }
+    if (!capsetPE2) {
+        return failed("no capset of PE 2");
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *f;
+    long length;
+
+    if (argc != 2 || (f = fopen(argv[1], "rb")) == NULL) {
+        fprintf(stderr, "usage: EventLogCheck <merged eventlog>\n");
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    size = (size_t) length;
+    data = malloc(size + 1);
+    if (data == NULL || fread(data, 1, size, f) != size) {
+        fprintf(stderr, "EventLogCheck: cannot read %s\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    pos = 0;
+    if (!readHeader() || !readEvents()) {
+        printf("merged eventlog FAILED\n");
+        return 1;
+    }
+    printf("merged eventlog ok\n");
+    free(data);
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Latency and bandwidth of the message passing layer (MPSystem.h),
+ * below the Eden primitives: ping-pong between PEs 1 and 2 and a
+ * stream of messages from PE 1 to PE 2, for message sizes from 8 bytes
+ * to 1MB. Works with any parallel way (-parcp, -partcp, ...).
+ *
+ * Run with +RTS -N2. Prints one JSON object per measurement (see
+ * Makefile). PEs other than 1 and 2 wait for the end.
+ *
+ * "MPBench check" sends a few messages of each size, with content
+ * depending on size and sequence number, which the receiver checks.
+ * Prints "<bench> <bytes> ok" (PE 2 answers garbled pings with an
+ * empty message, and reports the intact messages of a stream).
+ */
+
+#include "Rts.h"
+#include "MPSystem.h"
+#include "PEOpCodes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_SIZE (1024*1024)
+#define TAG      PP_DATA
+#define TAG_DONE PP_TERMINATE
+
+static StgWord8 payload[MAX_SIZE];
+static bool check = false;
+static int failures = 0;
+
+// check mode: the content of message seq of size bytes
+static void fill(uint32_t size, uint32_t seq)
+{
+    uint32_t i;
+
+    for (i = 0; i < size; i++) {
+        payload[i] = (StgWord8)((i * 7 + size + seq) % 251);
+    }
+}
+
+static bool intact(StgWord8 *data, uint32_t length, uint32_t size,
+                   uint32_t seq)
+{
+    uint32_t i;
+
+    if (length != size) {
+        return false;
+    }
+    for (i = 0; i < size; i++) {
+        if (data[i] != (StgWord8)((i * 7 + size + seq) % 251)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void report(const char *bench, uint32_t size, bool ok)
+{
+    printf("%s %u %s\n", bench, size, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void send_to(PEId pe, OpCode tag, uint32_t size)
+{
+    // the MP-System may refuse a message when too much is in flight
+    while (!MP_send(pe, tag, payload, size)) {
+        MP_probe();
+    }
+}
+
+// receives the next message, skipping FINISH (other PEs leaving early).
+// In check mode, returns whether it is message seq of size bytes
+static bool recv_msg(OpCode *tag, uint32_t size, uint32_t seq)
+{
+    PEId sender;
+    uint32_t length;
+    StgWord8 *data;
+    bool ok;
+
+    do {
+        data = MP_recv_borrow(tag, &sender, &length);
+        ok = !check || intact(data, length, size, seq);
+        MP_recv_release();
+    } while (*tag == PP_FINISH);
+    return ok;
+}
+
+// receives the answer at the end of a stream: the number of messages
+// which arrived (intact ones in check mode)
+static uint32_t recv_count(void)
+{
+    OpCode tag;
+    PEId sender;
+    uint32_t length, count = 0;
+    StgWord8 *data;
+
+    do {
+        data = MP_recv_borrow(&tag, &sender, &length);
+        if (tag != PP_FINISH && length == sizeof(count)) {
+            memcpy(&count, data, sizeof(count));
+        }
+        MP_recv_release();
+    } while (tag == PP_FINISH);
+    return count;
+}
+
+static void ping_pong(uint32_t size, int iters)
+{
+    OpCode tag;
+    double t0 = 0;
+    bool ok = true;
+    int i;
+
+    // first tenth warms up
+    for (i = -iters/10; i < iters; i++) {
+        if (i == 0) t0 = now_ns();
+        if (check) fill(size, i + iters);
+        if (thisPE == 1) {
+            send_to(2, TAG, size);
+            ok = recv_msg(&tag, size, i + iters) && ok;
+        } else if (recv_msg(&tag, size, i + iters)) {
+            send_to(1, TAG, size);
+        } else {
+            send_to(1, TAG, 0);
+        }
+    }
+    if (thisPE == 1 && check) {
+        report("mp-pingpong", size, ok);
+    } else if (thisPE == 1) {
+        printf("{\"bench\":\"mp-pingpong\",\"bytes\":%u,\"iters\":%d,"
+               "\"ns_per_op\":%.0f}\n",
+               size, iters, (now_ns() - t0) / iters);
+    }
+}
+
+static void stream(uint32_t size, int count)
+{
+    OpCode tag;
+    double t0;
+    uint32_t received = 0;
+    int i;
+
+    t0 = now_ns();
+    if (thisPE == 1) {
+        for (i = 0; i < count; i++) {
+            if (check) fill(size, i);
+            send_to(2, TAG, size);
+        }
+        received = recv_count(); // answer after the last message
+        if (check) {
+            report("mp-stream", size, received == (uint32_t)count);
+            return;
+        }
+        double ns = now_ns() - t0;
+        printf("{\"bench\":\"mp-stream\",\"bytes\":%u,\"iters\":%d,"
+               "\"ns_per_op\":%.0f,\"mbps\":%.1f}\n",
+               size, count, ns / count, (double)size * count * 1000 / ns);
+    } else {
+        for (i = 0; i < count; i++) {
+            if (recv_msg(&tag, size, i)) {
+                received++;
+            }
+        }
+        memcpy(payload, &received, sizeof(received));
+        send_to(1, TAG, sizeof(received));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t size;
+    PEId pe;
+    OpCode tag;
+
+    hs_init(&argc, &argv);
+    check = argc > 1 && strcmp(argv[1], "check") == 0;
+
+    if (nPEs < 2) {
+        if (thisPE == 1) {
+            fprintf(stderr, "MPBench: needs at least 2 PEs (+RTS -N2)\n");
+        }
+        hs_exit();
+        return 1;
+    }
+    memset(payload, 7, sizeof(payload));
+
+    if (thisPE <= 2) {
+        for (size = 8; size <= MAX_SIZE; size *= 8) {
+            ping_pong(size, check ? 5 : size < 65536 ? 10000 : 1000);
+        }
+        for (size = 8; size <= MAX_SIZE; size *= 8) {
+            stream(size, check ? 50 : size < 65536 ? 100000 : 2000);
+        }
+    }
+    if (thisPE == 1) {
+        for (pe = 3; pe <= nPEs; pe++) {
+            send_to(pe, TAG_DONE, 0);
+        }
+    } else if (thisPE > 2) {
+        recv_msg(&tag, 0, 0);
+    }
+
+    hs_exit();
+    return failures > 0 ? 1 : 0;
+}
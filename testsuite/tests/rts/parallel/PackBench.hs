@@ -0,0 +1,141 @@
+-- Pack/unpack throughput of serialize# and deserialize#, for graphs of
+-- different shapes: wide (balanced tree) and deep (chain) graphs of
+-- the same size, sharing-heavy graphs, and large byte arrays.
+--
+--   PackBench check      round-trips small graphs, prints "<graph> ok"
+--   PackBench [scale]    prints one JSON object per graph (see Makefile)
+
+{-# LANGUAGE BangPatterns #-}
+{-# LANGUAGE ExistentialQuantification #-}
+{-# LANGUAGE MagicHash #-}
+{-# LANGUAGE UnboxedTuples #-}
+
+import Control.Exception (evaluate)
+import Control.Monad
+import GHC.Clock (getMonotonicTimeNSec)
+import GHC.Exts
+import GHC.IO
+import System.Environment (getArgs)
+import System.Exit
+import Text.Printf (printf)
+
+data Tree = Leaf !Int | Node Tree Tree
+
+data Packed = Packed ByteArray#
+
+data Bytes = Bytes ByteArray#
+
+serialize :: a -> IO Packed
+serialize x = IO $ \s ->
+  case serialize# x s of
+    (# s', 0#, arr #) -> (# s', Packed arr #)
+    (# _, err, _ #)   -> error ("serialize# failed, code " ++ show (I# err))
+
+deserialize :: Packed -> IO a
+deserialize (Packed arr) = IO $ \s ->
+  case deserialize# arr s of
+    (# s', 0#, x #) -> (# s', x #)
+    (# _, err, _ #) -> error ("deserialize# failed, code " ++ show (I# err))
+
+packedBytes :: Packed -> Int
+packedBytes (Packed arr) = I# (sizeofByteArray# arr)
+
+-- balanced tree with n leaves
+wide :: Int -> Tree
+wide n | n <= 1    = Leaf n
+       | otherwise = Node (wide h) (wide (n - h))
+  where h = n `div` 2
+
+-- chain of n leaves
+deep :: Int -> Tree
+deep n = go 1
+  where go i | i >= n    = Leaf i
+             | otherwise = Node (Leaf i) (go (i + 1))
+
+-- 2^d leaves, but only d+1 nodes (each level shared twice)
+dag :: Int -> Tree
+dag 0 = Leaf 1
+dag d = let t = dag (d - 1) in Node t t
+
+-- n list cells, all pointing to the same tree
+sharedList :: Int -> [Tree]
+sharedList n = replicate n (wide 1000)
+
+-- byte array of n bytes (one ARR_WORDS closure)
+bytes :: Int -> IO Bytes
+bytes (I# n) = IO $ \s ->
+  case newByteArray# n s of
+    (# s1, m #) -> case setByteArray# m 0# n 7# s1 of
+      s2 -> case unsafeFreezeByteArray# m s2 of
+        (# s3, arr #) -> (# s3, Bytes arr #)
+
+-- checksums, also force the graphs completely
+sumTree :: Tree -> Int
+sumTree (Leaf i)   = i
+sumTree (Node l r) = let !a = sumTree l in a + sumTree r
+
+sumShared :: [Tree] -> Int
+sumShared ts = length ts + sumTree (head ts)
+
+sumBytes :: Bytes -> Int
+sumBytes (Bytes arr) = I# (sizeofByteArray# arr) + I# (indexInt8Array# arr 0#)
+
+data Graph = forall a . Graph String Int a (a -> Int)
+
+graphs :: Int -> IO [Graph]
+graphs scale = do
+  b <- bytes (scale * 64)
+  return
+    [ Graph "wide"   n (wide n) sumTree
+    , Graph "deep"   n (deep n) sumTree
+    , Graph "dag"    d (dag d) sumTree
+    , Graph "shared" n (sharedList n) sumShared
+    , Graph "bytes"  (scale * 64) b sumBytes
+    ]
+  where n = scale
+        d = 20
+
+timed :: Int -> IO () -> IO Double
+timed iters act = do
+  t0 <- getMonotonicTimeNSec
+  replicateM_ iters act
+  t1 <- getMonotonicTimeNSec
+  return (fromIntegral (t1 - t0) / fromIntegral iters)
+
+-- repeat so that a run takes about 0.2 seconds
+iterations :: Double -> Int
+iterations ns = max 3 (min 100000 (round (2.0e8 / max 1 ns)))
+
+bench :: Graph -> IO ()
+bench (Graph name size x check) = do
+  _ <- evaluate (check x)
+  p <- serialize x
+  let len = packedBytes p
+  one <- timed 1 (void (serialize x))
+  let iters = iterations one
+  packNs <- timed iters (serialize x >>= \q -> void (evaluate (packedBytes q)))
+  unpackNs <- timed iters (deserialize p >>= \y -> void (evaluate (y `asTypeOf` x)))
+  printf ("{\"bench\":\"pack\",\"graph\":\"%s\",\"size\":%d,\"bytes\":%d,"
+          ++ "\"iters\":%d,\"pack_ns\":%.0f,\"unpack_ns\":%.0f,"
+          ++ "\"pack_mbps\":%.1f,\"unpack_mbps\":%.1f}\n")
+         name size len iters packNs unpackNs
+         (mbps len packNs) (mbps len unpackNs)
+  where mbps len ns = fromIntegral len * 1000 / ns :: Double
+
+roundTrip :: Graph -> IO ()
+roundTrip (Graph name _ x check) = do
+  p <- serialize x
+  y <- deserialize p
+  if check y == check x
+    then putStrLn (name ++ " ok")
+    else putStrLn (name ++ " FAILED") >> exitFailure
+
+main :: IO ()
+main = do
+  args <- getArgs
+  case args of
+    ["check"] -> graphs 1000 >>= mapM_ roundTrip . map small
+    [scale]   -> graphs (read scale) >>= mapM_ bench
+    _         -> graphs 100000 >>= mapM_ bench
+  where small (Graph "dag" _ _ _) = Graph "dag" 10 (dag 10) sumTree
+        small g = g
@@ -0,0 +1,54 @@
+-- Broadcasts (send modes 5 and 6) to three PEs with fan-out 1: the main
+-- PE sends each packet to one PE only, which relays it to the next one
+-- (processBcastMsg). All rounds are sent before any answer is read, and
+-- the rings are small (+RTS -qQ64k -qq2), so the main PE has to wait
+-- for congested PEs (send gates) and the relaying PEs have to keep
+-- packets until they can be sent on.
+
+import Control.Exception (evaluate)
+import Control.Monad
+import Data.List (transpose)
+import EdenPrims
+
+data Reply = Chan !ChanName | Sum !Int
+
+rounds :: Int
+rounds = 20
+
+-- the list of round r
+list :: Int -> [Int]
+list r = [r .. r + 999]
+
+-- runs on the other PEs: an inport for every round, whose lists are
+-- answered with their sums
+worker :: ChanName -> IO ()
+worker reply = do
+  connectC reply
+  ins <- replicateM rounds createC
+  forM_ ins $ \(c, _) -> sendData modeStream (Chan c)
+  forM_ ins $ \(_, xs) -> do
+    s <- evaluate (sum (xs :: [Int]))
+    sendData modeStream (Sum s)
+  sendData modeData ([] :: [Reply])
+
+chans :: [Reply] -> ([ChanName], [Reply])
+chans replies = ([c | Chan c <- take rounds replies], drop rounds replies)
+
+sums :: [Reply] -> [Int]
+sums replies = [s | Sum s <- replies]
+
+main :: IO ()
+main = do
+  ins <- forM [2 .. 4] $ \pe -> do
+    (me, replies) <- createC
+    spawn pe (worker me)
+    return replies
+  let (cs, rest) = unzip (map chans ins)
+  forM_ (zip [1 ..] (transpose cs)) $ \(r, rcs) -> do
+    let xs = list r
+    _ <- evaluate (sum xs)
+    forM_ rcs $ \c -> connectC c >> addBcast
+    bcast 1 xs
+  forM_ (zip [1 ..] (transpose (map sums rest))) $ \(r, ss) ->
+    print (r :: Int, length ss, all (== sum (list r)) ss)
+
@@ -0,0 +1,41 @@
+-- A broadcast (send modes 5 and 6) to more receivers than fit into the
+-- pack buffer (+RTS -qQ16k: 2048 words, 3 words per receiver): the
+-- graph is sent to each receiver on its own instead.
+
+import Control.Exception (evaluate)
+import Control.Monad
+import EdenPrims
+
+data Reply = Chan !ChanName | Sum !Int
+
+perPE :: Int
+perPE = 300
+
+list :: [Int]
+list = [1 .. 100]
+
+-- runs on the other PEs: perPE inports, answered with the number of
+-- them which got the list
+worker :: ChanName -> IO ()
+worker reply = do
+  connectC reply
+  ins <- replicateM perPE createC
+  forM_ ins $ \(c, _) -> sendData modeStream (Chan c)
+  n <- foldM (\n (_, xs) -> do
+                s <- evaluate (sum (xs :: [Int]))
+                return $! if s == sum list then n + 1 else n)
+             0 ins
+  sendData modeStream (Sum n)
+  sendData modeData ([] :: [Reply])
+
+main :: IO ()
+main = do
+  ins <- forM [2 .. 4] $ \pe -> do
+    (me, replies) <- createC
+    spawn pe (worker me)
+    return replies
+  let cs = concat [[c | Chan c <- take perPE rs] | rs <- ins]
+  forM_ cs $ \c -> connectC c >> addBcast
+  bcast 0 list
+  print (length cs)
+  print [s | rs <- ins, Sum s <- drop perPE rs]
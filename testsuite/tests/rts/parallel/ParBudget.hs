@@ -0,0 +1,52 @@
+-- The receive budget (+RTS -qR1, -qRb4k, -qRt100): PE 2 floods the main
+-- PE with a stream of small lists, while a counter thread runs on the
+-- main PE. With the budget, the scheduler runs the counter in between
+-- the messages, so the counter sees the received bytes (+RTS -T) grow
+-- many times during the flood, and not only before and after it.
+
+import Control.Concurrent
+import Control.Exception (evaluate)
+import Control.Monad
+import Data.IORef
+import Data.Word (Word64)
+import EdenPrims
+import GHC.Stats (getRTSStats, msg_bytes_received)
+
+messages :: Int
+messages = 2000
+
+bytesReceived :: IO Word64
+bytesReceived = fmap msg_bytes_received getRTSStats
+
+-- runs on PE 2
+flood :: ChanName -> IO ()
+flood reply = do
+  connectC reply
+  forM_ [1 .. messages] $ \i -> sendData modeStream [i .. i + 99]
+  sendData modeData ([] :: [[Int]])
+
+-- counts, and records the bytes received at each step, until done
+counter :: IORef Bool -> IORef [Word64] -> IO ()
+counter done samples = do
+  b <- bytesReceived
+  modifyIORef' samples (b :)
+  stop <- readIORef done
+  unless stop (yield >> counter done samples)
+
+main :: IO ()
+main = do
+  done <- newIORef False
+  samples <- newIORef []
+  finished <- newEmptyMVar
+  _ <- forkIO (counter done samples >> putMVar finished ())
+  b0 <- bytesReceived
+  (me, lists) <- createC
+  spawn 2 (flood me)
+  total <- evaluate (sum (map sum (lists :: [[Int]])))
+  b1 <- bytesReceived
+  writeIORef done True
+  takeMVar finished
+  ss <- readIORef samples
+  print (total == sum [sum [i .. i + 99] | i <- [1 .. messages]])
+  -- steps of the counter while the flood was received
+  print (length (filter (\b -> b > b0 && b < b1) ss) >= 100)
@@ -0,0 +1,36 @@
+-- Compact regions are shipped as their blocks, which the receiver adopts:
+-- two lists in the same region of several blocks, sent to another PE,
+-- are in a compact region there.
+
+import Control.Exception (evaluate)
+import EdenPrims
+import GHC.Compact
+
+data Reply = Chan !ChanName | Sums !Int !Int !Bool
+
+-- runs on PE 2
+worker :: ChanName -> IO ()
+worker reply = do
+  (me, pair) <- createC
+  connectC reply
+  sendData modeStream (Chan me)
+  let (xs, ys) = pair :: ([Int], [Int])
+  inRegion <- (&&) <$> isCompact xs <*> isCompact ys
+  sendData modeStream (Sums (sum xs) (sum ys) inRegion)
+  sendData modeData ([] :: [Reply])
+
+main :: IO ()
+main = do
+  c <- compact [1 .. 10000 :: Int]
+  let v = getCompact c
+  (me, replies) <- createC
+  spawn 2 (worker me)
+  case replies of
+    Chan ch : rest -> do
+      connectC ch
+      w <- evaluate (drop 10 v) -- the tail, in the region as well
+      sendData modeData (v, w)
+      case rest of
+        Sums s1 s2 inRegion : _ -> print (s1, s2, inRegion)
+        _ -> error "ParCompact: no sums"
+    _ -> error "ParCompact: no channel from worker"
@@ -0,0 +1,16 @@
+-- Runs on two PEs with +RTS -l -qT, for the eventlog which the main PE
+-- writes for both of them (checked by EventLogCheck, see Makefile).
+
+import EdenPrims
+
+-- runs on PE 2
+worker :: ChanName -> IO ()
+worker reply = do
+  connectC reply
+  sendData modeData (sum [1 .. 1000000 :: Int])
+
+main :: IO ()
+main = do
+  (me, result) <- createC
+  spawn 2 (worker me)
+  print (result :: Int)
@@ -0,0 +1,42 @@
+-- Graphs larger than the pack buffer (+RTS -qQ16k) are sent in parts
+-- (PP_PART) and reassembled by the receiver: a process whose closure
+-- holds a long list and a tree, and results of the same size sent back.
+
+import Control.Exception (evaluate)
+import EdenPrims
+
+data Tree = Leaf !Int | Node Tree Tree
+
+data Reply = Sum !Int | Echo [Int] Tree
+
+build :: Int -> Int -> Tree
+build 0 i = Leaf i
+build d i = Node (build (d - 1) (2 * i)) (build (d - 1) (2 * i + 1))
+
+sumTree :: Tree -> Int
+sumTree (Leaf i)   = i
+sumTree (Node l r) = sumTree l + sumTree r
+
+-- runs on PE 2
+worker :: [Int] -> Tree -> ChanName -> IO ()
+worker xs t reply = do
+  connectC reply
+  sendData modeStream (Sum (sum xs + sumTree t))
+  let ys = map (+ 1) xs
+  _ <- evaluate (sum ys) -- sent as data, not as a thunk
+  sendData modeStream (Echo ys t)
+  sendData modeData ([] :: [Reply])
+
+main :: IO ()
+main = do
+  let xs = [1 .. 50000]
+      t  = build 12 1
+  _ <- evaluate (sum xs + sumTree t)
+  (me, replies) <- createC
+  spawn 2 (worker xs t me)
+  case replies of
+    Sum s : Echo ys t' : _ -> do
+      print s
+      print (sum ys, length ys)
+      print (sumTree t' == sumTree t)
+    _ -> error "ParParts: unexpected replies"
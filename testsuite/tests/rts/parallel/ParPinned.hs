@@ -0,0 +1,73 @@
+-- Pinning PEs to cores and NUMA nodes (+RTS -qA), with four PEs:
+--   - every PE runs on a subset of the CPUs the program had at the start,
+--     disjoint from the CPUs of the other PEs (unless there are fewer
+--     CPUs than PEs),
+--   - the CPUs of a PE are on one node in sysfs, which MP_locality
+--     reports for it (on every PE),
+--   - locality-preferring placement (-qrloc, here with -qremote to keep
+--     processes off the main PE) puts processes on PEs of the main PE's
+--     node: the first two for each of them, as a PE of another node is
+--     only taken when those run two more processes. Without other PEs
+--     on that node (one PE per node), they go to the other PEs.
+-- See ParPinned_c.c for the helpers.
+
+import Control.Monad
+import Data.List (intersect)
+import Data.Word (Word32)
+import EdenPrims
+import Foreign
+import Foreign.C.Types
+
+foreign import ccall unsafe "parentCPUs" parentCPUs :: IO CInt
+foreign import ccall unsafe "ownCPUs" ownCPUs :: Ptr CInt -> CInt -> IO CInt
+foreign import ccall unsafe "sysfsNode" sysfsNode :: CInt -> IO CInt
+foreign import ccall unsafe "MP_locality" mpLocality :: Word32 -> IO Word32
+foreign import ccall unsafe "&nPEs" nPEsPtr :: Ptr Word32
+
+-- PE, its CPUs (Nothing if not all in the parent's set), their nodes in
+-- sysfs, and its locality as the PE itself sees it
+data Report = Report !Int !(Maybe [Int]) [Int] !Int
+
+report :: IO Report
+report = do
+  me <- selfPe
+  cpus <- allocaArray 1024 $ \p -> do
+    n <- ownCPUs p 1024
+    if n < 0 then return Nothing
+             else fmap (Just . map fromIntegral) (peekArray (fromIntegral n) p)
+  nodes <- mapM (fmap fromIntegral . sysfsNode . fromIntegral)
+                (maybe [] id cpus)
+  loc <- mpLocality (fromIntegral me)
+  return (Report me cpus nodes (fromIntegral loc))
+
+-- runs an action on a PE (0: chosen by the placement policy), returns
+-- its result
+onPE :: Int -> IO a -> IO a
+onPE pe act = do
+  (me, result) <- createC
+  spawn pe $ do
+    connectC me
+    act >>= sendData modeData
+  return result
+
+main :: IO ()
+main = do
+  n <- fmap fromIntegral (peek nPEsPtr)
+  parent <- fmap fromIntegral parentCPUs
+  reports <- mapM (\pe -> onPE pe report) [1 .. n]
+  locs <- mapM (fmap fromIntegral . mpLocality . fromIntegral) [1 .. n]
+  let cpuSets = [cs | Report _ (Just cs) _ _ <- reports]
+  -- subsets of the parent's CPUs, disjoint if there are enough
+  print (length cpuSets == n && all (not . null) cpuSets)
+  print (parent < n || and [ null (a `intersect` b)
+                           | (i, a) <- zip [0 :: Int ..] cpuSets
+                           , (j, b) <- zip [0 ..] cpuSets, i < j ])
+  -- the node from sysfs, also as the main PE sees it
+  print (and [ all (== loc) nodes && loc == l && pe == p
+             | (Report pe _ nodes loc, p, l) <- zip3 reports [1 ..] locs ])
+  -- placement on the main PE's node, or on the other PEs if none is
+  -- there (not an empty check)
+  let near = [p | (p, l) <- zip [2 ..] (tail locs), l == head locs]
+      targets = if null near then [2 .. n] else near
+  placed <- replicateM (2 * length targets) (onPE 0 selfPe)
+  print (not (null placed) && all (`elem` targets) placed)
@@ -0,0 +1,99 @@
+/*
+ * Helpers for ParPinned.hs: the CPU affinity of a PE, and the NUMA node
+ * of a CPU in sysfs (Linux only).
+ */
+
+#define _GNU_SOURCE /* sched_getaffinity */
+#include <sched.h>
+#include <stdio.h>
+
+#define MAX_NODES 256
+
+/* the CPUs of the program before the PEs were started (and pinned). The
+ * other PEs are forked in hs_init, and inherit it. */
+static cpu_set_t parentSet;
+
+__attribute__((constructor))
+static void readParentSet(void)
+{
+    CPU_ZERO(&parentSet);
+    if (sched_getaffinity(0, sizeof(parentSet), &parentSet) != 0) {
+        perror("ParPinned: sched_getaffinity");
+    }
+}
+
+int parentCPUs(void)
+{
+    return CPU_COUNT(&parentSet);
+}
+
+/* the CPUs this PE runs on, at most max of them into cpus. Returns their
+ * number, -1 if one of them is not in the parent's set. */
+int ownCPUs(int *cpus, int max)
+{
+    cpu_set_t own;
+    int cpu, n = 0;
+
+    if (sched_getaffinity(0, sizeof(own), &own) != 0) {
+        perror("ParPinned: sched_getaffinity");
+        return 0;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &own)) {
+            if (!CPU_ISSET(cpu, &parentSet)) {
+                return -1;
+            }
+            if (n < max) {
+                cpus[n++] = cpu;
+            }
+        }
+    }
+    return n;
+}
+
+/* whether a cpulist of sysfs (like "0-3,8-11") contains cpu */
+static int inCpulist(FILE *f, int cpu)
+{
+    int from, to, sep;
+
+    while (fscanf(f, "%d", &from) == 1) {
+        to = from;
+        sep = fgetc(f);
+        if (sep == '-') {
+            if (fscanf(f, "%d", &to) != 1) {
+                return 0;
+            }
+            sep = fgetc(f);
+        }
+        if (from <= cpu && cpu <= to) {
+            return 1;
+        }
+        if (sep != ',') {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* the NUMA node of cpu, 0 without NUMA information in sysfs */
+int sysfsNode(int cpu)
+{
+    char path[64];
+    FILE *f;
+    int node, found;
+
+    for (node = 0; node < MAX_NODES; node++) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        found = inCpulist(f, cpu);
+        fclose(f);
+        if (found) {
+            return node;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+-- Placeholders for blackholes (+RTS -qL): a pair is sent while one of
+-- its components is under evaluation by a thread which waits for an
+-- MVar. The receiver gets the other component right away, and a
+-- placeholder, which is updated when the value has been computed (after
+-- the receiver answered). Without -qL, the sender would wait for the
+-- value, and never fill the MVar.
+
+import Control.Concurrent
+import Control.Exception (evaluate)
+import Control.Monad
+import EdenPrims
+import GHC.Conc (ThreadStatus (..), BlockReason (..), threadStatus)
+import System.IO.Unsafe (unsafePerformIO)
+
+data Reply = Chan !ChanName | First !Int | Second !Int
+
+-- a thunk whose evaluation waits for the MVar
+later :: MVar Int -> Int
+later mv = unsafePerformIO (takeMVar mv)
+{-# NOINLINE later #-}
+
+-- runs on PE 2, answers with the components of the pair one by one
+worker :: ChanName -> IO ()
+worker reply = do
+  (me, pair) <- createC
+  connectC reply
+  sendData modeStream (Chan me)
+  let (a, b) = pair :: (Int, Int)
+  sendData modeStream (First a)
+  sendData modeStream (Second b)
+  sendData modeData ([] :: [Reply])
+
+-- until the thread is blocked (and the thunk it evaluates a blackhole)
+waitBlocked :: ThreadId -> IO ()
+waitBlocked t = do
+  s <- threadStatus t
+  unless (s == ThreadBlocked BlockedOnMVar) (yield >> waitBlocked t)
+
+main :: IO ()
+main = do
+  mv <- newEmptyMVar
+  let x = later mv + 1
+  t <- forkIO (void (evaluate x))
+  waitBlocked t
+  (me, replies) <- createC
+  spawn 2 (worker me)
+  case replies of
+    Chan c : rest -> do
+      connectC c
+      sendData modeData (42 :: Int, x)
+      case rest of
+        First a : rest' -> do
+          print a
+          putMVar mv 6
+          case rest' of
+            Second b : _ -> print b
+            _ -> error "ParPlaceholder: no second component"
+        _ -> error "ParPlaceholder: no first component"
+    _ -> error "ParPlaceholder: no channel from worker"
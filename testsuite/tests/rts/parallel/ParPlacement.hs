@@ -0,0 +1,22 @@
+-- Placement on the least loaded PE (+RTS -qrll): a batch of processes
+-- spawned without a target PE at once is spread over all four PEs,
+-- although they are sent before any of them answers. Every process
+-- answers with the PE it runs on.
+
+import Control.Monad
+import Data.List (nub, sort)
+import EdenPrims
+
+processes :: Int
+processes = 12
+
+main :: IO ()
+main = do
+  pes <- replicateM processes $ do
+    (me, pe) <- createC
+    spawn 0 $ do
+      connectC me
+      selfPe >>= sendData modeData
+    return pe
+  print (length pes)
+  print (sort (nub pes) :: [Int])
@@ -0,0 +1,84 @@
+-- Round trips of data of different kinds between two PEs, which has to
+-- arrive unchanged, and the bytes sent for a larger payload (+RTS -T):
+--
+--   ParRoundTrip encoded      with +RTS -qE, a list of small Ints takes
+--                             less than 16 bytes per element
+--   ParRoundTrip compressed   with +RTS -qZ1k, a repetitive String takes
+--                             less than 4 bytes per character (no byte
+--                             arrays, messages with those are not
+--                             compressed)
+
+import Control.Exception (evaluate)
+import Control.Monad
+import EdenPrims
+import System.Environment (getArgs)
+import System.Exit
+
+data Tree = Leaf | Node Tree !Int Tree
+  deriving (Eq, Show)
+
+data Value = Ints [Int] | Text String | Reals [Double] | Tree Tree
+  deriving (Eq, Show)
+
+data Reply = Chan !ChanName | Echo Value
+
+-- runs on PE 2, sends every value back
+echo :: ChanName -> IO ()
+echo reply = do
+  (me, values) <- createC
+  connectC reply
+  sendData modeStream (Chan me)
+  forM_ values $ \v -> sendData modeStream (Echo v)
+  sendData modeData ([] :: [Reply])
+
+build :: Int -> Int -> Tree
+build 0 _ = Leaf
+build d i = Node (build (d - 1) (2 * i)) i (build (d - 1) (2 * i + 1))
+
+values :: [Value]
+values =
+  [ Ints ([-1000 .. 1000] ++ [maxBound, minBound, 0xF0, -0xF0])
+  , Text "parallel \955 \123456 \0 end"
+  , Reals [0, 0.5, -1.0e300, 1.0e-300, 3.141592653589793]
+  , Tree (build 10 1)
+  ]
+
+-- the payload for a mode, and the bytes it may take when sent
+payload :: String -> (Value, Int)
+payload "encoded"    = (Ints [1 .. 5000], 5000 * 16)
+payload "compressed" = (Text (concat (replicate 2000 "abcdefghij")), 20000 * 4)
+payload mode         = error ("ParRoundTrip: unknown mode " ++ mode)
+
+-- sends a value, returns the one which came back and the later replies
+roundTrip :: [Reply] -> Value -> IO (Value, [Reply])
+roundTrip replies v = do
+  _ <- evaluate (length (show v)) -- sent as data, not as thunks
+  sendData modeStream v
+  case replies of
+    Echo v' : rest -> return (v', rest)
+    _              -> error "ParRoundTrip: unexpected reply"
+
+main :: IO ()
+main = do
+  [mode] <- getArgs
+  let (big, limit) = payload mode
+  (me, replies) <- createC
+  spawn 2 (echo me)
+  case replies of
+    Chan c : rest0 -> do
+      connectC c
+      (same, rest1) <- foldM (\(ok, rs) v -> do (v', rs') <- roundTrip rs v
+                                                return (ok && v' == v, rs'))
+                             (True, rest0) values
+      putStrLn (if same then "round trip ok" else "round trip FAILED")
+      b0 <- bytesSent
+      (big', _) <- roundTrip rest1 big
+      b1 <- bytesSent
+      sendData modeData ([] :: [Value])
+      let bytes = fromIntegral (b1 - b0)
+      if big' == big && bytes < limit
+        then putStrLn (mode ++ " ok")
+        else putStrLn (mode ++ " FAILED: " ++ show bytes ++ " bytes")
+             >> exitFailure
+      unless same exitFailure
+    _ -> error "ParRoundTrip: no channel from echo process"
@@ -0,0 +1,56 @@
+-- The sharing cache between PEs (+RTS -qC64): a list sent many times is
+-- sent in full only until the receiver keeps it, later messages refer
+-- to it. Compares the bytes sent (+RTS -T) for one list sent once and
+-- another one sent ten times.
+
+import Control.Exception (evaluate)
+import Control.Monad
+import EdenPrims
+import System.Exit
+
+data Reply = Chan !ChanName | Got !Int
+
+-- runs on PE 2, answers every list with its sum
+echo :: ChanName -> IO ()
+echo reply = do
+  (me, lists) <- createC
+  connectC reply
+  sendData modeStream (Chan me)
+  forM_ lists $ \xs -> sendData modeStream (Got (sum (xs :: [Int])))
+  sendData modeData ([] :: [Reply])
+
+-- sends a list, returns its sum from the reply and the later replies
+roundTrip :: [Reply] -> [Int] -> IO (Int, [Reply])
+roundTrip replies xs = do
+  sendData modeStream xs
+  case replies of
+    Got s : rest -> return (s, rest)
+    _            -> error "ParSharing: unexpected reply"
+
+main :: IO ()
+main = do
+  let once  = [1 .. 5000] :: [Int]
+      often = map (* 2) [1 .. 5000] :: [Int]
+  _ <- evaluate (sum once + sum often)
+  (me, replies) <- createC
+  spawn 2 (echo me)
+  case replies of
+    Chan c : rest0 -> do
+      connectC c
+      b0 <- bytesSent
+      (s, rest1) <- roundTrip rest0 once
+      b1 <- bytesSent
+      (sums, _) <- foldM (\(ss, rs) _ -> do (s', rs') <- roundTrip rs often
+                                            return (s' : ss, rs'))
+                         ([], rest1) [1 .. 10 :: Int]
+      b2 <- bytesSent
+      sendData modeData ([] :: [[Int]])
+      print s
+      print (length sums, all (== sum often) sums)
+      -- at most the first few of the ten are sent in full
+      if b2 - b1 < 4 * (b1 - b0)
+        then putStrLn "sharing ok"
+        else putStrLn ("sharing FAILED: " ++ show (b1 - b0) ++ " bytes once, "
+                       ++ show (b2 - b1) ++ " bytes ten times")
+             >> exitFailure
+    _ -> error "ParSharing: no channel from echo process"
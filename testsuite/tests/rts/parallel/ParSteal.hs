@@ -0,0 +1,32 @@
+-- Work stealing of unstarted processes (+RTS -qF): eight processes are
+-- all spawned on PE 2, which holds back those it cannot start yet
+-- (holdProcess). The idle PE 3 fishes for work, and PE 2 forwards held
+-- processes to it, still packed. Every process answers on its own
+-- channel with its result and the PE it ran on, exactly once.
+
+import Control.Exception (evaluate)
+import Control.Monad
+import Data.List (sort)
+import EdenPrims
+
+processes :: Int
+processes = 8
+
+-- some work, long enough for the other PEs to ask for processes
+work :: Int -> Int
+work i = length (filter even [1 .. 5000000 + i])
+
+main :: IO ()
+main = do
+  answers <- forM [1 .. processes] $ \i -> do
+    (me, answer) <- createC
+    spawn 2 $ do
+      connectC me
+      r <- evaluate (work i)
+      pe <- selfPe
+      sendData modeData (i, pe, r)
+    return answer
+  let (is, pes, results) = unzip3 answers
+  print (sort is == [1 .. processes])
+  print (results == map work [1 .. processes])
+  print (3 `elem` (pes :: [Int]))
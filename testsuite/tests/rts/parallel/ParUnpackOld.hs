@@ -0,0 +1,179 @@
+-- Unpacking into the oldest generation (+RTS -qO64k): graphs of more than
+-- 64kB are unpacked into blocks of the oldest generation (see
+-- startUnpackRegion and nextUnpackBlock in Pack.c). They point to young
+-- closures, which have to be on the mutable list (recordUnpacked):
+--   - lists received before, found in the sharing cache (-qC64),
+--   - arrays larger than a block, allocated in the nursery as usual,
+--   - a placeholder for a thunk under evaluation (-qL), updated later.
+-- The mutable arrays among them are marked dirty (recordUnpackedArray),
+-- young values written into them later have to survive. A thread on the
+-- receiving PE forces GCs all the time, with a small nursery (-A64k).
+
+{-# LANGUAGE MagicHash #-}
+{-# LANGUAGE UnboxedTuples #-}
+
+import Control.Concurrent
+import Control.Exception (evaluate)
+import Control.Monad
+import EdenPrims
+import GHC.Conc (ThreadStatus (..), BlockReason (..), threadStatus)
+import GHC.Exts
+import GHC.IO
+import System.IO.Unsafe (unsafePerformIO)
+import System.Mem (performMajorGC, performMinorGC)
+
+data MArr  = MArr (MutableArray# RealWorld Int)
+data SMArr = SMArr (SmallMutableArray# RealWorld Int)
+data Arr   = Arr (Array# Int)
+
+newMArr :: Int -> (Int -> Int) -> IO MArr
+newMArr n@(I# n#) f = do
+  a <- IO $ \s -> case newArray# n# 0 s of (# s', a #) -> (# s', MArr a #)
+  forM_ [0 .. n - 1] $ \i -> writeM a i $! f i
+  return a
+
+writeM :: MArr -> Int -> Int -> IO ()
+writeM (MArr a) (I# i) x =
+  IO $ \s -> case writeArray# a i x s of s' -> (# s', () #)
+
+sumM :: MArr -> IO Int
+sumM (MArr a) = foldM add 0 [0 .. I# (sizeofMutableArray# a) - 1]
+  where add acc (I# i) = IO (readArray# a i) >>= \x -> return $! acc + x
+
+newSMArr :: Int -> (Int -> Int) -> IO SMArr
+newSMArr n@(I# n#) f = do
+  a <- IO $ \s -> case newSmallArray# n# 0 s of
+    (# s', a #) -> (# s', SMArr a #)
+  forM_ [0 .. n - 1] $ \i -> writeS a i $! f i
+  return a
+
+writeS :: SMArr -> Int -> Int -> IO ()
+writeS (SMArr a) (I# i) x =
+  IO $ \s -> case writeSmallArray# a i x s of s' -> (# s', () #)
+
+sumS :: SMArr -> IO Int
+sumS (SMArr a) = foldM add 0 [0 .. I# (sizeofSmallMutableArray# a) - 1]
+  where add acc (I# i) =
+          IO (readSmallArray# a i) >>= \x -> return $! acc + x
+
+newArr :: Int -> (Int -> Int) -> IO Arr
+newArr n f = do
+  MArr a <- newMArr n f
+  IO $ \s -> case unsafeFreezeArray# a s of (# s', b #) -> (# s', Arr b #)
+
+sumA :: Arr -> Int
+sumA (Arr a) = sum [ case indexArray# a i of (# x #) -> x
+                    | I# i <- [0 .. I# (sizeofArray# a) - 1] ]
+
+-- shared list, long list, small and large mutable array, small mutable
+-- array, frozen array larger than a block, and a value which may not be
+-- there yet
+data Big = Big [Int] [Int] MArr MArr SMArr Arr Int
+
+data Msg = Shared [Int] | Round Big
+
+data Reply = Chan !ChanName | Sums [Int] | Value !Int
+
+rounds :: Int
+rounds = 3
+
+sharedList :: [Int]
+sharedList = [1 .. 500]
+
+-- the sums of a round, before and after young values were written into
+-- the arrays
+expected :: Int -> [Int]
+expected r = [ sum sharedList, sum (bigList r)
+             , sum (map (+ r) [0 .. 99]), sum (map (* r) [0 .. 999])
+             , sum (map (+ r) [0 .. 49]), sum [0 .. 1999]
+             , sum (map (* 3) [0 .. 99]), sum (map (* 5) [0 .. 999])
+             , sum (map (* 7) [0 .. 49]) ]
+
+bigList :: Int -> [Int]
+bigList r = [r .. r + 19999]
+
+-- a thunk whose evaluation waits for the MVar
+later :: MVar Int -> Int
+later mv = unsafePerformIO (takeMVar mv)
+{-# NOINLINE later #-}
+
+-- runs on PE 2
+worker :: ChanName -> IO ()
+worker reply = do
+  gcs <- forkIO (forever (performMinorGC >> yield))
+  (me, msgs) <- createC
+  connectC reply
+  sendData modeStream (Chan me)
+  forM_ msgs $ \msg -> case msg of
+    Shared xs -> do
+      s <- evaluate (sum xs)
+      sendData modeStream (Sums [s])
+    Round (Big xs ys small large smallArr frozen pending) -> do
+      before <- sequence [ evaluate (sum xs), evaluate (sum ys)
+                         , sumM small, sumM large, sumS smallArr
+                         , evaluate (sumA frozen) ]
+      forM_ [0 .. 99] $ \i -> writeM small i $! i * 3
+      forM_ [0 .. 999] $ \i -> writeM large i $! i * 5
+      forM_ [0 .. 49] $ \i -> writeS smallArr i $! i * 7
+      replicateM_ 3 performMinorGC
+      performMajorGC
+      after <- sequence [sumM small, sumM large, sumS smallArr]
+      ss <- mapM evaluate (before ++ after)
+      sendData modeStream (Sums ss)
+      p <- evaluate pending
+      sendData modeStream (Value p)
+  killThread gcs
+  sendData modeData ([] :: [Reply])
+
+-- until the thread is blocked (and the thunk it evaluates a blackhole)
+waitBlocked :: ThreadId -> IO ()
+waitBlocked t = do
+  s <- threadStatus t
+  unless (s == ThreadBlocked BlockedOnMVar) (yield >> waitBlocked t)
+
+main :: IO ()
+main = do
+  -- built at runtime, a top-level list would be static (not cached)
+  shared <- mapM evaluate sharedList
+  (me, replies) <- createC
+  spawn 2 (worker me)
+  case replies of
+    Chan c : rest0 -> do
+      connectC c
+      sendData modeStream (Shared shared)
+      rest1 <- case rest0 of
+        Sums [s] : rest -> print (s == sum sharedList) >> return rest
+        _ -> error "ParUnpackOld: no answer for the shared list"
+      foldM_ (oneRound shared) rest1 [1 .. rounds]
+      sendData modeData ([] :: [Msg])
+    _ -> error "ParUnpackOld: no channel from worker"
+
+-- sends a graph of more than 64kB, in the last round with a placeholder,
+-- whose value is given after the sums have come back
+oneRound :: [Int] -> [Reply] -> Int -> IO [Reply]
+oneRound shared replies r = do
+  mv <- newEmptyMVar
+  pending <- if r < rounds
+               then return r
+               else do
+                 let x = later mv + 1
+                 t <- forkIO (void (evaluate x))
+                 waitBlocked t
+                 return x
+  big <- mapM evaluate (bigList r)
+  small <- newMArr 100 (+ r)
+  large <- newMArr 1000 (* r)
+  smallArr <- newSMArr 50 (+ r)
+  frozen <- newArr 2000 id
+  sendData modeStream
+    (Round (Big shared big small large smallArr frozen pending))
+  case replies of
+    Sums ss : rest -> do
+      print (r, ss == expected r)
+      when (r == rounds) $ putMVar mv 41
+      case rest of
+        Value v : rest' -> do
+          print (v == (if r < rounds then r else 42))
+          return rest'
+        _ -> error "ParUnpackOld: no value"
+    _ -> error "ParUnpackOld: no sums"
@@ -0,0 +1,198 @@
+/*
+ * Stress test for the rings of the shared-memory way (-parcp, see
+ * CpComm.c), on the MP-System (MPSystem.h) directly: every PE sends
+ * MSGS messages to every other PE, a third of them up to 300kB, through
+ * rings of 64kB (+RTS -qq2), so that large messages are streamed and
+ * senders wait for space while taking in their own messages. The
+ * content depends on sender, receiver and sequence number, and is
+ * checked by the receiver.
+ *
+ * Half of the messages are borrowed (MP_recv_borrow). While borrowing,
+ * the PE sends a small message to another one, and checks that the
+ * borrowed data stays as it was.
+ *
+ * At the end, every PE sends DONE to every other PE, with the number
+ * of messages which arrived garbled (DONE comes after all messages of
+ * the same sender, rings keep their order). PE 1 prints the result.
+ *
+ * Run with +RTS -N4 -qq2.
+ */
+
+#include "Rts.h"
+#include "MPSystem.h"
+#include "PEOpCodes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MSGS       300
+#define MAX_LARGE  (300*1024)
+#define MAX_SMALL  200
+#define TAG        PP_DATA
+#define TAG_POKE   PP_CONNECT
+#define TAG_DONE   PP_TERMINATE
+
+static StgWord8 *buffer;     // for sending
+static StgWord8 *copy;       // of a borrowed message
+static uint32_t sent[MAX_PES], received[MAX_PES];
+static uint32_t garbled = 0, dones = 0, doneGarbled = 0;
+
+static uint32_t rnd(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+// content of message seq from PE from to PE to (the first word is
+// its length)
+static StgWord8 contentAt(PEId from, PEId to, uint32_t seq, uint32_t i)
+{
+    return (StgWord8)(from * 1000 + to * 100000 + seq + i * 7);
+}
+
+static void fill(PEId to, uint32_t seq, uint32_t length)
+{
+    uint32_t i;
+
+    for (i = 0; i < length; i++) {
+        buffer[i] = contentAt(thisPE, to, seq, i);
+    }
+    if (length >= sizeof(length)) {
+        memcpy(buffer, &length, sizeof(length));
+    }
+}
+
+static void check(PEId from, StgWord8 *data, uint32_t length)
+{
+    uint32_t seq = received[from-1]++, i, stored;
+
+    if (length >= sizeof(length)) {
+        memcpy(&stored, data, sizeof(stored));
+        if (stored != length) {
+            fprintf(stderr, "PE %d: message %u from PE %d has %u bytes, "
+                    "sent %u\n", thisPE, seq, from, length, stored);
+            garbled++;
+            return;
+        }
+    }
+    for (i = sizeof(length); i < length; i++) {
+        if (data[i] != contentAt(from, thisPE, seq, i)) {
+            fprintf(stderr, "PE %d: message %u from PE %d garbled at "
+                    "byte %u\n", thisPE, seq, from, i);
+            garbled++;
+            return;
+        }
+    }
+}
+
+// receives and checks one message, returns false if there was none
+// (when not blocking)
+static bool receive(bool block, uint32_t *seed)
+{
+    OpCode tag;
+    PEId sender;
+    uint32_t length, count;
+    StgWord8 *data, poke = 1;
+
+    if (!block && !MP_probe()) {
+        return false;
+    }
+    data = MP_recv_borrow(&tag, &sender, &length);
+    if (((StgWord) data) % sizeof(StgWord) != 0) {
+        fprintf(stderr, "PE %d: borrowed message not aligned\n", thisPE);
+        garbled++;
+    }
+    switch (tag) {
+    case TAG:
+        if (rnd(seed) & 1) {
+            // sending may take in messages of our own, the borrowed
+            // one has to stay
+            memcpy(copy, data, length);
+            MP_send(thisPE % nPEs + 1, TAG_POKE, &poke, sizeof(poke));
+            if (memcmp(copy, data, length) != 0) {
+                fprintf(stderr, "PE %d: borrowed message changed\n", thisPE);
+                garbled++;
+            }
+        }
+        check(sender, data, length);
+        break;
+    case TAG_DONE:
+        if (length == sizeof(count)) {
+            memcpy(&count, data, sizeof(count));
+            doneGarbled += count;
+        }
+        dones++;
+        break;
+    default: // pokes, FINISH of PEs leaving
+        break;
+    }
+    MP_recv_release();
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t seed, recvSeed, length, i;
+    PEId to;
+
+    hs_init(&argc, &argv);
+
+    if (nPEs < 2) {
+        if (thisPE == 1) {
+            fprintf(stderr, "RingStress: needs at least 2 PEs (+RTS -N4)\n");
+        }
+        hs_exit();
+        return 1;
+    }
+    buffer = malloc(MAX_LARGE);
+    copy = malloc(DATASPACEWORDS * sizeof(StgWord));
+    seed = thisPE * 77;
+    recvSeed = thisPE * 13;
+
+    for (i = 0; i < MSGS; i++) {
+        for (to = 1; to <= nPEs; to++) {
+            if (to == thisPE) {
+                continue;
+            }
+            length = (rnd(&seed) % 3 == 0) ? rnd(&seed) % MAX_LARGE
+                                           : rnd(&seed) % MAX_SMALL;
+            fill(to, sent[to-1], length);
+            // the ring may be full, take in messages meanwhile
+            while (!MP_send(to, TAG, buffer, length)) {
+                receive(false, &recvSeed);
+            }
+            sent[to-1]++;
+        }
+        while (receive(false, &recvSeed)) {}
+    }
+
+    for (to = 1; to <= nPEs; to++) {
+        if (to != thisPE) {
+            while (!MP_send(to, TAG_DONE, (StgWord8*) &garbled,
+                            sizeof(garbled))) {
+                receive(false, &recvSeed);
+            }
+        }
+    }
+    while (dones < nPEs - 1) {
+        receive(true, &recvSeed);
+    }
+    for (to = 1; to <= nPEs; to++) {
+        if (to != thisPE && received[to-1] != MSGS) {
+            fprintf(stderr, "PE %d: %u messages from PE %d, sent %u\n",
+                    thisPE, received[to-1], to, MSGS);
+            garbled++;
+        }
+    }
+
+    // PE 1 knows the garbled messages of the others (before their DONE)
+    if (thisPE == 1) {
+        printf("%s\n", (garbled + doneGarbled == 0) ? "ring stress ok"
+                                                   : "ring stress FAILED");
+    }
+
+    free(buffer);
+    free(copy);
+    hs_exit();
+    return 0;
+}
@@ -0,0 +1,177 @@
+-- Message passing between two PEs through the Eden primitives
+-- (expectData#, connectToPort#, sendData#): ping-pong latency and
+-- streaming bandwidth for byte array payloads of different sizes.
+--
+-- Needs a parallel way (-parcp, -partcp, ...), run with +RTS -N2.
+--
+--   SendBench check      a few messages of each size, checks their
+--                        content, prints "<bench> <bytes> ok"
+--   SendBench [max]      prints one JSON object per measurement (see
+--                        Makefile)
+
+{-# LANGUAGE MagicHash #-}
+{-# LANGUAGE UnboxedTuples #-}
+
+import Control.Exception (evaluate)
+import Control.Monad
+import Data.Word (Word32)
+import Foreign.Ptr (Ptr)
+import Foreign.Storable (peek)
+import GHC.Clock (getMonotonicTimeNSec)
+import GHC.Exts
+import GHC.IO
+import System.Environment (getArgs)
+import System.Exit
+import Text.Printf (printf)
+
+foreign import ccall unsafe "&thisPE" thisPEPtr :: Ptr Word32
+
+data Bytes = Bytes ByteArray#
+
+data ChanName = ChanName !Int !Int !Int -- PE, process, inport
+
+-- messages to the echo process, and its replies
+data Msg = Chan !ChanName   -- inport of the echo process
+         | Ping Bytes       -- sent back
+         | Blob Bytes       -- only received
+         | Sync             -- answered by Synced
+         | Synced !Int      -- blobs received (intact ones when checking)
+
+-- Eden send modes, see sendWrapper in rts/parallel/DataComms.c
+modeConnect, modeStream, modeData :: Int
+modeConnect = 1
+modeStream  = 2
+modeData    = 3
+
+instantiate :: Int -> Int
+instantiate pe = 4 + pe * 8
+
+createC :: IO (ChanName, a)
+createC = do
+  pe <- peek thisPEPtr
+  IO $ \s -> case expectData# s of
+    (# s', p, i, x #) -> (# s', (ChanName (fromIntegral pe) (I# p) (I# i), x) #)
+
+connectC :: ChanName -> IO ()
+connectC (ChanName (I# pe) (I# p) (I# i)) = do
+  IO $ \s -> case connectToPort# pe p i s of s' -> (# s', () #)
+  sendData modeConnect ()
+
+sendData :: Int -> a -> IO ()
+sendData (I# m) x = IO $ \s -> case sendData# m x s of s' -> (# s', () #)
+
+-- a payload of n bytes, byte i is (byteAt n i)
+bytes :: Int -> IO Bytes
+bytes n@(I# n#) = IO $ \s ->
+  case newByteArray# n# s of
+    (# s1, m #) -> case fill m 0 s1 of
+      s2 -> case unsafeFreezeByteArray# m s2 of
+        (# s3, arr #) -> (# s3, Bytes arr #)
+  where
+    fill :: MutableByteArray# RealWorld -> Int
+         -> State# RealWorld -> State# RealWorld
+    fill m i@(I# i#) s
+      | i >= n    = s
+      | otherwise = case byteAt n i of
+          W# w -> fill m (i + 1) (writeWord8Array# m i# w s)
+
+byteAt :: Int -> Int -> Word
+byteAt n i = fromIntegral ((i * 7 + n) `mod` 251)
+
+sizeOf :: Bytes -> Int
+sizeOf (Bytes arr) = I# (sizeofByteArray# arr)
+
+-- whether a received payload is the one sent
+intact :: Int -> Bytes -> Bool
+intact n b@(Bytes arr) = sizeOf b == n && all ok [0 .. n - 1]
+  where ok i@(I# i#) = W# (indexWord8Array# arr i#) == byteAt n i
+
+-- runs on PE 2: answers pings and syncs on the reply stream. When
+-- checking, only intact blobs are counted
+echo :: Bool -> ChanName -> IO ()
+echo check reply = do
+  (me, msgs) <- createC
+  connectC reply
+  sendData modeStream (Chan me)
+  let serve _ [] = return ()
+      serve k (m : ms) = case m of
+        Ping b -> sendData modeStream (Ping b) >> serve k ms
+        Blob b | check && not (intact (sizeOf b) b) -> serve k ms
+               | otherwise -> serve (k + 1) ms
+        Sync   -> sendData modeStream (Synced k) >> serve 0 ms
+        _      -> serve k ms
+  serve (0 :: Int) msgs
+  sendData modeData ([] :: [Msg])
+
+main :: IO ()
+main = do
+  args <- getArgs
+  let (check, maxSize) = case args of
+                           ["check"] -> (True, 262144)
+                           [n]       -> (False, read n)
+                           _         -> (False, 1048576)
+      sizes = takeWhile (<= maxSize) (iterate (* 8) 8)
+  (me, replies) <- createC
+  sendData (instantiate 2) (echo check me)
+  case replies of
+    Chan c : rest0 -> do
+      connectC c
+      rest1 <- foldM (pingPong check) rest0 sizes
+      rest2 <- foldM (bandwidth check) rest1 sizes
+      sendData modeData ([] :: [Msg])
+      _ <- evaluate (length rest2)
+      return ()
+    _ -> error "SendBench: no channel from echo process"
+
+report :: String -> Int -> Bool -> IO ()
+report bench size ok
+  | ok        = putStrLn (bench ++ " " ++ show size ++ " ok")
+  | otherwise = putStrLn (bench ++ " " ++ show size ++ " FAILED")
+                >> exitFailure
+
+-- round trips of one payload, returns the rest of the reply stream
+pingPong :: Bool -> [Msg] -> Int -> IO [Msg]
+pingPong check replies size = do
+  b <- bytes size
+  let iters | check     = 3
+            | otherwise = max 10 (min 10000 (100000000 `div` (size + 1000)))
+      loop 0 rs = return (rs, True)
+      loop k rs = do
+        sendData modeStream (Ping b)
+        case rs of
+          Ping r : rs'
+            | check && not (intact size r) -> return (rs', False)
+            | otherwise -> evaluate (sizeOf r) >> loop (k - 1 :: Int) rs'
+          _ -> error "SendBench: unexpected reply"
+  (rest, _) <- loop (if check then 0 else 10) replies -- warm up
+  t0 <- getMonotonicTimeNSec
+  (rest', ok) <- loop iters rest
+  t1 <- getMonotonicTimeNSec
+  let ns = fromIntegral (t1 - t0) / fromIntegral iters :: Double
+  if check
+    then report "send-pingpong" size ok
+    else printf ("{\"bench\":\"send-pingpong\",\"bytes\":%d,\"iters\":%d,"
+                 ++ "\"ns_per_op\":%.0f}\n") size iters ns
+  return rest'
+
+-- a stream of payloads, answered by one sync at the end
+bandwidth :: Bool -> [Msg] -> Int -> IO [Msg]
+bandwidth check replies size = do
+  b <- bytes size
+  let count | check     = 20
+            | otherwise = max 10 (min 100000 (200000000 `div` (size + 100)))
+  t0 <- getMonotonicTimeNSec
+  replicateM_ count (sendData modeStream (Blob b))
+  sendData modeStream Sync
+  (received, rest) <- case replies of
+            Synced k : rs -> return (k, rs)
+            _             -> error "SendBench: unexpected reply"
+  t1 <- getMonotonicTimeNSec
+  let ns = fromIntegral (t1 - t0) :: Double
+  if check
+    then report "send-stream" size (received == count)
+    else printf ("{\"bench\":\"send-stream\",\"bytes\":%d,\"iters\":%d,"
+                 ++ "\"ns_per_op\":%.0f,\"mbps\":%.1f}\n")
+                size count (ns / fromIntegral count)
+                (fromIntegral (size * count) * 1000 / ns)
+  return rest
@@ -0,0 +1,64 @@
+-- A small Eden program over TCP (-partcp) on localhost: PE 1 creates a
+-- process on PE 2, which streams results back, among them a large list
+-- which needs many TCP frames. The PEs are forked by the RTS (+RTS -N2,
+-- no EDEN_TCP_HOSTS). The output is checked, and the run has to end
+-- cleanly (exit code 0, nothing on stderr).
+
+{-# LANGUAGE MagicHash #-}
+{-# LANGUAGE UnboxedTuples #-}
+
+import Control.Exception (evaluate)
+import Control.Monad
+import Data.Word (Word32)
+import Foreign.Ptr (Ptr)
+import Foreign.Storable (peek)
+import GHC.Exts
+import GHC.IO
+
+foreign import ccall unsafe "&thisPE" thisPEPtr :: Ptr Word32
+
+data ChanName = ChanName !Int !Int !Int -- PE, process, inport
+
+data Msg = Square !Int | Big [Int]
+
+-- Eden send modes, see sendWrapper in rts/parallel/DataComms.c
+modeConnect, modeStream, modeData :: Int
+modeConnect = 1
+modeStream  = 2
+modeData    = 3
+
+instantiate :: Int -> Int
+instantiate pe = 4 + pe * 8
+
+createC :: IO (ChanName, a)
+createC = do
+  pe <- peek thisPEPtr
+  IO $ \s -> case expectData# s of
+    (# s', p, i, x #) -> (# s', (ChanName (fromIntegral pe) (I# p) (I# i), x) #)
+
+connectC :: ChanName -> IO ()
+connectC (ChanName (I# pe) (I# p) (I# i)) = do
+  IO $ \s -> case connectToPort# pe p i s of s' -> (# s', () #)
+  sendData modeConnect ()
+
+sendData :: Int -> a -> IO ()
+sendData (I# m) x = IO $ \s -> case sendData# m x s of s' -> (# s', () #)
+
+-- runs on PE 2
+worker :: ChanName -> IO ()
+worker reply = do
+  connectC reply
+  forM_ [1 .. 1000] $ \i -> sendData modeStream (Square (i * i))
+  let big = [1 .. 100000] :: [Int]
+  _ <- evaluate (sum big) -- sent as data, not as a thunk
+  sendData modeStream (Big big)
+  sendData modeData ([] :: [Msg])
+
+main :: IO ()
+main = do
+  (me, results) <- createC
+  sendData (instantiate 2) (worker me)
+  print (sum [n | Square n <- results])
+  case [xs | Big xs <- results] of
+    [xs] -> print (length xs, sum xs)
+    _    -> error "TcpLocal: no large list"